@@ -0,0 +1,193 @@
+// The decoder's pixel kernels, and whole decodes, with each SIMD level the
+// CPU has against the scalar reference (jpeg_available_kernels()).
+//
+// Kernels are timed on data that stays in cache: the inverse DCT per
+// block, chroma upsampling and YCbCr to RGB per output pixel of a 1920
+// pixel row. Decodes are of frames made by tests/jpeg_encoder at quality
+// 85, 4:2:0, into RGB at each scale, and include parse().
+
+#include "jpeg_kernels.h"
+#include "jpeg_decoder.h"
+#include "jpeg_encoder.h"
+#include <cstdio>
+#include <vector>
+#include <chrono>
+using namespace std;
+
+static const double MIN_SECONDS = 0.3;
+
+static double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() -
+        start).count();
+}
+
+// nanoseconds per 8x8 block
+static double time_idct(const JpegKernels& k)
+{
+    const int BLOCKS = 256;
+    vector<int16_t> coefs(64 * BLOCKS);
+    uint32_t x = 1;
+    for(size_t i = 0; i < coefs.size(); i++)
+    {
+        x = x * 1664525u + 1013904223u;
+        coefs[i] = (i % 64 < 16) ? (int16_t)((int)(x >> 24) - 128) : 0;
+    }
+
+    // a row of blocks side by side, as decode() lays them out
+    const size_t stride = 8 * BLOCKS;
+    vector<unsigned char> out(8 * stride);
+
+    size_t blocks = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do
+    {
+        if(k.idct_pair)
+        {
+            for(int b = 0; b < BLOCKS; b += 2)
+            {
+                k.idct_pair(&coefs[64 * b], &coefs[64 * (b + 1)],
+                    &out[8 * b], stride);
+            }
+        }
+        else
+        {
+            for(int b = 0; b < BLOCKS; b++)
+                k.idct(&coefs[64 * b], &out[8 * b], stride);
+        }
+        blocks += BLOCKS;
+    }
+    while(elapsed(start) < MIN_SECONDS);
+
+    return elapsed(start) * 1e9 / blocks;
+}
+
+// nanoseconds per output pixel of upsample_h2() and ycc_to_rgb()
+static void time_row_kernels(const JpegKernels& k, double& upsample_ns,
+    double& colour_ns)
+{
+    const size_t WIDTH = 1920;
+    vector<unsigned char> y(WIDTH), cb(WIDTH), cr(WIDTH), out(3 * WIDTH);
+    for(size_t i = 0; i < WIDTH; i++)
+    {
+        y[i] = (unsigned char)(i * 7);
+        cb[i] = (unsigned char)(i * 3 + 40);
+        cr[i] = (unsigned char)(200 - i);
+    }
+
+    size_t rows = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do
+    {
+        for(int i = 0; i < 64; i++)
+            k.upsample_h2(&cb[0], &out[0], WIDTH);
+        rows += 64;
+    }
+    while(elapsed(start) < MIN_SECONDS);
+    upsample_ns = elapsed(start) * 1e9 / (rows * WIDTH);
+
+    rows = 0;
+    start = chrono::steady_clock::now();
+    do
+    {
+        for(int i = 0; i < 64; i++)
+            k.ycc_to_rgb(&y[0], &cb[0], &cr[0], &out[0], WIDTH, false);
+        rows += 64;
+    }
+    while(elapsed(start) < MIN_SECONDS);
+    colour_ns = elapsed(start) * 1e9 / (rows * WIDTH);
+}
+
+// microseconds per frame
+static double time_decode(const JpegKernels& k,
+    const vector<unsigned char>& jpeg, int scale, JpegImage& image)
+{
+    JpegDecoder decoder;
+    decoder.set_kernels(k);
+
+    size_t frames = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do
+    {
+        if(!decoder.parse(&jpeg[0], jpeg.size()) ||
+           !decoder.decode(scale, JPEG_RGB, image))
+        {
+            return 0;
+        }
+        frames++;
+    }
+    while(elapsed(start) < MIN_SECONDS);
+
+    return elapsed(start) * 1e6 / frames;
+}
+
+int main()
+{
+    vector<JpegKernels> kernels;
+    jpeg_available_kernels(kernels);
+
+    printf("bench_decode: kernels (ns per block or per output pixel)\n");
+    double scalar_idct = 0, scalar_upsample = 0, scalar_colour = 0;
+    for(size_t i = 0; i < kernels.size(); i++)
+    {
+        const JpegKernels& k = kernels[i];
+        double idct = time_idct(k);
+        double upsample, colour;
+        time_row_kernels(k, upsample, colour);
+
+        if(i == 0)
+        {
+            scalar_idct = idct;
+            scalar_upsample = upsample;
+            scalar_colour = colour;
+        }
+
+        printf("  %-7s idct %6.1f ns (%4.1fx), upsample %5.2f ns (%4.1fx), "
+            "ycc_to_rgb %5.2f ns (%4.1fx)\n", k.name, idct,
+            scalar_idct / idct, upsample, scalar_upsample / upsample,
+            colour, scalar_colour / colour);
+    }
+
+    struct Size
+    {
+        int width;
+        int height;
+    };
+    Size sizes[] = {
+        { 1920, 1080 },
+        { 4208, 3120 }
+    };
+    int scales[] = { 1, 2, 4, 8 };
+
+    printf("decode to RGB (ms per frame, us per megapixel of frame)\n");
+    for(size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+    {
+        int w = sizes[s].width;
+        int h = sizes[s].height;
+        double megapixels = (double)w * h / 1e6;
+
+        vector<unsigned char> pixels = test_image(w, h, 3);
+        vector<unsigned char> jpeg = jpeg_encode(&pixels[0], w, h, 3);
+        printf("  %dx%d, %zu bytes\n", w, h, jpeg.size());
+
+        for(size_t c = 0; c < sizeof scales / sizeof scales[0]; c++)
+        {
+            JpegImage image;
+            double scalar = 0;
+            printf("    1/%d:", scales[c]);
+            for(size_t i = 0; i < kernels.size(); i++)
+            {
+                double us = time_decode(kernels[i], jpeg, scales[c], image);
+                if(i == 0)
+                    scalar = us;
+                printf("  %s %6.2f ms %5.0f us/MP", kernels[i].name,
+                    us / 1000.0, us / megapixels);
+                if(i > 0 && us > 0)
+                    printf(" (%.2fx)", scalar / us);
+            }
+            printf("\n");
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Per-frame latency of DecodePool against its worker count, for the
+// preview and analytics consumers it is for.
+//
+// Frames are made by tests/jpeg_encoder at quality 85, 4:2:0: 1920x1080
+// and 4208x3120, with a restart marker every MCU row, which the pool cuts
+// into bands, and without any, which it can only decode a frame to a
+// thread. Each is decoded to RGB at full size, one frame per decode()
+// call, for the latency; then the frames without markers in batches of 8,
+// for the throughput the per-frame fallback gets. The caller's thread
+// works too, so n workers means n + 1 threads.
+
+#include "decode_pool.h"
+#include "jpeg_encoder.h"
+#include <cstdio>
+#include <vector>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static const double MIN_SECONDS = 0.5;
+
+static double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() -
+        start).count();
+}
+
+// milliseconds per decode() of batch frames of jpeg
+static double time_pool(size_t workers, const vector<unsigned char>& jpeg,
+    size_t batch, int width, int height)
+{
+    size_t stride = (size_t)width * 3;
+    vector<vector<unsigned char> > out(batch,
+        vector<unsigned char>(stride * height));
+
+    vector<DecodeRequest> requests(batch);
+    for(size_t i = 0; i < batch; i++)
+    {
+        DecodeRequest& r = requests[i];
+        r.data = &jpeg[0];
+        r.size = jpeg.size();
+        r.scale = 1;
+        r.format = JPEG_RGB;
+        r.out = &out[i][0];
+        r.stride = stride;
+        r.ok = false;
+    }
+
+    DecodePool pool(workers);
+    pool.start();
+
+    if(!pool.decode(&requests[0], batch))
+        return 0;
+
+    size_t calls = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do
+    {
+        pool.decode(&requests[0], batch);
+        calls++;
+    }
+    while(elapsed(start) < MIN_SECONDS);
+
+    double ms = elapsed(start) * 1000.0 / calls;
+    pool.stop();
+    return ms;
+}
+
+int main()
+{
+    struct Size
+    {
+        int width;
+        int height;
+    };
+    Size sizes[] = {
+        { 1920, 1080 },
+        { 4208, 3120 }
+    };
+    size_t workers[] = { 0, 1, 3, 7 };
+    const size_t BATCH = 8;
+
+    printf("bench_decode_pool: %u hardware threads\n",
+        thread::hardware_concurrency());
+
+    for(size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+    {
+        int w = sizes[s].width;
+        int h = sizes[s].height;
+
+        vector<unsigned char> pixels = test_image(w, h, 3);
+        JpegEncodeOptions options;
+        options.restart_interval = (w + 15) / 16;
+        vector<unsigned char> with_rst = jpeg_encode(&pixels[0], w, h, 3,
+            options);
+        vector<unsigned char> without = jpeg_encode(&pixels[0], w, h, 3);
+
+        printf("  %dx%d, RST every MCU row, %zu bytes; none, %zu bytes\n",
+            w, h, with_rst.size(), without.size());
+
+        double single = 0;
+        for(size_t i = 0; i < sizeof workers / sizeof workers[0]; i++)
+        {
+            double rst_ms = time_pool(workers[i], with_rst, 1, w, h);
+            double plain_ms = time_pool(workers[i], without, 1, w, h);
+            double batch_ms = time_pool(workers[i], without, BATCH, w, h);
+            if(i == 0)
+                single = rst_ms;
+
+            printf("    %zu workers: RST %7.2f ms/frame (%4.2fx), none "
+                "%7.2f ms/frame, none in batches of %zu %6.1f frames/s\n",
+                workers[i], rst_ms, rst_ms > 0 ? single / rst_ms : 0.0,
+                plain_ms, BATCH, batch_ms > 0 ? BATCH * 1000.0 / batch_ms :
+                0.0);
+        }
+    }
+
+    return 0;
+}
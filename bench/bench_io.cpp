@@ -0,0 +1,118 @@
+// direct_io throughput of the two write backends: plain pwrite() against
+// io_uring.
+//
+// Four producer threads, one per camera, save synthetic frames of an odd
+// size, as real JPEGs are, into segment files under the directory given
+// as the first argument (default /tmp). With direct_io nearly every frame
+// is copied into the camera's bounce buffer and goes out from there, so
+// the share of bytes written from a registered buffer (WRITE_FIXED) says
+// whether io_uring is saving the per-write page pinning.
+//
+// If io_uring is not available (an old kernel, or a sandbox that blocks
+// it) the second run falls back to pwrite(), and says so.
+
+#include "save_thread.h"
+#include "io_queue.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static const int CAMERAS = 4;
+static const size_t FRAME_BYTES = 300 * 1024 + 77;
+static const size_t FRAMES_PER_CAMERA = 512;
+
+static void run(const string& base, IoBackend backend)
+{
+    const char* name = backend == IO_BACKEND_URING ? "io_uring" : "pwrite";
+
+    string dir = base + "/bench_io_" + name;
+    string cmd = "rm -rf '" + dir + "' && mkdir -p '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        exit(1);
+
+    SaveOptions options;
+    options.writer_count = 2;
+    options.segment_bytes = 256ULL * 1024 * 1024;
+    options.direct_io = true;
+    options.io_backend = backend;
+    options.budget.max_frames = 64;
+    options.budget.policy = BLOCK;
+    options.budget.block_us = 10 * 1000 * 1000;
+    options.durability.policy = SYNC_BYTES;
+    options.durability.bytes = 64ULL * 1024 * 1024;
+
+    vector<unsigned char> frame(FRAME_BYTES);
+    for(size_t i = 0; i < frame.size(); i++)
+        frame[i] = (unsigned char)(i * 131 + (i >> 9));
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    frame[FRAME_BYTES - 2] = 0xFF;
+    frame[FRAME_BYTES - 1] = 0xD9;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SaveStats stats;
+    {
+        SaveThread st(dir, options);
+        st.reserve_free_buffers(options.budget.max_frames + CAMERAS,
+            FRAME_BYTES);
+
+        vector<thread> producers;
+        for(int c = 0; c < CAMERAS; c++)
+        {
+            producers.push_back(thread([&st, &frame, c]() {
+                for(size_t i = 0; i < FRAMES_PER_CAMERA; i++)
+                {
+                    unique_ptr<SaveBuffer> buf = st.get_buffer();
+                    buf->store(&frame[0], frame.size());
+                    buf->camera = c;
+                    buf->capture_ns = (int64_t)(i + 1) * 33333333;
+                    st.save(buf);
+                }
+            }));
+        }
+
+        for(size_t i = 0; i < producers.size(); i++)
+            producers[i].join();
+
+        st.stop();
+        stats = st.stats();
+    }
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+    double mb = stats.bytes / 1e6;
+    printf("  %-8s %7.1f MB/s, %6.0f frames/s", name, mb / seconds,
+        stats.frames / seconds);
+    if(stats.queued_bytes)
+    {
+        printf(", %5.1f%% of queued bytes from registered buffers",
+            100.0 * stats.fixed_bytes / stats.queued_bytes);
+    }
+    printf("\n");
+
+    cmd = "rm -rf '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        fprintf(stderr, "could not remove %s\n", dir.c_str());
+}
+
+int main(int argc, char** argv)
+{
+    string base = argc > 1 ? argv[1] : "/tmp";
+
+    printf("bench_io: %d cameras, %zu byte frames, direct_io, %u hardware "
+        "threads\n", CAMERAS, FRAME_BYTES, thread::hardware_concurrency());
+
+    run(base, IO_BACKEND_PWRITE);
+
+    IoQueue probe;
+    if(!probe.init(4))
+        printf("  io_uring is not available here; pwrite() again:\n");
+    run(base, IO_BACKEND_URING);
+
+    return 0;
+}
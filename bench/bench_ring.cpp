@@ -0,0 +1,187 @@
+// Contention benchmark for the save queue hand-off: BoundedRing against the
+// mutex-guarded queue it replaced.
+//
+// Each producer stands in for a camera's Receive(): it takes a buffer from
+// the free list, pushes it onto the save queue, and records how long the
+// push took. One consumer stands in for the writer, popping buffers and
+// putting them back on the free list. The push latency is what a camera's
+// streaming thread sees; the throughput is what the writer gets.
+
+#include "ring_buffer.h"
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+struct Buffer
+{
+    int camera;
+};
+
+// the old queue: a container and a mutex around it
+template <typename T>
+class MutexQueue
+{
+  public:
+    explicit MutexQueue(size_t capacity) : m_capacity(capacity) {}
+
+    bool push(unique_ptr<T>& ptr)
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if(m_items.size() >= m_capacity)
+            return false;
+        m_items.push_back(ptr.release());
+        return true;
+    }
+
+    unique_ptr<T> pop()
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if(m_items.empty())
+            return unique_ptr<T>();
+        unique_ptr<T> result(m_items.front());
+        m_items.pop_front();
+        return result;
+    }
+
+    ~MutexQueue()
+    {
+        while(pop())
+            ;
+    }
+
+  private:
+    mutex m_mutex;
+    deque<T*> m_items;
+    size_t m_capacity;
+};
+
+static int64_t now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Result
+{
+    double pushes_per_s;
+    int64_t p50_ns;
+    int64_t p99_ns;
+    int64_t max_ns;
+};
+
+template <typename Queue>
+static Result run(size_t producers, size_t per_producer)
+{
+    const size_t capacity = 256;
+    Queue queue(capacity);
+    Queue free_list(capacity);
+
+    for(size_t i = 0; i < capacity; i++)
+    {
+        unique_ptr<Buffer> b(new Buffer());
+        free_list.push(b);
+    }
+
+    atomic<size_t> remaining(producers);
+    atomic<bool> go(false);
+    vector<vector<int64_t> > latencies(producers);
+    vector<thread> threads;
+
+    for(size_t p = 0; p < producers; p++)
+    {
+        threads.push_back(thread([&, p]() {
+            vector<int64_t>& lat = latencies[p];
+            lat.reserve(per_producer);
+            while(!go.load())
+                ;
+
+            for(size_t i = 0; i < per_producer; i++)
+            {
+                unique_ptr<Buffer> b = free_list.pop();
+                while(!b)
+                {
+                    this_thread::yield();
+                    b = free_list.pop();
+                }
+                b->camera = (int)p;
+
+                int64_t start = now_ns();
+                while(!queue.push(b))
+                    this_thread::yield();
+                lat.push_back(now_ns() - start);
+            }
+            remaining--;
+        }));
+    }
+
+    int64_t start = now_ns();
+    go.store(true);
+
+    size_t popped = 0;
+    while(popped < producers * per_producer)
+    {
+        unique_ptr<Buffer> b = queue.pop();
+        if(!b)
+        {
+            if(remaining.load() == 0 && !(b = queue.pop()))
+                continue;
+            if(!b)
+            {
+                this_thread::yield();
+                continue;
+            }
+        }
+        popped++;
+        free_list.push(b);
+    }
+
+    int64_t elapsed = now_ns() - start;
+    for(size_t p = 0; p < producers; p++)
+        threads[p].join();
+
+    vector<int64_t> all;
+    for(size_t p = 0; p < producers; p++)
+        all.insert(all.end(), latencies[p].begin(), latencies[p].end());
+    sort(all.begin(), all.end());
+
+    Result r;
+    r.pushes_per_s = (double)popped / (elapsed / 1e9);
+    r.p50_ns = all[all.size() / 2];
+    r.p99_ns = all[all.size() * 99 / 100];
+    r.max_ns = all.back();
+    return r;
+}
+
+static void report(const char* name, size_t producers, const Result& r)
+{
+    printf("  %-12s %2zu producers: %6.2f M pushes/s, push p50 %5lld ns, "
+        "p99 %7lld ns, max %9lld ns\n", name, producers,
+        r.pushes_per_s / 1e6, (long long)r.p50_ns, (long long)r.p99_ns,
+        (long long)r.max_ns);
+}
+
+int main()
+{
+    const size_t per_producer = 200000;
+    size_t counts[] = { 1, 2, 4, 8 };
+
+    printf("bench_ring: save queue hand-off, %u hardware threads\n",
+        thread::hardware_concurrency());
+
+    for(size_t i = 0; i < sizeof counts / sizeof counts[0]; i++)
+    {
+        size_t n = counts[i];
+        report("BoundedRing", n,
+            run<BoundedRing<Buffer> >(n, per_producer / n));
+        report("mutex queue", n,
+            run<MutexQueue<Buffer> >(n, per_producer / n));
+    }
+
+    return 0;
+}
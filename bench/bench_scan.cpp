@@ -0,0 +1,80 @@
+// Throughput of jpeg_scan(), the check every frame gets on the capture
+// path, with the 0xFF search it picked for this CPU against the scalar
+// one.
+//
+// Frames are made by tests/jpeg_encoder at a few sizes and qualities;
+// higher quality means more scan data and more stuffed 0xFF bytes. Each
+// frame is scanned over and over, so it sits in cache and the numbers are
+// the search's, not the memory's.
+
+#include "jpeg_scan.h"
+#include "jpeg_encoder.h"
+#include <cstdio>
+#include <vector>
+#include <chrono>
+using namespace std;
+
+typedef JpegCheck (*ScanFn)(const unsigned char* data, size_t size,
+    JpegScan& scan);
+
+static double mb_per_s(ScanFn scan_fn, const vector<unsigned char>& jpeg)
+{
+    const double min_seconds = 0.3;
+    size_t runs = 0;
+    JpegScan scan;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double seconds = 0;
+    do
+    {
+        for(int i = 0; i < 16; i++)
+        {
+            if(scan_fn(&jpeg[0], jpeg.size(), scan) != JPEG_VALID)
+                return 0;
+        }
+        runs += 16;
+        seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+    }
+    while(seconds < min_seconds);
+
+    return runs * jpeg.size() / 1e6 / seconds;
+}
+
+int main()
+{
+    struct Case
+    {
+        int width;
+        int height;
+        int quality;
+    };
+    Case cases[] = {
+        { 640, 480, 75 },
+        { 1920, 1080, 75 },
+        { 1920, 1080, 95 },
+        { 4208, 3120, 85 }
+    };
+
+    printf("bench_scan: jpeg_scan() with %s against scalar\n",
+        jpeg_scan_isa());
+
+    for(size_t i = 0; i < sizeof cases / sizeof cases[0]; i++)
+    {
+        const Case& c = cases[i];
+        JpegEncodeOptions options;
+        options.quality = c.quality;
+        vector<unsigned char> pixels = test_image(c.width, c.height, 3);
+        vector<unsigned char> jpeg = jpeg_encode(&pixels[0], c.width,
+            c.height, 3, options);
+
+        double simd = mb_per_s(jpeg_scan, jpeg);
+        double scalar = mb_per_s(jpeg_scan_scalar, jpeg);
+
+        printf("  %4dx%-4d q%d, %7zu bytes: %8.0f MB/s, scalar %6.0f MB/s, "
+            "%5.1fx\n", c.width, c.height, c.quality, jpeg.size(), simd,
+            scalar, scalar > 0 ? simd / scalar : 0.0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,135 @@
+// Trigger-to-durable latency of snapshots, with the disk idle and with
+// bulk recording keeping it busy.
+//
+// Eight producer threads, one per camera, save synthetic frames at about
+// 30 fps each, or as fast as the queue takes them (DropPolicy BLOCK) under
+// load, into segment files under the directory given as the first argument
+// (default /tmp), syncing every 64 MB. Meanwhile another thread asks for a
+// snapshot of each camera in turn, every 20 ms, and waits for it. The
+// latency is SnapshotResult::latency_us: from request_snapshot() to the
+// file being synced. The target is under 50 ms even under load.
+
+#include "save_thread.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+static const int CAMERAS = 8;
+static const size_t FRAME_BYTES = 256 * 1024;
+static const int SNAPSHOTS = 100;
+static const int64_t TARGET_US = 50 * 1000;
+
+static void run(const string& base, bool loaded)
+{
+    string dir = base + (loaded ? "/bench_snapshot_loaded" :
+        "/bench_snapshot_idle");
+    string cmd = "rm -rf '" + dir + "' && mkdir -p '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        exit(1);
+
+    SaveOptions options;
+    options.writer_count = 2;
+    options.segment_bytes = 256ULL * 1024 * 1024;
+    options.budget.max_frames = 64;
+    options.budget.policy = BLOCK;
+    options.budget.block_us = 10 * 1000 * 1000;
+    options.durability.policy = SYNC_BYTES;
+    options.durability.bytes = 64ULL * 1024 * 1024;
+
+    vector<unsigned char> frame(FRAME_BYTES);
+    for(size_t i = 0; i < frame.size(); i++)
+        frame[i] = (unsigned char)(i * 131 + (i >> 9));
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    frame[FRAME_BYTES - 2] = 0xFF;
+    frame[FRAME_BYTES - 1] = 0xD9;
+
+    vector<int64_t> latencies;
+    int failed = 0;
+    SaveStats stats;
+    {
+        SaveThread st(dir, options);
+        st.reserve_free_buffers(options.budget.max_frames + CAMERAS,
+            FRAME_BYTES);
+
+        atomic<bool> done(false);
+        vector<thread> producers;
+        for(int c = 0; c < CAMERAS; c++)
+        {
+            producers.push_back(thread([&st, &frame, &done, c, loaded]() {
+                for(int64_t i = 1; !done.load(); i++)
+                {
+                    unique_ptr<SaveBuffer> buf = st.get_buffer();
+                    buf->store(&frame[0], frame.size());
+                    buf->camera = c;
+                    buf->capture_ns = i * 33333333;
+                    st.save(buf);
+
+                    if(!loaded)
+                        this_thread::sleep_for(chrono::milliseconds(33));
+                }
+            }));
+        }
+
+        for(int n = 0; n < SNAPSHOTS; n++)
+        {
+            int camera = n % CAMERAS;
+            st.request_snapshot(camera, n);
+
+            SnapshotResult result;
+            if(st.wait_snapshot(camera, n, 5000, result) && result.ok)
+                latencies.push_back(result.latency_us);
+            else
+                failed++;
+
+            this_thread::sleep_for(chrono::milliseconds(20));
+        }
+
+        done.store(true);
+        for(size_t i = 0; i < producers.size(); i++)
+            producers[i].join();
+
+        st.stop();
+        stats = st.stats();
+    }
+
+    if(latencies.empty())
+    {
+        printf("  %-6s no snapshots finished\n", loaded ? "loaded" : "idle");
+        return;
+    }
+
+    sort(latencies.begin(), latencies.end());
+    size_t within = lower_bound(latencies.begin(), latencies.end(),
+        TARGET_US) - latencies.begin();
+
+    printf("  %-6s p50 %6.1f ms, p99 %6.1f ms, max %6.1f ms, %zu/%d under "
+        "%lld ms, %d failed; bulk %.0f MB\n", loaded ? "loaded" : "idle",
+        latencies[latencies.size() / 2] / 1000.0,
+        latencies[latencies.size() * 99 / 100] / 1000.0,
+        latencies.back() / 1000.0, within, SNAPSHOTS,
+        (long long)(TARGET_US / 1000), failed, stats.bytes / 1e6);
+
+    cmd = "rm -rf '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        fprintf(stderr, "could not remove %s\n", dir.c_str());
+}
+
+int main(int argc, char** argv)
+{
+    string base = argc > 1 ? argv[1] : "/tmp";
+
+    printf("bench_snapshot: %d cameras, %zu KB frames, %d snapshots, %u "
+        "hardware threads\n", CAMERAS, FRAME_BYTES / 1024, SNAPSHOTS,
+        thread::hardware_concurrency());
+
+    run(base, false);
+    run(base, true);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Cost of the DC thumbnails segments keep with their frames, per megapixel
+// of frame, against decoding the frame properly.
+//
+// First on one thread: JpegDecoder::decode_dc() for gray and RGB
+// thumbnails, then decode() at 1/8 scale, the next cheapest way to get an
+// image that size, and at full size. Each includes parse(). Then the
+// ThumbnailPool as the writers use it, on batches of 8 frames, with its
+// cost per megapixel as SaveStats::thumbnail_us_per_megapixel() reports
+// it and the frames per second it gets through.
+//
+// Frames are made by tests/jpeg_encoder at quality 85, 4:2:0.
+
+#include "jpeg_decoder.h"
+#include "thumbnail_pool.h"
+#include "jpeg_encoder.h"
+#include <cstdio>
+#include <vector>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+enum Method
+{
+    DC_GRAY,
+    DC_RGB,
+    SCALED_8,
+    FULL
+};
+
+static bool run_once(JpegDecoder& decoder, const vector<unsigned char>& jpeg,
+    Method method, JpegImage& image)
+{
+    if(!decoder.parse(&jpeg[0], jpeg.size()))
+        return false;
+
+    switch(method)
+    {
+    case DC_GRAY:
+        return decoder.decode_dc(1, image);
+    case DC_RGB:
+        return decoder.decode_dc(3, image);
+    case SCALED_8:
+        return decoder.decode(8, JPEG_RGB, image);
+    default:
+        return decoder.decode(1, JPEG_RGB, image);
+    }
+}
+
+// microseconds per frame
+static double time_method(const vector<unsigned char>& jpeg, Method method)
+{
+    JpegDecoder decoder;
+    JpegImage image;
+    if(!run_once(decoder, jpeg, method, image))
+        return 0;
+
+    const double min_seconds = 0.5;
+    size_t runs = 0;
+    double seconds = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    do
+    {
+        run_once(decoder, jpeg, method, image);
+        runs++;
+        seconds = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+    }
+    while(seconds < min_seconds);
+
+    return seconds * 1e6 / runs;
+}
+
+static void pool_run(const vector<unsigned char>& jpeg, size_t workers)
+{
+    const size_t BATCH = 8;
+    const int BATCHES = 4;
+
+    vector<FrameInfo> frames(BATCH, FrameInfo());
+    for(size_t i = 0; i < BATCH; i++)
+    {
+        frames[i].data = &jpeg[0];
+        frames[i].size = jpeg.size();
+    }
+
+    ThumbnailPool pool(3, workers);
+    pool.start();
+
+    vector<vector<unsigned char> > thumbnails;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for(int b = 0; b < BATCHES; b++)
+        pool.build(&frames[0], frames.size(), thumbnails);
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+    pool.stop();
+
+    double us_per_mp = pool.source_pixels() ?
+        (double)pool.busy_ns() / pool.source_pixels() * 1000.0 : 0.0;
+    printf("    pool, %zu workers: %6.0f us/MP of thread time, %5.1f "
+        "frames/s, %3llu failed\n", workers, us_per_mp,
+        BATCH * BATCHES / seconds, (unsigned long long)pool.failed());
+}
+
+int main()
+{
+    struct Size
+    {
+        int width;
+        int height;
+    };
+    Size sizes[] = {
+        { 640, 480 },
+        { 1920, 1080 },
+        { 4208, 3120 }
+    };
+
+    const char* names[] = { "DC gray", "DC RGB", "1/8 IDCT", "full" };
+
+    printf("bench_thumbnail: %s kernels, %u hardware threads\n",
+        jpeg_decode_isa(), thread::hardware_concurrency());
+
+    for(size_t s = 0; s < sizeof sizes / sizeof sizes[0]; s++)
+    {
+        int w = sizes[s].width;
+        int h = sizes[s].height;
+        double megapixels = (double)w * h / 1e6;
+
+        vector<unsigned char> pixels = test_image(w, h, 3);
+        vector<unsigned char> jpeg = jpeg_encode(&pixels[0], w, h, 3);
+
+        printf("  %dx%d (%.1f MP), %zu bytes\n", w, h, megapixels,
+            jpeg.size());
+
+        for(int m = DC_GRAY; m <= FULL; m++)
+        {
+            double us = time_method(jpeg, (Method)m);
+            printf("    %-9s %9.0f us/frame, %6.0f us/MP\n", names[m], us,
+                us / megapixels);
+        }
+
+        size_t workers[] = { 1, 2, 4 };
+        for(size_t i = 0; i < sizeof workers / sizeof workers[0]; i++)
+            pool_run(jpeg, workers[i]);
+    }
+
+    return 0;
+}
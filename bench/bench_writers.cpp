@@ -0,0 +1,119 @@
+// Throughput of the writer pool against its writer count.
+//
+// One producer thread per camera saves synthetic frames as fast as the
+// queue takes them (DropPolicy BLOCK, so nothing is shed), into segment
+// files under the directory given as the first argument (default /tmp).
+// Each camera's file is synced every 64 MB so the disk, not the page
+// cache, sets the pace. Pass "direct" as the second argument to write
+// with direct_io instead.
+//
+// The throughput should grow with the writer count until the disk, or
+// the CPUs, run out.
+
+#include "save_thread.h"
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static const int CAMERAS = 8;
+static const size_t FRAME_BYTES = 256 * 1024;
+static const size_t FRAMES_PER_CAMERA = 256;
+
+static double run(const string& base, size_t writers, bool direct)
+{
+    char name[64];
+    snprintf(name, sizeof name, "/bench_writers_%zu", writers);
+    string dir = base + name;
+    string cmd = "rm -rf '" + dir + "' && mkdir -p '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        exit(1);
+
+    SaveOptions options;
+    options.writer_count = writers;
+    options.segment_bytes = 256ULL * 1024 * 1024;
+    options.direct_io = direct;
+    options.budget.max_frames = 64;
+    options.budget.policy = BLOCK;
+    options.budget.block_us = 10 * 1000 * 1000;
+    options.durability.policy = SYNC_BYTES;
+    options.durability.bytes = 64ULL * 1024 * 1024;
+
+    vector<unsigned char> frame(FRAME_BYTES);
+    for(size_t i = 0; i < frame.size(); i++)
+        frame[i] = (unsigned char)(i * 131 + (i >> 9));
+    frame[0] = 0xFF;
+    frame[1] = 0xD8;
+    frame[FRAME_BYTES - 2] = 0xFF;
+    frame[FRAME_BYTES - 1] = 0xD9;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    SaveStats stats;
+    {
+        SaveThread st(dir, options);
+        st.reserve_free_buffers(options.budget.max_frames + CAMERAS,
+            FRAME_BYTES);
+
+        vector<thread> producers;
+        for(int c = 0; c < CAMERAS; c++)
+        {
+            producers.push_back(thread([&st, &frame, c]() {
+                for(size_t i = 0; i < FRAMES_PER_CAMERA; i++)
+                {
+                    unique_ptr<SaveBuffer> buf = st.get_buffer();
+                    buf->store(&frame[0], frame.size());
+                    buf->camera = c;
+                    buf->capture_ns = (int64_t)(i + 1) * 33333333;
+                    st.save(buf);
+                }
+            }));
+        }
+
+        for(size_t i = 0; i < producers.size(); i++)
+            producers[i].join();
+
+        st.stop();
+        stats = st.stats();
+    }
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+
+    double mb = stats.bytes / 1e6;
+    printf("  %zu writers: %7.1f MB/s, %6.0f frames/s, %llu steals, "
+        "%llu dropped\n", writers, mb / seconds, stats.frames / seconds,
+        (unsigned long long)stats.steals,
+        (unsigned long long)stats.dropped);
+
+    cmd = "rm -rf '" + dir + "'";
+    if(system(cmd.c_str()) != 0)
+        fprintf(stderr, "could not remove %s\n", dir.c_str());
+
+    return mb / seconds;
+}
+
+int main(int argc, char** argv)
+{
+    string base = argc > 1 ? argv[1] : "/tmp";
+    bool direct = argc > 2 && strcmp(argv[2], "direct") == 0;
+
+    printf("bench_writers: %d cameras, %zu KB frames, %s, %u hardware "
+        "threads\n", CAMERAS, FRAME_BYTES / 1024,
+        direct ? "direct_io" : "buffered", thread::hardware_concurrency());
+
+    size_t counts[] = { 1, 2, 4, 8 };
+    double one = 0;
+    for(size_t i = 0; i < sizeof counts / sizeof counts[0]; i++)
+    {
+        double rate = run(base, counts[i], direct);
+        if(i == 0)
+            one = rate;
+        else
+            printf("    %.2fx one writer\n", rate / one);
+    }
+
+    return 0;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "frame_sink.h"
+#include "output_file.h"
+
+// Streams JPEG frames into an OpenDML (AVI 2.0) file with a single MJPG
+// video stream, so recordings play in standard tools without re-encoding.
+//
+// Frames are appended as '00dc' chunks inside 'movi' lists. Every
+// INDEX_FRAMES frames an 'ix00' standard index chunk is written after them
+// and an entry pointing at it is added to the 'indx' super index in the
+// stream header. The header is patched in place at that point, so if the
+// process dies the file is still readable up to the last index chunk.
+// Once a RIFF reaches its size limit an 'AVIX' RIFF is started, which is
+// how OpenDML gets past the 4GB size of a single RIFF.
+//
+// The first RIFF also ends with a legacy 'idx1' index of its frames, for
+// players that do not know OpenDML. It is written when that RIFF is
+// finished, by the move to 'AVIX' or by close(); until then the file only
+// has the 'indx' index, which every OpenDML-aware player uses anyway.
+//
+// The frame size is taken from the first frame's SOF marker. The frame rate
+// is worked out from the frame timestamps when the file is closed.
+class AviWriter : public FrameSink
+{
+  public:
+    // frames per ix00 chunk
+    static const size_t INDEX_FRAMES = 1024;
+
+    // ix00 chunks that the super index has room for
+    static const size_t SUPER_INDEX_ENTRIES = 2048;
+
+    // largest RIFF before moving on to the next one. OpenDML readers limit
+    // the first RIFF to 1GB, so all of them are kept to that.
+    static const uint64_t RIFF_LIMIT = 1024ULL * 1024 * 1024;
+
+    // riff_limit is the most a RIFF may grow to; anything but RIFF_LIMIT
+    // is only of use for testing the move to the next one
+    explicit AviWriter(uint64_t riff_limit = RIFF_LIMIT);
+    ~AviWriter();
+
+    const char* extension() const { return ".avi"; }
+
+    // always starts a new file; OPEN_TRUNCATE is implied
+    bool open(const std::string& path, unsigned flags);
+    bool write_frames(const FrameInfo* frames, size_t count);
+    void close();
+
+    // writes an ix00 chunk for the frames since the last one and patches
+    // the header before syncing, so everything synced is still playable
+    // after a crash. Frequent syncs therefore use up the super index
+    // sooner and make full() come round earlier.
+    bool sync();
+
+    // true when the super index is nearly out of entries
+    bool full() const;
+
+    uint64_t bytes_written() const { return m_file.bytes_written(); }
+    uint64_t write_calls() const { return m_file.write_calls(); }
+
+    uint64_t frame_count() const { return m_frames; }
+
+  private:
+    AviWriter(const AviWriter&);
+    AviWriter& operator=(const AviWriter&);
+
+    struct IndexEntry
+    {
+        uint32_t offset; // of the chunk data, from m_movi_at
+        uint32_t size;
+    };
+
+    struct SuperEntry
+    {
+        uint64_t offset; // of the ix00 chunk
+        uint32_t size;   // of the ix00 chunk, header included
+        uint32_t frames;
+    };
+
+    bool write_header(const FrameInfo& first);
+    bool flush_pending();
+    bool flush_index();
+    bool end_first_riff();
+    bool start_riff();
+    bool update_header();
+
+    OutputFile m_file;
+    uint64_t m_riff_limit;
+    bool m_header_written;
+
+    // the header (everything up to the first 'movi' list) as last written,
+    // kept so it can be changed and patched back in one go
+    std::vector<unsigned char> m_header;
+    size_t m_avih_at;
+    size_t m_strh_at;
+    size_t m_indx_at;
+    size_t m_dmlh_at;
+
+    // where the next byte goes; m_file.position() plus m_slices
+    uint64_t m_pos;
+
+    // the RIFF being written and its 'movi' list
+    uint64_t m_riff_at;
+    uint64_t m_movi_at;
+    uint32_t m_riff_frames;
+
+    // frames in the first RIFF, which is all avih's frame count covers,
+    // and where its 'movi' list and the RIFF itself ended once idx1 has
+    // been written after them
+    uint32_t m_first_riff_frames;
+    uint64_t m_first_movi_end;
+    uint64_t m_first_riff_end;
+
+    uint64_t m_frames;
+    uint32_t m_largest_chunk;
+    int64_t m_first_us;
+    int64_t m_last_us;
+
+    std::vector<IndexEntry> m_index;
+
+    // every frame in the first RIFF, for its idx1 chunk
+    std::vector<IndexEntry> m_legacy_index;
+    std::vector<SuperEntry> m_super;
+
+    // frames gathered but not yet written: chunk headers and the slices
+    // that point at them and at the frame data
+    std::vector<unsigned char> m_chunk_headers;
+    std::vector<IoSlice> m_slices;
+
+    // scratch for building ix00 chunks and RIFF headers
+    std::vector<unsigned char> m_scratch;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+// Timestamps for captured frames. Frames are stamped on arrival with a
+// monotonic nanosecond clock (QueryPerformanceCounter / CLOCK_MONOTONIC),
+// which is cheap to read and never jumps, so the gaps between frames can
+// be measured to well under a millisecond. Wall-clock time is only worked
+// out later, when a frame is written.
+//
+// All functions are thread safe.
+
+// now, in nanoseconds on the monotonic clock. The zero point is arbitrary.
+int64_t monotonic_ns();
+
+// the wall-clock time, in microseconds since 1970-01-01 UTC, of a
+// monotonic_ns() reading. The offset between the two clocks is measured
+// again at most once a second, so a change to the system clock shows up
+// within a second. Smaller changes than the measurement can tell apart
+// from noise are left out, so while the system clock is not set, later
+// readings never map to earlier times.
+int64_t monotonic_to_wall_us(int64_t ns);
+
+// the date in the proleptic Gregorian calendar that is a number of days
+// after 1970-01-01
+void civil_from_days(int64_t days, int& y, unsigned& m, unsigned& d);
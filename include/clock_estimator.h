@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+// Follows one camera's own clock against the host's monotonic clock, so
+// the camera's sample times can be put on the host timeline without the
+// jitter of USB delivery and without drifting apart over a long run.
+//
+// Each frame gives a pair: the device timestamp (IMediaSample stream
+// time) and the host time it arrived (SaveBuffer::capture_ns). Arrival
+// lags capture by a delivery delay that varies from frame to frame but
+// is never below some minimum, so within each bucket of device time only
+// the pair with the smallest host-minus-device offset is kept: the frame
+// that got through fastest. A least-squares line through the last
+// window of those points gives the offset at any device time; its slope
+// is the drift between the two clocks.
+//
+// A jump of more than half a second against the fit (the graph was
+// restarted, the stream time went backwards) throws the history away and
+// starts again.
+//
+// Pure arithmetic, no system calls. Not thread safe; each camera's
+// estimator belongs to the writer holding that camera.
+class ClockEstimator
+{
+  public:
+    // window: number of buckets the fit goes back over. bucket_ns: device
+    // time covered by each.
+    explicit ClockEstimator(size_t window = 256,
+        int64_t bucket_ns = 1000000000);
+
+    // adds a frame. Returns true when a bucket was finished and the fit
+    // moved, i.e. about once per bucket_ns.
+    bool add(int64_t device_ns, int64_t host_ns);
+
+    // true once there is a fit, after the first two buckets
+    bool ready() const { return m_ready; }
+
+    // the host monotonic time that corresponds to a device time. Only
+    // meaningful once ready().
+    int64_t to_host_ns(int64_t device_ns) const;
+
+    // how much faster the host clock runs than the device's, in parts per
+    // million
+    double drift_ppm() const { return m_slope * 1e6; }
+
+    // spread (standard deviation) of the frames' arrival times around the
+    // fit, in microseconds
+    double jitter_us() const;
+
+    // frames added since the last reset
+    uint64_t frames() const { return m_frames; }
+
+    void reset();
+
+  private:
+    struct Point
+    {
+        int64_t device_ns;
+        int64_t offset_ns; // host minus device
+    };
+
+    double predicted_offset(int64_t device_ns) const;
+    void fit();
+
+    size_t m_window;
+    int64_t m_bucket_ns;
+
+    // the fastest frame of each finished bucket; a ring once it is full
+    std::vector<Point> m_points;
+    size_t m_next;
+
+    // the bucket being filled and its fastest frame so far
+    bool m_have_bucket;
+    int64_t m_bucket;
+    Point m_best;
+
+    // the fit: offset = m_base_offset + m_slope * (device - m_base_device)
+    bool m_ready;
+    int64_t m_base_device;
+    double m_base_offset;
+    double m_slope;
+
+    // running mean and variance of the residuals against the fit
+    double m_residual_mean;
+    double m_residual_var;
+    uint64_t m_frames;
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), as used by iSCSI, ext4 and friends. Pass 0 to
+// start a new checksum, or a previous result to continue it over more data:
+//
+//     uint32_t crc = crc32c(0, a, a_size);
+//     crc = crc32c(crc, b, b_size);    // same as one call over a then b
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <stdint.h>
+
+#include "jpeg_decoder.h"
+
+// A frame for DecodePool::decode() and where its pixels go: out is the
+// caller's, output_height(scale) rows of output_width(scale) pixels,
+// stride bytes apart (JpegDecoder::decode()).
+struct DecodeRequest
+{
+    const unsigned char* data;
+    size_t size;
+    int scale;
+    JpegPixelFormat format;
+    unsigned char* out;
+    size_t stride;
+
+    // set by decode(): false if the frame could not be decoded, with out
+    // left partly written
+    bool ok;
+};
+
+// Decodes frames to pixels on a pool of threads, for preview and analytics.
+//
+// A full-size decode of a 13 MP frame takes longer than a frame interval
+// on one core. Frames with restart markers can be split up: a quick
+// pre-scan (JpegDecoder::find_restarts()) finds where each restart interval
+// starts, and the frame's MCU rows are cut into bands at those places,
+// which threads decode at the same time into their own rows of the output
+// (JpegDecoder::decode_rows()). A frame without restart markers can only
+// be decoded from the top, so it is decoded whole by one thread; a batch
+// of such frames still spreads over the pool a frame per thread.
+//
+// Like ThumbnailPool, the caller of decode() works on its own batch until
+// it is all handed out, and batches from several callers share the pool.
+//
+// Thread safe.
+class DecodePool
+{
+  public:
+    explicit DecodePool(size_t worker_count);
+    ~DecodePool();
+
+    void start();
+    void stop();
+
+    // decodes requests[0, count), setting each one's ok. Returns once all
+    // of them are done; true if they all decoded.
+    bool decode(DecodeRequest* requests, size_t count);
+
+    // frames decoded and frames that could not be, and how many frames
+    // were split over threads
+    uint64_t decoded() const { return m_decoded.load(); }
+    uint64_t failed() const { return m_failed.load(); }
+    uint64_t split() const { return m_split.load(); }
+
+    // time spent decoding, summed over the threads, and the pixels of the
+    // frames decoded
+    uint64_t busy_ns() const { return m_busy_ns.load(); }
+    uint64_t source_pixels() const { return m_pixels.load(); }
+
+  private:
+    DecodePool(const DecodePool&);
+    DecodePool& operator=(const DecodePool&);
+
+    // MCU rows [first_row, first_row + row_count) of one request
+    struct Task
+    {
+        size_t request;
+        int first_row;
+        int row_count;
+    };
+
+    struct Job
+    {
+        DecodeRequest* requests;
+        std::vector<std::vector<size_t> > restarts;
+        std::vector<Task> tasks;
+
+        // per request: whether any of its tasks failed, and its pixels
+        std::vector<unsigned char> failed;
+        std::vector<uint64_t> pixels;
+
+        // next task to hand out, and tasks finished
+        size_t next;
+        size_t done;
+    };
+
+    class Worker;
+
+    void plan(Job& job, size_t index, JpegDecoder& decoder);
+    bool take(Job*& job, size_t& index);
+    void finish(Job* job, size_t index, bool ok);
+    void thread_main();
+
+    size_t m_worker_count;
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+    bool m_should_quit;
+
+    // jobs with tasks still to hand out, oldest first
+    std::deque<Job*> m_jobs;
+
+    std::atomic<uint64_t> m_decoded;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_split;
+    std::atomic<uint64_t> m_busy_ns;
+    std::atomic<uint64_t> m_pixels;
+};
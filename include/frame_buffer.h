@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+
+// Byte buffer for captured frames. It fills the role std::vector<unsigned
+// char> used to in SaveBuffer, with three differences that matter at
+// multi-megabyte frame sizes:
+//
+//   * storage is page aligned and a whole number of pages, so it can be
+//     handed straight to unbuffered (O_DIRECT / FILE_FLAG_NO_BUFFERING)
+//     writes;
+//   * resize() does not zero-fill, since every caller immediately
+//     overwrites the contents anyway;
+//   * prefault() touches every page up front, so the first frame stored in
+//     a fresh buffer does not take thousands of page faults on the capture
+//     thread.
+//
+// Memory comes straight from the OS (VirtualAlloc / mmap), optionally backed
+// by large pages when the system allows it.
+class FrameBuffer
+{
+  public:
+    FrameBuffer();
+    ~FrameBuffer();
+
+    unsigned char* data() { return m_data; }
+    const unsigned char* data() const { return m_data; }
+
+    unsigned char& operator[](size_t i) { return m_data[i]; }
+    const unsigned char& operator[](size_t i) const { return m_data[i]; }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool empty() const { return m_size == 0; }
+
+    // sets the size to 0. The storage is kept.
+    void clear() { m_size = 0; }
+
+    // makes room for at least byte_count bytes, keeping the current
+    // contents. Capacity is rounded up to a whole number of pages.
+    void reserve(size_t byte_count);
+
+    // changes the size. Bytes beyond the old size are left uninitialized.
+    void resize(size_t byte_count);
+
+    // writes to every page of the current capacity so it is backed by
+    // physical memory before the capture thread needs it.
+    void prefault();
+
+    // asks for large pages on future allocations. Falls back to normal pages
+    // if the OS refuses (on Windows this needs SeLockMemoryPrivilege).
+    void set_huge_pages(bool enable) { m_huge_pages = enable; }
+
+    // counts the times the storage has been moved to a new allocation.
+    // Anything that remembers data() (such as a buffer registered with the
+    // kernel) can compare this to see if its copy is stale.
+    unsigned generation() const { return m_generation; }
+
+    // alignment of data() and granularity of capacity()
+    static size_t page_size();
+
+  private:
+    FrameBuffer(const FrameBuffer&);
+    FrameBuffer& operator=(const FrameBuffer&);
+
+    static unsigned char* allocate(size_t& byte_count, bool huge);
+    static void release(unsigned char* p, size_t byte_count);
+
+    unsigned char* m_data;
+    size_t m_size;
+    size_t m_capacity;
+    unsigned m_generation;
+    bool m_huge_pages;
+};
+
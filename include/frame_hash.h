@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+// 64-bit hash of a whole frame, cheap enough to take of every frame as it
+// is captured. Used to spot a camera sending the same frame again, and
+// kept with each frame in a segment (FrameHash) so that a frame read back
+// can be checked against what arrived.
+//
+// The data is taken 64 bytes at a time into eight 64-bit lanes, each word
+// multiplied 32 by 32 bits with a key that changes from one 64 bytes to
+// the next, and the lanes are scrambled every KiB; the same scheme as
+// XXH3, so the SSE2 and AVX2 versions do four or eight lanes at once with
+// one multiply each. Every version gives the same result, on the little
+// endian machines this runs on, at well above memory bandwidth with AVX2.
+//
+// Not a cryptographic hash: it catches accidents, not forgeries.
+uint64_t frame_hash(const void* data, size_t size);
+
+// the plain C++ version, for checking the others against
+uint64_t frame_hash_scalar(const void* data, size_t size);
+
+// which version frame_hash() picked for this CPU: "avx2", "sse2" or
+// "scalar"
+const char* frame_hash_isa();
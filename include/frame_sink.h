@@ -0,0 +1,167 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+#include <stdint.h>
+
+#include "output_file.h"
+
+// One frame as handed to a FrameSink. The memory belongs to the caller and
+// only has to stay valid for the duration of the write_frames() call.
+struct FrameInfo
+{
+    const unsigned char* data;
+    size_t size;
+
+    int camera;
+
+    // capture time, in microseconds since 1970-01-01 UTC
+    int64_t time_us;
+
+    bool is_one_shot;
+    int one_shot_tag;
+
+    // see SaveBuffer::damaged. Only the segment format records it.
+    bool is_damaged;
+
+    // passed through to IoSlice::fixed for the frame data
+    unsigned fixed;
+
+    // the frame's RECORD_THUMBNAIL payload (ThumbnailPool), or NULL. Only
+    // the segment format keeps it.
+    const unsigned char* thumbnail;
+    size_t thumbnail_size;
+
+    // frame_hash() of the frame, if has_hash is set (SaveBuffer::hash).
+    // Only the segment format keeps it.
+    uint64_t hash;
+    bool has_hash;
+
+    // the frame is the same, byte for byte, as the one written before it
+    // to this sink, so a sink that keeps_repeats() may store it as a
+    // repeat of that one
+    bool is_repeat;
+};
+
+// A container that a camera's frames are appended to. The save thread owns
+// one per camera and rotates to a new one when the recording interval runs
+// out, full() says so, or the next frame would not fit().
+//
+// Like OutputFile, a sink is only ever touched by the writer thread that
+// holds its camera's shard.
+class FrameSink
+{
+  public:
+    virtual ~FrameSink() {}
+
+    // file name extension, including the dot
+    virtual const char* extension() const = 0;
+
+    // flags are OutputFile open() flags
+    virtual bool open(const std::string& path, unsigned flags) = 0;
+
+    // appends frames, in order, using as few system calls as possible
+    virtual bool write_frames(const FrameInfo* frames, size_t count) = 0;
+
+    // finishes the container (indexes, header fix-ups) and closes the file
+    virtual void close() = 0;
+
+    // makes every frame written so far durable (OutputFile::sync()), so a
+    // reader can still recover it after a power cut
+    virtual bool sync() = 0;
+
+    // true once the container cannot take much more, so the caller should
+    // close it and start another
+    virtual bool full() const { return false; }
+
+    // the most that writing f can add to the file, its share of whatever
+    // close() adds included. The caller sums this over the frames it
+    // gathers for write_frames() to ask whether they fit().
+    virtual uint64_t frame_bytes(const FrameInfo& f) const { return f.size; }
+
+    // whether frames adding up to bytes, by frame_bytes(), can still go in
+    // without the file growing past its limit
+    virtual bool fits(uint64_t bytes) const { return true; }
+
+    // true if one-shot frames should be written into this container along
+    // with the rest; otherwise they are saved as standalone JPEGs
+    virtual bool keeps_one_shots() const { return false; }
+
+    // true if the container can store a frame that is the same as the one
+    // before it as a reference to that one (FrameInfo::is_repeat);
+    // otherwise every frame is written whole
+    virtual bool keeps_repeats() const { return false; }
+
+    virtual uint64_t bytes_written() const = 0;
+    virtual uint64_t write_calls() const = 0;
+};
+
+// The plain format: JPEG frames concatenated back to back (.mjpg). There
+// is no header or index; readers find frames by their SOI/EOI markers. An
+// existing file is appended to.
+class StreamSink : public FrameSink
+{
+  public:
+    const char* extension() const { return ".mjpg"; }
+
+    bool open(const std::string& path, unsigned flags);
+    bool write_frames(const FrameInfo* frames, size_t count);
+    void close();
+    bool sync() { return m_file.sync(); }
+
+    uint64_t bytes_written() const { return m_file.bytes_written(); }
+    uint64_t write_calls() const { return m_file.write_calls(); }
+
+  private:
+    OutputFile m_file;
+    std::vector<IoSlice> m_slices;
+};
+
+// Each frame as a JPEG file of its own (FORMAT_JPEG_FILES). open() is
+// given a directory, which must exist; the sink keeps its path with a file
+// name on the end, so naming a frame is just writing eight digits into
+// that name. The numbers count up from the first frame's millisecond
+// within the minute times 1000, so names sort in capture order and a later
+// sink in the same directory does not reuse one. Frames without a DHT get
+// the standard one (jpeg_dht.h), so every file opens on its own.
+//
+// Files are closed as soon as they are written unless keep_for_sync is
+// set, in which case they stay open until sync() makes them durable. At
+// most MAX_UNSYNCED are kept; past that the oldest are synced early.
+class JpegDirSink : public FrameSink
+{
+  public:
+    explicit JpegDirSink(bool keep_for_sync = false);
+    ~JpegDirSink();
+
+    const char* extension() const { return ".jpg"; }
+
+    bool open(const std::string& path, unsigned flags);
+    bool write_frames(const FrameInfo* frames, size_t count);
+    void close();
+    bool sync();
+
+    uint64_t bytes_written() const { return m_bytes_written; }
+    uint64_t write_calls() const { return m_write_calls; }
+
+    static const size_t MAX_UNSYNCED = 256;
+
+  private:
+    bool finish(OutputFile& file, bool sync);
+
+    bool m_keep;
+    bool m_open;
+    unsigned m_flags;
+
+    // directory + "/NNNNNNNN.jpg"; m_digits is where the number starts
+    std::string m_path;
+    size_t m_digits;
+    bool m_numbered;
+    uint64_t m_next;
+
+    std::vector<std::unique_ptr<OutputFile> > m_unsynced;
+    uint64_t m_bytes_written;
+    uint64_t m_write_calls;
+};
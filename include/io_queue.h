@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "output_file.h"
+
+// Keeps several file writes in flight at once through Linux io_uring, so a
+// writer thread can hand the device a whole batch instead of waiting on one
+// write at a time. Talks to the kernel with raw system calls; there is no
+// liburing dependency.
+//
+// Memory can be registered with the kernel up front (register_buffers());
+// writes from inside a registered buffer then skip the per-write page
+// pinning and use IORING_OP_WRITE_FIXED.
+//
+// An IoQueue belongs to one thread. The save thread gives each writer its
+// own and makes it current for that thread; OutputFile then sends its
+// writes through the current queue, if there is one.
+//
+// On platforms without io_uring, init() always fails and nothing else is
+// ever called.
+class IoQueue
+{
+  public:
+    IoQueue();
+    ~IoQueue();
+
+    // sets up a ring with room for depth writes in flight. Returns false
+    // if io_uring is not available (old kernel, not Linux, blocked by a
+    // sandbox); callers fall back to plain writes.
+    bool init(unsigned depth);
+    bool ready() const;
+
+    // replaces the set of registered buffers. Buffer i is then passed to
+    // write() as fixed = i + 1. Must not be called with writes in flight.
+    // Returns false if the kernel refuses (e.g. RLIMIT_MEMLOCK), in which
+    // case no buffers are registered and writes still work.
+    bool register_buffers(const IoSlice* buffers, size_t count);
+    size_t registered_count() const { return m_registered; }
+
+    // queues a write of size bytes at offset. fixed names the registered
+    // buffer that data lies in (index + 1), or is 0. The memory must stay
+    // valid until wait_all() returns. If the queue is full this first
+    // waits for a write to finish.
+    bool write(int fd, const void* data, size_t size, uint64_t offset,
+        unsigned fixed);
+
+    // submits anything queued and waits for every write to complete,
+    // resubmitting the rest of any short write. Returns false if any write
+    // failed since the last call.
+    bool wait_all();
+
+    // number of io_uring_enter() calls made
+    uint64_t enter_calls() const { return m_enter_calls; }
+
+    // bytes queued by write(), and those of them sent from a registered
+    // buffer
+    uint64_t queued_bytes() const { return m_queued_bytes; }
+    uint64_t fixed_bytes() const { return m_fixed_bytes; }
+
+    // the queue OutputFile uses on this thread, or NULL for plain writes
+    static IoQueue* current();
+    static void set_current(IoQueue* queue);
+
+  private:
+    IoQueue(const IoQueue&);
+    IoQueue& operator=(const IoQueue&);
+
+    struct Request
+    {
+        int fd;
+        const unsigned char* data;
+        size_t size;
+        uint64_t offset;
+        unsigned fixed;
+
+        // WRITEV reads its iovec from here
+        void* iov_base;
+        size_t iov_len;
+    };
+
+    bool push(unsigned slot);
+    bool enter(unsigned min_complete);
+    void reap();
+    void teardown();
+
+    int m_fd;
+    unsigned m_depth;
+    size_t m_registered;
+    uint64_t m_enter_calls;
+    uint64_t m_queued_bytes;
+    uint64_t m_fixed_bytes;
+    bool m_failed;
+
+    // ring mappings and the fields inside them
+    void* m_sq_map;
+    size_t m_sq_map_size;
+    void* m_cq_map;
+    size_t m_cq_map_size;
+    void* m_sqes;
+    size_t m_sqes_size;
+
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_mask;
+    unsigned* m_sq_array;
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned* m_cq_mask;
+    void* m_cqes;
+
+    // queued but not yet handed to the kernel
+    unsigned m_unsubmitted;
+
+    std::vector<Request> m_requests;
+    std::vector<unsigned> m_free;
+};
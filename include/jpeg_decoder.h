@@ -0,0 +1,265 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "jpeg_kernels.h"
+
+// Layout of decoded pixels: one byte per sample, channels interleaved.
+enum JpegPixelFormat
+{
+    JPEG_GRAY,
+    JPEG_RGB,
+    JPEG_BGR
+};
+
+// Decoded pixels, 8 bits per sample, rows top to bottom with no padding.
+struct JpegImage
+{
+    int width;
+    int height;
+
+    // 1 for grayscale, 3 for RGB
+    int channels;
+
+    std::vector<unsigned char> pixels;
+
+    JpegImage() : width(0), height(0), channels(0) {}
+};
+
+// Decodes the JPEGs that cameras send: 8-bit Huffman-coded baseline or
+// extended sequential frames, gray or colour (YCbCr, or RGB as Adobe
+// marks it), with any sampling factors and restart markers. Frames
+// without a DHT use the standard tables (jpeg_dht.h). For progressive
+// frames only the first scan is read, which is enough for decode_dc()
+// when it carries the DC coefficients of every component, as encoders
+// write by default; when it has only the first, the image comes out gray.
+//
+// decode() works through the frame a row of MCUs at a time: Huffman
+// decoding into coefficients, then the inverse DCT, chroma upsampling and
+// colour conversion (jpeg_kernels.h) straight into the caller's memory.
+// Chroma is upsampled by repeating samples, not interpolating them. At
+// reduced scales subsampled chroma gets a larger inverse DCT than luma,
+// as libjpeg does, so it keeps its resolution relative to luma.
+//
+// A decoder can be used for any number of frames, one at a time; the
+// tables and buffers are reused.
+class JpegDecoder
+{
+  public:
+    JpegDecoder();
+
+    // reads the frame's headers, up to and including its first SOS.
+    // Returns false, with error() saying why, for anything not handled.
+    // data must stay valid while the frame is decoded.
+    bool parse(const unsigned char* data, size_t size);
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int components() const { return m_component_count; }
+
+    // a 1/8 scale image, one pixel per 8x8 block, made from the blocks'
+    // DC coefficients alone: (width + 7) / 8 by (height + 7) / 8. The AC
+    // coefficients are Huffman-decoded only to step over them; there is no
+    // dequantising or IDCT. channels is 1 for grayscale or 3 for RGB.
+    // gray, if given, gets what decode_dc(1) would give as well, from the
+    // same decode.
+    bool decode_dc(int channels, JpegImage& out, JpegImage* gray = NULL);
+
+    // size of decode()'s image at 1/scale, for scale 1, 2, 4 or 8
+    int output_width(int scale) const {
+        return (m_width + scale - 1) / scale;
+    }
+    int output_height(int scale) const {
+        return (m_height + scale - 1) / scale;
+    }
+
+    // decodes the frame parse() was given, at 1/scale size, into out:
+    // output_height(scale) rows, stride bytes apart, of output_width(scale)
+    // pixels each. Scaling is done in the inverse DCT, so a smaller image
+    // also costs less. The frame is read where it lies (a SaveBuffer's
+    // bytes(), say) and out is the caller's, so a pooled buffer can be
+    // filled with no copies in between. Sequential frames only.
+    bool decode(int scale, JpegPixelFormat format, unsigned char* out,
+        size_t stride);
+
+    // the same into an image of its own
+    bool decode(int scale, JpegPixelFormat format, JpegImage& image);
+
+    // MCU rows, the units decode_rows() works in, and the MCUs in each;
+    // an MCU row is 8, 16 or 32 pixel rows at full size
+    int mcu_rows() const { return m_mcus_y; }
+    int mcus_per_row() const { return m_mcus_x; }
+
+    // size of an MCU in pixels at full size: 8 times the largest sampling
+    // factors, so 16 by 16 for 4:2:0
+    int mcu_width() const { return 8 * m_hmax; }
+    int mcu_height() const { return 8 * m_vmax; }
+
+    // MCUs per restart interval, or 0 if the frame has no restart markers
+    unsigned restart_interval() const { return m_restart_interval; }
+
+    // finds where each restart interval after the first starts, for
+    // decode_rows(). False if the frame has no restart interval or is
+    // missing some of the markers; restarts is left empty then.
+    bool find_restarts(std::vector<size_t>& restarts) const;
+
+    // decode() of only MCU rows [first_row, first_row + row_count): the
+    // same output rows of out, at the same place, are written and nothing
+    // else is. With restarts from find_restarts() decoding starts at the
+    // restart interval holding first_row; without them, every row above
+    // has to be Huffman-decoded to get to it. This lets several decoders,
+    // each with the frame parsed, work on one frame at once.
+    bool decode_rows(int scale, JpegPixelFormat format, unsigned char* out,
+        size_t stride, int first_row, int row_count,
+        const std::vector<size_t>& restarts);
+
+    // false makes decode() use the scalar kernels, which give the same
+    // pixels; for checking and timing the SIMD ones against them
+    void set_simd(bool on) {
+        m_kernels = on ? &jpeg_kernels() : &jpeg_scalar_kernels();
+    }
+
+    // decode() with these kernels, one of jpeg_available_kernels(), which
+    // must stay valid while the decoder uses them
+    void set_kernels(const JpegKernels& kernels) { m_kernels = &kernels; }
+
+    const char* error() const { return m_error; }
+
+  private:
+    // FAST_BITS-bit lookup for short codes, then the canonical code ranges
+    // of JPEG spec section F.2.2.3 for the rest
+    static const int FAST_BITS = 9;
+
+    struct HuffmanTable
+    {
+        bool defined;
+
+        // (code length << 8) | symbol, or 0 where the code is longer
+        uint16_t fast[1 << FAST_BITS];
+
+        // AC tables only: for the same short codes, (code length plus the
+        // coefficient bits that follow << 8) | how far the code moves
+        // through the block, 64 for end of block. Lets decode_dc() step
+        // over a coefficient with one lookup.
+        uint16_t skip[1 << FAST_BITS];
+
+        int32_t maxcode[18];
+        int32_t valptr[17];
+        int32_t mincode[17];
+        unsigned char values[256];
+    };
+
+    // the Annex K tables, built once and shared by every decoder
+    struct DefaultTables
+    {
+        HuffmanTable dc[2];
+        HuffmanTable ac[2];
+
+        DefaultTables();
+    };
+
+    struct Component
+    {
+        int id;
+        int h;
+        int v;
+        int tq;
+
+        // tables of the current scan
+        int td;
+        int ta;
+
+        // blocks across and down, padded out to whole MCUs
+        int blocks_w;
+        int blocks_h;
+
+        int dc_pred;
+    };
+
+    // entropy-coded data, with stuffing removed. Reads zeros once it runs
+    // into a marker, which it leaves in place.
+    struct BitReader
+    {
+        const unsigned char* p;
+        const unsigned char* end;
+        uint64_t bits;
+        int count;
+        bool at_marker;
+
+        void reset(const unsigned char* from, const unsigned char* to);
+        void fill();
+    };
+
+    bool fail(const char* why);
+    bool parse_dqt(const unsigned char* p, size_t length);
+    bool parse_dht(const unsigned char* p, size_t length);
+    bool parse_sof(const unsigned char* p, size_t length, unsigned char m);
+    bool parse_sos(const unsigned char* p, size_t length);
+    void build_table(HuffmanTable& t, const unsigned char* counts,
+        const unsigned char* values);
+
+    int decode_symbol(const HuffmanTable& t);
+    int receive_extend(int s);
+    void skip_bits(int s);
+    bool skip_ac(const HuffmanTable& t);
+    bool restart();
+    void dc_image(int channels, int needed, JpegImage& out) const;
+    bool decode_block(Component& c, int16_t* coefs, unsigned char& has_ac);
+    void transform_row(int count);
+    void output_rows(int scale, JpegPixelFormat format, int count,
+        unsigned char* out, size_t stride, int rows);
+
+    const char* m_error;
+
+    const unsigned char* m_data;
+    size_t m_size;
+
+    int m_width;
+    int m_height;
+    int m_component_count;
+    Component m_components[4];
+    int m_hmax;
+    int m_vmax;
+    int m_mcus_x;
+    int m_mcus_y;
+
+    bool m_progressive;
+    bool m_rgb;
+    unsigned m_restart_interval;
+
+    uint16_t m_quant[4][64];
+    HuffmanTable m_dc_tables[4];
+    HuffmanTable m_ac_tables[4];
+
+    // the first scan: its components, spectral selection, successive
+    // approximation and where its entropy-coded data starts
+    int m_scan_count;
+    int m_scan[4];
+    int m_ss;
+    int m_se;
+    int m_ah;
+    int m_al;
+    size_t m_scan_start;
+
+    BitReader m_bits;
+
+    // decode_dc(): DC planes, one value per block. decode(): the samples
+    // of one row of MCUs
+    std::vector<unsigned char> m_planes[4];
+
+    // decode(): one row of MCUs' coefficients, each block's 64 in a run,
+    // and whether each block has any AC coefficients
+    std::vector<int16_t> m_coefs[4];
+    std::vector<unsigned char> m_has_ac[4];
+
+    // decode(): samples across and down that each component's blocks
+    // come out as, 8 / scale or more
+    int m_block_size[4];
+
+    // decode(): rows of subsampled components brought up to full width
+    std::vector<unsigned char> m_upsampled[3];
+
+    const JpegKernels* m_kernels;
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+
+#include "output_file.h"
+
+// Many UVC cameras leave the DHT segment out of their MJPEG frames and
+// rely on the standard Huffman tables from the JPEG spec (Annex K.3), as
+// the AVI1 MJPEG convention allows. Decoders for video know to do that;
+// ordinary image viewers do not, and refuse the frame.
+//
+// Frames are kept as the camera sent them. Only where a frame leaves as a
+// standalone JPEG is the standard DHT put in, and then as an extra slice
+// of a gathered write rather than by copying the frame.
+
+// the standard tables as one complete DHT segment, marker included
+extern const unsigned char JPEG_DEFAULT_DHT[];
+extern const size_t JPEG_DEFAULT_DHT_SIZE;
+
+// where a DHT has to go for the frame to open anywhere: the offset of its
+// first SOS marker, if there is no DHT before it. 0 if the frame already
+// has one, or its headers cannot be walked.
+size_t jpeg_dht_insert_point(const unsigned char* data, size_t size);
+
+// fills slices with the frame as a standalone JPEG: the frame itself, or
+// the part before the insert point, JPEG_DEFAULT_DHT, and the rest.
+// fixed is passed through to the frame's slices. Returns the number of
+// slices used, at most 3.
+size_t jpeg_standalone_slices(const unsigned char* data, size_t size,
+    unsigned fixed, IoSlice slices[3]);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// The pixel work of JpegDecoder::decode(): inverse DCT, chroma upsampling
+// and YCbCr to RGB conversion. Each kernel comes in AVX2, SSE4.1 and
+// scalar versions; jpeg_kernels() picks the best the CPU has, the same
+// way jpeg_scan() does.
+//
+// The SIMD versions give exactly the same output as the scalar ones, which
+// are written to do the same fixed-point arithmetic step for step. That
+// keeps the scalar kernels usable as a reference for checking and
+// benchmarking the others.
+//
+// The inverse DCT is the accurate integer one of the IJG's libjpeg
+// (jidctint.c), with 32-bit intermediates and 13-bit constants.
+// Coefficients are dequantised and in natural (not zigzag) order.
+struct JpegKernels
+{
+    // "avx2", "sse4.1" or "scalar"
+    const char* name;
+
+    // inverse DCT of one block into 8 rows of 8 samples, stride apart
+    void (*idct)(const int16_t* coefs, unsigned char* out, size_t stride);
+
+    // two blocks side by side: a into out and b into out + 8. NULL where
+    // the kernels do one block at a time.
+    void (*idct_pair)(const int16_t* a, const int16_t* b, unsigned char* out,
+        size_t stride);
+
+    // doubles a row of samples across: out[2i] = out[2i + 1] = in[i], for
+    // out_width samples
+    void (*upsample_h2)(const unsigned char* in, unsigned char* out,
+        size_t out_width);
+
+    // converts full-width rows of Y, Cb and Cr to interleaved RGB, or BGR
+    void (*ycc_to_rgb)(const unsigned char* y, const unsigned char* cb,
+        const unsigned char* cr, unsigned char* out, size_t width, bool bgr);
+};
+
+// the best kernels for this CPU
+const JpegKernels& jpeg_kernels();
+
+// the reference kernels
+const JpegKernels& jpeg_scalar_kernels();
+
+// every set of kernels this CPU can run: the scalar ones first, then each
+// SIMD level in turn up to the one jpeg_kernels() picked
+void jpeg_available_kernels(std::vector<JpegKernels>& kernels);
+
+// name of the kernels jpeg_kernels() picked
+const char* jpeg_decode_isa();
+
+// reduced-size inverse DCTs for scaled decoding, from the same library
+// (jidctred.c): 4x4, 2x2 and 1x1 samples from a whole block. Only the
+// low-frequency coefficients are used. Scalar only; they are already a
+// fraction of the cost of the full one.
+void jpeg_idct_4x4(const int16_t* coefs, unsigned char* out, size_t stride);
+void jpeg_idct_2x2(const int16_t* coefs, unsigned char* out, size_t stride);
+void jpeg_idct_1x1(const int16_t* coefs, unsigned char* out, size_t stride);
+
+// a block with no AC coefficients comes out flat at this level, whatever
+// the size
+static inline unsigned char jpeg_dc_level(int dc)
+{
+    int v = ((dc + 4) >> 3) + 128;
+    return v < 0 ? 0 : (v > 255 ? 255 : (unsigned char)v);
+}
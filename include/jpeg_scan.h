@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <stdint.h>
+
+// Structural check of a JPEG as delivered by a camera, fast enough to run
+// on every frame. USB MJPEG cameras regularly hand over frames that were
+// cut short, lost their EOI, or picked up garbage after a bus glitch; this
+// finds those without decoding anything.
+//
+// It walks the marker segments (SOI, tables, SOF, SOS, ...) by their
+// lengths, and runs through the entropy-coded data after each SOS looking
+// only at 0xFF bytes, which must be followed by a 0x00 stuffing byte, a
+// restart marker or the next real marker. Finding the 0xFF bytes is the
+// only part that touches every byte; it uses AVX2 or SSE2 where the CPU
+// has them, so the check runs at about memory bandwidth.
+//
+// Anything after the EOI is padding and is left out of the frame's length.
+
+enum JpegCheck
+{
+    JPEG_VALID,
+
+    // does not start with an SOI marker
+    JPEG_NO_SOI,
+
+    // ends before its EOI, or in the middle of a marker segment
+    JPEG_TRUNCATED,
+
+    // a byte where a marker should be is not one, or the marker is not
+    // allowed there
+    JPEG_BAD_MARKER,
+
+    // a 0xFF in entropy-coded data that is not followed by 0x00, a restart
+    // marker or a marker
+    JPEG_BAD_STUFFING,
+
+    // an SOS, or the EOI, with no frame header (SOFn) before it
+    JPEG_NO_FRAME_HEADER,
+
+    // EOI without any scan (SOS) before it
+    JPEG_NO_SCAN
+};
+
+struct JpegScan
+{
+    JpegCheck result;
+
+    // JPEG_VALID: bytes up to and including the EOI
+    size_t length;
+
+    // otherwise: where the problem was found
+    size_t error_offset;
+
+    // number of SOS markers; above 1 for progressive JPEGs
+    unsigned scans;
+};
+
+// checks the JPEG in data[0, size). Returns scan.result.
+JpegCheck jpeg_scan(const unsigned char* data, size_t size, JpegScan& scan);
+
+// the same check with the plain C++ 0xFF search, for checking the others
+// against
+JpegCheck jpeg_scan_scalar(const unsigned char* data, size_t size,
+    JpegScan& scan);
+
+// short description of a result, for log messages
+const char* jpeg_check_name(JpegCheck check);
+
+// length of the JPEG's headers: everything up to the end of its first
+// SOS segment, after which the entropy-coded data starts. 0 if the markers
+// before that cannot be walked.
+size_t jpeg_header_length(const unsigned char* data, size_t size);
+
+// the width and height in the JPEG's frame header (SOFn), found by walking
+// the markers before it. false if there is none, or the way to it is
+// broken.
+bool jpeg_frame_size(const unsigned char* data, size_t size, int& width,
+    int& height);
+
+// finds the restart markers in the entropy-coded data that starts at
+// data[start]: restarts gets the offset just past each one, where the data
+// of the next restart interval starts. Returns the offset of the marker
+// that ends the data, or size if there is none. Uses the same 0xFF search
+// as jpeg_scan(), so it costs about as much as reading the data once.
+size_t jpeg_find_restarts(const unsigned char* data, size_t size,
+    size_t start, std::vector<size_t>& restarts);
+
+// which 0xFF search jpeg_scan() picked for this CPU: "avx2", "sse2" or
+// "scalar"
+const char* jpeg_scan_isa();
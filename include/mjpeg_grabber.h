@@ -1,9 +1,50 @@
 #pragma once
 
 #include <dshow.h>
+#include <memory>
+#include <vector>
+#include <atomic>
+
+#include "save_thread.h"
+#include "sample_ref.h"
+#include "sample_pool.h"
+#include "jpeg_scan.h"
 
 class MJ_GrabberFilter;
 
+// What the input pin does with frames that fail jpeg_scan().
+enum JpegCheckMode
+{
+    // save every frame as delivered, without looking at it
+    JPEG_CHECK_OFF,
+    
+    // save damaged frames too, flagged as such (SaveBuffer::damaged)
+    JPEG_CHECK_MARK,
+    
+    // throw damaged frames away
+    JPEG_CHECK_DROP
+};
+
+// Counters kept by the input pin when checking frames.
+struct JpegCheckStats
+{
+    uint64_t checked;
+    
+    // frames that had bytes after their EOI, and how many bytes that was
+    uint64_t trimmed;
+    uint64_t trimmed_bytes;
+    
+    // damaged frames: cut short, and broken in any other way
+    uint64_t truncated;
+    uint64_t corrupt;
+    
+    // damaged frames thrown away under JPEG_CHECK_DROP
+    uint64_t dropped;
+    
+    JpegCheckStats() : checked(0), trimmed(0), trimmed_bytes(0),
+        truncated(0), corrupt(0), dropped(0) {}
+};
+
 // IEnumMediaTypes is an interface used to access the list of media types
 // supported by a pin. In this case, we need to indicate that the MJ_InputPin
 // can support receiving JPEG frames.
@@ -38,17 +79,94 @@ class MJ_PinMediaTypes : public IEnumMediaTypes
     ULONG index;
 };
 
-#if 0
+class MJ_Allocator;
+
+// One frame buffer handed out by MJ_Allocator. Wraps a SamplePool slot; when
+// the last reference is released, the sample goes back to its allocator
+// rather than being deleted. Samples are created once, at Commit(), and
+// reused for the life of the allocator.
+//
+// Reference counting is atomic, since samples are usually released by a
+// save thread rather than the thread that filled them.
+//
+// IUnknown
+//   IMediaSample
+
+class MJ_MediaSample : public IMediaSample
+{
+  public:
+    // buffer and size describe the usable area of slot's memory
+    MJ_MediaSample(MJ_Allocator* owner, SamplePool::Slot* slot, BYTE* buffer,
+        long size);
+    virtual ~MJ_MediaSample() {}
+    
+    // IUnknown methods
+    STDMETHODIMP QueryInterface(REFIID riid, LPVOID* ppvObj);
+    STDMETHODIMP_(ULONG) AddRef();
+    STDMETHODIMP_(ULONG) Release();
+    
+    // IMediaSample methods
+    STDMETHODIMP GetPointer(BYTE** ppBuffer);
+    STDMETHODIMP_(long) GetSize();
+    STDMETHODIMP GetTime(REFERENCE_TIME* pTimeStart,
+        REFERENCE_TIME* pTimeEnd);
+    STDMETHODIMP SetTime(REFERENCE_TIME* pTimeStart,
+        REFERENCE_TIME* pTimeEnd);
+    STDMETHODIMP IsSyncPoint();
+    STDMETHODIMP SetSyncPoint(BOOL bIsSyncPoint);
+    STDMETHODIMP IsPreroll();
+    STDMETHODIMP SetPreroll(BOOL bIsPreroll);
+    STDMETHODIMP_(long) GetActualDataLength();
+    STDMETHODIMP SetActualDataLength(long length);
+    STDMETHODIMP GetMediaType(AM_MEDIA_TYPE** ppMediaType);
+    STDMETHODIMP SetMediaType(AM_MEDIA_TYPE* pMediaType);
+    STDMETHODIMP IsDiscontinuity();
+    STDMETHODIMP SetDiscontinuity(BOOL bDiscontinuity);
+    STDMETHODIMP GetMediaTime(LONGLONG* pTimeStart, LONGLONG* pTimeEnd);
+    STDMETHODIMP SetMediaTime(LONGLONG* pTimeStart, LONGLONG* pTimeEnd);
+    
+  private:
+    friend class MJ_Allocator;
+    
+    // clears per-frame state before the sample is handed out again
+    void reset();
+    
+    volatile LONG ref_count;
+    MJ_Allocator* owner;
+    SamplePool::Slot* slot;
+    BYTE* buffer;
+    long buffer_size;
+    
+    long actual_length;
+    REFERENCE_TIME time_start;
+    REFERENCE_TIME time_end;
+    LONGLONG media_start;
+    LONGLONG media_end;
+    bool time_valid;
+    bool media_time_valid;
+    bool sync_point;
+    bool preroll;
+    bool discontinuity;
+};
+
 // Allocates frame buffers. Required to support IMemInputPin interface
 // on MJ_InputPin class.
 //
+// The upstream pin asks for a buffer count and size through SetProperties.
+// We honour the request, but never go below the minimums configured for the
+// camera (see MJ_GrabberFilter::set_allocator_properties), so there are
+// enough samples in flight to ride out a slow write -- or to cover the whole
+// save queue when capture is zero-copy. Buffers come from a SamplePool and
+// are recycled without heap traffic.
+//
 // IUnknown
 //   IMemAllocator
 
 class MJ_Allocator : public IMemAllocator
 {
   public:
-    MJ_Allocator();
+    MJ_Allocator(long min_buffers, long min_buffer_size);
+    virtual ~MJ_Allocator();
     
     // IUnknown methods
     STDMETHODIMP QueryInterface(REFIID riid, LPVOID* ppvObj);
@@ -70,13 +188,44 @@ class MJ_Allocator : public IMemAllocator
         ALLOCATOR_PROPERTIES* pActual);
         
   private:
+    void free_samples();
+    
     ALLOCATOR_PROPERTIES properties;
     bool properties_set;
     bool commited;
     
-    ULONG ref_count;  
+    long min_buffers;
+    long min_buffer_size;
+    
+    SamplePool pool;
+    std::vector<MJ_MediaSample*> samples; // parallel to the pool's slots
+    
+    volatile LONG ref_count;  
+};
+
+
+// Holds an AddRef()'d IMediaSample so that a frame can be written straight
+// out of the camera's buffer. Released by the save thread once written.
+class MJ_SampleRef : public SampleRef
+{
+  public:
+    MJ_SampleRef() : sample(NULL), ptr(NULL), length(0) {}
+    virtual ~MJ_SampleRef() { release(); }
+    
+    // takes a reference on pSample; ptr and len describe its payload
+    void hold(IMediaSample* pSample, BYTE* ptr, LONG len);
+    
+    // SampleRef methods
+    const unsigned char* data() const { return ptr; }
+    size_t size() const { return length; }
+    bool held() const { return sample != NULL; }
+    void release();
+    
+  private:
+    IMediaSample* sample;
+    BYTE* ptr;
+    size_t length;
 };
-#endif
 
 
 // Pins on a DirectShow filter must implement the IPin interface.
@@ -93,8 +242,8 @@ class MJ_InputPin : public IPin, public IMemInputPin
 {
   public:
     explicit MJ_InputPin(MJ_GrabberFilter* f) : ref_count(0), filter(f),
-        other_end(NULL) {}
-    virtual ~MJ_InputPin() {}
+        other_end(NULL), allocator(NULL) {}
+    virtual ~MJ_InputPin();
     
     // IUnknown methods
     STDMETHODIMP QueryInterface(REFIID riid, LPVOID* ppvObj);
@@ -138,7 +287,14 @@ class MJ_InputPin : public IPin, public IMemInputPin
     ULONG ref_count;
     MJ_GrabberFilter* filter;
     IPin* other_end;
-    //MJ_Allocator* allocator;
+    
+    // our own allocator, created on first GetAllocator(). The upstream pin
+    // may pick a different one; NotifyAllocator() tells us which.
+    MJ_Allocator* allocator;
+    
+    // the buffer the next frame will be copied into. Only touched from the
+    // streaming thread that calls Receive.
+    std::unique_ptr<SaveBuffer> buffer;
 };
 
 // Pin Enumerator for the DirectShow filter.
@@ -184,11 +340,39 @@ class MJ_EnumPins : public IEnumPins
 class MJ_GrabberFilter : public IBaseFilter
 {
     friend class MJ_EnumPins;
+    friend class MJ_InputPin;
     
   public:
-    MJ_GrabberFilter();
+    // frames received by the input pin are tagged with camera and handed to
+    // saver, which must outlive the filter.
+    MJ_GrabberFilter(SaveThread* saver, int camera);
     virtual ~MJ_GrabberFilter() {}
     
+    // when enabled, Receive() keeps a reference to each IMediaSample and
+    // hands that to the save thread instead of copying the frame. Only use
+    // this with an allocator large enough to cover the save queue, and the
+    // one frame a writer holds for SaveOptions::repeat_records, or the
+    // camera will stall waiting for samples. Set before the graph runs.
+    void set_zero_copy(bool enable) { zero_copy = enable; }
+    
+    // whether Receive() checks each frame's JPEG structure, and what it
+    // does with damaged ones. Frames that pass have anything after their
+    // EOI trimmed off. Checked frames are hashed too (SaveBuffer::hash) if
+    // the saver keeps hashes (SaveThread::wants_frame_hashes()).
+    // The default is JPEG_CHECK_MARK. Set before the graph runs.
+    void set_jpeg_check(JpegCheckMode mode) { check_mode = mode; }
+    
+    // a snapshot of the frame check counters
+    JpegCheckStats check_stats() const;
+    
+    // minimum number and size of sample buffers the input pin's allocator
+    // will provide, whatever the upstream pin asks for. A size of 0 means
+    // "whatever upstream asks for". Set before the graph is connected.
+    void set_allocator_properties(long buffers, long buffer_size) {
+        alloc_buffers = buffers;
+        alloc_buffer_size = buffer_size;
+    }
+    
     // IUnknown methods
     STDMETHODIMP QueryInterface(REFIID riid, LPVOID* ppvObj);
     STDMETHODIMP_(ULONG) AddRef();
@@ -225,6 +409,22 @@ class MJ_GrabberFilter : public IBaseFilter
     MJ_InputPin* input_pin;
     IFilterGraph* graph;
     LPCWSTR name;
+    
+    SaveThread* saver;
+    int camera;
+    bool zero_copy;
+    
+    // written by the streaming thread in Receive(), read by check_stats()
+    JpegCheckMode check_mode;
+    std::atomic<uint64_t> checked;
+    std::atomic<uint64_t> trimmed;
+    std::atomic<uint64_t> trimmed_bytes;
+    std::atomic<uint64_t> truncated;
+    std::atomic<uint64_t> corrupt;
+    std::atomic<uint64_t> dropped;
+    
+    long alloc_buffers;
+    long alloc_buffer_size;
 };
 
 // Reference URLs from MSDN:
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#include "jpeg_decoder.h"
+
+// How MotionDetector decides that something is moving, and what SaveThread
+// keeps while nothing is (SaveOptions::motion).
+struct MotionOptions
+{
+    bool enabled;
+
+    // how far an MCU's mean luma must be from the background, in 8-bit
+    // levels, for it to count as changed. The frame's overall change in
+    // brightness is taken out first, so auto exposure is not motion.
+    unsigned threshold;
+
+    // changed MCUs, in thousandths of those watched, at or above which
+    // motion starts, and below which it may stop. The gap between the two
+    // keeps a borderline scene from flickering in and out of motion.
+    unsigned start_per_mille;
+    unsigned stop_per_mille;
+
+    // frames in a row at or above start_per_mille before motion starts, so
+    // that one noisy frame does not set it off
+    unsigned start_frames;
+
+    // how long motion lasts after the last frame at or above
+    // stop_per_mille
+    unsigned hold_ms;
+
+    // how quickly the background follows the scene: each frame moves it
+    // 1/2^background_shift of the way towards what it sees
+    unsigned background_shift;
+
+    // SaveThread: while nothing moves, one frame is still kept this often,
+    // so a still scene is recorded at a low frame rate rather than not at
+    // all. 0 keeps none.
+    unsigned idle_interval_ms;
+
+    MotionOptions() : enabled(false), threshold(12), start_per_mille(4),
+        stop_per_mille(2), start_frames(2), hold_ms(3000),
+        background_shift(4), idle_interval_ms(1000) {}
+};
+
+// A frame as MotionDetector looks at it: its gray DC image, one pixel per
+// 8x8 block (JpegDecoder::decode_dc()), and how many of those pixels
+// across and down make up an MCU. ThumbnailPool makes these from the same
+// decode as the frame's thumbnail.
+struct MotionFrame
+{
+    JpegImage luma;
+    int cell_width;
+    int cell_height;
+
+    // false if the frame could not be decoded
+    bool ok;
+
+    MotionFrame() : cell_width(1), cell_height(1), ok(false) {}
+};
+
+// Motion detection in the compressed domain: a frame is reduced to the
+// mean luma of each MCU, taken from the DC coefficients of its blocks
+// (JpegDecoder::decode_dc()) with no IDCT and no colour conversion, and
+// compared with a running average of earlier frames.
+//
+// The DC coefficients still have to be Huffman-decoded out of the whole
+// frame, so reducing a frame costs about what a thumbnail does, roughly
+// 1 ms per megapixel on one core; the comparison after that is a few
+// microseconds. SaveThread has its ThumbnailPool do the decoding and
+// hands the results to update() in order.
+//
+// Keep one detector per camera. Not thread safe.
+class MotionDetector
+{
+  public:
+    explicit MotionDetector(const MotionOptions& options = MotionOptions());
+
+    // which MCUs to watch, columns by rows of them row by row, non-zero to
+    // watch. Only used for frames with that many MCUs across and down;
+    // other frames, or an empty mask, have every MCU watched.
+    void set_mask(int columns, int rows,
+        const std::vector<unsigned char>& mask);
+
+    // looks at the next frame, captured at time_us, and returns whether
+    // there is motion. A frame that cannot be decoded counts as motion, so
+    // that it is not thrown away for being unreadable. The first frame,
+    // and the first after the frame size changes, only sets the background.
+    bool update(const unsigned char* data, size_t size, int64_t time_us);
+
+    // the same for a frame that has been decoded already
+    bool update(const MotionFrame& frame, int64_t time_us);
+
+    bool moving() const { return m_moving; }
+
+    // thousandths of the watched MCUs that changed in the last frame
+    unsigned changed_per_mille() const { return m_changed; }
+
+    // frames looked at, and those that could not be decoded
+    uint64_t frames() const { return m_frames; }
+    uint64_t failures() const { return m_failures; }
+
+  private:
+    void measure(const MotionFrame& frame);
+    unsigned compare();
+
+    MotionOptions m_options;
+
+    JpegDecoder m_decoder;
+    MotionFrame m_frame;
+
+    // MCUs across and down of the frames the background was built from,
+    // and per MCU the frame's level, in 1/256ths, and the background's, in
+    // 1/2^24ths so that it still moves at a background_shift of 16
+    int m_columns;
+    int m_rows;
+    std::vector<int32_t> m_levels;
+    std::vector<int64_t> m_background;
+
+    int m_mask_columns;
+    int m_mask_rows;
+    std::vector<unsigned char> m_mask;
+
+    bool m_moving;
+    unsigned m_changed;
+
+    // frames in a row at or above start_per_mille, and the time of the
+    // last at or above stop_per_mille
+    unsigned m_above;
+    int64_t m_last_motion_us;
+
+    uint64_t m_frames;
+    uint64_t m_failures;
+};
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "frame_buffer.h"
+
+// One piece of a gathered write. The memory must stay valid until the
+// write call that it is passed to returns.
+struct IoSlice
+{
+    const void* data;
+    size_t size;
+
+    // if data lies in a buffer registered with the writer thread's
+    // IoQueue, that buffer's index plus one; otherwise 0
+    unsigned fixed;
+};
+
+// Thin wrapper around a native file handle that is opened once and then
+// appended to for a long time. The save thread keeps one of these open per
+// camera so that writing a frame never costs an open/close or a directory
+// lookup.
+//
+// Not thread safe; an OutputFile is only ever touched by one writer thread
+// at a time.
+//
+// In direct mode, if the calling thread has a current IoQueue (Linux
+// io_uring), the block writes of a write_gather() call are split up and
+// put in flight together rather than issued one after another; the call
+// still returns only once they have all completed. Buffered writes always
+// use plain system calls, since they only copy into the page cache.
+class OutputFile
+{
+  public:
+    // open() flags
+    enum
+    {
+        // bypass the page cache (O_DIRECT / FILE_FLAG_NO_BUFFERING). Slices
+        // that start page aligned at an aligned file position are written
+        // straight from the caller's memory; anything else goes through an
+        // aligned bounce buffer. The file is trimmed to its real length on
+        // close().
+        OPEN_DIRECT = 1,
+
+        // throw away any existing contents instead of appending to them
+        OPEN_TRUNCATE = 2,
+
+        // keep the existing contents and length, but start writing at
+        // offset 0, over the top of them. The file is never made shorter,
+        // so anything past the last write is left as it was. This is for
+        // reusing files whose space was set aside with extend().
+        OPEN_OVERWRITE = 4
+    };
+
+    OutputFile();
+    ~OutputFile();
+
+    // opens (creating if needed) the file at path. Unless OPEN_TRUNCATE or
+    // OPEN_OVERWRITE is given, existing contents are kept and new writes
+    // are appended at the end. Returns false on error.
+    bool open(const std::string& path, unsigned flags = 0);
+    void close();
+    bool is_open() const;
+
+    bool write(const void* data, size_t size);
+
+    // writes all slices back to back, using as few system calls as the
+    // platform allows. On POSIX this is writev(). Windows has no gathered
+    // write for buffered handles, so small slices are coalesced through a
+    // staging buffer while large ones are written directly.
+    bool write_gather(const IoSlice* slices, size_t count);
+
+    // overwrites size bytes that were already written, starting at file
+    // offset. Meant for small fix-ups such as container headers; it does
+    // not move the append position. The range must end at or before
+    // position().
+    bool patch(uint64_t offset, const void* data, size_t size);
+
+    // file offset that the next write will land at
+    uint64_t position() const;
+
+    // file offset up to which everything written can be seen by other
+    // readers of the file. Only differs from position() in direct mode,
+    // where the last partial block is held back until it fills or the file
+    // is closed.
+    uint64_t visible_position() const;
+
+    // asks the filesystem to reserve disk space for the first size bytes
+    // of the file without changing its length, so later appends do not
+    // have to allocate blocks. Space that is still unused when the file is
+    // closed is given back. Returns false if the platform or filesystem
+    // cannot do this; the file works the same either way.
+    bool preallocate(uint64_t size);
+
+    // grows the file to at least size bytes with all of its disk space
+    // allocated (posix_fallocate / SetFileInformationByHandle). Unlike
+    // preallocate() this changes the length, and the space is kept when
+    // the file is closed. Does not move the write position.
+    bool extend(uint64_t size);
+
+    // makes everything written so far durable, so it survives a crash or
+    // power cut (fdatasync / FlushFileBuffers). In direct mode the partial
+    // last block is written out first, padded with zeros that later writes
+    // replace. The first sync after open() also syncs the directory on
+    // POSIX, so a newly created file cannot vanish with its data. This
+    // waits for the disk; call it per batch, not per frame.
+    bool sync();
+
+    // number of bytes written since open()
+    uint64_t bytes_written() const { return m_bytes_written; }
+
+    // number of write system calls issued since open()
+    uint64_t write_calls() const { return m_write_calls; }
+
+    // alignment that direct writes must respect, in bytes
+    static const size_t DIRECT_ALIGNMENT = 4096;
+
+    // direct mode: stage what is not written straight from the caller's
+    // memory in tail, rather than in a buffer of the file's own. tail
+    // must outlive the file and should have tail_capacity() reserved. If
+    // it is registered with the IoQueue that writes the file, fixed is its
+    // index plus one, and whole blocks staged in it go out with
+    // IORING_OP_WRITE_FIXED; otherwise 0. Call before open().
+    void set_tail(FrameBuffer* tail, unsigned fixed);
+    static size_t tail_capacity();
+
+  private:
+    OutputFile(const OutputFile&);
+    OutputFile& operator=(const OutputFile&);
+
+    bool write_raw(const void* data, size_t size);
+    bool write_at(const void* data, size_t size, uint64_t offset);
+    bool read_at(void* data, size_t size, uint64_t offset);
+    bool truncate(uint64_t size);
+    uint64_t file_size();
+
+    bool submit_at(const void* data, size_t size, uint64_t offset,
+        unsigned fixed);
+    bool complete_writes();
+
+    bool open_native(const std::string& path, bool direct, bool truncate);
+    bool seek_native(uint64_t offset);
+    bool sync_native();
+    void close_native();
+    bool direct_gather(const IoSlice* slices, size_t count);
+    bool direct_gather_blocks(const IoSlice* slices, size_t count);
+    bool flush_tail_blocks();
+    unsigned tail_fixed() const;
+
+  #ifdef _WIN32
+    HANDLE m_handle;
+    std::vector<unsigned char> m_staging;
+  #else
+    int m_fd;
+  #endif
+
+    std::string m_path;
+    uint64_t m_start;
+
+    // OPEN_OVERWRITE: the length at open(), which close() never trims below
+    uint64_t m_keep_size;
+    uint64_t m_bytes_written;
+    uint64_t m_write_calls;
+
+    // direct mode: m_offset is the aligned file position of the first byte
+    // in m_tail, which holds data not yet written as a whole block
+    bool m_direct;
+    bool m_preallocated;
+
+    // sync() has made the file's directory entry durable since open()
+    bool m_dir_synced;
+
+    // writes have been put on the thread's IoQueue since the last
+    // complete_writes()
+    bool m_queued;
+    uint64_t m_offset;
+
+    // m_own_tail, or the caller's buffer from set_tail(), and the fixed
+    // index it was given with; only used while the buffer's generation is
+    // still the one it had then
+    FrameBuffer m_own_tail;
+    FrameBuffer* m_tail;
+    unsigned m_tail_fixed;
+    unsigned m_tail_generation;
+
+    // direct mode: aligned scratch for read-modify-write in patch()
+    FrameBuffer m_patch;
+};
+
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstddef>
+#include <stdint.h>
+
+// Bounded lock-free queue of owned objects, used to hand SaveBuffers between
+// the capture threads and the save thread without taking a mutex inside the
+// DirectShow Receive() callback.
+//
+// This is Dmitry Vyukov's bounded MPMC queue: every cell carries a sequence
+// number that tells producers and consumers whether it is ready for them, so
+// a push or pop is one CAS on the shared index plus one store to the cell.
+// It is safe for any number of producers and consumers, which covers both
+// directions we need: many cameras -> one writer (the save queue) and one
+// writer -> many cameras (the free list).
+//
+// Objects go in and come out as std::unique_ptr, following the single
+// ownership convention described in save_thread.h. Whatever is still in the
+// ring when it is destroyed is deleted.
+template <typename T>
+class BoundedRing
+{
+  public:
+    // capacity is rounded up to a power of two
+    explicit BoundedRing(size_t capacity) : m_cells(NULL), m_mask(0),
+        m_enqueue_pos(0), m_dequeue_pos(0)
+    {
+        size_t n = 2;
+        while(n < capacity)
+            n <<= 1;
+
+        m_cells = new Cell[n];
+        m_mask = n - 1;
+
+        for(size_t i = 0; i < n; i++)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+            m_cells[i].value = NULL;
+            m_cells[i].key.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ~BoundedRing()
+    {
+        while(pop())
+            ;
+
+        delete[] m_cells;
+    }
+
+    // moves ptr into the ring. Returns false, leaving ptr untouched, if the
+    // ring is full. key is kept alongside, for front_key().
+    bool push(std::unique_ptr<T>& ptr, uint64_t key = 0)
+    {
+        size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while(true)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if(diff == 0)
+            {
+                if(m_enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = m_enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->value = ptr.release();
+        cell->key.store(key, std::memory_order_relaxed);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // removes the oldest object from the ring, or returns an empty pointer
+    // if there is nothing to take.
+    std::unique_ptr<T> pop()
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+
+        while(true)
+        {
+            cell = &m_cells[pos & m_mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+            if(diff == 0)
+            {
+                if(m_dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                    std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)
+            {
+                return std::unique_ptr<T>(); // empty
+            }
+            else
+            {
+                pos = m_dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        std::unique_ptr<T> result(cell->value);
+        cell->value = NULL;
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return result;
+    }
+
+    // the key pushed with the object pop() would take next, without taking
+    // it. Never touches the object itself, which another consumer may have
+    // taken and freed by now. Returns false if the ring looks empty. Only a
+    // hint while other threads are pushing or popping.
+    bool front_key(uint64_t& key) const
+    {
+        size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        const Cell* cell = &m_cells[pos & m_mask];
+
+        if(cell->sequence.load(std::memory_order_acquire) != pos + 1)
+            return false;
+
+        key = cell->key.load(std::memory_order_relaxed);
+
+        // if the cell was popped and pushed again meanwhile, its sequence
+        // has moved on and key may belong to the newer object
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return cell->sequence.load(std::memory_order_relaxed) == pos + 1;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    // only a hint while other threads are pushing or popping
+    size_t size_approx() const
+    {
+        size_t head = m_enqueue_pos.load(std::memory_order_relaxed);
+        size_t tail = m_dequeue_pos.load(std::memory_order_relaxed);
+        return (head > tail) ? head - tail : 0;
+    }
+
+  private:
+    BoundedRing(const BoundedRing&);
+    BoundedRing& operator=(const BoundedRing&);
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T* value;
+        std::atomic<uint64_t> key;
+    };
+
+    Cell* m_cells;
+    size_t m_mask;
+
+    // producers and consumers hammer different indices; keep them on
+    // separate cache lines so they do not false-share. Padding rather than
+    // alignas, since the rings are heap allocated and C++11 operator new
+    // does not honour extended alignment.
+    char m_pad0[64];
+    std::atomic<size_t> m_enqueue_pos;
+    char m_pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_dequeue_pos;
+    char m_pad2[64 - sizeof(std::atomic<size_t>)];
+};
+
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "frame_buffer.h"
+
+// Fixed set of large frame buffers that are handed out and returned over
+// and over. This is the platform-neutral core of MJ_Allocator: the
+// DirectShow side wraps each slot in an IMediaSample, but the counting,
+// blocking and recycling all happen here.
+//
+// All memory is allocated (and faulted in) by commit(). After that,
+// acquire() and release() only move pointers around on a preallocated free
+// list, so running samples through the pool never touches the heap.
+//
+// acquire() and release() may be called from any thread.
+class SamplePool
+{
+  public:
+    struct Slot
+    {
+        FrameBuffer memory;
+        size_t index;
+    };
+
+    SamplePool();
+
+    // sets the number of slots and the usable size of each. prefix bytes are
+    // reserved in front of the usable area (DirectShow's cbPrefix). Returns
+    // false if the pool is committed or slots are still outstanding.
+    bool set_properties(size_t count, size_t size, size_t prefix);
+
+    size_t count() const { return m_count; }
+    size_t size() const { return m_size; }
+    size_t prefix() const { return m_prefix; }
+
+    // allocates storage for every slot, if that has not already been done
+    // for the current properties, and starts handing slots out.
+    bool commit();
+
+    // stops handing slots out and wakes anyone blocked in acquire(). Slots
+    // that are out may still be released. Storage is kept, so a
+    // Stop/Run cycle of the graph does not reallocate.
+    void decommit();
+
+    bool committed();
+
+    // takes a free slot. If none is free and wait is true, blocks until one
+    // is released. Returns NULL if the pool is not committed, or if it is
+    // empty and wait is false.
+    Slot* acquire(bool wait);
+
+    // puts a slot back on the free list
+    void release(Slot* slot);
+
+    // slot by index, for wrappers that keep parallel per-slot state
+    Slot* slot(size_t index) { return m_slots[index].get(); }
+
+    // number of slots currently handed out
+    size_t outstanding();
+
+  private:
+    SamplePool(const SamplePool&);
+    SamplePool& operator=(const SamplePool&);
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    size_t m_count;
+    size_t m_size;
+    size_t m_prefix;
+    bool m_committed;
+
+    std::vector<std::unique_ptr<Slot> > m_slots;
+    std::vector<Slot*> m_free;
+};
+
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+
+// A reference to frame memory that belongs to someone else -- in practice a
+// DirectShow IMediaSample from the camera's allocator -- held so the frame
+// can be written to disk without first being copied into a SaveBuffer.
+//
+// While a SampleRef is held, the upstream filter cannot reuse that sample,
+// so zero-copy capture only works if the allocator has enough samples to
+// cover everything sitting in the save queue (see MJ_Allocator).
+//
+// Implementations are reused from frame to frame: release() drops the
+// reference but leaves the object ready to hold the next sample, so the
+// capture path does not allocate.
+class SampleRef
+{
+  public:
+    virtual ~SampleRef() {}
+
+    virtual const unsigned char* data() const = 0;
+    virtual size_t size() const = 0;
+
+    // true while a sample is being held
+    virtual bool held() const = 0;
+
+    // drops the reference to the sample, if any
+    virtual void release() = 0;
+};
+
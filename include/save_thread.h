@@ -6,13 +6,26 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <stdint.h>
 
-#include <windows.h>
+#include "frame_buffer.h"
+#include "output_file.h"
+#include "frame_sink.h"
+#include "segment_writer.h"
+#include "io_queue.h"
+#include "ring_buffer.h"
+#include "sample_ref.h"
+#include "capture_clock.h"
+#include "clock_estimator.h"
+#include "time_directories.h"
+#include "thumbnail_pool.h"
+#include "motion_detector.h"
 
 class SaveThread;
 
 // SaveBuffers are passed back and forth between capture and I/O threads. 
-// They are owned by one thread at a time. SaveThread handles the locking when
+// They are owned by one thread at a time. SaveThread handles the hand-off when
 // transfering between threads. To enforce single ownership, they are passed 
 // around via std::unique_ptr. Please respect this convention.
 //
@@ -20,42 +33,745 @@ class SaveThread;
 // you can modify the struct without needing to do any additional locking.
 struct SaveBuffer
 {
-	std::vector<unsigned char> data;
+	FrameBuffer data;
+    
+    // zero-copy alternative to data: a reference to the capture sample
+    // itself. When it is held, it is what gets written, and it is released
+    // once the writer is done with the buffer.
+    std::unique_ptr<SampleRef> sample;
     
 	int camera;
-	SYSTEMTIME st;
 	
+    // when the frame arrived, on the monotonic_ns() clock. Converted to
+    // wall-clock time only when the frame is written.
+    int64_t capture_ns;
+    
+    // the sample's start time from IMediaSample::GetTime(), in 100ns
+    // units of the graph's stream time, if it had one
+    int64_t stream_time;
+    bool has_stream_time;
+    
+    // capture time in microseconds since 1970 UTC, worked out by the writer
+    // from the camera's clock when it can be followed, else from
+    // capture_ns. 0 until then.
+    int64_t time_us;
+    
     bool is_one_shot;
     int one_shot_tag;
+    
+    // the frame failed the capture-side JPEG check (jpeg_scan()) but was
+    // kept anyway
+    bool damaged;
+    
+    // frame_hash() of the frame, taken on the capture path when
+    // SaveThread::wants_frame_hashes(). If has_hash is not set, a writer
+    // whose format keeps hashes takes it itself.
+    uint64_t hash;
+    bool has_hash;
+    
+    // position of the frame among those offered for its camera, set by
+    // save(). Tells the writers which frames came after an event trigger.
+    uint64_t sequence;
+    
+    // index of data's storage among the buffers registered with the
+    // writers' IoQueues, or -1. Only good while data.generation() still
+    // equals fixed_generation.
+    int fixed_index;
+    unsigned fixed_generation;
 
+    // copies the frame into data, letting go of any held sample
     void store(void* src, size_t byte_count);
-	void save();
+    
+    // copies a held sample into data and releases it, so the buffer can be
+    // kept a long while without starving the capture allocator
+    void detach();
+    
+    // the frame bytes, from the held sample if there is one, else from data
+    const unsigned char* bytes() const;
+    size_t byte_count() const;
+    
+    // writes data to its own file at path, replacing anything already there,
+    // with the standard DHT put in if the frame has none (jpeg_dht.h).
+    // Used for one-shot frames when the output format does not keep them.
+    // With sync set, the file is also made durable before returning.
+    bool save(const std::string& path, bool sync = false) const;
+    
+    // resets the buffer for reuse, releasing any held sample. The capacity
+    // of data is retained.
 	void clear();
 
   private:
-    SaveBuffer() : camera(0), is_one_shot(false), one_shot_tag(0) {}
+    SaveBuffer() : camera(0), capture_ns(0), stream_time(0),
+        has_stream_time(false), time_us(0), is_one_shot(false),
+        one_shot_tag(0), damaged(false), hash(0), has_hash(false),
+        sequence(0), fixed_index(-1), fixed_generation(0) {}
     friend class SaveThread;
 };
 
+// Counters describing how well the writers are batching. A batch is
+// everything that was waiting for one camera shard when a writer claimed it.
+struct SaveStats
+{
+    uint64_t batches;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t write_calls;
+    uint64_t largest_batch;
+    
+    // batches written by a writer other than the shard's home writer
+    uint64_t steals;
+    
+    // frames thrown away by the queue budget, across all cameras. See
+    // DropStats for the per-camera breakdown.
+    uint64_t dropped;
+    
+    // syncs issued under the durability policy
+    uint64_t syncs;
+    
+    // event recording: frames that left the pre-roll without an event
+    // asking for them, and so were never written. Those still held at
+    // stop() are counted too.
+    uint64_t expired;
+    
+    // FORMAT_JPEG_FILES: minute directories a writer had to make itself
+    // because they had not been made ahead of time
+    uint64_t late_dirs;
+    
+    // SaveOptions::thumbnail_channels: thumbnails made, frames that could
+    // not be decoded for one, the time that took summed over the threads
+    // doing it, and the pixels of the frames they were made from. With
+    // motion gating these count the decodes for it, which make the
+    // thumbnails too.
+    uint64_t thumbnails;
+    uint64_t thumbnail_failures;
+    uint64_t thumbnail_ns;
+    uint64_t thumbnail_pixels;
+    
+    // SaveOptions::motion: frames checked for motion, those left out
+    // because nothing was moving, and the time the writers spent comparing
+    // them with the background; decoding them is in thumbnail_ns
+    uint64_t motion_checks;
+    uint64_t still_frames;
+    uint64_t motion_ns;
+    
+    // SaveOptions::repeat_records: frames stored as repeats of the one
+    // before them, and the bytes of frame data that saved
+    uint64_t repeats;
+    uint64_t repeat_bytes;
+    
+    // frames whose write failed. The camera's file is closed after a
+    // failed write, and the next frame starts another.
+    uint64_t lost_frames;
+    
+    // IO_BACKEND_URING: bytes of frame batches queued, and those of them
+    // written straight from a registered buffer (IORING_OP_WRITE_FIXED)
+    uint64_t queued_bytes;
+    uint64_t fixed_bytes;
+    
+    SaveStats() : batches(0), frames(0), bytes(0), write_calls(0),
+        largest_batch(0), steals(0), dropped(0), syncs(0), expired(0),
+        late_dirs(0), thumbnails(0), thumbnail_failures(0), thumbnail_ns(0),
+        thumbnail_pixels(0), motion_checks(0), still_frames(0),
+        motion_ns(0), repeats(0), repeat_bytes(0), lost_frames(0),
+        queued_bytes(0), fixed_bytes(0) {}
+    
+    double frames_per_batch() const {
+        return batches ? (double)frames / batches : 0.0;
+    }
+    
+    double bytes_per_write() const {
+        return write_calls ? (double)bytes / write_calls : 0.0;
+    }
+    
+    // what a thumbnail costs, in thread time per megapixel of frame
+    double thumbnail_us_per_megapixel() const {
+        return thumbnail_pixels ?
+            (double)thumbnail_ns / thumbnail_pixels * 1000.0 : 0.0;
+    }
+};
+
+// What to do with a frame when the save queue is over budget.
+enum DropPolicy
+{
+    // refuse the incoming frame
+    DROP_NEWEST,
+    
+    // throw away the oldest queued frame (of any camera) to make room
+    DROP_OLDEST,
+    
+    // once a camera hits a full queue, only every keep_every'th frame from
+    // it is offered to the queue until the queue has drained below half
+    KEEP_EVERY_NTH,
+    
+    // wait up to block_us microseconds for the writer to make room, then
+    // refuse the frame. Note this stalls the capture thread.
+    BLOCK
+};
+
+// Limits on how much captured data may wait on the save queue. Because the
+// free list recycles only what the writer has finished with, this also
+// bounds the memory held by SaveBuffers when the disk falls behind.
+struct QueueBudget
+{
+    size_t max_frames;  // must be at least 1
+    size_t max_bytes;   // 0 means no byte limit
+    
+    DropPolicy policy;
+    unsigned keep_every; // used by KEEP_EVERY_NTH
+    unsigned block_us;   // used by BLOCK
+    
+    QueueBudget() : max_frames(256), max_bytes(0), policy(DROP_NEWEST),
+        keep_every(4), block_us(0) {}
+};
+
+// When the writers make what they have written durable. A sync covers
+// every batch written to the camera's file since the last one, so the wait
+// on the disk is shared by many frames rather than paid per frame.
+enum SyncPolicy
+{
+    // never; the OS writes data back in its own time, and a power cut can
+    // lose the last several seconds or more
+    SYNC_NONE,
+    
+    // after a batch, once interval_ms have passed since the camera's last
+    // sync; and, for a camera that has stopped sending, by an idle writer
+    // once they have passed, so nothing stays unsynced much longer
+    SYNC_INTERVAL,
+    
+    // after a batch, once bytes have been written since the camera's last
+    // sync
+    SYNC_BYTES,
+    
+    // only after a batch that holds a one-shot frame
+    SYNC_ONE_SHOTS
+};
+
+// How much a power cut may cost. With any policy but SYNC_NONE, a camera's
+// file is also synced before it is closed for the next one, and one-shot
+// frames saved as standalone JPEGs are synced as they are written.
+struct DurabilityPolicy
+{
+    SyncPolicy policy;
+    unsigned interval_ms; // used by SYNC_INTERVAL
+    uint64_t bytes;       // used by SYNC_BYTES
+    
+    DurabilityPolicy() : policy(SYNC_NONE), interval_ms(1000),
+        bytes(64ULL * 1024 * 1024) {}
+};
+
+// Event recording: instead of saving everything, each camera keeps its
+// most recent frames in memory and only writes them out when an event is
+// triggered (SaveThread::trigger_event()). The clip for an event is the
+// pre-roll held at the time plus the post-roll captured after it, in a file
+// of its own. Frames that age out of the pre-roll are never written.
+//
+// The pre-roll holds the SaveBuffers themselves, so nothing is copied;
+// reserve enough buffers for it, or get_buffer() will allocate new ones.
+// One-shot frames are still always saved.
+struct EventOptions
+{
+    bool enabled;
+    
+    // how far back the pre-roll reaches, in capture time
+    unsigned pre_roll_ms;
+    
+    // how long after the trigger frames keep being written. A trigger
+    // during the post-roll extends it.
+    unsigned post_roll_ms;
+    
+    // most bytes of frames each camera's pre-roll may hold; the oldest are
+    // let go first
+    size_t max_bytes;
+    
+    EventOptions() : enabled(false), pre_roll_ms(10000), post_roll_ms(10000),
+        max_bytes(64 * 1024 * 1024) {}
+};
+
+// Container that each camera's frames are written into.
+enum OutputFormat
+{
+    // indexed, checksummed frame records in preallocated .seg files
+    // (SegmentWriter); see segment_format.h
+    FORMAT_SEGMENT,
+    
+    // JPEGs back to back in camN.mjpg (StreamSink)
+    FORMAT_MJPEG_STREAM,
+    
+    // OpenDML AVI files with an MJPG stream (AviWriter)
+    FORMAT_AVI,
+    
+    // every frame as a .jpg of its own, in a directory per camera per
+    // minute: camN/YYYYMMDD/HH/MM/ (JpegDirSink, TimeDirectories)
+    FORMAT_JPEG_FILES
+};
+
+// How the writer threads issue their writes.
+enum IoBackend
+{
+    // one blocking system call at a time (writev / pwrite / WriteFile)
+    IO_BACKEND_PWRITE,
+    
+    // Linux io_uring: direct I/O block writes are put in flight together,
+    // queue_depth at a time per writer. Each camera's bounce buffer, which
+    // frame data is copied into unless it happens to start on a block
+    // boundary in the file, is registered with the kernel, as are the
+    // buffers set aside by reserve_free_buffers(); writes from them use
+    // IORING_OP_WRITE_FIXED. That saves pinning pages on every write, not
+    // the copy. Falls back to IO_BACKEND_PWRITE where io_uring is not
+    // available. Only changes anything when direct_io is set.
+    IO_BACKEND_URING
+};
+
+// How a SaveThread is set up. Fixed for the life of the thread.
+struct SaveOptions
+{
+    QueueBudget budget;
+    DurabilityPolicy durability;
+    EventOptions events;
+    
+    // motion gating: each camera's frames are checked for motion as they
+    // are written (MotionDetector), and while nothing moves only one per
+    // motion.idle_interval_ms is kept. One-shot frames are always kept.
+    // The frames are decoded for it on the thumbnail pool, in the same
+    // decode as their thumbnails if those are kept too. Not used with
+    // event recording, which decides what is kept itself.
+    MotionOptions motion;
+    
+    OutputFormat format;
+    
+    // start a new file for a camera once this many seconds of capture time
+    // have gone into the current one. 0 keeps one file per camera for the
+    // life of the thread (AVI files still roll over when their index fills).
+    // FORMAT_JPEG_FILES ignores this and moves on every minute.
+    unsigned file_seconds;
+    
+    // size of each .seg file. Its disk space is reserved when it is
+    // opened, and a new segment is started before a frame would take it,
+    // index and footer included, past this size; only a frame bigger than
+    // that on its own gets a segment that is larger. 0 means no limit and
+    // no preallocation.
+    uint64_t segment_bytes;
+    
+    // when non-zero, each camera records into a fixed ring of this many
+    // segment files (camN_ring_KK.seg), each segment_bytes long, instead of
+    // a growing series of them. The files are created at full size the
+    // first time the camera saves a frame. After that the writer moves
+    // round them and overwrites the oldest, so no file is ever created or
+    // deleted again and disk use stays fixed. Needs FORMAT_SEGMENT and a
+    // non-zero segment_bytes; file_seconds still applies.
+    unsigned ring_segments;
+    
+    // store each distinct JPEG header once per segment rather than with
+    // every frame (SegmentWriter::set_share_headers())
+    bool share_headers;
+    
+    // FORMAT_SEGMENT: store a frame that is the same as the camera's
+    // previous one, as some cameras send when the sensor stalls or the
+    // exposure is long, as a 16 byte RECORD_REPEAT record instead of the
+    // whole frame. Frames with the same frame_hash() and size are then
+    // compared byte for byte, so the writer holds on to each camera's
+    // last frame until the next one comes. Every frame's hash is kept
+    // either way.
+    bool repeat_records;
+    
+    // FORMAT_SEGMENT: keep a 1/8 scale thumbnail of every frame alongside
+    // it (RECORD_THUMBNAIL), 1 for gray or 3 for RGB. 0 for none.
+    int thumbnail_channels;
+    
+    // threads making the thumbnails, and decoding frames for motion
+    // gating, besides the writers themselves
+    size_t thumbnail_workers;
+    
+    // number of writer threads sharing the camera shards
+    size_t writer_count;
+    
+    // write with O_DIRECT / FILE_FLAG_NO_BUFFERING so long recordings do not
+    // push everything else on the machine out of the page cache
+    bool direct_io;
+    
+    // back SaveBuffer storage with large pages where the OS allows it
+    bool huge_pages;
+    
+    IoBackend io_backend;
+    
+    // writes each writer thread may have in flight with IO_BACKEND_URING
+    unsigned queue_depth;
+    
+    SaveOptions() : format(FORMAT_SEGMENT), file_seconds(0),
+        segment_bytes(1024ULL * 1024 * 1024), ring_segments(0),
+        share_headers(true), repeat_records(true), thumbnail_channels(0),
+        thumbnail_workers(2),
+        writer_count(1), direct_io(false), huge_pages(false),
+        io_backend(IO_BACKEND_PWRITE), queue_depth(16) {}
+};
+
+// Where a camera's recording ring is being written, for readers that want
+// to follow it live.
+struct RingPosition
+{
+    // false until the camera has written to its ring
+    bool active;
+    
+    // ring file being written (see SaveThread::ring_path()) and its
+    // SegmentHeader::sequence
+    unsigned segment;
+    uint64_t sequence;
+    
+    // bytes of that file that readers can see. Records that end at or
+    // before this offset are complete.
+    uint64_t offset;
+    
+    // capture time of the last record written
+    int64_t last_time_us;
+    
+    RingPosition() : active(false), segment(0), sequence(0), offset(0),
+        last_time_us(0) {}
+};
+
+// How much of one camera's recording is known to be safe on disk. The gap
+// between written_us and durable_us is what a power cut at this moment
+// would lose.
+struct DurableMark
+{
+    // capture time of the newest frame that has been synced, or 0
+    int64_t durable_us;
+    
+    // capture time of the newest frame handed to the OS
+    int64_t written_us;
+    
+    // syncs done for this camera
+    uint64_t syncs;
+    
+    DurableMark() : durable_us(0), written_us(0), syncs(0) {}
+};
+
+// How one camera's own clock compares with the host's, as followed by its
+// writer. See ClockEstimator.
+struct ClockDrift
+{
+    // set once the writer has a fit and is timing the camera's frames by
+    // its stream times rather than by when they arrived
+    bool valid;
+    
+    // how much faster the host clock runs than the camera's, in parts per
+    // million
+    double drift_ppm;
+    
+    // spread of the frames' arrival times around the fit, in microseconds
+    double jitter_us;
+    
+    // frames with stream times seen since the fit was last started over
+    uint64_t frames;
+    
+    ClockDrift() : valid(false), drift_ppm(0), jitter_us(0), frames(0) {}
+};
+
+// What became of a snapshot asked for with SaveThread::request_snapshot().
+struct SnapshotResult
+{
+    int camera;
+    int tag;
+    
+    // true once the frame has been written to path and synced
+    bool ok;
+    std::string path;
+    
+    // from request_snapshot() to the file being durable
+    int64_t latency_us;
+    
+    SnapshotResult() : camera(0), tag(0), ok(false), latency_us(0) {}
+};
+
+// Why frames from one camera were shed.
+struct DropStats
+{
+    uint64_t frames;     // frames offered to the queue
+    uint64_t queue_full; // refused because there was no room
+    uint64_t evicted;    // queued, then thrown out by DROP_OLDEST
+    uint64_t decimated;  // skipped by KEEP_EVERY_NTH
+    uint64_t timed_out;  // BLOCK waited block_us and gave up
+    
+    // value of 'frames' when the most recent drop happened, so a drop
+    // can be located in the camera's stream
+    uint64_t last_drop_frame;
+    
+    DropStats() : frames(0), queue_full(0), evicted(0), decimated(0),
+        timed_out(0), last_drop_frame(0) {}
+    
+    uint64_t total() const {
+        return queue_full + evicted + decimated + timed_out;
+    }
+};
+
+// SaveThread is a pool of writer threads that drain the save queue and
+// append each camera's frames to one large file per camera, in the format
+// chosen by SaveOptions. By default that is a series of segment files, each
+// named after the capture time of its first frame
+// (<base_path>/camN_YYYYMMDD_HHMMSS_mmm.seg). A plain MJPEG stream with no
+// interval is the exception: it goes to a single camN.mjpg that stays open
+// for the life of the pool. A writer takes everything waiting for a
+// camera at once and hands it to the OS as one gathered write, so the cost
+// of a syscall is spread over many frames.
+//
+// The queue is split into shards, one per camera. A shard is only ever
+// drained by one writer at a time, which keeps each camera's frames in
+// order. Writers prefer their own shards (camera % writer_count) but will
+// steal a waiting shard from a writer that is stuck on a slow write, so
+// throughput grows with writer count as long as there are cameras to spread
+// across. A single camera is always written by one thread at a time.
+//
+// The capture side never takes a lock: buffers move through lock-free
+// rings, and the writers are only signalled when a shard goes from empty to
+// non-empty. While the writers are busy, producers just push.
 class SaveThread
 {
-    std::thread m_thread;
+  public:
+    static const int MAX_CAMERAS = 16;
+    
+  private:
+    std::vector<std::thread> m_threads;
+    size_t m_writer_count;
+    
+    // only used to put writers to sleep and wake them up again
     std::mutex  m_mutex;
     std::condition_variable m_cv;
     
-    bool m_should_quit;
+    std::atomic<bool> m_should_quit;
+    std::atomic<uint64_t> m_dropped;
     
     std::string m_base_path;
     
-    std::vector<std::unique_ptr<SaveBuffer> > save_queue;
-    std::vector<std::unique_ptr<SaveBuffer> > free_buffers;
+    // FORMAT_JPEG_FILES only
+    std::unique_ptr<TimeDirectories> m_dirs;
+    
+    // FORMAT_SEGMENT with thumbnail_channels set, or motion gating, only
+    std::unique_ptr<ThumbnailPool> m_thumbnails;
+    SaveOptions m_options;
+    
+    // what is currently sitting in the shards, checked against m_budget.
+    // Producers reserve before pushing; writers release as they pop.
+    QueueBudget m_budget;
+    std::atomic<size_t> m_pending_frames;
+    std::atomic<size_t> m_pending_bytes;
+    
+    // producers waiting under the BLOCK policy
+    std::mutex m_space_mutex;
+    std::condition_variable m_space_cv;
+    std::atomic<int> m_blocked;
+    
+    struct CameraCounters
+    {
+        std::atomic<uint64_t> frames;
+        std::atomic<uint64_t> queue_full;
+        std::atomic<uint64_t> evicted;
+        std::atomic<uint64_t> decimated;
+        std::atomic<uint64_t> timed_out;
+        std::atomic<uint64_t> last_drop_frame;
+        std::atomic<bool> decimating;
+    };
+    
+    CameraCounters m_counters[MAX_CAMERAS];
+    
+    struct CameraOutput
+    {
+        CameraOutput() : tail_fixed(0), opened_us(0), sink_frames(0),
+            pending_bytes(0),
+            repeat(0), segment(NULL), ring_ready(false), ring_slot(0),
+            ring_sequence(0),
+            unsynced_bytes(0), unsynced_one_shot(false), synced_ms(0),
+            written_us(0), preroll_bytes(0), event_until_us(0),
+            in_event(false), motion_mask_version(0), kept_us(0),
+            last_hash(0), last_size(0) {}
+        
+        // direct_io: the bounce buffer the camera's segments stage
+        // unaligned data in (OutputFile::set_tail()), kept from one file
+        // to the next, and its index plus one among m_fixed, or 0. Ahead
+        // of sink, so it outlives it.
+        std::unique_ptr<FrameBuffer> tail;
+        unsigned tail_fixed;
+        
+        std::unique_ptr<FrameSink> sink;
+        
+        // maps the camera's stream times onto the monotonic_ns() clock
+        ClockEstimator clock;
+        
+        // capture time of the first frame in the sink
+        int64_t opened_us;
+        
+        // frames handed to the sink, or gathered for it, since it was
+        // opened, and the sink's frame_bytes() of those not yet written
+        size_t sink_frames;
+        uint64_t pending_bytes;
+        
+        // the previous file name without its extension, and how many files
+        // in a row have started in the same millisecond
+        std::string last_name;
+        unsigned repeat;
+        
+        // ring mode: sink as a SegmentWriter, the ring file it is writing,
+        // and the sequence number it was given
+        SegmentWriter* segment;
+        bool ring_ready;
+        unsigned ring_slot;
+        uint64_t ring_sequence;
+        
+        // what has gone into the sink since it was last synced, when that
+        // was (steady clock, in milliseconds), and the capture time of the
+        // last frame written
+        uint64_t unsynced_bytes;
+        bool unsynced_one_shot;
+        int64_t synced_ms;
+        int64_t written_us;
+        
+        // event recording: the held frames, oldest first, and the capture
+        // time at which the current event's post-roll ends
+        std::vector<std::unique_ptr<SaveBuffer> > preroll;
+        size_t preroll_bytes;
+        int64_t event_until_us;
+        bool in_event;
+        
+        // thumbnails of the frames being written, kept for the buffers
+        std::vector<std::vector<unsigned char> > thumbnails;
+        
+        // motion gating: the batch's frames as decode_for_motion() made
+        // them, the camera's detector, the version of its mask that was
+        // last given to it, and the capture time of the last frame kept
+        std::vector<MotionFrame> motion_frames;
+        std::unique_ptr<MotionDetector> motion;
+        unsigned motion_mask_version;
+        int64_t kept_us;
+        
+        // hash and size of the last frame handed to the sink, which the
+        // next may be a repeat of; a size of 0 if there is none. With
+        // repeat_records its buffer is held too, so that a frame with the
+        // same hash can be compared with it byte for byte.
+        uint64_t last_hash;
+        size_t last_size;
+        std::unique_ptr<SaveBuffer> last_frame;
+    };
+    
+    struct Shard
+    {
+        explicit Shard(size_t capacity) : queue(capacity), queued(0),
+            in_use(false) {}
+        
+        BoundedRing<SaveBuffer> queue;
+        
+        // number of buffers pushed onto queue that no writer has taken yet.
+        // A producer that moves this from 0 to 1 wakes a writer.
+        std::atomic<size_t> queued;
+        
+        // set by the writer currently draining this shard
+        std::atomic<bool> in_use;
+        
+        // output files of the cameras in this shard, indexed by camera.
+        // Only touched by the writer holding in_use.
+        std::vector<CameraOutput> outputs;
+    };
+    
+    std::vector<std::unique_ptr<Shard> > m_shards;
+    
+    BoundedRing<SaveBuffer> free_buffers;
+    
+    std::mutex m_stats_mutex;
+    SaveStats m_stats;
+    
+    // memory registered with the writers' queues, indexed by
+    // SaveBuffer::fixed_index and CameraOutput::tail_fixed - 1. Each writer
+    // registers it with its IoQueue, and does so again whenever
+    // m_fixed_version moves on. With direct_io the first FIXED_TAILS
+    // places are the cameras' tails, which carry most of the bytes; they
+    // hold m_fixed_spare, one page, until a tail takes them, and are
+    // registered on their own if the kernel refuses the whole set. A
+    // place is never given other memory, apart from a tail taking over
+    // from m_fixed_spare, so an index below a queue's registered_count()
+    // always means the same memory. m_fixed_warned is set once a refusal
+    // has been reported.
+    static const size_t MAX_FIXED = 1024;
+    static const size_t FIXED_TAILS = 4 * MAX_CAMERAS;
+    FrameBuffer m_fixed_spare;
+    size_t m_fixed_tails;
+    bool m_fixed_warned;
+    std::mutex m_fixed_mutex;
+    std::vector<IoSlice> m_fixed;
+    std::atomic<unsigned> m_fixed_version;
+    
+    // published by the writers after each batch in ring mode
+    std::mutex m_ring_mutex;
+    RingPosition m_ring[MAX_CAMERAS];
+    
+    // set by trigger_event() to the sequence number of the camera's next
+    // frame, and taken by the writer once it reaches that frame.
+    // NO_EVENT when nothing is pending.
+    static const uint64_t NO_EVENT = UINT64_MAX;
+    std::atomic<uint64_t> m_event_at[MAX_CAMERAS];
+    
+    // snapshots: requests waiting for their camera's next frame, copies
+    // of frames waiting for the snapshot thread, and finished results
+    // waiting to be collected. m_snap_wanted counts the requests per camera
+    // so that the capture path only locks when one is waiting.
+    struct SnapshotRequest
+    {
+        int camera;
+        int tag;
+        int64_t asked_us;
+    };
+    
+    struct Snapshot
+    {
+        std::unique_ptr<SaveBuffer> buf;
+        int64_t asked_us;
+    };
+    
+    static const size_t MAX_SNAPSHOT_RESULTS = 256;
+    
+    std::thread m_snap_thread;
+    std::mutex m_snap_mutex;
+    std::condition_variable m_snap_cv;
+    std::condition_variable m_snap_done_cv;
+    std::vector<SnapshotRequest> m_snap_requests;
+    std::vector<Snapshot> m_snap_ready;
+    std::vector<SnapshotResult> m_snap_done;
+    std::atomic<int> m_snap_wanted[MAX_CAMERAS];
+    
+    // published by the writers after each batch
+    std::mutex m_durable_mutex;
+    DurableMark m_durable[MAX_CAMERAS];
+    
+    // published by the writers about once a second per camera
+    std::mutex m_clock_mutex;
+    ClockDrift m_clock[MAX_CAMERAS];
+    
+    // motion masks set by set_motion_mask(). A writer hands a camera's to
+    // its detector when m_motion_version has moved on.
+    struct MotionMask
+    {
+        MotionMask() : columns(0), rows(0) {}
+        
+        int columns;
+        int rows;
+        std::vector<unsigned char> cells;
+    };
+    
+    std::mutex m_motion_mutex;
+    MotionMask m_motion_masks[MAX_CAMERAS];
+    std::atomic<unsigned> m_motion_version[MAX_CAMERAS];
     
   public:
-    SaveThread();
+    // starts options.writer_count writer threads. Files are written into
+    // base_path, which must already exist. options.budget limits what may
+    // wait on the save queue and says what happens to frames that do not fit.
+    explicit SaveThread(const std::string& base_path = ".",
+        const SaveOptions& options = SaveOptions());
+    
+    // writes out anything still queued, then stops the writer threads.
+    ~SaveThread();
     
     // allocates buffer_count free buffers, each with iniital_data_reserve
-    // bytes preallocated in their data fields. This is intended to be called
-    // once when the thread is first started.
+    // bytes preallocated in their data fields. The memory is faulted in
+    // here, so the capture thread never pays for it, and with
+    // IO_BACKEND_URING it is registered with the writers' queues. This is
+    // intended to be called once when the thread is first started.
     void reserve_free_buffers(size_t buffer_count, size_t initial_data_reserve);
   
     // grabs a SaveBuffer from the free buffers list, or allocates a new one
@@ -63,15 +779,129 @@ class SaveThread
     std::unique_ptr<SaveBuffer> get_buffer();
     
     // takes ownership of the buffer and puts it on the save queue so that its
-    // contents will be written to disk. ptr will be empty upon return.
+    // contents will be written to disk. ptr will be empty upon return. If the
+    // budget's drop policy sheds the frame, the buffer is recycled.
     void save(std::unique_ptr<SaveBuffer>& ptr);
     
-    // Equivalent to calling save() followed by get_buffer(), but avoids
-    // the overhead of multiple mutex lock/unlocks. This is usually what you
-    // want in most cases, except when first starting and when finishing.
+    // Equivalent to calling save() followed by get_buffer(). This is usually
+    // what you want in most cases, except when first starting and when
+    // finishing. If the frame is shed, ptr keeps its buffer for reuse
+    // instead of trading it for a free one.
     void save_and_get_buffer(std::unique_ptr<SaveBuffer>& ptr);
+    
+    // whether the writers keep frame_hash() of the frames (the segment
+    // format does), so that it is worth taking on the capture path while
+    // the frame is in cache (SaveBuffer::hash)
+    bool wants_frame_hashes() const;
+    
+    // stops the writer threads after the save queue has been drained.
+    // Buffers passed to save() after this point are discarded. Safe to call
+    // twice.
+    void stop();
+    
+    // event recording: writes out the camera's pre-roll and keeps writing
+    // its frames for the post-roll, which starts at the first frame saved
+    // after this call. A negative camera triggers every camera. Cheap and
+    // safe to call from any thread. A trigger that comes before the writer
+    // has reached the last one is merged into it.
+    void trigger_event(int camera);
+    
+    // asks for the camera's next frame to be saved as its own JPEG,
+    // <base_path>/oneshot_camN_<tag>.jpg, and synced. The frame is copied
+    // as it is handed to save() and written by a thread of its own, ahead
+    // of everything on the save queue, so a busy disk delays it by one
+    // small write rather than the whole backlog. The frame is still
+    // recorded as usual. Safe to call from any thread.
+    void request_snapshot(int camera, int tag);
+    
+    // waits up to timeout_ms for the camera's snapshot with this tag to be
+    // finished and hands back its result. Tags only need to be unique per
+    // camera. Each result can be collected once; only the most recent
+    // MAX_SNAPSHOT_RESULTS are kept. Returns false on timeout, or if the
+    // thread stops first.
+    bool wait_snapshot(int camera, int tag, unsigned timeout_ms,
+        SnapshotResult& result);
+    
+    // returns a snapshot of the batching counters
+    SaveStats stats();
+    
+    // returns a snapshot of the drop counters for one camera. Cameras
+    // numbered MAX_CAMERAS or above share the last set of counters.
+    DropStats drop_stats(int camera);
+    
+    size_t writer_count() const { return m_writer_count; }
+    
+    // how far the camera's recording has been made durable. Cameras
+    // numbered MAX_CAMERAS or above share the last slot.
+    DurableMark durability(int camera);
+    
+    // how the camera's clock is drifting against the host's. Cameras
+    // numbered MAX_CAMERAS or above share the last slot.
+    ClockDrift clock_drift(int camera);
+    
+    // ring mode: where the camera's ring is currently being written.
+    // Cameras numbered MAX_CAMERAS or above share the last slot.
+    RingPosition ring_position(int camera);
+    
+    // ring mode: path of one of a camera's ring files
+    std::string ring_path(int camera, unsigned segment) const;
+    
+    // motion gating: which of the camera's MCUs to watch, columns by rows
+    // of them row by row, non-zero to watch (MotionDetector::set_mask()).
+    // An empty mask watches them all. Safe to call from any thread; takes
+    // effect from the camera's next batch. Cameras numbered MAX_CAMERAS
+    // or above share the last mask.
+    void set_motion_mask(int camera, int columns, int rows,
+        const std::vector<unsigned char>& mask);
+    
+  private:
+    std::unique_ptr<SaveBuffer> new_buffer();
+    bool enqueue(std::unique_ptr<SaveBuffer>& ptr);
+    bool has_room(size_t bytes) const;
+    bool wait_for_room(size_t bytes);
+    bool evict_oldest(Shard& preferred);
+    void release_pending(const SaveBuffer& buf);
+    void note_drop(CameraCounters& cc, std::atomic<uint64_t>& reason);
+    CameraCounters& counters_for(int camera);
+    Shard& shard_for(int camera);
+    void recycle(std::unique_ptr<SaveBuffer>& ptr);
+    
+    Shard* claim_shard(size_t writer, bool& stolen);
+    bool any_claimable() const;
+    void thread_main(size_t writer);
+    void register_fixed(IoQueue& queue, unsigned& version);
+    void register_fixed_locked(IoQueue& queue);
+    unsigned fixed_for(const SaveBuffer& buf) const;
+    void prepare_tail(CameraOutput& out);
+    void write_batch(Shard& shard,
+        std::vector<std::unique_ptr<SaveBuffer> >& batch);
+    CameraOutput* output_for(Shard& shard, int camera);
+    bool open_output(CameraOutput& out, const SaveBuffer& first,
+        int64_t time_us);
+    bool output_expired(const CameraOutput& out, int64_t time_us) const;
+    bool ring_mode() const;
+    bool prepare_ring(CameraOutput& out, int camera);
+    bool write_frames(CameraOutput& out, std::vector<FrameInfo>& frames,
+        SaveStats& delta);
+    std::string one_shot_path(const SaveBuffer& buf) const;
+    void save_one_shot(const SaveBuffer& buf);
+    void take_snapshots(const SaveBuffer& frame);
+    void snapshot_main();
+    void close_output(CameraOutput& out, int camera,
+        std::vector<FrameInfo>& frames, SaveStats& delta);
+    bool motion_gated() const;
+    void decode_for_motion(CameraOutput& out,
+        const std::vector<std::unique_ptr<SaveBuffer> >& batch, size_t first);
+    bool motion_keeps(CameraOutput& out, const MotionFrame& frame,
+        const SaveBuffer& buf, int64_t time_us, SaveStats& delta);
+    bool start_event(CameraOutput& out,
+        std::vector<std::unique_ptr<SaveBuffer> >& batch, size_t at);
+    void hold_preroll(CameraOutput& out, std::unique_ptr<SaveBuffer>& ptr,
+        int64_t time_us, SaveStats& delta);
+    bool sync_due(const CameraOutput& out) const;
+    int64_t sync_idle();
+    void sync_output(CameraOutput& out, int camera, SaveStats& delta);
+    void publish_durability(int camera, int64_t written_us, bool synced);
+    int64_t frame_time(CameraOutput* out, SaveBuffer& buf);
+    void publish_clock(int camera, const ClockEstimator& clock);
 };
-
-
-
-
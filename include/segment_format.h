@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint.h>
+
+// On-disk layout of a frame segment (.seg), the native archive format of
+// the save thread. Everything is little endian and every structure is a
+// multiple of 8 bytes with naturally aligned fields, so a reader can mmap
+// the file and use these structs in place.
+//
+//     SegmentHeader
+//     RecordHeader, payload, zero padding to 8 bytes    \ once per frame,
+//     RecordHeader, payload, zero padding to 8 bytes    / in capture order
+//     ...
+//     SegmentIndexEntry[record_count]
+//     SegmentFooter                                     (last 32 bytes)
+//
+// Records are only ever appended. The index and footer are written when the
+// segment is closed, and the header's index_offset and record_count are
+// filled in at the same time. A segment without a footer was not closed
+// cleanly; its records can still be recovered by walking them from the
+// header, stopping at the first one whose magic or checksum is wrong.
+//
+// Segments in a recording ring (SaveOptions::ring_segments) are fixed-size
+// files that are written over again and again, so the footer is not at the
+// end of the file; find it from the header's index_offset instead. Past the
+// end of the current records are the records of an older pass, which have
+// valid checksums of their own. A recovery walk therefore also stops at the
+// first record whose time_us is older than the one before it.
+//
+// Frames from one camera nearly always carry the same JPEG headers (quant
+// and Huffman tables, SOF, SOS). From version 2 a segment may hold each
+// distinct header only once, in a RECORD_HEADER_BLOCK record, and frames
+// that use it are stored as RECORD_SHARED_HEADER records without it. Both
+// kinds of payload start with a HeaderRef; a frame is put back together
+// as the header block's bytes followed by its own, and comes out exactly
+// as it was captured. A header block is always written before the first
+// frame that refers to it, in the same segment, so a recovery walk meets
+// it first. SegmentReader does all of this.
+//
+// A frame may be followed by a RECORD_THUMBNAIL record with the same
+// time_us: a ThumbnailHeader and then the frame at 1/8 scale, as raw
+// 8-bit gray or RGB pixels. The thumbnails make a second track in the
+// index that a timeline can be drawn from without reading any frames.
+//
+// From version 3 a frame record may start with a FrameHash
+// (RECORD_HASHED): frame_hash() of the whole frame as captured, taken
+// when it arrived, so a reader can check the frame it puts back together
+// against what the camera sent. A frame that is the same as the frame
+// before it, as cameras send when the sensor stalls, is stored as a
+// RECORD_REPEAT record holding only its FrameHash; it is read as that
+// earlier frame, which is always in the same segment.
+
+#define SEGMENT_MAGIC        "MJPGSEG1"
+#define SEGMENT_FOOTER_MAGIC "MJSEGEND"
+
+static const uint32_t SEGMENT_VERSION = 3;
+static const uint32_t RECORD_MAGIC = 0x4D415246; // "FRAM"
+static const uint32_t RECORD_ALIGNMENT = 8;
+
+// SegmentIndexEntry and RecordHeader flags
+static const uint32_t RECORD_ONE_SHOT = 1;
+
+// the frame failed the structural JPEG check at capture (jpeg_scan.h)
+static const uint32_t RECORD_DAMAGED = 2;
+
+// not a frame: the payload is a HeaderRef and then a JPEG header shared
+// by later RECORD_SHARED_HEADER records. Takes the time of the frame that
+// first used it.
+static const uint32_t RECORD_HEADER_BLOCK = 4;
+
+// the payload is a HeaderRef and then the frame without its header
+static const uint32_t RECORD_SHARED_HEADER = 8;
+
+// not a frame: the payload is a ThumbnailHeader and the pixels of the
+// frame just before it
+static const uint32_t RECORD_THUMBNAIL = 16;
+
+// the payload is only a FrameHash: the frame is the same as the last
+// frame record before it that is not itself a repeat. Has no thumbnail of
+// its own; it shares that frame's.
+static const uint32_t RECORD_REPEAT = 32;
+
+// the payload starts with a FrameHash, ahead of any HeaderRef
+static const uint32_t RECORD_HASHED = 64;
+
+struct SegmentHeader
+{
+    char magic[8];              // SEGMENT_MAGIC, not NUL terminated
+    uint32_t version;
+    uint32_t header_size;       // sizeof(SegmentHeader); records start here
+    uint32_t record_header_size;
+    uint32_t index_entry_size;
+    int32_t camera;
+    uint32_t reserved0;
+    int64_t first_time_us;      // capture time of the first record
+    uint64_t index_offset;      // 0 until the segment is closed
+    uint64_t record_count;      // 0 until the segment is closed
+
+    // ring segments: counts up by one each time any file of the camera's
+    // ring is started, so the highest value is the newest. 0 otherwise.
+    uint64_t sequence;
+};
+
+struct RecordHeader
+{
+    uint32_t magic;             // RECORD_MAGIC
+    uint32_t size;              // payload bytes, not counting padding
+    int64_t time_us;            // capture time, microseconds since 1970 UTC
+    int32_t camera;
+    uint32_t flags;
+    int32_t one_shot_tag;
+
+    // CRC-32C of the payload, continued over the 28 header bytes above
+    uint32_t checksum;
+};
+
+// Start of the payload of RECORD_HEADER_BLOCK and RECORD_SHARED_HEADER
+// records. A frame's header is the header block in the same segment with
+// the same hash and size.
+struct HeaderRef
+{
+    uint64_t hash;              // 64-bit FNV-1a of the header bytes
+    uint32_t header_size;       // bytes of JPEG header
+    uint32_t reserved;
+};
+
+// Start of the payload of RECORD_HASHED records, and the whole payload of
+// RECORD_REPEAT ones.
+struct FrameHash
+{
+    uint64_t hash;              // frame_hash() of the whole frame
+    uint32_t frame_size;        // bytes of the whole frame
+    uint32_t reserved;
+};
+
+// Start of the payload of RECORD_THUMBNAIL records. The pixels follow,
+// rows top to bottom with no padding: width * height * channels bytes.
+struct ThumbnailHeader
+{
+    uint16_t width;
+    uint16_t height;
+    uint8_t channels;           // 1 for gray, 3 for RGB
+    uint8_t reserved[3];
+};
+
+struct SegmentIndexEntry
+{
+    uint64_t offset;            // of the RecordHeader
+    int64_t time_us;
+    uint32_t size;              // payload bytes
+    uint32_t flags;
+};
+
+struct SegmentFooter
+{
+    uint64_t index_offset;
+    uint64_t record_count;
+    uint32_t index_checksum;    // CRC-32C of the whole index
+    uint32_t reserved;
+    char magic[8];              // SEGMENT_FOOTER_MAGIC
+};
+
+static_assert(sizeof(SegmentHeader) == 64, "SegmentHeader layout");
+static_assert(sizeof(RecordHeader) == 32, "RecordHeader layout");
+static_assert(sizeof(SegmentIndexEntry) == 24, "SegmentIndexEntry layout");
+static_assert(sizeof(SegmentFooter) == 32, "SegmentFooter layout");
+static_assert(sizeof(HeaderRef) == 16, "HeaderRef layout");
+static_assert(sizeof(ThumbnailHeader) == 8, "ThumbnailHeader layout");
+static_assert(sizeof(FrameHash) == 16, "FrameHash layout");
+
+// offset of the checksum within RecordHeader; it covers everything before
+static const uint32_t RECORD_CHECKSUMMED_BYTES = 28;
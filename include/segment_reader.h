@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "segment_format.h"
+#include "output_file.h"
+#include "jpeg_decoder.h"
+
+// Reads frames back out of a segment file (see segment_format.h).
+//
+// open() loads the index from the footer, or, if the segment was not
+// closed cleanly, rebuilds it by walking the records and checking each
+// checksum. Frames whose headers were shared with others are put back
+// together on read, so read_frame() always gives the JPEG exactly as it
+// was captured, and frames stored as repeats are read as the frame they
+// repeat. Header blocks are read once, the first time a frame needs one,
+// and kept. Thumbnails are read on their own, with read_thumbnail(), so a
+// timeline can be drawn without touching the frames.
+//
+// Not thread safe.
+class SegmentReader
+{
+  public:
+    SegmentReader();
+    ~SegmentReader();
+
+    // returns false if the file cannot be read or is not a segment
+    bool open(const std::string& path);
+    void close();
+
+    const SegmentHeader& header() const { return m_header; }
+
+    // false if the index had to be rebuilt from the records
+    bool closed_cleanly() const { return m_clean; }
+
+    // frames in capture order, repeats (RECORD_REPEAT) included; header
+    // blocks and thumbnails are not counted. The size in an entry is the
+    // stored payload, not the size of the rebuilt frame.
+    size_t frame_count() const { return m_frames.size(); }
+    const SegmentIndexEntry& frame(size_t i) const {
+        return m_index[m_frames[i]];
+    }
+
+    // reads frame i into jpeg. Returns false if its checksum is wrong, the
+    // header it shares cannot be found, or, for a frame stored with its
+    // hash (RECORD_HASHED), the frame put back together does not match it.
+    bool read_frame(size_t i, std::vector<unsigned char>& jpeg);
+
+    // reads frame i and describes it as a standalone JPEG, for exporting
+    // or serving with a gathered write: the frame's pieces, with the
+    // standard DHT between them if the camera left it out (jpeg_dht.h).
+    // Nothing is copied; the slices are only good until the next call.
+    // Records are checked as for read_frame(), but not the frame's hash.
+    bool frame_slices(size_t i, std::vector<IoSlice>& slices);
+
+    // whether frame i was saved with a thumbnail (RECORD_THUMBNAIL). A
+    // repeat has the thumbnail of the frame it repeats.
+    bool has_thumbnail(size_t i) const {
+        return i < m_thumbnails.size() && m_thumbnails[i] != NO_THUMBNAIL;
+    }
+
+    // reads frame i's thumbnail. Returns false if it has none, or if its
+    // checksum or size is wrong.
+    bool read_thumbnail(size_t i, JpegImage& image);
+
+  private:
+    SegmentReader(const SegmentReader&);
+    SegmentReader& operator=(const SegmentReader&);
+
+    bool read_at(uint64_t offset, void* data, size_t size);
+    bool read_record(uint64_t offset, RecordHeader& r,
+        std::vector<unsigned char>& payload);
+    bool load_index();
+    void walk_records();
+    void load_headers();
+    bool read_parts(size_t i, bool standalone, std::vector<IoSlice>& slices);
+
+    FILE* m_file;
+    std::string m_path;
+    uint64_t m_size;
+    SegmentHeader m_header;
+    bool m_clean;
+
+    // every record, and the positions in it of the frames and of their
+    // thumbnails. m_sources has, for each frame, the frame that holds its
+    // bytes: itself, or for a repeat the frame it repeats.
+    std::vector<SegmentIndexEntry> m_index;
+    std::vector<size_t> m_frames;
+    std::vector<size_t> m_sources;
+    std::vector<size_t> m_thumbnails;
+
+    static const size_t NO_THUMBNAIL = (size_t)-1;
+    static const size_t NO_SOURCE = (size_t)-1;
+
+    // header blocks by hash
+    std::map<uint64_t, std::vector<unsigned char> > m_headers;
+    bool m_headers_loaded;
+
+    // the hash of the frame read_parts() last read, if it had one
+    FrameHash m_hash;
+    bool m_hashed;
+
+    std::vector<unsigned char> m_payload;
+    std::vector<IoSlice> m_slices;
+};
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "frame_sink.h"
+#include "output_file.h"
+#include "segment_format.h"
+
+// Writes frames into a segment file (see segment_format.h). The file's
+// disk space is reserved up front for segment_bytes, so appending never
+// waits on the filesystem to find more blocks; whatever is left over is
+// handed back when the segment is closed. The file, index and footer
+// included, stays within segment_bytes as long as the caller moves on to
+// the next segment whenever the frames it has gathered would not fit();
+// only a single frame too big for any segment goes past it.
+//
+// One-shot frames are kept as records like any other, flagged with
+// RECORD_ONE_SHOT and their tag.
+//
+// Unless set_share_headers(false) is called, each distinct JPEG header is
+// stored once per segment and frames are stored without it (see
+// segment_format.h). Headers are told apart by hash and compared byte for
+// byte, so a collision only costs the sharing. A segment shares at most
+// MAX_SHARED_HEADERS of them; frames with any other header, or whose
+// header cannot be found, are stored whole.
+//
+// A frame that comes with a thumbnail (FrameInfo::thumbnail) is followed
+// by a RECORD_THUMBNAIL record holding it.
+//
+// A frame with a hash (FrameInfo::has_hash) is stored with it, as a
+// RECORD_HASHED record. One marked FrameInfo::is_repeat, which the caller
+// has compared byte for byte with the frame before it, is stored as a
+// RECORD_REPEAT record of 16 bytes instead, as long as the last frame
+// written to the segment has the same hash and size; otherwise, say when
+// that frame went into the segment before, it is written whole.
+//
+// In reuse mode the writer is filling one file of a recording ring. The
+// file already exists at its full size (see OutputFile::extend()) and is
+// written from the start, over whatever an earlier pass left there; it is
+// never truncated, and only grown by a frame too big for it.
+class SegmentWriter : public FrameSink
+{
+  public:
+    explicit SegmentWriter(uint64_t segment_bytes, bool reuse_file = false);
+    ~SegmentWriter();
+
+    const char* extension() const { return ".seg"; }
+
+    // stored in the header; see SegmentHeader::sequence. Call before open().
+    void set_sequence(uint64_t sequence) { m_sequence = sequence; }
+
+    // whether frames share their headers within the segment. Call before
+    // open().
+    void set_share_headers(bool share) { m_share_headers = share; }
+
+    // the channels of the thumbnails (FrameInfo::thumbnail) frames will
+    // come with, or 0 for none. Only used by frame_bytes(), to allow for
+    // a thumbnail that has not been made yet.
+    void set_thumbnail_channels(int channels) {
+        m_thumbnail_channels = channels;
+    }
+
+    // direct mode: see OutputFile::set_tail(). Call before open().
+    void set_tail(FrameBuffer* tail, unsigned fixed) {
+        m_file.set_tail(tail, fixed);
+    }
+
+    // starts a new file, or in reuse mode rewrites an existing one
+    bool open(const std::string& path, unsigned flags);
+
+    // the frames only go in the index once the write has succeeded. After
+    // a failure the segment should be closed: what made it into the file
+    // is left out of the index, which close() puts after it.
+    bool write_frames(const FrameInfo* frames, size_t count);
+
+    // writes the index and footer and closes the file
+    void close();
+
+    // the index and footer are only written by close(); records synced
+    // before a crash are found again by walking them
+    bool sync() { return m_file.sync(); }
+
+    bool full() const;
+    uint64_t frame_bytes(const FrameInfo& f) const;
+    bool fits(uint64_t bytes) const;
+    bool keeps_one_shots() const { return true; }
+    bool keeps_repeats() const { return true; }
+
+    uint64_t bytes_written() const { return m_file.bytes_written(); }
+    uint64_t write_calls() const { return m_file.write_calls(); }
+
+    uint64_t record_count() const { return m_index.size(); }
+
+    static const size_t MAX_SHARED_HEADERS = 64;
+
+    // headers shorter than this are not worth a HeaderRef and an extra
+    // record
+    static const size_t MIN_SHARED_HEADER = 64;
+
+    // bytes of the file that other readers can see. Every record that ends
+    // at or before this offset is complete.
+    uint64_t visible_bytes() const { return m_file.visible_position(); }
+
+  private:
+    SegmentWriter(const SegmentWriter&);
+    SegmentWriter& operator=(const SegmentWriter&);
+
+    bool write_footer();
+    void add_record(const FrameInfo& f, uint32_t flags, const FrameHash* hash,
+        const HeaderRef* ref, const unsigned char* data, size_t size,
+        unsigned fixed);
+    const HeaderRef* share_header(const FrameInfo& f, size_t& header_size);
+
+    struct SharedHeader
+    {
+        HeaderRef ref;
+        std::vector<unsigned char> bytes;
+    };
+
+    OutputFile m_file;
+    uint64_t m_segment_bytes;
+    bool m_reuse;
+    uint64_t m_sequence;
+    bool m_share_headers;
+    int m_thumbnail_channels;
+
+    SegmentHeader m_header;
+
+    // end of the records written so far
+    uint64_t m_pos;
+
+    std::vector<SegmentIndexEntry> m_index;
+
+    // the records of a write_frames() call, committed to m_index and m_pos
+    // once the write succeeds: their index entries, and where the next one
+    // goes
+    std::vector<SegmentIndexEntry> m_pending;
+    uint64_t m_next;
+
+    // a write has failed since open()
+    bool m_failed;
+
+    // the headers stored in this segment so far
+    std::vector<SharedHeader> m_headers;
+
+    // hash and size of the last frame written whole, which a repeat may
+    // refer to; a size of 0 if there is none, or it had no hash
+    uint64_t m_last_hash;
+    size_t m_last_size;
+
+    // record headers, FrameHashes and HeaderRefs for one write_frames()
+    // call, and the slices that point at them and at the frame data. Each
+    // frame can make three records.
+    std::vector<RecordHeader> m_records;
+    std::vector<FrameHash> m_hashes;
+    std::vector<HeaderRef> m_refs;
+    std::vector<IoSlice> m_slices;
+};
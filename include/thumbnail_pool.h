@@ -0,0 +1,98 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <stdint.h>
+
+#include "frame_sink.h"
+#include "motion_detector.h"
+
+// Makes the 1/8 scale thumbnails that segments keep alongside their frames
+// (RECORD_THUMBNAIL in segment_format.h), from the frames' DC coefficients
+// alone (JpegDecoder::decode_dc()).
+//
+// Even without an IDCT a thumbnail means Huffman-decoding the whole frame,
+// which for a large frame takes far longer than writing it. So the work
+// is spread over a pool of threads of its own; a writer hands over its
+// batch with build() and helps with it until every frame is done. Batches
+// from several writers share the pool.
+//
+// Motion detection needs the same decode (MotionFrame), so build() can
+// hand back each frame's gray DC image too, and a pool can be made for
+// that alone.
+//
+// Thread safe.
+class ThumbnailPool
+{
+  public:
+    // channels is 1 for gray thumbnails or 3 for RGB, or 0 for a pool
+    // that only decodes frames for motion detection
+    ThumbnailPool(int channels, size_t worker_count);
+    ~ThumbnailPool();
+
+    void start();
+    void stop();
+
+    // sets thumbnails[i] to the RECORD_THUMBNAIL payload for frames[i]:
+    // a ThumbnailHeader and the pixels. Frames that cannot be decoded get
+    // an empty one, as does every frame if the pool makes no thumbnails.
+    // If motion is given, motion[i] is set from the same decode. Returns
+    // once all of them are done.
+    void build(const FrameInfo* frames, size_t count,
+        std::vector<std::vector<unsigned char> >& thumbnails,
+        std::vector<MotionFrame>* motion = NULL);
+
+    // frames decoded and frames that could not be
+    uint64_t built() const { return m_built.load(); }
+    uint64_t failed() const { return m_failed.load(); }
+
+    // time spent decoding them, summed over the threads, and the pixels of
+    // the frames decoded
+    uint64_t busy_ns() const { return m_busy_ns.load(); }
+    uint64_t source_pixels() const { return m_pixels.load(); }
+
+  private:
+    ThumbnailPool(const ThumbnailPool&);
+    ThumbnailPool& operator=(const ThumbnailPool&);
+
+    struct Job
+    {
+        const FrameInfo* frames;
+        size_t count;
+        std::vector<std::vector<unsigned char> >* thumbnails;
+        std::vector<MotionFrame>* motion;
+
+        // next frame to hand out, and frames finished
+        size_t next;
+        size_t done;
+    };
+
+    class Worker;
+
+    void make(Worker& worker, Job& job, size_t index);
+
+    bool take(Job*& job, size_t& index);
+    void finish(Job* job);
+    void thread_main();
+
+    int m_channels;
+    size_t m_worker_count;
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::condition_variable m_done_cv;
+    bool m_should_quit;
+
+    // jobs with frames still to hand out, oldest first
+    std::deque<Job*> m_jobs;
+
+    std::atomic<uint64_t> m_built;
+    std::atomic<uint64_t> m_failed;
+    std::atomic<uint64_t> m_busy_ns;
+    std::atomic<uint64_t> m_pixels;
+};
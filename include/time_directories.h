@@ -0,0 +1,71 @@
+#pragma once
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <set>
+#include <map>
+#include <utility>
+#include <atomic>
+#include <stdint.h>
+
+// The directory tree that FORMAT_JPEG_FILES writes into:
+//
+//     base/camN/YYYYMMDD/HH/MM/
+//
+// one directory per camera per minute (UTC), so no directory ever holds
+// more than a minute of one camera's frames however long the recording.
+//
+// Making a directory means a few metadata writes and lookups, which is
+// no place for a writer thread to wait. A background thread keeps the
+// directories for the current minute and the two after it made for every
+// camera that has asked for one, so by the time a writer rolls over to a
+// new minute its directory is already there. If it is not (the camera has
+// just started, or the thread fell behind) the writer makes it itself and
+// late() goes up.
+//
+// Thread safe.
+class TimeDirectories
+{
+  public:
+    explicit TimeDirectories(const std::string& base_path);
+    ~TimeDirectories();
+
+    void start();
+    void stop();
+
+    // path, without a trailing slash, of the directory for the camera's
+    // frames in the minute that holds time_us (microseconds since 1970
+    // UTC). Returns an empty string if it could not be made.
+    std::string minute_path(int camera, int64_t time_us);
+
+    // number of directories a caller of minute_path() had to make
+    uint64_t late() const { return m_late.load(); }
+
+    static const int64_t MINUTE_US = 60000000;
+
+  private:
+    TimeDirectories(const TimeDirectories&);
+    TimeDirectories& operator=(const TimeDirectories&);
+
+    typedef std::pair<int, int64_t> Key;
+
+    std::string path_for(int camera, int64_t minute) const;
+    bool make(int camera, int64_t minute);
+    void thread_main();
+
+    std::string m_base_path;
+
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_should_quit;
+
+    // newest minute each camera has asked for, and the camera/minute
+    // directories known to exist
+    std::map<int, int64_t> m_cameras;
+    std::set<Key> m_made;
+
+    std::atomic<uint64_t> m_late;
+};
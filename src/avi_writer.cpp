@@ -0,0 +1,560 @@
+#include "avi_writer.h"
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+// AVI is little endian throughout; these append or overwrite fields
+// byte by byte so the host's byte order does not matter
+
+static void put16(vector<unsigned char>& v, uint16_t x)
+{
+    v.push_back((unsigned char)x);
+    v.push_back((unsigned char)(x >> 8));
+}
+
+static void put32(vector<unsigned char>& v, uint32_t x)
+{
+    put16(v, (uint16_t)x);
+    put16(v, (uint16_t)(x >> 16));
+}
+
+static void put64(vector<unsigned char>& v, uint64_t x)
+{
+    put32(v, (uint32_t)x);
+    put32(v, (uint32_t)(x >> 32));
+}
+
+static void put_fourcc(vector<unsigned char>& v, const char* cc)
+{
+    v.insert(v.end(), cc, cc + 4);
+}
+
+static void put_zeros(vector<unsigned char>& v, size_t count)
+{
+    v.insert(v.end(), count, 0);
+}
+
+static void set32(unsigned char* p, uint32_t x)
+{
+    p[0] = (unsigned char)x;
+    p[1] = (unsigned char)(x >> 8);
+    p[2] = (unsigned char)(x >> 16);
+    p[3] = (unsigned char)(x >> 24);
+}
+
+static void set64(unsigned char* p, uint64_t x)
+{
+    set32(p, (uint32_t)x);
+    set32(p + 4, (uint32_t)(x >> 32));
+}
+
+// offsets of the fields we fill in later, from the start of each chunk's
+// data
+static const size_t AVIH_US_PER_FRAME = 0;
+static const size_t AVIH_FLAGS        = 12;
+static const size_t AVIH_TOTAL_FRAMES = 16;
+static const size_t AVIH_BUFFER_SIZE  = 28;
+static const size_t STRH_SCALE        = 20;
+static const size_t STRH_RATE         = 24;
+static const size_t STRH_LENGTH       = 32;
+static const size_t STRH_BUFFER_SIZE  = 36;
+static const size_t INDX_ENTRIES_USED = 4;
+static const size_t INDX_HEADER       = 24;
+
+// ix00 header after the 8 byte chunk header
+static const size_t STD_INDEX_HEADER = 24;
+
+// avih flag: the file has an idx1 chunk
+static const uint32_t AVIF_HASINDEX = 0x10;
+
+// idx1 entry flag
+static const uint32_t AVIIF_KEYFRAME = 0x10;
+
+static const uint32_t DEFAULT_US_PER_FRAME = 33333;
+
+// finds the frame size in a JPEG's SOF marker. Returns false if there is
+// none before the scan data.
+static bool jpeg_dimensions(const unsigned char* p, size_t size,
+    uint32_t& width, uint32_t& height)
+{
+    if(size < 4 || p[0] != 0xFF || p[1] != 0xD8)
+        return false;
+
+    size_t i = 2;
+    while(i + 4 <= size)
+    {
+        if(p[i] != 0xFF)
+            return false;
+
+        unsigned char marker = p[i + 1];
+        if(marker == 0xFF)
+        {
+            i++; // fill byte
+            continue;
+        }
+
+        // SOF0..SOF15, leaving out DHT, JPG and DAC which share the range
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+           marker != 0xC8 && marker != 0xCC)
+        {
+            if(i + 9 > size)
+                return false;
+            height = (p[i + 5] << 8) | p[i + 6];
+            width = (p[i + 7] << 8) | p[i + 8];
+            return true;
+        }
+
+        if(marker == 0xDA || marker == 0xD9)
+            return false;
+
+        size_t length = (p[i + 2] << 8) | p[i + 3];
+        i += 2 + length;
+    }
+
+    return false;
+}
+
+AviWriter::AviWriter(uint64_t riff_limit) : m_riff_limit(riff_limit),
+    m_header_written(false), m_avih_at(0), m_strh_at(0), m_indx_at(0),
+    m_dmlh_at(0), m_pos(0), m_riff_at(0), m_movi_at(0), m_riff_frames(0),
+    m_first_riff_frames(0), m_first_movi_end(0), m_first_riff_end(0),
+    m_frames(0), m_largest_chunk(0), m_first_us(0), m_last_us(0)
+{
+}
+
+AviWriter::~AviWriter()
+{
+    close();
+}
+
+bool AviWriter::open(const std::string& path, unsigned flags)
+{
+    close();
+
+    if(!m_file.open(path, flags | OutputFile::OPEN_TRUNCATE))
+        return false;
+
+    m_header_written = false;
+    m_header.clear();
+    m_pos = 0;
+    m_riff_at = 0;
+    m_movi_at = 0;
+    m_riff_frames = 0;
+    m_first_riff_frames = 0;
+    m_first_movi_end = 0;
+    m_first_riff_end = 0;
+    m_frames = 0;
+    m_largest_chunk = 0;
+    m_first_us = 0;
+    m_last_us = 0;
+    m_index.clear();
+    m_index.reserve(INDEX_FRAMES);
+    m_super.clear();
+    m_super.reserve(SUPER_INDEX_ENTRIES);
+    m_legacy_index.clear();
+    return true;
+}
+
+void AviWriter::close()
+{
+    if(!m_file.is_open())
+        return;
+
+    if(m_header_written)
+    {
+        bool ok = flush_index();
+        if(ok && m_riff_at == 0)
+            ok = end_first_riff() && update_header();
+        if(!ok)
+            fprintf(stderr, "ERROR: Could not finish the AVI index\n");
+    }
+
+    m_file.close();
+    m_header_written = false;
+}
+
+bool AviWriter::sync()
+{
+    if(!m_file.is_open())
+        return false;
+
+    if(m_header_written && !flush_index())
+        return false;
+
+    return m_file.sync();
+}
+
+bool AviWriter::full() const
+{
+    // keep a spare entry for the index written by close()
+    return m_super.size() + 2 >= SUPER_INDEX_ENTRIES;
+}
+
+bool AviWriter::write_header(const FrameInfo& first)
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    if(!jpeg_dimensions(first.data, first.size, width, height))
+    {
+        fprintf(stderr, "WARNING: No frame size in the first JPEG; "
+            "the AVI header will say 0x0\n");
+    }
+
+    vector<unsigned char>& h = m_header;
+    h.clear();
+
+    put_fourcc(h, "RIFF");
+    put32(h, 0);
+    put_fourcc(h, "AVI ");
+
+    size_t hdrl_at = h.size();
+    put_fourcc(h, "LIST");
+    put32(h, 0);
+    put_fourcc(h, "hdrl");
+
+    // MainAVIHeader
+    put_fourcc(h, "avih");
+    put32(h, 56);
+    m_avih_at = h.size();
+    put32(h, DEFAULT_US_PER_FRAME);
+    put32(h, 0);            // max bytes per second
+    put32(h, 0);            // padding granularity
+    put32(h, 0);            // flags
+    put32(h, 0);            // total frames (first RIFF only)
+    put32(h, 0);            // initial frames
+    put32(h, 1);            // streams
+    put32(h, 0);            // suggested buffer size
+    put32(h, width);
+    put32(h, height);
+    put_zeros(h, 16);
+
+    size_t strl_at = h.size();
+    put_fourcc(h, "LIST");
+    put32(h, 0);
+    put_fourcc(h, "strl");
+
+    // AVIStreamHeader
+    put_fourcc(h, "strh");
+    put32(h, 56);
+    m_strh_at = h.size();
+    put_fourcc(h, "vids");
+    put_fourcc(h, "MJPG");
+    put32(h, 0);            // flags
+    put16(h, 0);            // priority
+    put16(h, 0);            // language
+    put32(h, 0);            // initial frames
+    put32(h, DEFAULT_US_PER_FRAME); // scale
+    put32(h, 1000000);      // rate
+    put32(h, 0);            // start
+    put32(h, 0);            // length
+    put32(h, 0);            // suggested buffer size
+    put32(h, 0xFFFFFFFF);   // quality
+    put32(h, 0);            // sample size
+    put16(h, 0);
+    put16(h, 0);
+    put16(h, (uint16_t)width);
+    put16(h, (uint16_t)height);
+
+    // BITMAPINFOHEADER
+    put_fourcc(h, "strf");
+    put32(h, 40);
+    put32(h, 40);
+    put32(h, width);
+    put32(h, height);
+    put16(h, 1);            // planes
+    put16(h, 24);           // bit count
+    put_fourcc(h, "MJPG");
+    put32(h, width * height * 3);
+    put_zeros(h, 16);
+
+    // AVISUPERINDEX, with room for every entry we will ever add
+    put_fourcc(h, "indx");
+    put32(h, (uint32_t)(INDX_HEADER + 16 * SUPER_INDEX_ENTRIES));
+    m_indx_at = h.size();
+    put16(h, 4);            // longs per entry
+    h.push_back(0);         // sub type
+    h.push_back(0);         // AVI_INDEX_OF_INDEXES
+    put32(h, 0);            // entries in use
+    put_fourcc(h, "00dc");
+    put_zeros(h, 12);
+    put_zeros(h, 16 * SUPER_INDEX_ENTRIES);
+
+    set32(&h[strl_at + 4], (uint32_t)(h.size() - strl_at - 8));
+
+    // OpenDML extended header
+    put_fourcc(h, "LIST");
+    put32(h, 4 + 8 + 248);
+    put_fourcc(h, "odml");
+    put_fourcc(h, "dmlh");
+    put32(h, 248);
+    m_dmlh_at = h.size();
+    put_zeros(h, 248);
+
+    set32(&h[hdrl_at + 4], (uint32_t)(h.size() - hdrl_at - 8));
+
+    put_fourcc(h, "LIST");
+    put32(h, 4);
+    put_fourcc(h, "movi");
+
+    m_riff_at = 0;
+    m_movi_at = h.size() - 12;
+    m_pos = h.size();
+
+    if(!m_file.write(&h[0], h.size()))
+        return false;
+
+    m_header_written = true;
+    return true;
+}
+
+bool AviWriter::write_frames(const FrameInfo* frames, size_t count)
+{
+    if(count == 0)
+        return true;
+
+    if(!m_header_written && !write_header(frames[0]))
+        return false;
+
+    static const unsigned char pad = 0;
+
+    // sized up front; m_slices points into it
+    m_chunk_headers.resize(8 * count);
+    m_slices.clear();
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const FrameInfo& f = frames[i];
+        uint32_t size = (uint32_t)f.size;
+        uint64_t chunk = 8 + size + (size & 1);
+
+        // keep the RIFF, and the ix00 chunk (and in the first RIFF the
+        // idx1 chunk) that will end it, under the limit; otherwise index
+        // once enough frames have gone by
+        uint64_t index_bytes = 8 + STD_INDEX_HEADER + 8 * (m_index.size() + 1);
+        if(m_riff_at == 0)
+            index_bytes += 8 + 16 * (m_legacy_index.size() + 1);
+        if(m_riff_frames > 0 &&
+           m_pos + chunk + index_bytes - m_riff_at > m_riff_limit)
+        {
+            if(!flush_index() || !start_riff())
+                return false;
+        }
+        else if(m_index.size() >= INDEX_FRAMES && !full())
+        {
+            if(!flush_index())
+                return false;
+        }
+
+        unsigned char* header = &m_chunk_headers[8 * i];
+        memcpy(header, "00dc", 4);
+        set32(header + 4, size);
+
+        IoSlice s = { header, 8 };
+        m_slices.push_back(s);
+
+        IoSlice d = { f.data, f.size, f.fixed };
+        m_slices.push_back(d);
+
+        if(size & 1)
+        {
+            IoSlice p = { &pad, 1 };
+            m_slices.push_back(p);
+        }
+
+        IndexEntry e = { (uint32_t)(m_pos + 8 - m_movi_at), size };
+        m_index.push_back(e);
+        if(m_riff_at == 0)
+            m_legacy_index.push_back(e);
+
+        m_pos += chunk;
+        m_riff_frames++;
+        if(m_riff_at == 0)
+            m_first_riff_frames = m_riff_frames;
+
+        if(m_frames == 0)
+            m_first_us = f.time_us;
+        m_last_us = f.time_us;
+        m_frames++;
+
+        if(size + 8 > m_largest_chunk)
+            m_largest_chunk = size + 8;
+    }
+
+    return flush_pending();
+}
+
+bool AviWriter::flush_pending()
+{
+    if(m_slices.empty())
+        return true;
+
+    bool ok = m_file.write_gather(&m_slices[0], m_slices.size());
+    m_slices.clear();
+    return ok;
+}
+
+// writes the frames gathered so far followed by an ix00 chunk for them,
+// then brings the header up to date
+bool AviWriter::flush_index()
+{
+    if(!flush_pending())
+        return false;
+
+    if(m_index.empty())
+        return true;
+
+    vector<unsigned char>& v = m_scratch;
+    v.clear();
+
+    put_fourcc(v, "ix00");
+    put32(v, (uint32_t)(STD_INDEX_HEADER + 8 * m_index.size()));
+    put16(v, 2);            // longs per entry
+    v.push_back(0);         // sub type
+    v.push_back(1);         // AVI_INDEX_OF_CHUNKS
+    put32(v, (uint32_t)m_index.size());
+    put_fourcc(v, "00dc");
+    put64(v, m_movi_at);    // base offset
+    put32(v, 0);
+
+    for(size_t i = 0; i < m_index.size(); i++)
+    {
+        // the top bit would mark a delta frame; every JPEG is a key frame
+        put32(v, m_index[i].offset);
+        put32(v, m_index[i].size);
+    }
+
+    SuperEntry entry = { m_pos, (uint32_t)v.size(), (uint32_t)m_index.size() };
+
+    if(!m_file.write(&v[0], v.size()))
+        return false;
+
+    m_pos += v.size();
+    m_index.clear();
+
+    // full() keeps this from happening in practice; if it does, the frames
+    // are still in the file but players will not find them
+    if(m_super.size() < SUPER_INDEX_ENTRIES)
+        m_super.push_back(entry);
+
+    return update_header();
+}
+
+// writes the idx1 chunk that closes the first RIFF, after its 'movi' list
+bool AviWriter::end_first_riff()
+{
+    vector<unsigned char>& v = m_scratch;
+    v.clear();
+
+    put_fourcc(v, "idx1");
+    put32(v, (uint32_t)(16 * m_legacy_index.size()));
+
+    for(size_t i = 0; i < m_legacy_index.size(); i++)
+    {
+        // offsets are of the chunk header, from the 'movi' fourcc
+        put_fourcc(v, "00dc");
+        put32(v, AVIIF_KEYFRAME);
+        put32(v, m_legacy_index[i].offset - 16);
+        put32(v, m_legacy_index[i].size);
+    }
+
+    if(!m_file.write(&v[0], v.size()))
+        return false;
+
+    m_first_movi_end = m_pos;
+    m_pos += v.size();
+    m_first_riff_end = m_pos;
+    vector<IndexEntry>().swap(m_legacy_index);
+    return true;
+}
+
+bool AviWriter::start_riff()
+{
+    if(m_riff_at == 0 && !end_first_riff())
+        return false;
+
+    vector<unsigned char>& v = m_scratch;
+    v.clear();
+
+    put_fourcc(v, "RIFF");
+    put32(v, 4 + 12);
+    put_fourcc(v, "AVIX");
+    put_fourcc(v, "LIST");
+    put32(v, 4);
+    put_fourcc(v, "movi");
+
+    if(!m_file.write(&v[0], v.size()))
+        return false;
+
+    m_riff_at = m_pos;
+    m_movi_at = m_pos + 12;
+    m_pos += v.size();
+    m_riff_frames = 0;
+
+    // the first RIFF's size now takes in idx1, which puts the new one
+    // straight after it
+    return update_header();
+}
+
+// fills in the sizes, counts and super index entries in the header and
+// writes it back, along with the sizes of the current RIFF if that is not
+// the first one
+bool AviWriter::update_header()
+{
+    vector<unsigned char>& h = m_header;
+
+    bool first_done = m_first_riff_end != 0;
+    uint64_t first_end = first_done ? m_first_riff_end : m_pos;
+    uint64_t first_movi_end = first_done ? m_first_movi_end : m_pos;
+    size_t first_movi = h.size() - 12;
+
+    set32(&h[4], (uint32_t)(first_end - 8));
+    set32(&h[first_movi + 4], (uint32_t)(first_movi_end - first_movi - 8));
+
+    uint32_t us_per_frame = DEFAULT_US_PER_FRAME;
+    if(m_frames > 1 && m_last_us > m_first_us)
+    {
+        uint64_t span = (uint64_t)(m_last_us - m_first_us);
+        us_per_frame = (uint32_t)(span / (m_frames - 1));
+        if(us_per_frame == 0)
+            us_per_frame = 1;
+    }
+
+    set32(&h[m_avih_at + AVIH_US_PER_FRAME], us_per_frame);
+    set32(&h[m_avih_at + AVIH_FLAGS], first_done ? AVIF_HASINDEX : 0);
+    set32(&h[m_avih_at + AVIH_TOTAL_FRAMES], m_first_riff_frames);
+    set32(&h[m_avih_at + AVIH_BUFFER_SIZE], m_largest_chunk);
+
+    set32(&h[m_strh_at + STRH_SCALE], us_per_frame);
+    set32(&h[m_strh_at + STRH_RATE], 1000000);
+    set32(&h[m_strh_at + STRH_LENGTH], (uint32_t)m_frames);
+    set32(&h[m_strh_at + STRH_BUFFER_SIZE], m_largest_chunk);
+
+    set32(&h[m_indx_at + INDX_ENTRIES_USED], (uint32_t)m_super.size());
+    for(size_t i = 0; i < m_super.size(); i++)
+    {
+        unsigned char* e = &h[m_indx_at + INDX_HEADER + 16 * i];
+        set64(e, m_super[i].offset);
+        set32(e + 8, m_super[i].size);
+        set32(e + 12, m_super[i].frames);
+    }
+
+    set32(&h[m_dmlh_at], (uint32_t)m_frames);
+
+    if(!m_file.patch(0, &h[0], h.size()))
+        return false;
+
+    if(m_riff_at != 0)
+    {
+        unsigned char size[4];
+
+        set32(size, (uint32_t)(m_pos - m_riff_at - 8));
+        if(!m_file.patch(m_riff_at + 4, size, 4))
+            return false;
+
+        set32(size, (uint32_t)(m_pos - m_movi_at - 8));
+        if(!m_file.patch(m_movi_at + 4, size, 4))
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,149 @@
+#include "capture_clock.h"
+#include <atomic>
+#include <thread>
+#include <cstdlib>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+using namespace std;
+
+static const int64_t NS_PER_SECOND = 1000000000;
+
+// times the clocks are read each time the offset is measured. The reading
+// that took least time is kept, as the one least likely to have been
+// interrupted half way.
+static const int MEASURE_TRIES = 3;
+
+// wall-clock microseconds minus monotonic microseconds, and when that was
+// last measured. Only the thread holding g_refreshing changes them.
+static atomic<int64_t> g_offset_us(0);
+static atomic<int64_t> g_measured_ns(0);
+static atomic<bool> g_measured(false);
+static atomic<bool> g_refreshing(false);
+
+#ifdef _WIN32
+
+int64_t monotonic_ns()
+{
+    static LARGE_INTEGER frequency = { { 0, 0 } };
+    if(frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    // split so the multiply cannot overflow after a long uptime
+    int64_t f = frequency.QuadPart;
+    int64_t seconds = now.QuadPart / f;
+    int64_t rest = now.QuadPart % f;
+    return seconds * NS_PER_SECOND + rest * NS_PER_SECOND / f;
+}
+
+static int64_t wall_us()
+{
+    // GetSystemTimePreciseAsFileTime() is only there on Windows 8 and
+    // later; the older call ticks in steps of up to 16ms
+    typedef VOID (WINAPI *GetTimeFn)(LPFILETIME);
+    static GetTimeFn get_time = NULL;
+    if(!get_time)
+    {
+        HMODULE kernel = GetModuleHandleA("kernel32.dll");
+        get_time = (GetTimeFn)GetProcAddress(kernel,
+            "GetSystemTimePreciseAsFileTime");
+        if(!get_time)
+            get_time = GetSystemTimeAsFileTime;
+    }
+
+    FILETIME ft;
+    get_time(&ft);
+
+    // 100ns units since 1601-01-01
+    int64_t t = ((int64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (t - 116444736000000000LL) / 10;
+}
+
+#else
+
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static int64_t wall_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
+
+int64_t monotonic_to_wall_us(int64_t ns)
+{
+    int64_t now = monotonic_ns();
+    bool measured = g_measured.load(memory_order_acquire);
+
+    // one thread measures; the rest carry on with the old offset
+    if((!measured ||
+        now - g_measured_ns.load(memory_order_relaxed) >= NS_PER_SECOND) &&
+       !g_refreshing.exchange(true, memory_order_acquire))
+    {
+        // take the wall clock between two monotonic readings and pair it
+        // with their midpoint
+        int64_t offset = 0;
+        int64_t span = -1;
+        int64_t after = 0;
+        for(int i = 0; i < MEASURE_TRIES; i++)
+        {
+            int64_t before = monotonic_ns();
+            int64_t wall = wall_us();
+            after = monotonic_ns();
+
+            if(span < 0 || after - before < span)
+            {
+                offset = wall - (before + (after - before) / 2) / 1000;
+                span = after - before;
+            }
+        }
+
+        // a change no bigger than the reading could be out by, rounding
+        // included, is noise. Taking it would move times back by a
+        // microsecond or two now and then.
+        int64_t old = g_offset_us.load(memory_order_relaxed);
+        if(!measured || llabs(offset - old) > span / 2000 + 1)
+            g_offset_us.store(offset, memory_order_relaxed);
+        g_measured_ns.store(after, memory_order_relaxed);
+        g_measured.store(true, memory_order_release);
+        g_refreshing.store(false, memory_order_release);
+    }
+    else if(!measured)
+    {
+        // there is no old offset yet; wait for the first one
+        while(!g_measured.load(memory_order_acquire))
+            this_thread::yield();
+    }
+
+    return ns / 1000 + g_offset_us.load(memory_order_relaxed);
+}
+
+// the date in the proleptic Gregorian calendar that is a number of days
+// after 1970-01-01
+void civil_from_days(int64_t days, int& y, unsigned& m, unsigned& d)
+{
+    days += 719468;
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned doe = (unsigned)(days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+
+    d = doy - (153 * mp + 2) / 5 + 1;
+    m = mp < 10 ? mp + 3 : mp - 9;
+    y = (int)(yoe + era * 400) + (m <= 2);
+}
@@ -0,0 +1,147 @@
+#include "clock_estimator.h"
+#include <cmath>
+using namespace std;
+
+// further than this from the fit is taken as a break in the stream
+static const double DISCONTINUITY_NS = 500e6;
+
+// weight of each new residual in the running jitter figures
+static const double RESIDUAL_WEIGHT = 1.0 / 64;
+
+ClockEstimator::ClockEstimator(size_t window, int64_t bucket_ns) :
+    m_window(window < 2 ? 2 : window),
+    m_bucket_ns(bucket_ns > 0 ? bucket_ns : 1)
+{
+    m_points.reserve(m_window);
+    reset();
+}
+
+void ClockEstimator::reset()
+{
+    m_points.clear();
+    m_next = 0;
+    m_have_bucket = false;
+    m_bucket = 0;
+    m_best.device_ns = 0;
+    m_best.offset_ns = 0;
+    m_ready = false;
+    m_base_device = 0;
+    m_base_offset = 0;
+    m_slope = 0;
+    m_residual_mean = 0;
+    m_residual_var = 0;
+    m_frames = 0;
+}
+
+double ClockEstimator::predicted_offset(int64_t device_ns) const
+{
+    return m_base_offset + m_slope * (double)(device_ns - m_base_device);
+}
+
+int64_t ClockEstimator::to_host_ns(int64_t device_ns) const
+{
+    return device_ns + (int64_t)llround(predicted_offset(device_ns));
+}
+
+double ClockEstimator::jitter_us() const
+{
+    return sqrt(m_residual_var) / 1000.0;
+}
+
+bool ClockEstimator::add(int64_t device_ns, int64_t host_ns)
+{
+    int64_t offset = host_ns - device_ns;
+
+    // how far this frame is from where the clocks were expected to be
+    double reference = m_ready ? predicted_offset(device_ns) :
+        (double)m_best.offset_ns;
+
+    if(m_have_bucket && (device_ns < m_best.device_ns - m_bucket_ns ||
+       fabs((double)offset - reference) > DISCONTINUITY_NS))
+    {
+        reset();
+    }
+
+    m_frames++;
+
+    if(m_ready)
+    {
+        double residual = (double)offset - predicted_offset(device_ns);
+        double delta = residual - m_residual_mean;
+        m_residual_mean += RESIDUAL_WEIGHT * delta;
+        m_residual_var = (1 - RESIDUAL_WEIGHT) *
+            (m_residual_var + RESIDUAL_WEIGHT * delta * delta);
+    }
+
+    int64_t bucket = device_ns / m_bucket_ns;
+    Point p = { device_ns, offset };
+
+    if(!m_have_bucket)
+    {
+        m_have_bucket = true;
+        m_bucket = bucket;
+        m_best = p;
+        return false;
+    }
+
+    if(bucket <= m_bucket)
+    {
+        if(offset < m_best.offset_ns)
+            m_best = p;
+        return false;
+    }
+
+    // the bucket is finished; its fastest frame joins the window
+    if(m_points.size() < m_window)
+        m_points.push_back(m_best);
+    else
+        m_points[m_next] = m_best;
+    m_next = (m_next + 1) % m_window;
+
+    m_bucket = bucket;
+    m_best = p;
+
+    fit();
+    return true;
+}
+
+// least squares through the window, worked relative to its first point so
+// the products stay well inside a double's precision
+void ClockEstimator::fit()
+{
+    size_t n = m_points.size();
+    if(n < 2)
+        return;
+
+    int64_t x0 = m_points[0].device_ns;
+    int64_t y0 = m_points[0].offset_ns;
+
+    double sx = 0;
+    double sy = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        sx += (double)(m_points[i].device_ns - x0);
+        sy += (double)(m_points[i].offset_ns - y0);
+    }
+
+    double mx = sx / n;
+    double my = sy / n;
+
+    double sxx = 0;
+    double sxy = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+        double dx = (double)(m_points[i].device_ns - x0) - mx;
+        double dy = (double)(m_points[i].offset_ns - y0) - my;
+        sxx += dx * dx;
+        sxy += dx * dy;
+    }
+
+    if(sxx <= 0)
+        return;
+
+    m_slope = sxy / sxx;
+    m_base_device = x0 + (int64_t)llround(mx);
+    m_base_offset = (double)y0 + my;
+    m_ready = true;
+}
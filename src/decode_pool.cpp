@@ -0,0 +1,239 @@
+#include "decode_pool.h"
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+// a decoder kept by each thread, so its buffers are reused from one task
+// to the next
+class DecodePool::Worker
+{
+  public:
+    Worker(DecodePool& pool) : m_pool(pool) {}
+
+    bool run(const Job& job, const Task& task);
+
+  private:
+    DecodePool& m_pool;
+    JpegDecoder m_decoder;
+};
+
+bool DecodePool::Worker::run(const Job& job, const Task& task)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // parsing again for each band is a few microseconds, next to the
+    // milliseconds of the band itself
+    const DecodeRequest& r = job.requests[task.request];
+    bool ok = m_decoder.parse(r.data, r.size) &&
+        m_decoder.decode_rows(r.scale, r.format, r.out, r.stride,
+            task.first_row, task.row_count, job.restarts[task.request]);
+
+    m_pool.m_busy_ns += chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start).count();
+    return ok;
+}
+
+DecodePool::DecodePool(size_t worker_count) :
+    m_worker_count(worker_count), m_should_quit(false), m_decoded(0),
+    m_failed(0), m_split(0), m_busy_ns(0), m_pixels(0)
+{
+}
+
+DecodePool::~DecodePool()
+{
+    stop();
+}
+
+void DecodePool::start()
+{
+    if(!m_threads.empty())
+        return;
+
+    m_should_quit = false;
+    for(size_t i = 0; i < m_worker_count; i++)
+        m_threads.push_back(std::thread(&DecodePool::thread_main, this));
+}
+
+void DecodePool::stop()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_should_quit = true;
+    }
+
+    m_cv.notify_all();
+
+    for(size_t i = 0; i < m_threads.size(); i++)
+    {
+        if(m_threads[i].joinable())
+            m_threads[i].join();
+    }
+
+    m_threads.clear();
+}
+
+// adds the tasks for request index to job: bands of MCU rows that start
+// at restart intervals if the frame has them, else the whole frame
+void DecodePool::plan(Job& job, size_t index, JpegDecoder& decoder)
+{
+    const DecodeRequest& r = job.requests[index];
+    if(!decoder.parse(r.data, r.size))
+    {
+        job.failed[index] = 1;
+        return;
+    }
+
+    job.pixels[index] = (uint64_t)decoder.width() * decoder.height();
+
+    std::vector<size_t>& restarts = job.restarts[index];
+    int rows = decoder.mcu_rows();
+
+    size_t threads = m_worker_count + 1;
+    if(threads == 1 || !decoder.find_restarts(restarts) || restarts.empty())
+    {
+        Task task = { index, 0, rows };
+        job.tasks.push_back(task);
+        return;
+    }
+
+    // a couple of bands per thread, so one that is slow to decode does
+    // not hold up the rest
+    uint64_t intervals = restarts.size() + 1;
+    uint64_t bands = min<uint64_t>(intervals, 2 * threads);
+    uint64_t per_row = decoder.mcus_per_row();
+
+    // a band starts at the first whole MCU row of its first interval; the
+    // band before finishes any row the interval starts partway along
+    int first = 0;
+    for(uint64_t b = 1; b <= bands; b++)
+    {
+        uint64_t mcu = b * intervals / bands * decoder.restart_interval();
+        int end = b == bands ? rows :
+            (int)min<uint64_t>((mcu + per_row - 1) / per_row, rows);
+
+        if(end > first)
+        {
+            Task task = { index, first, end - first };
+            job.tasks.push_back(task);
+            first = end;
+        }
+    }
+
+    m_split++;
+}
+
+// hands out the next task of the oldest job. Call with m_mutex held.
+bool DecodePool::take(Job*& job, size_t& index)
+{
+    if(m_jobs.empty())
+        return false;
+
+    job = m_jobs.front();
+    index = job->next++;
+    if(job->next == job->tasks.size())
+        m_jobs.pop_front();
+    return true;
+}
+
+void DecodePool::finish(Job* job, size_t index, bool ok)
+{
+    bool last;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if(!ok)
+            job->failed[job->tasks[index].request] = 1;
+        last = (++job->done == job->tasks.size());
+    }
+
+    if(last)
+        m_done_cv.notify_all();
+}
+
+bool DecodePool::decode(DecodeRequest* requests, size_t count)
+{
+    if(count == 0)
+        return true;
+
+    Job job;
+    job.requests = requests;
+    job.restarts.resize(count);
+    job.failed.assign(count, 0);
+    job.pixels.assign(count, 0);
+    job.next = 0;
+    job.done = 0;
+
+    Worker worker(*this);
+    JpegDecoder planner;
+    for(size_t i = 0; i < count; i++)
+        plan(job, i, planner);
+
+    if(!job.tasks.empty())
+    {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_jobs.push_back(&job);
+        }
+
+        m_cv.notify_all();
+
+        // the caller works on its own job rather than sitting idle. Once
+        // all of it has been handed out, it only waits.
+        unique_lock<mutex> lock(m_mutex);
+        while(job.next < job.tasks.size())
+        {
+            size_t index = job.next++;
+            if(job.next == job.tasks.size())
+                m_jobs.erase(find(m_jobs.begin(), m_jobs.end(), &job));
+
+            lock.unlock();
+            bool ok = worker.run(job, job.tasks[index]);
+            lock.lock();
+
+            if(!ok)
+                job.failed[job.tasks[index].request] = 1;
+            job.done++;
+        }
+
+        while(job.done < job.tasks.size())
+            m_done_cv.wait(lock);
+    }
+
+    bool all_ok = true;
+    for(size_t i = 0; i < count; i++)
+    {
+        requests[i].ok = !job.failed[i];
+        if(!requests[i].ok)
+        {
+            all_ok = false;
+            m_failed++;
+            continue;
+        }
+
+        m_decoded++;
+        m_pixels += job.pixels[i];
+    }
+
+    return all_ok;
+}
+
+void DecodePool::thread_main()
+{
+    Worker worker(*this);
+
+    for(;;)
+    {
+        Job* job = NULL;
+        size_t index = 0;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            while(!m_should_quit && !take(job, index))
+                m_cv.wait(lock);
+
+            if(!job)
+                return;
+        }
+
+        bool ok = worker.run(*job, job->tasks[index]);
+        finish(job, index, ok);
+    }
+}
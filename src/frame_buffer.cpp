@@ -0,0 +1,137 @@
+#include "frame_buffer.h"
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+FrameBuffer::FrameBuffer() : m_data(NULL), m_size(0), m_capacity(0),
+    m_generation(0), m_huge_pages(false)
+{
+}
+
+FrameBuffer::~FrameBuffer()
+{
+    release(m_data, m_capacity);
+}
+
+static size_t query_page_size()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+size_t FrameBuffer::page_size()
+{
+    static const size_t cached = query_page_size();
+    return cached;
+}
+
+unsigned char* FrameBuffer::allocate(size_t& byte_count, bool huge)
+{
+    size_t page = page_size();
+    byte_count = (byte_count + page - 1) & ~(page - 1);
+
+#ifdef _WIN32
+    if(huge)
+    {
+        size_t large = GetLargePageMinimum();
+        if(large)
+        {
+            size_t rounded = (byte_count + large - 1) & ~(large - 1);
+            void* p = VirtualAlloc(NULL, rounded,
+                MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+            if(p)
+            {
+                byte_count = rounded;
+                return (unsigned char*)p;
+            }
+        }
+    }
+
+    void* p = VirtualAlloc(NULL, byte_count, MEM_RESERVE | MEM_COMMIT,
+        PAGE_READWRITE);
+    if(!p)
+        throw std::bad_alloc();
+    return (unsigned char*)p;
+#else
+    void* p = mmap(NULL, byte_count, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+        throw std::bad_alloc();
+
+  #ifdef MADV_HUGEPAGE
+    if(huge)
+        madvise(p, byte_count, MADV_HUGEPAGE);
+  #else
+    (void)huge;
+  #endif
+
+    return (unsigned char*)p;
+#endif
+}
+
+void FrameBuffer::release(unsigned char* p, size_t byte_count)
+{
+    if(!p)
+        return;
+
+#ifdef _WIN32
+    (void)byte_count;
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, byte_count);
+#endif
+}
+
+void FrameBuffer::reserve(size_t byte_count)
+{
+    if(byte_count <= m_capacity)
+        return;
+
+    size_t capacity = byte_count;
+    unsigned char* p = allocate(capacity, m_huge_pages);
+
+    if(m_size)
+        memcpy(p, m_data, m_size);
+
+    release(m_data, m_capacity);
+    m_data = p;
+    m_capacity = capacity;
+    m_generation++;
+}
+
+void FrameBuffer::resize(size_t byte_count)
+{
+    if(byte_count > m_capacity)
+    {
+        // frames from one camera vary a little in size; leave some headroom
+        // so a slightly larger frame does not cost another reallocation
+        reserve(byte_count + byte_count / 8);
+    }
+
+    m_size = byte_count;
+}
+
+void FrameBuffer::prefault()
+{
+    size_t page = page_size();
+
+    // a write (not a read) is needed; reading a fresh anonymous page may
+    // just map the shared zero page
+    volatile unsigned char* p = m_data;
+    for(size_t i = 0; i < m_capacity; i += page)
+        p[i] = 0;
+}
+
@@ -0,0 +1,296 @@
+#include "frame_hash.h"
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// as in jpeg_scan.cpp: no AVX2 from GCC on Windows (GCC bug 54412)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !(defined(_WIN32) && !defined(__clang__))
+#define FRAME_HASH_AVX2 1
+#include <immintrin.h>
+#endif
+
+// the data is taken a stripe at a time, one 64-bit word per lane, and the
+// lanes are scrambled after every block of stripes. Stripe s of a block
+// uses keys [s, s + LANES); the scramble uses the last LANES of them.
+static const size_t LANES = 8;
+static const size_t STRIPE = 8 * LANES;
+static const size_t BLOCK_STRIPES = 16;
+static const size_t BLOCK = STRIPE * BLOCK_STRIPES;
+static const size_t KEY_COUNT = BLOCK_STRIPES + LANES;
+
+static const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+static const uint64_t PRIME32_2 = 0x85EBCA77ULL;
+static const uint64_t PRIME32_3 = 0xC2B2AE3DULL;
+static const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME64_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME64_5 = 0x27D4EB2F165667C5ULL;
+
+struct HashKeys
+{
+    uint64_t k[KEY_COUNT];
+};
+
+// splitmix64 from a fixed seed; any well mixed constants would do, but
+// they must never change, or stored hashes stop matching
+static HashKeys make_keys()
+{
+    HashKeys keys;
+    uint64_t x = PRIME64_1;
+    for(size_t i = 0; i < KEY_COUNT; i++)
+    {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        keys.k[i] = z ^ (z >> 31);
+    }
+    return keys;
+}
+
+static const uint64_t* hash_keys()
+{
+    static const HashKeys keys = make_keys();
+    return keys.k;
+}
+
+// === Scalar ===
+
+static inline uint64_t load64(const unsigned char* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+// each lane gets the low half of its keyed word times the high half, and
+// its neighbour's word as it was
+static void accumulate_scalar(uint64_t* acc, const unsigned char* p,
+    size_t stripes, const uint64_t* key)
+{
+    for(size_t s = 0; s < stripes; s++, p += STRIPE)
+    {
+        for(size_t j = 0; j < LANES; j++)
+        {
+            uint64_t w = load64(p + 8 * j);
+            uint64_t x = w ^ key[s + j];
+            acc[j] += (x & 0xFFFFFFFF) * (x >> 32);
+            acc[j ^ 1] += w;
+        }
+    }
+}
+
+static void scramble_scalar(uint64_t* acc, const uint64_t* key)
+{
+    for(size_t j = 0; j < LANES; j++)
+    {
+        uint64_t a = acc[j];
+        a ^= a >> 47;
+        a ^= key[j];
+        acc[j] = a * PRIME32_1;
+    }
+}
+
+// === SSE2 ===
+
+#ifdef __SSE2__
+static void accumulate_sse2(uint64_t* acc, const unsigned char* p,
+    size_t stripes, const uint64_t* key)
+{
+    __m128i a[LANES / 2];
+    for(size_t l = 0; l < LANES / 2; l++)
+        a[l] = _mm_loadu_si128((const __m128i*)(acc + 2 * l));
+
+    for(size_t s = 0; s < stripes; s++, p += STRIPE)
+    {
+        for(size_t l = 0; l < LANES / 2; l++)
+        {
+            __m128i w = _mm_loadu_si128((const __m128i*)(p + 16 * l));
+            __m128i x = _mm_xor_si128(w,
+                _mm_loadu_si128((const __m128i*)(key + s + 2 * l)));
+            __m128i product = _mm_mul_epu32(x,
+                _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 3, 0, 1)));
+            __m128i swapped = _mm_shuffle_epi32(w, _MM_SHUFFLE(1, 0, 3, 2));
+            a[l] = _mm_add_epi64(a[l], _mm_add_epi64(product, swapped));
+        }
+    }
+
+    for(size_t l = 0; l < LANES / 2; l++)
+        _mm_storeu_si128((__m128i*)(acc + 2 * l), a[l]);
+}
+
+// a 64 by 32-bit multiply is the low halves' product plus the high
+// halves' moved up, each a 32 by 32 multiply
+static void scramble_sse2(uint64_t* acc, const uint64_t* key)
+{
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+
+    for(size_t l = 0; l < LANES / 2; l++)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(acc + 2 * l));
+        a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+        a = _mm_xor_si128(a,
+            _mm_loadu_si128((const __m128i*)(key + 2 * l)));
+
+        __m128i low = _mm_mul_epu32(a, prime);
+        __m128i high = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+        a = _mm_add_epi64(low, _mm_slli_epi64(high, 32));
+        _mm_storeu_si128((__m128i*)(acc + 2 * l), a);
+    }
+}
+#endif
+
+// === AVX2 ===
+
+#ifdef FRAME_HASH_AVX2
+__attribute__((target("avx2")))
+static void accumulate_avx2(uint64_t* acc, const unsigned char* p,
+    size_t stripes, const uint64_t* key)
+{
+    __m256i a0 = _mm256_loadu_si256((const __m256i*)acc);
+    __m256i a1 = _mm256_loadu_si256((const __m256i*)(acc + 4));
+
+    for(size_t s = 0; s < stripes; s++, p += STRIPE)
+    {
+        __m256i w0 = _mm256_loadu_si256((const __m256i*)p);
+        __m256i w1 = _mm256_loadu_si256((const __m256i*)(p + 32));
+        __m256i x0 = _mm256_xor_si256(w0,
+            _mm256_loadu_si256((const __m256i*)(key + s)));
+        __m256i x1 = _mm256_xor_si256(w1,
+            _mm256_loadu_si256((const __m256i*)(key + s + 4)));
+
+        __m256i p0 = _mm256_mul_epu32(x0,
+            _mm256_shuffle_epi32(x0, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i p1 = _mm256_mul_epu32(x1,
+            _mm256_shuffle_epi32(x1, _MM_SHUFFLE(0, 3, 0, 1)));
+
+        a0 = _mm256_add_epi64(a0, _mm256_add_epi64(p0,
+            _mm256_shuffle_epi32(w0, _MM_SHUFFLE(1, 0, 3, 2))));
+        a1 = _mm256_add_epi64(a1, _mm256_add_epi64(p1,
+            _mm256_shuffle_epi32(w1, _MM_SHUFFLE(1, 0, 3, 2))));
+    }
+
+    _mm256_storeu_si256((__m256i*)acc, a0);
+    _mm256_storeu_si256((__m256i*)(acc + 4), a1);
+}
+#endif
+
+// === Selection ===
+
+typedef void (*Accumulate)(uint64_t* acc, const unsigned char* p,
+    size_t stripes, const uint64_t* key);
+typedef void (*Scramble)(uint64_t* acc, const uint64_t* key);
+
+struct HashImpl
+{
+    Accumulate accumulate;
+    Scramble scramble;
+    const char* name;
+};
+
+static const HashImpl scalar_impl =
+{
+    accumulate_scalar, scramble_scalar, "scalar"
+};
+
+static HashImpl pick_impl()
+{
+    HashImpl impl = scalar_impl;
+
+#ifdef __SSE2__
+    impl.accumulate = accumulate_sse2;
+    impl.scramble = scramble_sse2;
+    impl.name = "sse2";
+#endif
+
+#ifdef FRAME_HASH_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        // the scramble only runs once a KiB; SSE2 is plenty for it
+        impl.accumulate = accumulate_avx2;
+        impl.name = "avx2";
+    }
+#endif
+
+    return impl;
+}
+
+static const HashImpl& hash_impl()
+{
+    static const HashImpl impl = pick_impl();
+    return impl;
+}
+
+static inline uint64_t rotl64(uint64_t x, unsigned r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static uint64_t hash_with(const HashImpl& impl, const void* data,
+    size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const uint64_t* key = hash_keys();
+
+    uint64_t acc[LANES] =
+    {
+        PRIME32_3, PRIME64_1, PRIME64_2, PRIME64_3,
+        PRIME64_4, PRIME32_2, PRIME64_5, PRIME32_1
+    };
+
+    size_t blocks = size / BLOCK;
+    for(size_t b = 0; b < blocks; b++, p += BLOCK)
+    {
+        impl.accumulate(acc, p, BLOCK_STRIPES, key);
+        impl.scramble(acc, key + BLOCK_STRIPES);
+    }
+
+    // what is left is less than a block: whole stripes, and then the last
+    // few bytes padded out with zeros. The size, mixed in below, tells a
+    // frame that ends in zeros from a shorter one.
+    size_t rest = size - blocks * BLOCK;
+    size_t stripes = rest / STRIPE;
+    impl.accumulate(acc, p, stripes, key);
+
+    if(rest % STRIPE)
+    {
+        unsigned char last[STRIPE] = { 0 };
+        memcpy(last, p + stripes * STRIPE, rest % STRIPE);
+        impl.accumulate(acc, last, 1, key + stripes);
+    }
+
+    uint64_t h = (uint64_t)size * PRIME64_1;
+    for(size_t j = 0; j < LANES; j++)
+        h = rotl64(h ^ avalanche(acc[j]), 27) * PRIME64_1 + PRIME64_4;
+
+    return avalanche(h);
+}
+
+uint64_t frame_hash(const void* data, size_t size)
+{
+    return hash_with(hash_impl(), data, size);
+}
+
+uint64_t frame_hash_scalar(const void* data, size_t size)
+{
+    return hash_with(scalar_impl, data, size);
+}
+
+const char* frame_hash_isa()
+{
+    return hash_impl().name;
+}
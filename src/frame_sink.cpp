@@ -0,0 +1,147 @@
+#include "frame_sink.h"
+#include "jpeg_dht.h"
+using namespace std;
+
+bool StreamSink::open(const std::string& path, unsigned flags)
+{
+    return m_file.open(path, flags);
+}
+
+bool StreamSink::write_frames(const FrameInfo* frames, size_t count)
+{
+    m_slices.clear();
+
+    for(size_t i = 0; i < count; i++)
+    {
+        IoSlice s = { frames[i].data, frames[i].size, frames[i].fixed };
+        m_slices.push_back(s);
+    }
+
+    if(m_slices.empty())
+        return true;
+
+    return m_file.write_gather(&m_slices[0], m_slices.size());
+}
+
+void StreamSink::close()
+{
+    m_file.close();
+}
+
+// === JpegDirSink ===
+
+static const int NAME_DIGITS = 8;
+static const int64_t MINUTE_US = 60000000;
+
+JpegDirSink::JpegDirSink(bool keep_for_sync) :
+    m_keep(keep_for_sync), m_open(false), m_flags(0), m_digits(0),
+    m_numbered(false), m_next(0), m_bytes_written(0), m_write_calls(0)
+{
+}
+
+JpegDirSink::~JpegDirSink()
+{
+    close();
+}
+
+bool JpegDirSink::open(const std::string& path, unsigned flags)
+{
+    close();
+
+    m_path = path + "/";
+    m_digits = m_path.size();
+    m_path.append(NAME_DIGITS, '0');
+    m_path += extension();
+
+    m_flags = (flags & OutputFile::OPEN_DIRECT) | OutputFile::OPEN_TRUNCATE;
+    m_numbered = false;
+    m_next = 0;
+    m_bytes_written = 0;
+    m_write_calls = 0;
+    m_open = true;
+    return true;
+}
+
+// closes a written file, syncing it first if asked, and counts its writes
+bool JpegDirSink::finish(OutputFile& file, bool sync)
+{
+    bool ok = !sync || file.sync();
+    file.close();
+    m_write_calls += file.write_calls();
+    return ok;
+}
+
+bool JpegDirSink::write_frames(const FrameInfo* frames, size_t count)
+{
+    if(!m_open)
+        return false;
+
+    bool ok = true;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const FrameInfo& f = frames[i];
+
+        if(!m_numbered)
+        {
+            int64_t in_minute = f.time_us % MINUTE_US;
+            if(in_minute < 0)
+                in_minute += MINUTE_US;
+            m_next = (uint64_t)(in_minute / 1000) * 1000;
+            m_numbered = true;
+        }
+
+        uint64_t n = m_next++;
+        for(int d = NAME_DIGITS - 1; d >= 0; d--)
+        {
+            m_path[m_digits + d] = (char)('0' + n % 10);
+            n /= 10;
+        }
+
+        unique_ptr<OutputFile> file(new OutputFile());
+        if(!file->open(m_path, m_flags))
+        {
+            ok = false;
+            continue;
+        }
+
+        IoSlice slices[3];
+        size_t pieces = jpeg_standalone_slices(f.data, f.size, f.fixed,
+            slices);
+        if(!file->write_gather(slices, pieces))
+            ok = false;
+        m_bytes_written += f.size;
+
+        if(!m_keep)
+        {
+            ok = finish(*file, false) && ok;
+            continue;
+        }
+
+        if(m_unsynced.size() >= MAX_UNSYNCED)
+        {
+            ok = finish(*m_unsynced.front(), true) && ok;
+            m_unsynced.erase(m_unsynced.begin());
+        }
+        m_unsynced.push_back(std::move(file));
+    }
+
+    return ok;
+}
+
+bool JpegDirSink::sync()
+{
+    bool ok = true;
+    for(size_t i = 0; i < m_unsynced.size(); i++)
+        ok = finish(*m_unsynced[i], true) && ok;
+    m_unsynced.clear();
+    return ok;
+}
+
+void JpegDirSink::close()
+{
+    for(size_t i = 0; i < m_unsynced.size(); i++)
+        finish(*m_unsynced[i], false);
+    m_unsynced.clear();
+    m_open = false;
+}
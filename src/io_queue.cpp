@@ -0,0 +1,416 @@
+#include "io_queue.h"
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+
+using namespace std;
+
+// largest single write; an sqe length is 32 bits
+static const size_t MAX_WRITE = 1u << 30;
+
+static thread_local IoQueue* t_current = NULL;
+
+IoQueue* IoQueue::current()
+{
+    return t_current;
+}
+
+void IoQueue::set_current(IoQueue* queue)
+{
+    t_current = queue;
+}
+
+IoQueue::IoQueue() : m_fd(-1), m_depth(0), m_registered(0),
+    m_enter_calls(0), m_queued_bytes(0), m_fixed_bytes(0), m_failed(false),
+    m_sq_map(NULL), m_sq_map_size(0),
+    m_cq_map(NULL), m_cq_map_size(0), m_sqes(NULL), m_sqes_size(0),
+    m_sq_head(NULL), m_sq_tail(NULL), m_sq_mask(NULL), m_sq_array(NULL),
+    m_cq_head(NULL), m_cq_tail(NULL), m_cq_mask(NULL), m_cqes(NULL),
+    m_unsubmitted(0)
+{
+}
+
+IoQueue::~IoQueue()
+{
+    if(ready())
+        wait_all();
+
+    teardown();
+}
+
+bool IoQueue::ready() const
+{
+    return m_fd >= 0;
+}
+
+#ifdef HAVE_IO_URING
+
+static_assert(sizeof(struct iovec) == sizeof(void*) + sizeof(size_t),
+    "Request::iov_base/iov_len must look like a struct iovec");
+
+bool IoQueue::init(unsigned depth)
+{
+    teardown();
+
+    if(depth == 0)
+        depth = 1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    int fd = (int)syscall(__NR_io_uring_setup, depth, &p);
+    if(fd < 0)
+        return false;
+
+    m_fd = fd;
+
+    m_sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // newer kernels put both rings in one mapping
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(m_cq_map_size > m_sq_map_size)
+            m_sq_map_size = m_cq_map_size;
+        m_cq_map_size = m_sq_map_size;
+    }
+
+    m_sq_map = mmap(NULL, m_sq_map_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(m_sq_map == MAP_FAILED)
+    {
+        m_sq_map = NULL;
+        teardown();
+        return false;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        m_cq_map = m_sq_map;
+    }
+    else
+    {
+        m_cq_map = mmap(NULL, m_cq_map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(m_cq_map == MAP_FAILED)
+        {
+            m_cq_map = NULL;
+            teardown();
+            return false;
+        }
+    }
+
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(m_sqes == MAP_FAILED)
+    {
+        m_sqes = NULL;
+        teardown();
+        return false;
+    }
+
+    char* sq = (char*)m_sq_map;
+    m_sq_head = (unsigned*)(sq + p.sq_off.head);
+    m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    m_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    m_sq_array = (unsigned*)(sq + p.sq_off.array);
+
+    char* cq = (char*)m_cq_map;
+    m_cq_head = (unsigned*)(cq + p.cq_off.head);
+    m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    m_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    m_cqes = cq + p.cq_off.cqes;
+
+    // never more in flight than the submission ring holds, so a
+    // resubmitted short write always finds room
+    m_depth = (depth < p.sq_entries) ? depth : p.sq_entries;
+    m_requests.assign(m_depth, Request());
+    m_free.clear();
+    for(unsigned i = 0; i < m_depth; i++)
+        m_free.push_back(m_depth - 1 - i);
+
+    m_unsubmitted = 0;
+    m_failed = false;
+    return true;
+}
+
+void IoQueue::teardown()
+{
+    if(m_sqes)
+        munmap(m_sqes, m_sqes_size);
+    if(m_cq_map && m_cq_map != m_sq_map)
+        munmap(m_cq_map, m_cq_map_size);
+    if(m_sq_map)
+        munmap(m_sq_map, m_sq_map_size);
+
+    m_sqes = NULL;
+    m_cq_map = NULL;
+    m_sq_map = NULL;
+
+    if(m_fd >= 0)
+        ::close(m_fd);
+
+    m_fd = -1;
+    m_registered = 0;
+    m_requests.clear();
+    m_free.clear();
+}
+
+bool IoQueue::register_buffers(const IoSlice* buffers, size_t count)
+{
+    if(!ready())
+        return false;
+
+    if(m_registered)
+    {
+        syscall(__NR_io_uring_register, m_fd, IORING_UNREGISTER_BUFFERS,
+            NULL, 0);
+        m_registered = 0;
+    }
+
+    if(count == 0)
+        return true;
+
+    vector<struct iovec> iov(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        iov[i].iov_base = (void*)buffers[i].data;
+        iov[i].iov_len = buffers[i].size;
+    }
+
+    if(syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS,
+        &iov[0], (unsigned)count) != 0)
+    {
+        return false;
+    }
+
+    m_registered = count;
+    return true;
+}
+
+// puts a request on the submission ring; the kernel sees it at the next
+// enter()
+bool IoQueue::push(unsigned slot)
+{
+    Request& r = m_requests[slot];
+
+    unsigned tail = *m_sq_tail;
+    unsigned index = tail & *m_sq_mask;
+
+    struct io_uring_sqe* sqe = (struct io_uring_sqe*)m_sqes + index;
+    memset(sqe, 0, sizeof *sqe);
+    sqe->fd = r.fd;
+    sqe->off = r.offset;
+    sqe->user_data = slot;
+
+    if(r.fixed && r.fixed <= m_registered)
+    {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = (uintptr_t)r.data;
+        sqe->len = (unsigned)r.size;
+        sqe->buf_index = (uint16_t)(r.fixed - 1);
+    }
+    else
+    {
+        r.iov_base = (void*)r.data;
+        r.iov_len = r.size;
+
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = (uintptr_t)&r.iov_base;
+        sqe->len = 1;
+    }
+
+    m_sq_array[index] = index;
+
+    // the kernel must see the sqe before the new tail
+    __atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    m_unsubmitted++;
+    return true;
+}
+
+bool IoQueue::enter(unsigned min_complete)
+{
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    m_enter_calls++;
+    int submitted = (int)syscall(__NR_io_uring_enter, m_fd, m_unsubmitted,
+        min_complete, flags, NULL, 0);
+
+    if(submitted < 0)
+    {
+        // interrupted or short of resources; the caller just goes round
+        // again
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            return true;
+
+        fprintf(stderr, "ERROR: io_uring_enter failed: %s\n",
+            strerror(errno));
+        return false;
+    }
+
+    m_unsubmitted -= (unsigned)submitted;
+    return true;
+}
+
+// handles every completion that has arrived
+void IoQueue::reap()
+{
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)m_cqes;
+    unsigned head = *m_cq_head;
+
+    while(head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe& cqe = cqes[head & *m_cq_mask];
+        unsigned slot = (unsigned)cqe.user_data;
+        int res = cqe.res;
+        head++;
+
+        Request& r = m_requests[slot];
+
+        if(res == -EINTR || res == -EAGAIN)
+        {
+            push(slot);
+            continue;
+        }
+
+        if(res <= 0)
+        {
+            fprintf(stderr, "ERROR: Queued write failed: %s\n",
+                res < 0 ? strerror(-res) : "no progress");
+            m_failed = true;
+            m_free.push_back(slot);
+            continue;
+        }
+
+        if((size_t)res < r.size)
+        {
+            // short write; send the rest from where it stopped
+            r.data += res;
+            r.size -= res;
+            r.offset += res;
+            push(slot);
+            continue;
+        }
+
+        m_free.push_back(slot);
+    }
+
+    __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+}
+
+bool IoQueue::write(int fd, const void* data, size_t size, uint64_t offset,
+    unsigned fixed)
+{
+    const unsigned char* p = (const unsigned char*)data;
+
+    m_queued_bytes += size;
+    if(fixed)
+        m_fixed_bytes += size;
+
+    while(size > 0)
+    {
+        while(m_free.empty())
+        {
+            if(!enter(1))
+            {
+                teardown();
+                return false;
+            }
+            reap();
+        }
+
+        size_t chunk = (size > MAX_WRITE) ? MAX_WRITE : size;
+
+        unsigned slot = m_free.back();
+        m_free.pop_back();
+
+        Request& r = m_requests[slot];
+        r.fd = fd;
+        r.data = p;
+        r.size = chunk;
+        r.offset = offset;
+        r.fixed = fixed;
+        push(slot);
+
+        p += chunk;
+        size -= chunk;
+        offset += chunk;
+    }
+
+    return true;
+}
+
+bool IoQueue::wait_all()
+{
+    if(!ready())
+        return false;
+
+    while(m_free.size() < m_depth)
+    {
+        if(!enter(1))
+        {
+            teardown();
+            return false;
+        }
+        reap();
+    }
+
+    bool ok = !m_failed;
+    m_failed = false;
+    return ok;
+}
+
+#else // no io_uring
+
+bool IoQueue::init(unsigned)
+{
+    return false;
+}
+
+void IoQueue::teardown()
+{
+}
+
+bool IoQueue::register_buffers(const IoSlice*, size_t)
+{
+    return false;
+}
+
+bool IoQueue::push(unsigned)
+{
+    return false;
+}
+
+bool IoQueue::enter(unsigned)
+{
+    return false;
+}
+
+void IoQueue::reap()
+{
+}
+
+bool IoQueue::write(int, const void*, size_t, uint64_t, unsigned)
+{
+    return false;
+}
+
+bool IoQueue::wait_all()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,1076 @@
+#include "jpeg_decoder.h"
+#include "jpeg_scan.h"
+#include "jpeg_dht.h"
+#include <cstring>
+using namespace std;
+
+static inline unsigned char clamp_sample(int x)
+{
+    return x < 0 ? 0 : (x > 255 ? 255 : (unsigned char)x);
+}
+
+// natural position of each coefficient in zigzag order
+static const unsigned char ZIGZAG[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+static bool valid_scale(int scale)
+{
+    return scale == 1 || scale == 2 || scale == 4 || scale == 8;
+}
+
+// === BitReader ===
+
+void JpegDecoder::BitReader::reset(const unsigned char* from,
+    const unsigned char* to)
+{
+    p = from;
+    end = to;
+    bits = 0;
+    count = 0;
+    at_marker = false;
+}
+
+// tops the buffer up to at least 57 bits. bits holds count valid bits at
+// its top end.
+void JpegDecoder::BitReader::fill()
+{
+    while(count <= 56)
+    {
+        unsigned b = 0;
+        if(!at_marker && p < end)
+        {
+            b = *p;
+            if(b != 0xFF)
+            {
+                p++;
+            }
+            else if(p + 1 < end && p[1] == 0x00)
+            {
+                p += 2;
+            }
+            else
+            {
+                at_marker = true;
+                b = 0;
+            }
+        }
+
+        bits |= (uint64_t)b << (56 - count);
+        count += 8;
+    }
+}
+
+// === JpegDecoder ===
+
+JpegDecoder::JpegDecoder() :
+    m_error(NULL), m_data(NULL), m_size(0), m_width(0), m_height(0),
+    m_component_count(0), m_hmax(1), m_vmax(1), m_mcus_x(0), m_mcus_y(0),
+    m_progressive(false), m_rgb(false), m_restart_interval(0),
+    m_scan_count(0), m_ss(0), m_se(63), m_ah(0), m_al(0), m_scan_start(0),
+    m_kernels(&jpeg_kernels())
+{
+    memset(m_components, 0, sizeof m_components);
+    memset(m_quant, 0, sizeof m_quant);
+    memset(m_dc_tables, 0, sizeof m_dc_tables);
+    memset(m_ac_tables, 0, sizeof m_ac_tables);
+    memset(&m_bits, 0, sizeof m_bits);
+}
+
+bool JpegDecoder::fail(const char* why)
+{
+    m_error = why;
+    return false;
+}
+
+void JpegDecoder::build_table(HuffmanTable& t, const unsigned char* counts,
+    const unsigned char* values)
+{
+    memset(&t, 0, sizeof t);
+    t.defined = true;
+
+    int total = 0;
+    for(int i = 0; i < 16; i++)
+        total += counts[i];
+    memcpy(t.values, values, total > 256 ? 256 : total);
+
+    int code = 0;
+    int k = 0;
+    for(int len = 1; len <= 16; len++)
+    {
+        t.valptr[len] = k;
+        t.mincode[len] = code;
+
+        for(int i = 0; i < counts[len - 1] && k < 256; i++, k++)
+        {
+            if(len <= FAST_BITS)
+            {
+                // every FAST_BITS-bit value that starts with this code
+                int shift = FAST_BITS - len;
+                int first = code << shift;
+                int run = values[k] >> 4;
+                int size = values[k] & 15;
+                int skip = (len + size) << 8 |
+                    (size ? run + 1 : (run == 15 ? 16 : 64));
+
+                for(int j = 0; j < (1 << shift); j++)
+                {
+                    t.fast[first + j] = (uint16_t)(len << 8 | values[k]);
+                    t.skip[first + j] = (uint16_t)skip;
+                }
+            }
+            code++;
+        }
+
+        t.maxcode[len] = counts[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    // sentinel so the slow path always stops
+    t.maxcode[17] = 0x7FFFFFFF;
+}
+
+bool JpegDecoder::parse_dqt(const unsigned char* p, size_t length)
+{
+    while(length > 0)
+    {
+        int precision = p[0] >> 4;
+        int id = p[0] & 15;
+        size_t bytes = 1 + 64 * (precision ? 2 : 1);
+        if(id > 3 || bytes > length)
+            return fail("bad DQT");
+
+        // stored in zigzag order, which is also the order the
+        // coefficients are decoded in, so it is kept that way
+        for(int i = 0; i < 64; i++)
+        {
+            m_quant[id][i] = precision ?
+                (uint16_t)(p[1 + 2 * i] << 8 | p[2 + 2 * i]) : p[1 + i];
+        }
+
+        p += bytes;
+        length -= bytes;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::parse_dht(const unsigned char* p, size_t length)
+{
+    while(length > 0)
+    {
+        if(length < 17)
+            return fail("bad DHT");
+
+        int tc = p[0] >> 4;
+        int th = p[0] & 15;
+
+        // the codes of each length must fit in what the shorter ones left
+        size_t total = 0;
+        int codes = 0;
+        for(int i = 0; i < 16; i++)
+        {
+            total += p[1 + i];
+            codes = (codes << 1) + p[1 + i];
+            if(codes > 2 << i)
+                return fail("bad DHT");
+        }
+
+        if(tc > 1 || th > 3 || total > 256 || 17 + total > length)
+            return fail("bad DHT");
+
+        build_table(tc ? m_ac_tables[th] : m_dc_tables[th], p + 1, p + 17);
+
+        p += 17 + total;
+        length -= 17 + total;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::parse_sof(const unsigned char* p, size_t length,
+    unsigned char m)
+{
+    if(m != 0xC0 && m != 0xC1 && m != 0xC2)
+        return fail("not a Huffman-coded DCT frame");
+    if(length < 6 || p[0] != 8)
+        return fail("not an 8-bit frame");
+
+    m_progressive = (m == 0xC2);
+    m_height = p[1] << 8 | p[2];
+    m_width = p[3] << 8 | p[4];
+    m_component_count = p[5];
+
+    if(m_width == 0 || m_height == 0)
+        return fail("no size in frame header (DNL is not handled)");
+    if(m_component_count < 1 || m_component_count > 4 ||
+       length < 6 + 3 * (size_t)m_component_count)
+    {
+        return fail("bad frame header");
+    }
+
+    m_hmax = 1;
+    m_vmax = 1;
+    for(int i = 0; i < m_component_count; i++)
+    {
+        Component& c = m_components[i];
+        c.id = p[6 + 3 * i];
+        c.h = p[7 + 3 * i] >> 4;
+        c.v = p[7 + 3 * i] & 15;
+        c.tq = p[8 + 3 * i];
+
+        if(c.h < 1 || c.h > 4 || c.v < 1 || c.v > 4 || c.tq > 3)
+            return fail("bad component in frame header");
+
+        if(c.h > m_hmax)
+            m_hmax = c.h;
+        if(c.v > m_vmax)
+            m_vmax = c.v;
+    }
+
+    // a lone component is coded block by block whatever its sampling
+    // factors say (JPEG spec A.2.2), which is the same as 1x1
+    if(m_component_count == 1)
+    {
+        m_components[0].h = 1;
+        m_components[0].v = 1;
+        m_hmax = 1;
+        m_vmax = 1;
+    }
+
+    m_mcus_x = (m_width + 8 * m_hmax - 1) / (8 * m_hmax);
+    m_mcus_y = (m_height + 8 * m_vmax - 1) / (8 * m_vmax);
+
+    for(int i = 0; i < m_component_count; i++)
+    {
+        Component& c = m_components[i];
+        c.blocks_w = m_mcus_x * c.h;
+        c.blocks_h = m_mcus_y * c.v;
+    }
+
+    return true;
+}
+
+bool JpegDecoder::parse_sos(const unsigned char* p, size_t length)
+{
+    if(m_component_count == 0)
+        return fail("scan before frame header");
+    if(length < 1)
+        return fail("bad scan header");
+
+    m_scan_count = p[0];
+    if(m_scan_count < 1 || m_scan_count > 4 ||
+       length < 4 + 2 * (size_t)m_scan_count)
+    {
+        return fail("bad scan header");
+    }
+
+    for(int i = 0; i < m_scan_count; i++)
+    {
+        int id = p[1 + 2 * i];
+        int k = 0;
+        while(k < m_component_count && m_components[k].id != id)
+            k++;
+        if(k == m_component_count)
+            return fail("scan names an unknown component");
+
+        m_scan[i] = k;
+        m_components[k].td = p[2 + 2 * i] >> 4;
+        m_components[k].ta = p[2 + 2 * i] & 15;
+        if(m_components[k].td > 3 || m_components[k].ta > 3)
+            return fail("bad scan header");
+    }
+
+    const unsigned char* q = p + 1 + 2 * m_scan_count;
+    m_ss = q[0];
+    m_se = q[1];
+    m_ah = q[2] >> 4;
+    m_al = q[2] & 15;
+    return true;
+}
+
+JpegDecoder::DefaultTables::DefaultTables()
+{
+    JpegDecoder d;
+    d.parse_dht(JPEG_DEFAULT_DHT + 4, JPEG_DEFAULT_DHT_SIZE - 4);
+    for(int i = 0; i < 2; i++)
+    {
+        dc[i] = d.m_dc_tables[i];
+        ac[i] = d.m_ac_tables[i];
+    }
+}
+
+bool JpegDecoder::parse(const unsigned char* data, size_t size)
+{
+    m_error = NULL;
+    m_data = data;
+    m_size = size;
+    m_component_count = 0;
+    m_restart_interval = 0;
+    m_rgb = false;
+
+    for(int i = 0; i < 4; i++)
+    {
+        m_dc_tables[i].defined = false;
+        m_ac_tables[i].defined = false;
+    }
+
+    bool adobe = false;
+    int adobe_transform = 1;
+
+    if(size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return fail("no SOI");
+
+    size_t pos = 2;
+    for(;;)
+    {
+        if(pos >= size || data[pos] != 0xFF)
+            return fail("no marker where one should be");
+        while(pos < size && data[pos] == 0xFF)
+            pos++;
+        if(pos >= size)
+            return fail("truncated");
+
+        unsigned char m = data[pos++];
+        if(m == 0xD8 || m == 0xD9 || m == 0x01 || (m >= 0xD0 && m <= 0xD7))
+            return fail("no scan");
+
+        if(pos + 2 > size)
+            return fail("truncated");
+        size_t length = (size_t)data[pos] << 8 | data[pos + 1];
+        if(length < 2 || pos + length > size)
+            return fail("truncated");
+
+        const unsigned char* p = data + pos + 2;
+        size_t n = length - 2;
+        pos += length;
+
+        bool ok = true;
+        switch(m)
+        {
+        case 0xDB:
+            ok = parse_dqt(p, n);
+            break;
+        case 0xC4:
+            ok = parse_dht(p, n);
+            break;
+        case 0xC0:
+        case 0xC1:
+        case 0xC2:
+        case 0xC3:
+        case 0xC5:
+        case 0xC6:
+        case 0xC7:
+        case 0xC9:
+        case 0xCA:
+        case 0xCB:
+        case 0xCD:
+        case 0xCE:
+        case 0xCF:
+            ok = parse_sof(p, n, m);
+            break;
+        case 0xDD:
+            if(n < 2)
+                return fail("bad DRI");
+            m_restart_interval = p[0] << 8 | p[1];
+            break;
+        case 0xEE:
+            if(n >= 12 && memcmp(p, "Adobe", 5) == 0)
+            {
+                adobe = true;
+                adobe_transform = p[11];
+            }
+            break;
+        case 0xDA:
+            if(!parse_sos(p, n))
+                return false;
+            m_scan_start = pos;
+            break;
+        default:
+            break;
+        }
+
+        if(!ok)
+            return false;
+        if(m == 0xDA)
+            break;
+    }
+
+    // the standard tables stand in for any the camera left out
+    static const DefaultTables defaults;
+    for(int i = 0; i < 2; i++)
+    {
+        if(!m_dc_tables[i].defined)
+            m_dc_tables[i] = defaults.dc[i];
+        if(!m_ac_tables[i].defined)
+            m_ac_tables[i] = defaults.ac[i];
+    }
+
+    if(m_component_count == 3)
+    {
+        // Adobe says outright; otherwise component ids R, G, B are the
+        // only sign of an RGB frame
+        if(adobe)
+            m_rgb = (adobe_transform == 0);
+        else
+            m_rgb = (m_components[0].id == 'R' && m_components[1].id == 'G'
+                && m_components[2].id == 'B');
+    }
+    else if(m_component_count == 4)
+    {
+        return fail("CMYK frames are not handled");
+    }
+
+    return true;
+}
+
+inline int JpegDecoder::decode_symbol(const HuffmanTable& t)
+{
+    if(m_bits.count < 32)
+        m_bits.fill();
+
+    unsigned look = (unsigned)(m_bits.bits >> (64 - FAST_BITS));
+    unsigned e = t.fast[look];
+    if(e)
+    {
+        int len = e >> 8;
+        m_bits.bits <<= len;
+        m_bits.count -= len;
+        return e & 255;
+    }
+
+    for(int len = FAST_BITS + 1; len <= 16; len++)
+    {
+        int32_t code = (int32_t)(m_bits.bits >> (64 - len));
+        if(code <= t.maxcode[len])
+        {
+            m_bits.bits <<= len;
+            m_bits.count -= len;
+            return t.values[(t.valptr[len] + code - t.mincode[len]) & 255];
+        }
+    }
+
+    return -1;
+}
+
+// the next s bits as a signed coefficient value (JPEG spec F.2.2.1)
+inline int JpegDecoder::receive_extend(int s)
+{
+    if(s == 0)
+        return 0;
+    if(m_bits.count < s)
+        m_bits.fill();
+
+    int v = (int)(m_bits.bits >> (64 - s));
+    m_bits.bits <<= s;
+    m_bits.count -= s;
+
+    return v < (1 << (s - 1)) ? v - (1 << s) + 1 : v;
+}
+
+inline void JpegDecoder::skip_bits(int s)
+{
+    if(m_bits.count < s)
+        m_bits.fill();
+    m_bits.bits <<= s;
+    m_bits.count -= s;
+}
+
+// steps over a block's AC coefficients without working out their values
+bool JpegDecoder::skip_ac(const HuffmanTable& t)
+{
+    for(int k = 1; k < 64; )
+    {
+        if(m_bits.count < 32)
+            m_bits.fill();
+
+        unsigned e = t.skip[m_bits.bits >> (64 - FAST_BITS)];
+        if(e)
+        {
+            m_bits.bits <<= e >> 8;
+            m_bits.count -= e >> 8;
+            k += e & 255;
+            continue;
+        }
+
+        int rs = decode_symbol(t);
+        if(rs < 0)
+            return false;
+
+        int run = rs >> 4;
+        int size = rs & 15;
+        if(size == 0)
+        {
+            if(run != 15)
+                break;
+            k += 16;
+            continue;
+        }
+
+        skip_bits(size);
+        k += run + 1;
+    }
+
+    return true;
+}
+
+// moves past the next RSTn marker and starts the predictions again
+bool JpegDecoder::restart()
+{
+    const unsigned char* p = m_bits.p;
+    const unsigned char* end = m_bits.end;
+
+    while(p + 1 < end && !(p[0] == 0xFF && p[1] >= 0xD0 && p[1] <= 0xD7))
+        p++;
+    if(p + 1 >= end)
+        return fail("missing restart marker");
+
+    m_bits.reset(p + 2, end);
+    for(int i = 0; i < m_component_count; i++)
+        m_components[i].dc_pred = 0;
+    return true;
+}
+
+bool JpegDecoder::decode_dc(int channels, JpegImage& out, JpegImage* gray)
+{
+    if(m_component_count == 0)
+        return fail("no frame parsed");
+    if(channels != 1 && channels != 3)
+        return fail("channels must be 1 or 3");
+    if(m_progressive && (m_ss != 0 || m_se != 0 || m_ah != 0))
+        return fail("first progressive scan is not a DC scan");
+
+    // the components the image is made from must be in the first scan.
+    // Progressive frames may code the DC of each component in a scan of
+    // its own; those come out gray.
+    bool in_scan[4] = { false, false, false, false };
+    for(int i = 0; i < m_scan_count; i++)
+        in_scan[m_scan[i]] = true;
+    if(!in_scan[0])
+        return fail("first scan lacks the first component");
+
+    int needed = (channels == 3 && m_component_count == 3 &&
+        in_scan[1] && in_scan[2]) ? 3 : 1;
+
+    for(int i = 0; i < m_scan_count; i++)
+    {
+        const Component& c = m_components[m_scan[i]];
+        if(!m_dc_tables[c.td].defined ||
+           (!m_progressive && !m_ac_tables[c.ta].defined))
+        {
+            return fail("scan uses an undefined Huffman table");
+        }
+    }
+
+    for(int i = 0; i < m_component_count; i++)
+    {
+        Component& c = m_components[i];
+        c.dc_pred = 0;
+        m_planes[i].assign((size_t)c.blocks_w * c.blocks_h, 128);
+    }
+
+    m_bits.reset(m_data + m_scan_start, m_data + m_size);
+
+    // one component on its own is coded block by block over just the
+    // blocks that cover it; several together go MCU by MCU
+    bool interleaved = m_scan_count > 1;
+    int units_x = m_mcus_x;
+    int units_y = m_mcus_y;
+    if(!interleaved)
+    {
+        const Component& c = m_components[m_scan[0]];
+        int w = (m_width * c.h + m_hmax - 1) / m_hmax;
+        int h = (m_height * c.v + m_vmax - 1) / m_vmax;
+        units_x = (w + 7) / 8;
+        units_y = (h + 7) / 8;
+    }
+
+    unsigned todo = m_restart_interval;
+
+    for(int uy = 0; uy < units_y; uy++)
+    {
+        for(int ux = 0; ux < units_x; ux++)
+        {
+            if(m_restart_interval)
+            {
+                if(todo == 0)
+                {
+                    if(!restart())
+                        return false;
+                    todo = m_restart_interval;
+                }
+                todo--;
+            }
+
+            for(int i = 0; i < m_scan_count; i++)
+            {
+                Component& c = m_components[m_scan[i]];
+                const HuffmanTable& dc = m_dc_tables[c.td];
+                const HuffmanTable& ac = m_ac_tables[c.ta];
+                int bh = interleaved ? c.v : 1;
+                int bw = interleaved ? c.h : 1;
+
+                for(int by = 0; by < bh; by++)
+                {
+                    for(int bx = 0; bx < bw; bx++)
+                    {
+                        int s = decode_symbol(dc);
+                        if(s < 0 || s > 15)
+                            return fail("bad Huffman code");
+                        c.dc_pred += receive_extend(s);
+
+                        if(!m_progressive && !skip_ac(ac))
+                            return fail("bad Huffman code");
+
+                        int x = interleaved ? ux * c.h + bx : ux;
+                        int y = interleaved ? uy * c.v + by : uy;
+
+                        // the DC coefficient is 8 times the block's mean
+                        // level, less 128
+                        int dc_value = c.dc_pred * (1 << m_al) *
+                            m_quant[c.tq][0];
+                        m_planes[m_scan[i]][(size_t)y * c.blocks_w + x] =
+                            clamp_sample((dc_value + 4 + 1024) >> 3);
+                    }
+                }
+            }
+        }
+    }
+
+    dc_image(channels, needed, out);
+    if(gray)
+        dc_image(1, 1, *gray);
+
+    return true;
+}
+
+// the image decode_dc() gives from the DC planes, with the first needed
+// components in them
+void JpegDecoder::dc_image(int channels, int needed, JpegImage& out) const
+{
+    out.width = (m_width + 7) / 8;
+    out.height = (m_height + 7) / 8;
+    out.channels = channels;
+    out.pixels.resize((size_t)out.width * out.height * channels);
+
+    unsigned char* dst = out.pixels.empty() ? NULL : &out.pixels[0];
+
+    for(int y = 0; y < out.height; y++)
+    {
+        for(int x = 0; x < out.width; x++)
+        {
+            int s[3];
+            for(int i = 0; i < needed; i++)
+            {
+                const Component& c = m_components[i];
+                int bx = x * c.h / m_hmax;
+                int by = y * c.v / m_vmax;
+                s[i] = m_planes[i][(size_t)by * c.blocks_w + bx];
+            }
+
+            if(channels == 1)
+            {
+                *dst++ = (unsigned char)s[0];
+            }
+            else if(needed == 1)
+            {
+                dst[0] = dst[1] = dst[2] = (unsigned char)s[0];
+                dst += 3;
+            }
+            else if(m_rgb)
+            {
+                dst[0] = (unsigned char)s[0];
+                dst[1] = (unsigned char)s[1];
+                dst[2] = (unsigned char)s[2];
+                dst += 3;
+            }
+            else
+            {
+                // JFIF YCbCr to RGB, in 16.16 fixed point
+                int yy = s[0] << 16;
+                int cb = s[1] - 128;
+                int cr = s[2] - 128;
+                dst[0] = clamp_sample((yy + 91881 * cr + 32768) >> 16);
+                dst[1] = clamp_sample((yy - 22554 * cb - 46802 * cr +
+                    32768) >> 16);
+                dst[2] = clamp_sample((yy + 116130 * cb + 32768) >> 16);
+                dst += 3;
+            }
+        }
+    }
+}
+
+// Huffman-decodes and dequantises one block into coefs, which must be
+// zeroed, in natural order
+inline bool JpegDecoder::decode_block(Component& c, int16_t* coefs,
+    unsigned char& has_ac)
+{
+    const uint16_t* q = m_quant[c.tq];
+
+    int s = decode_symbol(m_dc_tables[c.td]);
+    if(s < 0 || s > 15)
+        return false;
+    c.dc_pred += receive_extend(s);
+    coefs[0] = (int16_t)(c.dc_pred * q[0]);
+
+    const HuffmanTable& ac = m_ac_tables[c.ta];
+    for(int k = 1; k < 64; k++)
+    {
+        int rs = decode_symbol(ac);
+        if(rs < 0)
+            return false;
+
+        int run = rs >> 4;
+        int size = rs & 15;
+        if(size == 0)
+        {
+            if(run != 15)
+                break;
+            k += 15;
+            continue;
+        }
+
+        k += run;
+        if(k > 63)
+            return false;
+
+        coefs[ZIGZAG[k]] = (int16_t)(receive_extend(size) * q[k]);
+        has_ac = 1;
+    }
+
+    return true;
+}
+
+// inverse DCT of the first count components' blocks in the current row of
+// MCUs, into m_planes
+void JpegDecoder::transform_row(int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        const Component& c = m_components[i];
+        int size = m_block_size[i];
+        size_t stride = (size_t)c.blocks_w * size;
+
+        for(int by = 0; by < c.v; by++)
+        {
+            for(int bx = 0; bx < c.blocks_w; bx++)
+            {
+                size_t block = (size_t)by * c.blocks_w + bx;
+                const int16_t* coefs = &m_coefs[i][block * 64];
+                unsigned char* out = &m_planes[i][by * size * stride +
+                    bx * size];
+
+                // most blocks of a typical frame are flat
+                if(!m_has_ac[i][block])
+                {
+                    unsigned char level = jpeg_dc_level(coefs[0]);
+                    for(int y = 0; y < size; y++)
+                        memset(out + y * stride, level, size);
+                    continue;
+                }
+
+                if(size == 8)
+                {
+                    if(m_kernels->idct_pair && bx + 1 < c.blocks_w &&
+                       m_has_ac[i][block + 1])
+                    {
+                        m_kernels->idct_pair(coefs, coefs + 64, out, stride);
+                        bx++;
+                    }
+                    else
+                    {
+                        m_kernels->idct(coefs, out, stride);
+                    }
+                }
+                else if(size == 4)
+                {
+                    jpeg_idct_4x4(coefs, out, stride);
+                }
+                else if(size == 2)
+                {
+                    jpeg_idct_2x2(coefs, out, stride);
+                }
+                else
+                {
+                    jpeg_idct_1x1(coefs, out, stride);
+                }
+            }
+        }
+    }
+}
+
+// upsamples and converts the first rows rows of the current row of MCUs
+// into out
+void JpegDecoder::output_rows(int scale, JpegPixelFormat format, int count,
+    unsigned char* out, size_t stride, int rows)
+{
+    // output samples per MCU across and down
+    int mcu_w = m_hmax * 8 / scale;
+    int mcu_h = m_vmax * 8 / scale;
+    int width = output_width(scale);
+
+    for(int r = 0; r < rows; r++)
+    {
+        const unsigned char* row[3] = { NULL, NULL, NULL };
+
+        for(int i = 0; i < count; i++)
+        {
+            const Component& c = m_components[i];
+            int across = c.h * m_block_size[i];
+            int down = c.v * m_block_size[i];
+            const unsigned char* src = &m_planes[i][
+                (size_t)(r * down / mcu_h) * c.blocks_w * m_block_size[i]];
+
+            if(across == mcu_w)
+            {
+                row[i] = src;
+                continue;
+            }
+
+            unsigned char* up = &m_upsampled[i][0];
+            if(across * 2 == mcu_w)
+            {
+                m_kernels->upsample_h2(src, up, width);
+            }
+            else
+            {
+                for(int x = 0; x < width; x++)
+                    up[x] = src[x * across / mcu_w];
+            }
+            row[i] = up;
+        }
+
+        unsigned char* dst = out + r * stride;
+
+        if(count == 1 && format == JPEG_GRAY)
+        {
+            memcpy(dst, row[0], width);
+        }
+        else if(count == 1)
+        {
+            for(int x = 0; x < width; x++, dst += 3)
+                dst[0] = dst[1] = dst[2] = row[0][x];
+        }
+        else if(!m_rgb)
+        {
+            m_kernels->ycc_to_rgb(row[0], row[1], row[2], dst, width,
+                format == JPEG_BGR);
+        }
+        else if(format == JPEG_GRAY)
+        {
+            // BT.601 luma, in 8.8 fixed point
+            for(int x = 0; x < width; x++)
+            {
+                dst[x] = (unsigned char)((77 * row[0][x] + 150 * row[1][x] +
+                    29 * row[2][x] + 128) >> 8);
+            }
+        }
+        else
+        {
+            int ri = format == JPEG_BGR ? 2 : 0;
+            for(int x = 0; x < width; x++, dst += 3)
+            {
+                dst[ri] = row[0][x];
+                dst[1] = row[1][x];
+                dst[2 - ri] = row[2][x];
+            }
+        }
+    }
+}
+
+bool JpegDecoder::find_restarts(std::vector<size_t>& restarts) const
+{
+    restarts.clear();
+    if(m_component_count == 0 || m_restart_interval == 0)
+        return false;
+
+    jpeg_find_restarts(m_data, m_size, m_scan_start, restarts);
+
+    // some encoders put one more after the last interval
+    uint64_t mcus = (uint64_t)m_mcus_x * m_mcus_y;
+    size_t needed = (size_t)((mcus - 1) / m_restart_interval);
+    if(restarts.size() < needed)
+    {
+        restarts.clear();
+        return false;
+    }
+
+    restarts.resize(needed);
+    return true;
+}
+
+bool JpegDecoder::decode(int scale, JpegPixelFormat format,
+    unsigned char* out, size_t stride)
+{
+    static const std::vector<size_t> no_restarts;
+    return decode_rows(scale, format, out, stride, 0, m_mcus_y, no_restarts);
+}
+
+bool JpegDecoder::decode_rows(int scale, JpegPixelFormat format,
+    unsigned char* out, size_t stride, int first_row, int row_count,
+    const std::vector<size_t>& restarts)
+{
+    if(m_component_count == 0)
+        return fail("no frame parsed");
+    if(first_row < 0 || row_count < 0 || row_count > m_mcus_y - first_row)
+        return fail("rows are outside the frame");
+    if(!valid_scale(scale))
+        return fail("scale must be 1, 2, 4 or 8");
+    if(m_progressive)
+        return fail("progressive frames are not handled");
+    if(m_scan_count != m_component_count)
+        return fail("frame is coded in more than one scan");
+
+    for(int i = 0; i < m_component_count; i++)
+    {
+        const Component& c = m_components[i];
+        if(!m_dc_tables[c.td].defined || !m_ac_tables[c.ta].defined)
+            return fail("scan uses an undefined Huffman table");
+    }
+
+    // gray output from a YCbCr frame needs only Y to be transformed; the
+    // other components are still Huffman-decoded to get past them
+    int count = (format == JPEG_GRAY && !m_rgb) ? 1 : m_component_count;
+    int size = 8 / scale;
+    int width = output_width(scale);
+    int height = output_height(scale);
+
+    for(int i = 0; i < m_component_count; i++)
+    {
+        const Component& c = m_components[i];
+
+        // a component subsampled 2:1 or more both ways has its IDCT scaled
+        // up by as much as it can, which stands in for upsampling it
+        int block_size = size;
+        while(block_size < 8 && c.h * block_size * 2 <= m_hmax * size &&
+              c.v * block_size * 2 <= m_vmax * size)
+        {
+            block_size *= 2;
+        }
+        m_block_size[i] = block_size;
+
+        size_t blocks = (size_t)c.blocks_w * c.v;
+        m_coefs[i].resize(blocks * 64);
+        m_has_ac[i].resize(blocks);
+        m_planes[i].resize(blocks * block_size * block_size);
+        if(i < 3)
+            m_upsampled[i].resize(width);
+        m_components[i].dc_pred = 0;
+    }
+
+    // start from the restart interval that holds the first MCU wanted, or
+    // failing that from the top, and Huffman-decode up to that MCU only to
+    // get past it
+    uint64_t mcu = 0;
+    size_t start = m_scan_start;
+    if(m_restart_interval && !restarts.empty())
+    {
+        uint64_t interval = (uint64_t)first_row * m_mcus_x /
+            m_restart_interval;
+        if(interval > restarts.size())
+            interval = restarts.size();
+
+        mcu = interval * m_restart_interval;
+        if(interval > 0)
+            start = restarts[interval - 1];
+    }
+
+    m_bits.reset(m_data + start, m_data + m_size);
+    unsigned todo = m_restart_interval;
+    int first_mcu_x = (int)(mcu % m_mcus_x);
+
+    for(int my = (int)(mcu / m_mcus_x); my < first_row + row_count; my++)
+    {
+        bool skipping = my < first_row;
+        if(!skipping)
+        {
+            for(int i = 0; i < m_component_count; i++)
+            {
+                memset(&m_coefs[i][0], 0,
+                    m_coefs[i].size() * sizeof(int16_t));
+                memset(&m_has_ac[i][0], 0, m_has_ac[i].size());
+            }
+        }
+
+        for(int mx = first_mcu_x; mx < m_mcus_x; mx++)
+        {
+            if(m_restart_interval)
+            {
+                if(todo == 0)
+                {
+                    if(!restart())
+                        return false;
+                    todo = m_restart_interval;
+                }
+                todo--;
+            }
+
+            for(int i = 0; i < m_scan_count; i++)
+            {
+                int k = m_scan[i];
+                Component& c = m_components[k];
+
+                for(int by = 0; by < c.v; by++)
+                {
+                    for(int bx = 0; bx < c.h; bx++)
+                    {
+                        if(skipping)
+                        {
+                            int s = decode_symbol(m_dc_tables[c.td]);
+                            if(s < 0 || s > 15)
+                                return fail("bad Huffman code");
+                            c.dc_pred += receive_extend(s);
+                            if(!skip_ac(m_ac_tables[c.ta]))
+                                return fail("bad Huffman code");
+                            continue;
+                        }
+
+                        size_t block = (size_t)by * c.blocks_w +
+                            mx * c.h + bx;
+                        if(!decode_block(c, &m_coefs[k][block * 64],
+                           m_has_ac[k][block]))
+                        {
+                            return fail("bad Huffman code");
+                        }
+                    }
+                }
+            }
+        }
+
+        first_mcu_x = 0;
+        if(skipping)
+            continue;
+
+        transform_row(count);
+
+        int y = my * m_vmax * size;
+        int rows = m_vmax * size;
+        if(rows > height - y)
+            rows = height - y;
+
+        output_rows(scale, format, count, out + y * stride, stride, rows);
+    }
+
+    return true;
+}
+
+bool JpegDecoder::decode(int scale, JpegPixelFormat format, JpegImage& image)
+{
+    if(!valid_scale(scale))
+        return fail("scale must be 1, 2, 4 or 8");
+
+    image.width = output_width(scale);
+    image.height = output_height(scale);
+    image.channels = format == JPEG_GRAY ? 1 : 3;
+    image.pixels.resize((size_t)image.width * image.height * image.channels);
+
+    if(image.pixels.empty())
+        return fail("no frame parsed");
+
+    return decode(scale, format, &image.pixels[0],
+        (size_t)image.width * image.channels);
+}
@@ -0,0 +1,809 @@
+#include "jpeg_kernels.h"
+
+// the SIMD kernels are built with target attributes and picked at run
+// time, so the rest of the program needs nothing past SSE2
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JPEG_KERNELS_SSE4 1
+#include <immintrin.h>
+#endif
+
+// as in jpeg_scan.cpp: no AVX2 from GCC on Windows (GCC bug 54412)
+#if defined(JPEG_KERNELS_SSE4) && !(defined(_WIN32) && !defined(__clang__))
+#define JPEG_KERNELS_AVX2 1
+#endif
+
+// libjpeg's FIX() values of the constants in the inverse DCTs: the
+// constant times 2^13, rounded
+enum
+{
+    FIX_0_211164243 = 1730,
+    FIX_0_298631336 = 2446,
+    FIX_0_390180644 = 3196,
+    FIX_0_509795579 = 4176,
+    FIX_0_541196100 = 4433,
+    FIX_0_601344887 = 4926,
+    FIX_0_720959822 = 5906,
+    FIX_0_765366865 = 6270,
+    FIX_0_850430095 = 6967,
+    FIX_0_899976223 = 7373,
+    FIX_1_061594337 = 8697,
+    FIX_1_175875602 = 9633,
+    FIX_1_272758580 = 10426,
+    FIX_1_451774981 = 11893,
+    FIX_1_501321110 = 12299,
+    FIX_1_847759065 = 15137,
+    FIX_1_961570560 = 16069,
+    FIX_2_053119869 = 16819,
+    FIX_2_172734803 = 17799,
+    FIX_2_562915447 = 20995,
+    FIX_3_072711026 = 25172,
+    FIX_3_624509785 = 29692
+};
+
+// The 8x8 inverse DCT is done as pairs of 16-bit products summed into 32
+// bits, which is what a multiply-add instruction does. The odd part is
+// rearranged (as in libjpeg-turbo's SIMD code) so that every product
+// comes in such a pair; these are the constants of each pair.
+enum
+{
+    K_EVEN_2 = FIX_0_541196100,
+    K_EVEN_6 = FIX_0_541196100 - FIX_1_847759065,
+    K_EVEN_2B = FIX_0_541196100 + FIX_0_765366865,
+
+    K_Z3_A = FIX_1_175875602 - FIX_1_961570560,
+    K_Z4_B = FIX_1_175875602 - FIX_0_390180644,
+
+    K_7_0 = FIX_0_298631336 - FIX_0_899976223,
+    K_1_3 = FIX_1_501321110 - FIX_0_899976223,
+    K_5_1 = FIX_2_053119869 - FIX_2_562915447,
+    K_3_2 = FIX_3_072711026 - FIX_2_562915447
+};
+
+// first pass: columns, scaled down by 2^11 into 16 bits; second pass:
+// rows, scaled down by 2^18 to samples
+static const int PASS1_SHIFT = 11;
+static const int PASS2_SHIFT = 18;
+
+// YCbCr to RGB as Q15 fractions, for a rounding 16-bit multiply. Each
+// factor over 1 is split into the sample itself plus a fraction.
+enum
+{
+    K_CR_R = 13173,     // 1.402 - 1
+    K_CB_G = 11277,     // 0.34414
+    K_CR_G = 23401,     // 0.71414
+    K_CB_B = 25297      // 1.772 - 1
+};
+
+static inline int16_t saturate16(int32_t x)
+{
+    return x < -32768 ? -32768 : (x > 32767 ? 32767 : (int16_t)x);
+}
+
+static inline unsigned char clamp_sample(int x)
+{
+    return x < 0 ? 0 : (x > 255 ? 255 : (unsigned char)x);
+}
+
+// === Scalar ===
+
+// one 8-point pass over in[0..7], giving the values before they are
+// scaled down
+static void idct_1d(const int16_t* in, int32_t round, int32_t* out)
+{
+    int32_t tmp0 = in[0] * 8192 + in[4] * 8192 + round;
+    int32_t tmp1 = in[0] * 8192 - in[4] * 8192 + round;
+    int32_t tmp2 = in[2] * K_EVEN_2 + in[6] * K_EVEN_6;
+    int32_t tmp3 = in[2] * K_EVEN_2B + in[6] * K_EVEN_2;
+
+    int32_t tmp10 = tmp0 + tmp3;
+    int32_t tmp13 = tmp0 - tmp3;
+    int32_t tmp11 = tmp1 + tmp2;
+    int32_t tmp12 = tmp1 - tmp2;
+
+    // 16-bit sums, as the SIMD versions have them
+    int16_t z3 = (int16_t)(in[7] + in[3]);
+    int16_t z4 = (int16_t)(in[5] + in[1]);
+
+    int32_t z3p = z3 * K_Z3_A + z4 * FIX_1_175875602;
+    int32_t z4p = z3 * FIX_1_175875602 + z4 * K_Z4_B;
+
+    int32_t odd0 = in[7] * K_7_0 - in[1] * FIX_0_899976223 + z3p;
+    int32_t odd3 = -in[7] * FIX_0_899976223 + in[1] * K_1_3 + z4p;
+    int32_t odd1 = in[5] * K_5_1 - in[3] * FIX_2_562915447 + z4p;
+    int32_t odd2 = -in[5] * FIX_2_562915447 + in[3] * K_3_2 + z3p;
+
+    // only garbage coefficients take these past 32 bits; they wrap, as
+    // the SIMD adds do
+    out[0] = (int32_t)((uint32_t)tmp10 + (uint32_t)odd3);
+    out[7] = (int32_t)((uint32_t)tmp10 - (uint32_t)odd3);
+    out[1] = (int32_t)((uint32_t)tmp11 + (uint32_t)odd2);
+    out[6] = (int32_t)((uint32_t)tmp11 - (uint32_t)odd2);
+    out[2] = (int32_t)((uint32_t)tmp12 + (uint32_t)odd1);
+    out[5] = (int32_t)((uint32_t)tmp12 - (uint32_t)odd1);
+    out[3] = (int32_t)((uint32_t)tmp13 + (uint32_t)odd0);
+    out[4] = (int32_t)((uint32_t)tmp13 - (uint32_t)odd0);
+}
+
+static void idct_scalar(const int16_t* coefs, unsigned char* out,
+    size_t stride)
+{
+    int16_t ws[64];
+    int16_t v[8];
+    int32_t t[8];
+
+    for(int c = 0; c < 8; c++)
+    {
+        for(int k = 0; k < 8; k++)
+            v[k] = coefs[8 * k + c];
+
+        idct_1d(v, 1 << (PASS1_SHIFT - 1), t);
+
+        for(int k = 0; k < 8; k++)
+            ws[8 * k + c] = saturate16(t[k] >> PASS1_SHIFT);
+    }
+
+    for(int r = 0; r < 8; r++)
+    {
+        idct_1d(ws + 8 * r, 1 << (PASS2_SHIFT - 1), t);
+
+        unsigned char* row = out + r * stride;
+        for(int k = 0; k < 8; k++)
+        {
+            row[k] = clamp_sample(saturate16(
+                saturate16(t[k] >> PASS2_SHIFT) + 128));
+        }
+    }
+}
+
+static void upsample_h2_scalar(const unsigned char* in, unsigned char* out,
+    size_t out_width)
+{
+    for(size_t x = 0; x < out_width; x++)
+        out[x] = in[x >> 1];
+}
+
+// the rounding high half of a 16-bit product, as _mm_mulhrs_epi16
+static inline int mulhrs(int a, int b)
+{
+    return (a * b + 0x4000) >> 15;
+}
+
+static void ycc_to_rgb_scalar(const unsigned char* y, const unsigned char* cb,
+    const unsigned char* cr, unsigned char* out, size_t width, bool bgr)
+{
+    int ri = bgr ? 2 : 0;
+    int bi = bgr ? 0 : 2;
+
+    for(size_t x = 0; x < width; x++)
+    {
+        int l = y[x];
+        int b = cb[x] - 128;
+        int r = cr[x] - 128;
+
+        out[ri] = clamp_sample(l + r + mulhrs(r, K_CR_R));
+        out[1] = clamp_sample(l - mulhrs(b, K_CB_G) - mulhrs(r, K_CR_G));
+        out[bi] = clamp_sample(l + b + mulhrs(b, K_CB_B));
+        out += 3;
+    }
+}
+
+// === Reduced inverse DCTs ===
+
+// These follow libjpeg's jidctred.c. The sums are 64-bit because
+// coefficients from a damaged frame can overflow 32 bits; the reduced
+// sizes are cheap enough that it does not show.
+
+void jpeg_idct_4x4(const int16_t* coefs, unsigned char* out, size_t stride)
+{
+    int64_t ws[8 * 4];
+
+    // column 4 adds nothing to the four samples
+    for(int c = 0; c < 8; c++)
+    {
+        if(c == 4)
+            continue;
+
+        const int16_t* in = coefs + c;
+        int64_t tmp0 = in[0] * (1 << 14);
+        int64_t tmp2 = in[16] * FIX_1_847759065 - in[48] * FIX_0_765366865;
+        int64_t tmp10 = tmp0 + tmp2;
+        int64_t tmp12 = tmp0 - tmp2;
+
+        int64_t z1 = in[56];
+        int64_t z2 = in[40];
+        int64_t z3 = in[24];
+        int64_t z4 = in[8];
+
+        tmp0 = -z1 * FIX_0_211164243 + z2 * FIX_1_451774981 -
+            z3 * FIX_2_172734803 + z4 * FIX_1_061594337;
+        tmp2 = -z1 * FIX_0_509795579 - z2 * FIX_0_601344887 +
+            z3 * FIX_0_899976223 + z4 * FIX_2_562915447;
+
+        const int round = 1 << 11;
+        ws[c] = (tmp10 + tmp2 + round) >> 12;
+        ws[8 * 3 + c] = (tmp10 - tmp2 + round) >> 12;
+        ws[8 + c] = (tmp12 + tmp0 + round) >> 12;
+        ws[8 * 2 + c] = (tmp12 - tmp0 + round) >> 12;
+    }
+
+    for(int r = 0; r < 4; r++)
+    {
+        const int64_t* w = ws + 8 * r;
+        int64_t tmp0 = w[0] * (1 << 14);
+        int64_t tmp2 = w[2] * FIX_1_847759065 - w[6] * FIX_0_765366865;
+        int64_t tmp10 = tmp0 + tmp2;
+        int64_t tmp12 = tmp0 - tmp2;
+
+        tmp0 = -w[7] * FIX_0_211164243 + w[5] * FIX_1_451774981 -
+            w[3] * FIX_2_172734803 + w[1] * FIX_1_061594337;
+        tmp2 = -w[7] * FIX_0_509795579 - w[5] * FIX_0_601344887 +
+            w[3] * FIX_0_899976223 + w[1] * FIX_2_562915447;
+
+        const int round = 1 << 18;
+        unsigned char* row = out + r * stride;
+        row[0] = clamp_sample((int)((tmp10 + tmp2 + round) >> 19) + 128);
+        row[3] = clamp_sample((int)((tmp10 - tmp2 + round) >> 19) + 128);
+        row[1] = clamp_sample((int)((tmp12 + tmp0 + round) >> 19) + 128);
+        row[2] = clamp_sample((int)((tmp12 - tmp0 + round) >> 19) + 128);
+    }
+}
+
+void jpeg_idct_2x2(const int16_t* coefs, unsigned char* out, size_t stride)
+{
+    int64_t ws[8 * 2];
+
+    // only the odd columns and column 0 reach the two samples
+    for(int c = 0; c < 8; c++)
+    {
+        if(c == 2 || c == 4 || c == 6)
+            continue;
+
+        const int16_t* in = coefs + c;
+        int64_t tmp10 = in[0] * (1 << 15);
+        int64_t tmp0 = -in[56] * FIX_0_720959822 + in[40] * FIX_0_850430095 -
+            in[24] * FIX_1_272758580 + in[8] * FIX_3_624509785;
+
+        const int round = 1 << 12;
+        ws[c] = (tmp10 + tmp0 + round) >> 13;
+        ws[8 + c] = (tmp10 - tmp0 + round) >> 13;
+    }
+
+    for(int r = 0; r < 2; r++)
+    {
+        const int64_t* w = ws + 8 * r;
+        int64_t tmp10 = w[0] * (1 << 15);
+        int64_t tmp0 = -w[7] * FIX_0_720959822 + w[5] * FIX_0_850430095 -
+            w[3] * FIX_1_272758580 + w[1] * FIX_3_624509785;
+
+        const int round = 1 << 19;
+        unsigned char* row = out + r * stride;
+        row[0] = clamp_sample((int)((tmp10 + tmp0 + round) >> 20) + 128);
+        row[1] = clamp_sample((int)((tmp10 - tmp0 + round) >> 20) + 128);
+    }
+}
+
+void jpeg_idct_1x1(const int16_t* coefs, unsigned char* out, size_t)
+{
+    out[0] = jpeg_dc_level(coefs[0]);
+}
+
+#ifdef JPEG_KERNELS_SSE4
+
+// === SSE4.1 ===
+
+// a multiply-add constant: lo times the first of each pair of 16-bit
+// values, plus hi times the second
+__attribute__((target("sse4.1")))
+static inline __m128i pair_128(int lo, int hi)
+{
+    return _mm_set1_epi32((int)((uint32_t)(uint16_t)lo |
+        (uint32_t)(uint16_t)hi << 16));
+}
+
+// idct_1d() on four lanes, given the inputs interleaved in pairs: (0, 4),
+// (2, 6), (7, 1), (5, 3) and (in7 + in3, in5 + in1)
+__attribute__((target("sse4.1")))
+static inline void idct_half_128(__m128i p04, __m128i p26, __m128i p71,
+    __m128i p53, __m128i pz, __m128i round, __m128i* out)
+{
+    __m128i tmp0 = _mm_add_epi32(_mm_madd_epi16(p04, pair_128(8192, 8192)),
+        round);
+    __m128i tmp1 = _mm_add_epi32(_mm_madd_epi16(p04, pair_128(8192, -8192)),
+        round);
+    __m128i tmp2 = _mm_madd_epi16(p26, pair_128(K_EVEN_2, K_EVEN_6));
+    __m128i tmp3 = _mm_madd_epi16(p26, pair_128(K_EVEN_2B, K_EVEN_2));
+
+    __m128i tmp10 = _mm_add_epi32(tmp0, tmp3);
+    __m128i tmp13 = _mm_sub_epi32(tmp0, tmp3);
+    __m128i tmp11 = _mm_add_epi32(tmp1, tmp2);
+    __m128i tmp12 = _mm_sub_epi32(tmp1, tmp2);
+
+    __m128i z3p = _mm_madd_epi16(pz, pair_128(K_Z3_A, FIX_1_175875602));
+    __m128i z4p = _mm_madd_epi16(pz, pair_128(FIX_1_175875602, K_Z4_B));
+
+    __m128i odd0 = _mm_add_epi32(_mm_madd_epi16(p71,
+        pair_128(K_7_0, -FIX_0_899976223)), z3p);
+    __m128i odd3 = _mm_add_epi32(_mm_madd_epi16(p71,
+        pair_128(-FIX_0_899976223, K_1_3)), z4p);
+    __m128i odd1 = _mm_add_epi32(_mm_madd_epi16(p53,
+        pair_128(K_5_1, -FIX_2_562915447)), z4p);
+    __m128i odd2 = _mm_add_epi32(_mm_madd_epi16(p53,
+        pair_128(-FIX_2_562915447, K_3_2)), z3p);
+
+    out[0] = _mm_add_epi32(tmp10, odd3);
+    out[7] = _mm_sub_epi32(tmp10, odd3);
+    out[1] = _mm_add_epi32(tmp11, odd2);
+    out[6] = _mm_sub_epi32(tmp11, odd2);
+    out[2] = _mm_add_epi32(tmp12, odd1);
+    out[5] = _mm_sub_epi32(tmp12, odd1);
+    out[3] = _mm_add_epi32(tmp13, odd0);
+    out[4] = _mm_sub_epi32(tmp13, odd0);
+}
+
+// one pass over eight lanes: v[k] holds input k of each lane, and is
+// replaced by output k, scaled down by shift into 16 bits
+__attribute__((target("sse4.1")))
+static inline void idct_pass_128(__m128i* v, int round, int shift)
+{
+    __m128i z3 = _mm_add_epi16(v[7], v[3]);
+    __m128i z4 = _mm_add_epi16(v[5], v[1]);
+    __m128i r = _mm_set1_epi32(round);
+
+    __m128i lo[8];
+    __m128i hi[8];
+    idct_half_128(_mm_unpacklo_epi16(v[0], v[4]),
+        _mm_unpacklo_epi16(v[2], v[6]), _mm_unpacklo_epi16(v[7], v[1]),
+        _mm_unpacklo_epi16(v[5], v[3]), _mm_unpacklo_epi16(z3, z4), r, lo);
+    idct_half_128(_mm_unpackhi_epi16(v[0], v[4]),
+        _mm_unpackhi_epi16(v[2], v[6]), _mm_unpackhi_epi16(v[7], v[1]),
+        _mm_unpackhi_epi16(v[5], v[3]), _mm_unpackhi_epi16(z3, z4), r, hi);
+
+    __m128i count = _mm_cvtsi32_si128(shift);
+    for(int k = 0; k < 8; k++)
+    {
+        v[k] = _mm_packs_epi32(_mm_sra_epi32(lo[k], count),
+            _mm_sra_epi32(hi[k], count));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static inline void transpose_128(__m128i* v)
+{
+    __m128i a0 = _mm_unpacklo_epi16(v[0], v[1]);
+    __m128i a1 = _mm_unpackhi_epi16(v[0], v[1]);
+    __m128i a2 = _mm_unpacklo_epi16(v[2], v[3]);
+    __m128i a3 = _mm_unpackhi_epi16(v[2], v[3]);
+    __m128i a4 = _mm_unpacklo_epi16(v[4], v[5]);
+    __m128i a5 = _mm_unpackhi_epi16(v[4], v[5]);
+    __m128i a6 = _mm_unpacklo_epi16(v[6], v[7]);
+    __m128i a7 = _mm_unpackhi_epi16(v[6], v[7]);
+
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+    __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+    __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+    __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+    __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm_unpacklo_epi64(b0, b4);
+    v[1] = _mm_unpackhi_epi64(b0, b4);
+    v[2] = _mm_unpacklo_epi64(b1, b5);
+    v[3] = _mm_unpackhi_epi64(b1, b5);
+    v[4] = _mm_unpacklo_epi64(b2, b6);
+    v[5] = _mm_unpackhi_epi64(b2, b6);
+    v[6] = _mm_unpacklo_epi64(b3, b7);
+    v[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("sse4.1")))
+static void idct_sse4(const int16_t* coefs, unsigned char* out,
+    size_t stride)
+{
+    __m128i v[8];
+    for(int k = 0; k < 8; k++)
+        v[k] = _mm_loadu_si128((const __m128i*)(coefs + 8 * k));
+
+    // the rows hold the columns' inputs lane by lane, so the first pass
+    // needs no transpose
+    idct_pass_128(v, 1 << (PASS1_SHIFT - 1), PASS1_SHIFT);
+    transpose_128(v);
+    idct_pass_128(v, 1 << (PASS2_SHIFT - 1), PASS2_SHIFT);
+    transpose_128(v);
+
+    __m128i level = _mm_set1_epi16(128);
+    for(int k = 0; k < 8; k += 2)
+    {
+        __m128i rows = _mm_packus_epi16(_mm_adds_epi16(v[k], level),
+            _mm_adds_epi16(v[k + 1], level));
+        _mm_storel_epi64((__m128i*)(out + k * stride), rows);
+        _mm_storel_epi64((__m128i*)(out + (k + 1) * stride),
+            _mm_srli_si128(rows, 8));
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void upsample_h2_sse4(const unsigned char* in, unsigned char* out,
+    size_t out_width)
+{
+    size_t x = 0;
+    for(; x + 32 <= out_width; x += 32)
+    {
+        __m128i s = _mm_loadu_si128((const __m128i*)(in + x / 2));
+        _mm_storeu_si128((__m128i*)(out + x), _mm_unpacklo_epi8(s, s));
+        _mm_storeu_si128((__m128i*)(out + x + 16), _mm_unpackhi_epi8(s, s));
+    }
+
+    upsample_h2_scalar(in + x / 2, out + x, out_width - x);
+}
+
+// interleaves 16 samples each of three channels into 48 bytes
+__attribute__((target("sse4.1")))
+static inline void store_interleaved(__m128i c0, __m128i c1, __m128i c2,
+    unsigned char* out)
+{
+    const __m128i m00 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1,
+        -1, 3, -1, -1, 4, -1, -1, 5);
+    const __m128i m01 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1,
+        8, -1, -1, 9, -1, -1, 10, -1);
+    const __m128i m02 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13,
+        -1, -1, 14, -1, -1, 15, -1, -1);
+    const __m128i m10 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2,
+        -1, -1, 3, -1, -1, 4, -1, -1);
+    const __m128i m11 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1,
+        -1, 8, -1, -1, 9, -1, -1, 10);
+    const __m128i m12 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1,
+        13, -1, -1, 14, -1, -1, 15, -1);
+    const __m128i m20 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1,
+        2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i m21 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7,
+        -1, -1, 8, -1, -1, 9, -1, -1);
+    const __m128i m22 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1,
+        -1, 13, -1, -1, 14, -1, -1, 15);
+
+    __m128i o0 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m00),
+        _mm_shuffle_epi8(c1, m10)), _mm_shuffle_epi8(c2, m20));
+    __m128i o1 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m01),
+        _mm_shuffle_epi8(c1, m11)), _mm_shuffle_epi8(c2, m21));
+    __m128i o2 = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(c0, m02),
+        _mm_shuffle_epi8(c1, m12)), _mm_shuffle_epi8(c2, m22));
+
+    _mm_storeu_si128((__m128i*)out, o0);
+    _mm_storeu_si128((__m128i*)(out + 16), o1);
+    _mm_storeu_si128((__m128i*)(out + 32), o2);
+}
+
+// R, G and B of eight pixels as 16-bit values
+__attribute__((target("sse4.1")))
+static inline void ycc_8_sse4(__m128i y, __m128i cb, __m128i cr,
+    __m128i& r, __m128i& g, __m128i& b)
+{
+    r = _mm_add_epi16(_mm_add_epi16(y, cr),
+        _mm_mulhrs_epi16(cr, _mm_set1_epi16(K_CR_R)));
+    g = _mm_sub_epi16(_mm_sub_epi16(y,
+        _mm_mulhrs_epi16(cb, _mm_set1_epi16(K_CB_G))),
+        _mm_mulhrs_epi16(cr, _mm_set1_epi16(K_CR_G)));
+    b = _mm_add_epi16(_mm_add_epi16(y, cb),
+        _mm_mulhrs_epi16(cb, _mm_set1_epi16(K_CB_B)));
+}
+
+__attribute__((target("sse4.1")))
+static void ycc_to_rgb_sse4(const unsigned char* y, const unsigned char* cb,
+    const unsigned char* cr, unsigned char* out, size_t width, bool bgr)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi16(128);
+
+    size_t x = 0;
+    for(; x + 16 <= width; x += 16)
+    {
+        __m128i yv = _mm_loadu_si128((const __m128i*)(y + x));
+        __m128i bv = _mm_loadu_si128((const __m128i*)(cb + x));
+        __m128i rv = _mm_loadu_si128((const __m128i*)(cr + x));
+
+        __m128i r0, g0, b0, r1, g1, b1;
+        ycc_8_sse4(_mm_unpacklo_epi8(yv, zero),
+            _mm_sub_epi16(_mm_unpacklo_epi8(bv, zero), half),
+            _mm_sub_epi16(_mm_unpacklo_epi8(rv, zero), half), r0, g0, b0);
+        ycc_8_sse4(_mm_unpackhi_epi8(yv, zero),
+            _mm_sub_epi16(_mm_unpackhi_epi8(bv, zero), half),
+            _mm_sub_epi16(_mm_unpackhi_epi8(rv, zero), half), r1, g1, b1);
+
+        __m128i r = _mm_packus_epi16(r0, r1);
+        __m128i g = _mm_packus_epi16(g0, g1);
+        __m128i b = _mm_packus_epi16(b0, b1);
+
+        if(bgr)
+            store_interleaved(b, g, r, out + 3 * x);
+        else
+            store_interleaved(r, g, b, out + 3 * x);
+    }
+
+    ycc_to_rgb_scalar(y + x, cb + x, cr + x, out + 3 * x, width - x, bgr);
+}
+
+#endif // JPEG_KERNELS_SSE4
+
+#ifdef JPEG_KERNELS_AVX2
+
+// === AVX2 ===
+
+// The same as the SSE4.1 kernels, 256 bits at a time. AVX2 unpacks and
+// packs work within each 128-bit half, so for the inverse DCT each half
+// simply holds a different block.
+
+__attribute__((target("avx2")))
+static inline __m256i pair_256(int lo, int hi)
+{
+    return _mm256_set1_epi32((int)((uint32_t)(uint16_t)lo |
+        (uint32_t)(uint16_t)hi << 16));
+}
+
+__attribute__((target("avx2")))
+static inline void idct_half_256(__m256i p04, __m256i p26, __m256i p71,
+    __m256i p53, __m256i pz, __m256i round, __m256i* out)
+{
+    __m256i tmp0 = _mm256_add_epi32(
+        _mm256_madd_epi16(p04, pair_256(8192, 8192)), round);
+    __m256i tmp1 = _mm256_add_epi32(
+        _mm256_madd_epi16(p04, pair_256(8192, -8192)), round);
+    __m256i tmp2 = _mm256_madd_epi16(p26, pair_256(K_EVEN_2, K_EVEN_6));
+    __m256i tmp3 = _mm256_madd_epi16(p26, pair_256(K_EVEN_2B, K_EVEN_2));
+
+    __m256i tmp10 = _mm256_add_epi32(tmp0, tmp3);
+    __m256i tmp13 = _mm256_sub_epi32(tmp0, tmp3);
+    __m256i tmp11 = _mm256_add_epi32(tmp1, tmp2);
+    __m256i tmp12 = _mm256_sub_epi32(tmp1, tmp2);
+
+    __m256i z3p = _mm256_madd_epi16(pz, pair_256(K_Z3_A, FIX_1_175875602));
+    __m256i z4p = _mm256_madd_epi16(pz, pair_256(FIX_1_175875602, K_Z4_B));
+
+    __m256i odd0 = _mm256_add_epi32(_mm256_madd_epi16(p71,
+        pair_256(K_7_0, -FIX_0_899976223)), z3p);
+    __m256i odd3 = _mm256_add_epi32(_mm256_madd_epi16(p71,
+        pair_256(-FIX_0_899976223, K_1_3)), z4p);
+    __m256i odd1 = _mm256_add_epi32(_mm256_madd_epi16(p53,
+        pair_256(K_5_1, -FIX_2_562915447)), z4p);
+    __m256i odd2 = _mm256_add_epi32(_mm256_madd_epi16(p53,
+        pair_256(-FIX_2_562915447, K_3_2)), z3p);
+
+    out[0] = _mm256_add_epi32(tmp10, odd3);
+    out[7] = _mm256_sub_epi32(tmp10, odd3);
+    out[1] = _mm256_add_epi32(tmp11, odd2);
+    out[6] = _mm256_sub_epi32(tmp11, odd2);
+    out[2] = _mm256_add_epi32(tmp12, odd1);
+    out[5] = _mm256_sub_epi32(tmp12, odd1);
+    out[3] = _mm256_add_epi32(tmp13, odd0);
+    out[4] = _mm256_sub_epi32(tmp13, odd0);
+}
+
+__attribute__((target("avx2")))
+static inline void idct_pass_256(__m256i* v, int round, int shift)
+{
+    __m256i z3 = _mm256_add_epi16(v[7], v[3]);
+    __m256i z4 = _mm256_add_epi16(v[5], v[1]);
+    __m256i r = _mm256_set1_epi32(round);
+
+    __m256i lo[8];
+    __m256i hi[8];
+    idct_half_256(_mm256_unpacklo_epi16(v[0], v[4]),
+        _mm256_unpacklo_epi16(v[2], v[6]), _mm256_unpacklo_epi16(v[7], v[1]),
+        _mm256_unpacklo_epi16(v[5], v[3]), _mm256_unpacklo_epi16(z3, z4), r,
+        lo);
+    idct_half_256(_mm256_unpackhi_epi16(v[0], v[4]),
+        _mm256_unpackhi_epi16(v[2], v[6]), _mm256_unpackhi_epi16(v[7], v[1]),
+        _mm256_unpackhi_epi16(v[5], v[3]), _mm256_unpackhi_epi16(z3, z4), r,
+        hi);
+
+    __m128i count = _mm_cvtsi32_si128(shift);
+    for(int k = 0; k < 8; k++)
+    {
+        v[k] = _mm256_packs_epi32(_mm256_sra_epi32(lo[k], count),
+            _mm256_sra_epi32(hi[k], count));
+    }
+}
+
+__attribute__((target("avx2")))
+static inline void transpose_256(__m256i* v)
+{
+    __m256i a0 = _mm256_unpacklo_epi16(v[0], v[1]);
+    __m256i a1 = _mm256_unpackhi_epi16(v[0], v[1]);
+    __m256i a2 = _mm256_unpacklo_epi16(v[2], v[3]);
+    __m256i a3 = _mm256_unpackhi_epi16(v[2], v[3]);
+    __m256i a4 = _mm256_unpacklo_epi16(v[4], v[5]);
+    __m256i a5 = _mm256_unpackhi_epi16(v[4], v[5]);
+    __m256i a6 = _mm256_unpacklo_epi16(v[6], v[7]);
+    __m256i a7 = _mm256_unpackhi_epi16(v[6], v[7]);
+
+    __m256i b0 = _mm256_unpacklo_epi32(a0, a2);
+    __m256i b1 = _mm256_unpackhi_epi32(a0, a2);
+    __m256i b2 = _mm256_unpacklo_epi32(a1, a3);
+    __m256i b3 = _mm256_unpackhi_epi32(a1, a3);
+    __m256i b4 = _mm256_unpacklo_epi32(a4, a6);
+    __m256i b5 = _mm256_unpackhi_epi32(a4, a6);
+    __m256i b6 = _mm256_unpacklo_epi32(a5, a7);
+    __m256i b7 = _mm256_unpackhi_epi32(a5, a7);
+
+    v[0] = _mm256_unpacklo_epi64(b0, b4);
+    v[1] = _mm256_unpackhi_epi64(b0, b4);
+    v[2] = _mm256_unpacklo_epi64(b1, b5);
+    v[3] = _mm256_unpackhi_epi64(b1, b5);
+    v[4] = _mm256_unpacklo_epi64(b2, b6);
+    v[5] = _mm256_unpackhi_epi64(b2, b6);
+    v[6] = _mm256_unpacklo_epi64(b3, b7);
+    v[7] = _mm256_unpackhi_epi64(b3, b7);
+}
+
+__attribute__((target("avx2")))
+static void idct_pair_avx2(const int16_t* a, const int16_t* b,
+    unsigned char* out, size_t stride)
+{
+    __m256i v[8];
+    for(int k = 0; k < 8; k++)
+    {
+        v[k] = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128((const __m128i*)(a + 8 * k))),
+            _mm_loadu_si128((const __m128i*)(b + 8 * k)), 1);
+    }
+
+    idct_pass_256(v, 1 << (PASS1_SHIFT - 1), PASS1_SHIFT);
+    transpose_256(v);
+    idct_pass_256(v, 1 << (PASS2_SHIFT - 1), PASS2_SHIFT);
+    transpose_256(v);
+
+    __m256i level = _mm256_set1_epi16(128);
+    for(int k = 0; k < 8; k += 2)
+    {
+        // a's two rows in the low half, b's in the high
+        __m256i rows = _mm256_packus_epi16(_mm256_adds_epi16(v[k], level),
+            _mm256_adds_epi16(v[k + 1], level));
+        __m128i ra = _mm256_castsi256_si128(rows);
+        __m128i rb = _mm256_extracti128_si256(rows, 1);
+
+        unsigned char* row = out + k * stride;
+        _mm_storel_epi64((__m128i*)row, ra);
+        _mm_storel_epi64((__m128i*)(row + 8), rb);
+        _mm_storel_epi64((__m128i*)(row + stride), _mm_srli_si128(ra, 8));
+        _mm_storel_epi64((__m128i*)(row + stride + 8), _mm_srli_si128(rb, 8));
+    }
+}
+
+__attribute__((target("avx2")))
+static void upsample_h2_avx2(const unsigned char* in, unsigned char* out,
+    size_t out_width)
+{
+    size_t x = 0;
+    for(; x + 64 <= out_width; x += 64)
+    {
+        // the in-lane unpacks leave the halves crossed; put them back
+        __m256i s = _mm256_permute4x64_epi64(
+            _mm256_loadu_si256((const __m256i*)(in + x / 2)), 0xD8);
+        _mm256_storeu_si256((__m256i*)(out + x), _mm256_unpacklo_epi8(s, s));
+        _mm256_storeu_si256((__m256i*)(out + x + 32),
+            _mm256_unpackhi_epi8(s, s));
+    }
+
+    upsample_h2_sse4(in + x / 2, out + x, out_width - x);
+}
+
+__attribute__((target("avx2")))
+static inline void ycc_16_avx2(__m256i y, __m256i cb, __m256i cr,
+    __m256i& r, __m256i& g, __m256i& b)
+{
+    r = _mm256_add_epi16(_mm256_add_epi16(y, cr),
+        _mm256_mulhrs_epi16(cr, _mm256_set1_epi16(K_CR_R)));
+    g = _mm256_sub_epi16(_mm256_sub_epi16(y,
+        _mm256_mulhrs_epi16(cb, _mm256_set1_epi16(K_CB_G))),
+        _mm256_mulhrs_epi16(cr, _mm256_set1_epi16(K_CR_G)));
+    b = _mm256_add_epi16(_mm256_add_epi16(y, cb),
+        _mm256_mulhrs_epi16(cb, _mm256_set1_epi16(K_CB_B)));
+}
+
+__attribute__((target("avx2")))
+static void ycc_to_rgb_avx2(const unsigned char* y, const unsigned char* cb,
+    const unsigned char* cr, unsigned char* out, size_t width, bool bgr)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi16(128);
+
+    size_t x = 0;
+    for(; x + 32 <= width; x += 32)
+    {
+        __m256i yv = _mm256_loadu_si256((const __m256i*)(y + x));
+        __m256i bv = _mm256_loadu_si256((const __m256i*)(cb + x));
+        __m256i rv = _mm256_loadu_si256((const __m256i*)(cr + x));
+
+        __m256i r0, g0, b0, r1, g1, b1;
+        ycc_16_avx2(_mm256_unpacklo_epi8(yv, zero),
+            _mm256_sub_epi16(_mm256_unpacklo_epi8(bv, zero), half),
+            _mm256_sub_epi16(_mm256_unpacklo_epi8(rv, zero), half),
+            r0, g0, b0);
+        ycc_16_avx2(_mm256_unpackhi_epi8(yv, zero),
+            _mm256_sub_epi16(_mm256_unpackhi_epi8(bv, zero), half),
+            _mm256_sub_epi16(_mm256_unpackhi_epi8(rv, zero), half),
+            r1, g1, b1);
+
+        // packing undoes the unpacking within each half, so the samples
+        // come out in order
+        __m256i r = _mm256_packus_epi16(r0, r1);
+        __m256i g = _mm256_packus_epi16(g0, g1);
+        __m256i b = _mm256_packus_epi16(b0, b1);
+        if(bgr)
+        {
+            __m256i t = r;
+            r = b;
+            b = t;
+        }
+
+        store_interleaved(_mm256_castsi256_si128(r),
+            _mm256_castsi256_si128(g), _mm256_castsi256_si128(b),
+            out + 3 * x);
+        store_interleaved(_mm256_extracti128_si256(r, 1),
+            _mm256_extracti128_si256(g, 1), _mm256_extracti128_si256(b, 1),
+            out + 3 * x + 48);
+    }
+
+    ycc_to_rgb_sse4(y + x, cb + x, cr + x, out + 3 * x, width - x, bgr);
+}
+
+#endif // JPEG_KERNELS_AVX2
+
+// === Selection ===
+
+static const JpegKernels scalar_kernels =
+{
+    "scalar", idct_scalar, NULL, upsample_h2_scalar, ycc_to_rgb_scalar
+};
+
+void jpeg_available_kernels(std::vector<JpegKernels>& kernels)
+{
+    JpegKernels k = scalar_kernels;
+    kernels.assign(1, k);
+
+#ifdef JPEG_KERNELS_SSE4
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.1"))
+    {
+        k.name = "sse4.1";
+        k.idct = idct_sse4;
+        k.upsample_h2 = upsample_h2_sse4;
+        k.ycc_to_rgb = ycc_to_rgb_sse4;
+        kernels.push_back(k);
+    }
+#endif
+
+#ifdef JPEG_KERNELS_AVX2
+    if(__builtin_cpu_supports("avx2"))
+    {
+        k.name = "avx2";
+        k.idct_pair = idct_pair_avx2;
+        k.upsample_h2 = upsample_h2_avx2;
+        k.ycc_to_rgb = ycc_to_rgb_avx2;
+        kernels.push_back(k);
+    }
+#endif
+}
+
+static JpegKernels pick_kernels()
+{
+    std::vector<JpegKernels> kernels;
+    jpeg_available_kernels(kernels);
+    return kernels.back();
+}
+
+const JpegKernels& jpeg_kernels()
+{
+    static const JpegKernels kernels = pick_kernels();
+    return kernels;
+}
+
+const JpegKernels& jpeg_scalar_kernels()
+{
+    return scalar_kernels;
+}
+
+const char* jpeg_decode_isa()
+{
+    return jpeg_kernels().name;
+}
@@ -0,0 +1,416 @@
+#include "jpeg_scan.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// GCC does not keep the stack 32-byte aligned on 64-bit Windows, so any
+// AVX value spilled there faults (GCC bug 54412). The AVX2 search is only
+// built where that cannot happen.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !(defined(_WIN32) && !defined(__clang__))
+#define JPEG_SCAN_AVX2 1
+#include <immintrin.h>
+#endif
+
+// position of the first 0xFF in p[0, n), or n if there is none
+
+static size_t find_ff_scalar(const unsigned char* p, size_t n)
+{
+    size_t i = 0;
+    for(; i < n; i++)
+    {
+        if(p[i] == 0xFF)
+            break;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+static size_t find_ff_sse2(const unsigned char* p, size_t n)
+{
+    const __m128i ff = _mm_set1_epi8((char)0xFF);
+    size_t i = 0;
+
+    for(; i + 64 <= n; i += 64)
+    {
+        const __m128i* v = (const __m128i*)(p + i);
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128(v), ff);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128(v + 1), ff);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128(v + 2), ff);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128(v + 3), ff);
+
+        // one test for the common case of no 0xFF in 64 bytes
+        if(!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b),
+           _mm_or_si128(c, d))))
+        {
+            continue;
+        }
+
+        uint64_t mask = (uint64_t)(unsigned)_mm_movemask_epi8(a) |
+            (uint64_t)(unsigned)_mm_movemask_epi8(b) << 16 |
+            (uint64_t)(unsigned)_mm_movemask_epi8(c) << 32 |
+            (uint64_t)(unsigned)_mm_movemask_epi8(d) << 48;
+        return i + __builtin_ctzll(mask);
+    }
+
+    for(; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i*)(p + i)), ff);
+        unsigned mask = (unsigned)_mm_movemask_epi8(a);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + find_ff_scalar(p + i, n - i);
+}
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+__attribute__((target("avx2")))
+static size_t find_ff_avx2(const unsigned char* p, size_t n)
+{
+    const __m256i ff = _mm256_set1_epi8((char)0xFF);
+    size_t i = 0;
+
+    for(; i + 64 <= n; i += 64)
+    {
+        __m256i a = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(p + i)), ff);
+        __m256i b = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(p + i + 32)), ff);
+
+        if(_mm256_testz_si256(_mm256_or_si256(a, b), _mm256_or_si256(a, b)))
+            continue;
+
+        uint64_t mask = (uint64_t)(unsigned)_mm256_movemask_epi8(a) |
+            (uint64_t)(unsigned)_mm256_movemask_epi8(b) << 32;
+        return i + __builtin_ctzll(mask);
+    }
+
+    for(; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i*)(p + i)), ff);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(a);
+        if(mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    return i + find_ff_scalar(p + i, n - i);
+}
+#endif
+
+typedef size_t (*FindFF)(const unsigned char* p, size_t n);
+
+struct FindFFImpl
+{
+    FindFF find;
+    const char* name;
+};
+
+static FindFFImpl pick_find_ff()
+{
+    FindFFImpl impl = { find_ff_scalar, "scalar" };
+
+#ifdef __SSE2__
+    impl.find = find_ff_sse2;
+    impl.name = "sse2";
+#endif
+
+#ifdef JPEG_SCAN_AVX2
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        impl.find = find_ff_avx2;
+        impl.name = "avx2";
+    }
+#endif
+
+    return impl;
+}
+
+static const FindFFImpl& find_ff_impl()
+{
+    static const FindFFImpl impl = pick_find_ff();
+    return impl;
+}
+
+const char* jpeg_scan_isa()
+{
+    return find_ff_impl().name;
+}
+
+static bool is_sof(unsigned char m)
+{
+    // C4 (DHT), C8 (JPG) and CC (DAC) sit in the SOF range but are not
+    // frame headers
+    return m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC;
+}
+
+static bool is_rst(unsigned char m)
+{
+    return m >= 0xD0 && m <= 0xD7;
+}
+
+static JpegCheck fail(JpegScan& scan, JpegCheck result, size_t offset)
+{
+    scan.result = result;
+    scan.error_offset = offset;
+    return result;
+}
+
+// runs through entropy-coded data from pos. On success pos is left on the
+// 0xFF of the marker that ends it.
+static JpegCheck skip_entropy(const unsigned char* data, size_t size,
+    size_t& pos, FindFF find, JpegScan& scan)
+{
+    for(;;)
+    {
+        size_t p = pos + find(data + pos, size - pos);
+        if(p + 1 >= size)
+            return fail(scan, JPEG_TRUNCATED, size);
+
+        unsigned char b = data[p + 1];
+        if(b == 0x00 || is_rst(b))
+        {
+            pos = p + 2;
+            continue;
+        }
+
+        // a marker may be preceded by any number of 0xFF fill bytes
+        size_t q = p + 1;
+        while(q < size && data[q] == 0xFF)
+            q++;
+        if(q >= size)
+            return fail(scan, JPEG_TRUNCATED, size);
+
+        b = data[q];
+        if(q > p + 1 && is_rst(b))
+        {
+            pos = q + 1;
+            continue;
+        }
+
+        if(b < 0xC0)
+            return fail(scan, JPEG_BAD_STUFFING, p);
+
+        pos = p;
+        return JPEG_VALID;
+    }
+}
+
+static JpegCheck scan_with(const unsigned char* data, size_t size,
+    FindFF find, JpegScan& scan)
+{
+    scan.result = JPEG_VALID;
+    scan.length = 0;
+    scan.error_offset = 0;
+    scan.scans = 0;
+
+    if(size < 2 || data[0] != 0xFF || data[1] != 0xD8)
+        return fail(scan, JPEG_NO_SOI, 0);
+
+    bool have_frame = false;
+    size_t pos = 2;
+
+    for(;;)
+    {
+        if(pos >= size)
+            return fail(scan, JPEG_TRUNCATED, size);
+        if(data[pos] != 0xFF)
+            return fail(scan, JPEG_BAD_MARKER, pos);
+
+        size_t at = pos;
+        while(pos < size && data[pos] == 0xFF)
+            pos++;
+        if(pos >= size)
+            return fail(scan, JPEG_TRUNCATED, size);
+
+        unsigned char m = data[pos++];
+
+        if(m == 0xD9)
+        {
+            if(!have_frame)
+                return fail(scan, JPEG_NO_FRAME_HEADER, at);
+            if(scan.scans == 0)
+                return fail(scan, JPEG_NO_SCAN, at);
+
+            scan.length = pos;
+            return JPEG_VALID;
+        }
+
+        // SOI again, TEM, RSTn outside a scan and the reserved codes do not
+        // belong between segments
+        if(m < 0xC0 || m == 0xD8 || is_rst(m))
+            return fail(scan, JPEG_BAD_MARKER, at);
+
+        if(pos + 2 > size)
+            return fail(scan, JPEG_TRUNCATED, size);
+
+        size_t length = (size_t)data[pos] << 8 | data[pos + 1];
+        if(length < 2)
+            return fail(scan, JPEG_BAD_MARKER, at);
+        if(pos + length > size)
+            return fail(scan, JPEG_TRUNCATED, size);
+
+        pos += length;
+
+        if(is_sof(m))
+        {
+            have_frame = true;
+        }
+        else if(m == 0xDA)
+        {
+            if(!have_frame)
+                return fail(scan, JPEG_NO_FRAME_HEADER, at);
+
+            scan.scans++;
+            if(skip_entropy(data, size, pos, find, scan) != JPEG_VALID)
+                return scan.result;
+        }
+    }
+}
+
+JpegCheck jpeg_scan(const unsigned char* data, size_t size, JpegScan& scan)
+{
+    return scan_with(data, size, find_ff_impl().find, scan);
+}
+
+JpegCheck jpeg_scan_scalar(const unsigned char* data, size_t size,
+    JpegScan& scan)
+{
+    return scan_with(data, size, find_ff_scalar, scan);
+}
+
+size_t jpeg_header_length(const unsigned char* data, size_t size)
+{
+    if(size < 2 || data[0] != 0xFF || data[1] != 0xD8)
+        return 0;
+
+    size_t pos = 2;
+    while(pos < size)
+    {
+        if(data[pos] != 0xFF)
+            return 0;
+
+        while(pos < size && data[pos] == 0xFF)
+            pos++;
+        if(pos >= size)
+            return 0;
+
+        unsigned char m = data[pos++];
+        if(m < 0xC0 || m == 0xD8 || m == 0xD9 || is_rst(m))
+            return 0;
+
+        if(pos + 2 > size)
+            return 0;
+
+        size_t length = (size_t)data[pos] << 8 | data[pos + 1];
+        if(length < 2 || pos + length > size)
+            return 0;
+
+        pos += length;
+        if(m == 0xDA)
+            return pos;
+    }
+
+    return 0;
+}
+
+bool jpeg_frame_size(const unsigned char* data, size_t size, int& width,
+    int& height)
+{
+    if(size < 2 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+
+    size_t pos = 2;
+    while(pos < size)
+    {
+        if(data[pos] != 0xFF)
+            return false;
+
+        while(pos < size && data[pos] == 0xFF)
+            pos++;
+        if(pos >= size)
+            return false;
+
+        unsigned char m = data[pos++];
+        if(m < 0xC0 || m == 0xD8 || m == 0xD9 || m == 0xDA || is_rst(m))
+            return false;
+
+        if(pos + 2 > size)
+            return false;
+
+        size_t length = (size_t)data[pos] << 8 | data[pos + 1];
+        if(length < 2 || pos + length > size)
+            return false;
+
+        // length, precision, then height and width
+        if(is_sof(m))
+        {
+            if(length < 7)
+                return false;
+
+            height = data[pos + 3] << 8 | data[pos + 4];
+            width = data[pos + 5] << 8 | data[pos + 6];
+            return true;
+        }
+
+        pos += length;
+    }
+
+    return false;
+}
+
+size_t jpeg_find_restarts(const unsigned char* data, size_t size,
+    size_t start, std::vector<size_t>& restarts)
+{
+    FindFF find = find_ff_impl().find;
+    restarts.clear();
+
+    size_t pos = start;
+    while(pos < size)
+    {
+        size_t p = pos + find(data + pos, size - pos);
+
+        // a marker may be preceded by any number of 0xFF fill bytes
+        size_t q = p + 1;
+        while(q < size && data[q] == 0xFF)
+            q++;
+        if(q >= size)
+            break;
+
+        if(is_rst(data[q]))
+            restarts.push_back(q + 1);
+        else if(data[q] != 0x00)
+            return p;
+
+        pos = q + 1;
+    }
+
+    return size;
+}
+
+const char* jpeg_check_name(JpegCheck check)
+{
+    switch(check)
+    {
+    case JPEG_VALID:
+        return "valid";
+    case JPEG_NO_SOI:
+        return "no SOI";
+    case JPEG_TRUNCATED:
+        return "truncated";
+    case JPEG_BAD_MARKER:
+        return "bad marker";
+    case JPEG_BAD_STUFFING:
+        return "bad stuffing";
+    case JPEG_NO_FRAME_HEADER:
+        return "no frame header";
+    case JPEG_NO_SCAN:
+        return "no scan";
+    }
+    return "unknown";
+}
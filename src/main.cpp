@@ -1,5 +1,6 @@
 #include "mjpeg_grabber.h"
 #include "camera.h"
+#include "save_thread.h"
 
 #include <cstdio>
 #include <cstdlib>
@@ -135,6 +136,7 @@ int main()
     IMediaControl* graph_control = NULL;
     IEnumPins* enum_pins = NULL;
     
+    MJ_GrabberFilter* grabber = NULL;
     IBaseFilter* save_filter = NULL;
     IPin* save_pin = NULL;
     
@@ -144,6 +146,17 @@ int main()
     time_t start;
     time_t now;
     
+    // writer thread for captured frames; started before any camera so that
+    // Receive() always has somewhere to put them. Each camera records into
+    // segment files of at most ten minutes each, with colour thumbnails
+    // for scrubbing through them.
+    SaveOptions save_options;
+    save_options.file_seconds = 10 * 60;
+    save_options.thumbnail_channels = 3;
+    
+    SaveThread saver(".", save_options);
+    saver.reserve_free_buffers(16, 8 * 1024 * 1024);
+    
     // Init COM
     // See: [0], [1]
     HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
@@ -235,7 +248,13 @@ int main()
         goto cleanup;
     }
     
-    save_filter = new MJ_GrabberFilter();
+    grabber = new MJ_GrabberFilter(&saver, 0);
+    
+    // ask for enough samples that the camera keeps streaming through a
+    // slow write; the size comes from the media type upstream picks
+    grabber->set_allocator_properties(32, 0);
+    
+    save_filter = grabber;
     save_filter->AddRef();
     hr = save_filter->FindPin(L"input", &save_pin);
     
@@ -269,8 +288,8 @@ int main()
         fprintf(stderr, "--------------------------------------------\n");
         
         if( pAmt->majortype == MEDIATYPE_Video && 
-            pAmt->subtype == MEDIASUBTYPE_MJPG &&
-            ) //pAmt->lSampleSize == 39386880)
+            pAmt->subtype == MEDIASUBTYPE_MJPG
+            ) //&& pAmt->lSampleSize == 39386880)
         {
             display_amt(pAmt);
             break;
@@ -345,6 +364,41 @@ int main()
     
     graph_control->Stop();
     
+    {
+        SaveStats stats = saver.stats();
+        fprintf(stderr, "saved %llu frames (%llu bytes) in %llu batches\n",
+            (unsigned long long)stats.frames,
+            (unsigned long long)stats.bytes,
+            (unsigned long long)stats.batches);
+        fprintf(stderr, "  %.1f frames/batch, %.0f bytes/write call\n",
+            stats.frames_per_batch(), stats.bytes_per_write());
+        fprintf(stderr, "  %llu thumbnails (%llu failed), %.0f us/megapixel\n",
+            (unsigned long long)stats.thumbnails,
+            (unsigned long long)stats.thumbnail_failures,
+            stats.thumbnail_us_per_megapixel());
+        fprintf(stderr, "  %llu frames stored as repeats (%llu bytes saved)\n",
+            (unsigned long long)stats.repeats,
+            (unsigned long long)stats.repeat_bytes);
+        if(stats.lost_frames)
+            fprintf(stderr, "  %llu frames lost to failed writes\n",
+                (unsigned long long)stats.lost_frames);
+        
+        DropStats drops = saver.drop_stats(0);
+        fprintf(stderr, "  dropped %llu of %llu frames (last at frame %llu)\n",
+            (unsigned long long)drops.total(),
+            (unsigned long long)drops.frames,
+            (unsigned long long)drops.last_drop_frame);
+
+        JpegCheckStats checks = grabber->check_stats();
+        fprintf(stderr, "  checked %llu frames: %llu truncated, %llu corrupt, "
+            "%llu trimmed (%llu bytes)\n",
+            (unsigned long long)checks.checked,
+            (unsigned long long)checks.truncated,
+            (unsigned long long)checks.corrupt,
+            (unsigned long long)checks.trimmed,
+            (unsigned long long)checks.trimmed_bytes);
+    }
+    
 cleanup:
     fprintf(stderr, "FIXME: Proper cleanup crashes; need to debug.\n");
     return 0;
@@ -1,6 +1,8 @@
 #include "mjpeg_grabber.h"
+#include "frame_hash.h"
 #include <iostream>
 #include <cstring>
+#include <new>
 using namespace std;
 
 // === MJ_PinMediaTypes ===
@@ -148,9 +150,260 @@ STDMETHODIMP MJ_PinMediaTypes::Skip(ULONG cMediaTypes)
     return S_OK;
 }
 
-#if 0
+// === MJ_SampleRef ===
+
+void MJ_SampleRef::hold(IMediaSample* pSample, BYTE* p, LONG len)
+{
+    pSample->AddRef();
+    release();
+    
+    sample = pSample;
+    ptr = p;
+    length = (len > 0) ? len : 0;
+}
+
+void MJ_SampleRef::release()
+{
+    if(sample)
+    {
+        sample->Release();
+        sample = NULL;
+    }
+    
+    ptr = NULL;
+    length = 0;
+}
+
+// === MJ_MediaSample ===
+
+MJ_MediaSample::MJ_MediaSample(MJ_Allocator* owner, SamplePool::Slot* slot,
+    BYTE* buffer, long size) : ref_count(0), owner(owner), slot(slot),
+    buffer(buffer), buffer_size(size)
+{
+    reset();
+}
+
+void MJ_MediaSample::reset()
+{
+    actual_length = 0;
+    time_start = 0;
+    time_end = 0;
+    media_start = 0;
+    media_end = 0;
+    time_valid = false;
+    media_time_valid = false;
+    sync_point = false;
+    preroll = false;
+    discontinuity = false;
+}
+
+STDMETHODIMP MJ_MediaSample::QueryInterface(REFIID riid, LPVOID* ppvObj)
+{
+    if(ppvObj == NULL)
+    {
+        return E_POINTER;
+    }
+    
+    if(riid == IID_IUnknown)
+    {
+        *ppvObj = (IUnknown*)this;
+        AddRef();
+        return S_OK;
+    }
+        
+    if(riid == IID_IMediaSample)
+    {
+        *ppvObj = (IMediaSample*)this;
+        AddRef();
+        return S_OK;
+    }
+        
+    *ppvObj = NULL;
+    return E_NOINTERFACE;
+}
+
+STDMETHODIMP_(ULONG) MJ_MediaSample::AddRef()
+{
+    return InterlockedIncrement(&ref_count);
+}
+
+STDMETHODIMP_(ULONG) MJ_MediaSample::Release()
+{
+    LONG count = InterlockedDecrement(&ref_count);
+    
+    if(count == 0)
+    {
+        // not deleted; it goes back to the allocator to be reused. Don't
+        // touch this object after the call, it may already be handed out.
+        owner->ReleaseBuffer(this);
+        return 0;
+    }
+    
+    return count;
+}
+
+STDMETHODIMP MJ_MediaSample::GetPointer(BYTE** ppBuffer)
+{
+    if(ppBuffer == NULL)
+        return E_POINTER;
+    
+    *ppBuffer = buffer;
+    return S_OK;
+}
+
+STDMETHODIMP_(long) MJ_MediaSample::GetSize()
+{
+    return buffer_size;
+}
+
+STDMETHODIMP MJ_MediaSample::GetTime(REFERENCE_TIME* pTimeStart,
+    REFERENCE_TIME* pTimeEnd)
+{
+    if(pTimeStart == NULL || pTimeEnd == NULL)
+        return E_POINTER;
+    
+    if(!time_valid)
+        return VFW_E_SAMPLE_TIME_NOT_SET;
+    
+    *pTimeStart = time_start;
+    *pTimeEnd = time_end;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::SetTime(REFERENCE_TIME* pTimeStart,
+    REFERENCE_TIME* pTimeEnd)
+{
+    // SetTime(NULL, NULL) clears the time stamps
+    if(pTimeStart == NULL)
+    {
+        time_valid = false;
+        return S_OK;
+    }
+    
+    time_start = *pTimeStart;
+    time_end = pTimeEnd ? *pTimeEnd : *pTimeStart;
+    time_valid = true;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::IsSyncPoint()
+{
+    return sync_point ? S_OK : S_FALSE;
+}
+
+STDMETHODIMP MJ_MediaSample::SetSyncPoint(BOOL bIsSyncPoint)
+{
+    sync_point = (bIsSyncPoint != FALSE);
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::IsPreroll()
+{
+    return preroll ? S_OK : S_FALSE;
+}
+
+STDMETHODIMP MJ_MediaSample::SetPreroll(BOOL bIsPreroll)
+{
+    preroll = (bIsPreroll != FALSE);
+    return S_OK;
+}
+
+STDMETHODIMP_(long) MJ_MediaSample::GetActualDataLength()
+{
+    return actual_length;
+}
+
+STDMETHODIMP MJ_MediaSample::SetActualDataLength(long length)
+{
+    if(length < 0 || length > buffer_size)
+        return VFW_E_BUFFER_OVERFLOW;
+    
+    actual_length = length;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::GetMediaType(AM_MEDIA_TYPE** ppMediaType)
+{
+    if(ppMediaType == NULL)
+        return E_POINTER;
+    
+    // S_FALSE: the media type has not changed since the last sample
+    *ppMediaType = NULL;
+    return S_FALSE;
+}
+
+STDMETHODIMP MJ_MediaSample::SetMediaType(AM_MEDIA_TYPE* pMediaType)
+{
+    // We only ever accept MJPEG, and the frames are self-describing, so a
+    // format change mid-stream needs nothing from us.
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::IsDiscontinuity()
+{
+    return discontinuity ? S_OK : S_FALSE;
+}
+
+STDMETHODIMP MJ_MediaSample::SetDiscontinuity(BOOL bDiscontinuity)
+{
+    discontinuity = (bDiscontinuity != FALSE);
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::GetMediaTime(LONGLONG* pTimeStart,
+    LONGLONG* pTimeEnd)
+{
+    if(pTimeStart == NULL || pTimeEnd == NULL)
+        return E_POINTER;
+    
+    if(!media_time_valid)
+        return VFW_E_MEDIA_TIME_NOT_SET;
+    
+    *pTimeStart = media_start;
+    *pTimeEnd = media_end;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_MediaSample::SetMediaTime(LONGLONG* pTimeStart,
+    LONGLONG* pTimeEnd)
+{
+    if(pTimeStart == NULL)
+    {
+        media_time_valid = false;
+        return S_OK;
+    }
+    
+    media_start = *pTimeStart;
+    media_end = pTimeEnd ? *pTimeEnd : *pTimeStart;
+    media_time_valid = true;
+    return S_OK;
+}
+
 
 // === MJ_Allocator ===
+
+MJ_Allocator::MJ_Allocator(long min_buffers, long min_buffer_size) :
+    properties_set(false), commited(false), min_buffers(min_buffers),
+    min_buffer_size(min_buffer_size), ref_count(0)
+{
+    memset(&properties, 0, sizeof properties);
+}
+
+MJ_Allocator::~MJ_Allocator()
+{
+    // every outstanding sample holds a reference on us, so by now they
+    // have all come back
+    free_samples();
+}
+
+void MJ_Allocator::free_samples()
+{
+    for(size_t i = 0; i < samples.size(); i++)
+        delete samples[i];
+    
+    samples.clear();
+}
+
 STDMETHODIMP MJ_Allocator::QueryInterface(REFIID riid, LPVOID* ppvObj)
 {
     if(ppvObj == NULL)
@@ -176,7 +429,168 @@ STDMETHODIMP MJ_Allocator::QueryInterface(REFIID riid, LPVOID* ppvObj)
     return E_NOINTERFACE;    
 }
 
-#endif
+STDMETHODIMP_(ULONG) MJ_Allocator::AddRef()
+{
+    // samples are released (and so release us) from the save thread
+    return InterlockedIncrement(&ref_count);
+}
+
+STDMETHODIMP_(ULONG) MJ_Allocator::Release()
+{
+    LONG count = InterlockedDecrement(&ref_count);
+    
+    if(count == 0)
+    {
+        delete this;
+        return 0; // don't use 'return ref_count'; that'd be use-after-free!
+    }
+    
+    return count;
+}
+
+STDMETHODIMP MJ_Allocator::SetProperties(
+    ALLOCATOR_PROPERTIES* pRequest,
+    ALLOCATOR_PROPERTIES* pActual)
+{
+    if(pRequest == NULL || pActual == NULL)
+        return E_POINTER;
+    
+    if(commited)
+        return VFW_E_ALREADY_COMMITTED;
+    
+    if(pool.outstanding() != 0)
+        return VFW_E_BUFFERS_OUTSTANDING;
+    
+    long align = pRequest->cbAlign;
+    if(align <= 0 || (align & (align - 1)) != 0 ||
+       (size_t)align > FrameBuffer::page_size())
+    {
+        return VFW_E_BADALIGN;
+    }
+    
+    ALLOCATOR_PROPERTIES actual = *pRequest;
+    
+    if(actual.cBuffers < min_buffers)
+        actual.cBuffers = min_buffers;
+    if(actual.cBuffers < 1)
+        actual.cBuffers = 1;
+    
+    if(actual.cbBuffer < min_buffer_size)
+        actual.cbBuffer = min_buffer_size;
+    if(actual.cbBuffer <= 0)
+        return E_INVALIDARG;
+    
+    if(actual.cbPrefix < 0)
+        actual.cbPrefix = 0;
+    
+    // slot memory is page aligned; push the data start past the prefix to
+    // the next multiple of cbAlign
+    size_t offset = ((size_t)actual.cbPrefix + align - 1) & ~(size_t)(align - 1);
+    
+    if(!pool.set_properties(actual.cBuffers, actual.cbBuffer, offset))
+        return VFW_E_BUFFERS_OUTSTANDING;
+    
+    // the old samples point into storage the pool just dropped
+    free_samples();
+    
+    properties = actual;
+    properties_set = true;
+    *pActual = actual;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_Allocator::GetProperties(ALLOCATOR_PROPERTIES* pProps)
+{
+    if(pProps == NULL)
+        return E_POINTER;
+    
+    *pProps = properties;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_Allocator::Commit()
+{
+    if(!properties_set)
+        return VFW_E_SIZENOTSET;
+    
+    try
+    {
+        if(!pool.commit())
+            return E_OUTOFMEMORY;
+    }
+    catch(const std::bad_alloc&)
+    {
+        return E_OUTOFMEMORY;
+    }
+    
+    if(samples.empty())
+    {
+        samples.reserve(pool.count());
+        
+        for(size_t i = 0; i < pool.count(); i++)
+        {
+            SamplePool::Slot* slot = pool.slot(i);
+            samples.push_back(new MJ_MediaSample(this, slot,
+                slot->memory.data() + pool.prefix(), (long)pool.size()));
+        }
+    }
+    
+    commited = true;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_Allocator::Decommit()
+{
+    // outstanding samples stay valid and come back through ReleaseBuffer;
+    // anyone blocked in GetBuffer is woken and fails
+    commited = false;
+    pool.decommit();
+    return S_OK;
+}
+
+STDMETHODIMP MJ_Allocator::GetBuffer(
+    IMediaSample** ppBuffer,
+    REFERENCE_TIME *pStartTime,
+    REFERENCE_TIME *pEndTime,
+    DWORD dwFlags)
+{
+    if(ppBuffer == NULL)
+        return E_POINTER;
+    
+    *ppBuffer = NULL;
+    
+    bool wait = (dwFlags & AM_GBF_NOWAIT) == 0;
+    SamplePool::Slot* slot = pool.acquire(wait);
+    
+    if(slot == NULL)
+        return pool.committed() ? VFW_E_TIMEOUT : VFW_E_NOT_COMMITTED;
+    
+    MJ_MediaSample* sample = samples[slot->index];
+    sample->reset();
+    sample->ref_count = 1;
+    
+    if(pStartTime && pEndTime)
+        sample->SetTime(pStartTime, pEndTime);
+    
+    // each outstanding sample keeps the allocator alive
+    AddRef();
+    
+    *ppBuffer = sample;
+    return S_OK;
+}
+
+STDMETHODIMP MJ_Allocator::ReleaseBuffer(IMediaSample* pBuffer)
+{
+    if(pBuffer == NULL)
+        return E_POINTER;
+    
+    // only our own samples ever come back here
+    MJ_MediaSample* sample = static_cast<MJ_MediaSample*>(pBuffer);
+    pool.release(sample->slot);
+    
+    Release();
+    return S_OK;
+}
 
 // === MJ_InputPin ===
 
@@ -212,6 +626,15 @@ STDMETHODIMP MJ_InputPin::QueryInterface(REFIID riid, LPVOID* ppvObj)
     return E_NOINTERFACE;    
 }
 
+MJ_InputPin::~MJ_InputPin()
+{
+    if(allocator)
+    {
+        allocator->Release();
+        allocator = NULL;
+    }
+}
+
 STDMETHODIMP_(ULONG) MJ_InputPin::AddRef()
 {
     ref_count++;
@@ -421,48 +844,157 @@ STDMETHODIMP MJ_InputPin::ReceiveConnection(
 // --- MJ_InputPin IMemInputPin methods ---
 STDMETHODIMP MJ_InputPin::GetAllocator(IMemAllocator** ppAllocator)
 {
-    return VFW_E_NO_ALLOCATOR;
+    if(ppAllocator == NULL)
+        return E_POINTER;
+    
+    if(allocator == NULL)
+    {
+        allocator = new MJ_Allocator(filter->alloc_buffers,
+            filter->alloc_buffer_size);
+        allocator->AddRef();
+    }
+    
+    *ppAllocator = allocator;
+    (*ppAllocator)->AddRef();
+    return S_OK;
 }
 
 STDMETHODIMP MJ_InputPin::GetAllocatorRequirements(ALLOCATOR_PROPERTIES *pProps)
 {
-    return E_NOTIMPL;
+    if(pProps == NULL)
+        return E_POINTER;
+    
+    if(filter->alloc_buffers <= 0 && filter->alloc_buffer_size <= 0)
+        return E_NOTIMPL;
+    
+    // upstream pins that insist on their own allocator still look at this
+    // when sizing it
+    memset(pProps, 0, sizeof(ALLOCATOR_PROPERTIES));
+    pProps->cBuffers = filter->alloc_buffers;
+    pProps->cbBuffer = filter->alloc_buffer_size;
+    pProps->cbAlign = 1;
+    pProps->cbPrefix = 0;
+    return S_OK;
 }
 
 STDMETHODIMP MJ_InputPin::NotifyAllocator(IMemAllocator* pAllocator, BOOL bReadOnly)
 {
-    return S_OK; // FIXME: Save the allocator if we need it for some reason
+    // Nothing to do either way: Receive() only reads from the samples, so
+    // it works the same whether upstream chose MJ_Allocator or its own.
+    return S_OK;
 }
 
-extern void dump_file(const char* path, void* data, size_t size);
-
 STDMETHODIMP MJ_InputPin::Receive(IMediaSample* pSample)
 {
+    // stamped first, so the time does not depend on what follows
+    int64_t arrived_ns = monotonic_ns();
+    
     if(pSample == NULL)
     {
         fprintf(stderr, "ERROR: pSample is NULL!\n");
         return E_POINTER;
     }
     
-    fprintf(stderr, "Frame data!\n");
-    
     BYTE* ptr = NULL;
     LONG length = 0;
     
+    // The sample belongs to the upstream filter; we must not Release() it
+    // here, since we never AddRef()'d it.
     HRESULT hr = pSample->GetPointer(&ptr);
     if(FAILED(hr))
     {
         fprintf(stderr, "ERROR: pSample->GetPointer() failed?!\n");
         fprintf(stderr, "REASON: %lx\n", (unsigned long)hr);
-        pSample->Release();
+        return hr;
     }
     
     length = pSample->GetActualDataLength();
+    if(length <= 0)
+        return S_OK;
+    
+    SaveThread* saver = filter->saver;
+    
+    // cameras pad frames and, after a bus glitch, hand over broken ones;
+    // look before anything is copied or queued
+    bool damaged = false;
+    bool hashed = false;
+    uint64_t hash = 0;
+    if(filter->check_mode != JPEG_CHECK_OFF)
+    {
+        JpegScan scan;
+        jpeg_scan(ptr, length, scan);
+        filter->checked++;
+        
+        if(scan.result == JPEG_VALID)
+        {
+            if(scan.length < (size_t)length)
+            {
+                filter->trimmed++;
+                filter->trimmed_bytes += length - scan.length;
+                length = (LONG)scan.length;
+            }
+        }
+        else
+        {
+            damaged = true;
+            if(scan.result == JPEG_TRUNCATED)
+                filter->truncated++;
+            else
+                filter->corrupt++;
+            
+            if(filter->check_mode == JPEG_CHECK_DROP)
+            {
+                filter->dropped++;
+                return S_OK;
+            }
+        }
+        
+        // while the frame is still in cache from the check: the writer
+        // spots repeated frames by it, and keeps it to check the frame
+        // against when it is read back. Other formats have no use for it.
+        if(saver->wants_frame_hashes())
+        {
+            hash = frame_hash(ptr, length);
+            hashed = true;
+        }
+    }
+    
+    if(!buffer)
+        buffer = saver->get_buffer();
+    
+    if(filter->zero_copy)
+    {
+        // reuse the buffer's SampleRef if it already has one of ours, so
+        // the steady state does not allocate
+        MJ_SampleRef* ref = dynamic_cast<MJ_SampleRef*>(buffer->sample.get());
+        if(!ref)
+        {
+            ref = new MJ_SampleRef();
+            buffer->sample.reset(ref);
+        }
+        
+        ref->hold(pSample, ptr, length);
+    }
+    else
+    {
+        buffer->store(ptr, length);
+    }
+    
+    buffer->camera = filter->camera;
+    buffer->capture_ns = arrived_ns;
+    buffer->damaged = damaged;
+    buffer->hash = hash;
+    buffer->has_hash = hashed;
     
-    dump_file("debug_frame.jpg", ptr, length);
+    REFERENCE_TIME start = 0;
+    REFERENCE_TIME end = 0;
+    hr = pSample->GetTime(&start, &end);
     
-    pSample->Release();
-    exit(1);
+    // VFW_S_NO_STOP_TIME still gives a start time
+    buffer->has_stream_time = SUCCEEDED(hr);
+    buffer->stream_time = buffer->has_stream_time ? start : 0;
+    
+    saver->save_and_get_buffer(buffer);
     return S_OK;
 }
 
@@ -604,13 +1136,28 @@ STDMETHODIMP MJ_EnumPins::Skip(ULONG cPins)
 
 // === MJ_GrabberFilter ===
 
-MJ_GrabberFilter::MJ_GrabberFilter() : ref_count(0), input_pin(NULL), 
-    graph(NULL), name(NULL)
+MJ_GrabberFilter::MJ_GrabberFilter(SaveThread* saver, int camera) :
+    ref_count(0), input_pin(NULL), graph(NULL), name(NULL), saver(saver),
+    camera(camera), zero_copy(false), check_mode(JPEG_CHECK_MARK),
+    checked(0), trimmed(0), trimmed_bytes(0), truncated(0), corrupt(0),
+    dropped(0), alloc_buffers(0), alloc_buffer_size(0)
 {
     input_pin = new MJ_InputPin(this);
     input_pin->AddRef();
 }
 
+JpegCheckStats MJ_GrabberFilter::check_stats() const
+{
+    JpegCheckStats result;
+    result.checked = checked.load();
+    result.trimmed = trimmed.load();
+    result.trimmed_bytes = trimmed_bytes.load();
+    result.truncated = truncated.load();
+    result.corrupt = corrupt.load();
+    result.dropped = dropped.load();
+    return result;
+}
+
 
 STDMETHODIMP MJ_GrabberFilter::QueryInterface(REFIID riid, LPVOID* ppvObj)
 {
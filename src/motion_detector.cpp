@@ -0,0 +1,167 @@
+#include "motion_detector.h"
+#include <cstdlib>
+using namespace std;
+
+MotionDetector::MotionDetector(const MotionOptions& options) :
+    m_options(options), m_columns(0), m_rows(0), m_mask_columns(0),
+    m_mask_rows(0), m_moving(false), m_changed(0), m_above(0),
+    m_last_motion_us(0), m_frames(0), m_failures(0)
+{
+    if(m_options.stop_per_mille > m_options.start_per_mille)
+        m_options.stop_per_mille = m_options.start_per_mille;
+    if(m_options.background_shift > 16)
+        m_options.background_shift = 16;
+}
+
+void MotionDetector::set_mask(int columns, int rows,
+    const std::vector<unsigned char>& mask)
+{
+    if(columns <= 0 || rows <= 0 ||
+       mask.size() != (size_t)columns * rows)
+    {
+        m_mask.clear();
+        m_mask_columns = 0;
+        m_mask_rows = 0;
+        return;
+    }
+
+    m_mask = mask;
+    m_mask_columns = columns;
+    m_mask_rows = rows;
+}
+
+// fills m_levels with the mean luma of each MCU of the frame, from the
+// 1/8 scale DC image
+void MotionDetector::measure(const MotionFrame& frame)
+{
+    const JpegImage& image = frame.luma;
+    int cell_w = frame.cell_width;
+    int cell_h = frame.cell_height;
+    int columns = (image.width + cell_w - 1) / cell_w;
+    int rows = (image.height + cell_h - 1) / cell_h;
+
+    if(columns != m_columns || rows != m_rows)
+    {
+        m_columns = columns;
+        m_rows = rows;
+        m_background.clear();
+    }
+
+    m_levels.assign((size_t)columns * rows, 0);
+
+    // the DC image is cut off at the frame's edge, so the last MCUs across
+    // and down may have fewer blocks in it
+    for(int y = 0; y < image.height; y++)
+    {
+        const unsigned char* row = &image.pixels[(size_t)y * image.width];
+        int32_t* levels = &m_levels[(size_t)(y / cell_h) * columns];
+
+        for(int x = 0; x < image.width; x++)
+            levels[x / cell_w] += row[x];
+    }
+
+    for(int my = 0; my < rows; my++)
+    {
+        int h = min(cell_h, image.height - my * cell_h);
+        for(int mx = 0; mx < columns; mx++)
+        {
+            int w = min(cell_w, image.width - mx * cell_w);
+            int32_t& level = m_levels[(size_t)my * columns + mx];
+            level = w > 0 && h > 0 ? level * 256 / (w * h) : 0;
+        }
+    }
+}
+
+// thousandths of the watched MCUs that differ from the background, which
+// is then moved towards the frame
+unsigned MotionDetector::compare()
+{
+    size_t count = m_levels.size();
+    bool masked = m_mask_columns == m_columns && m_mask_rows == m_rows;
+
+    // the frame's overall change in brightness, left out of each MCU's
+    int64_t total = 0;
+    size_t watched = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        if(masked && !m_mask[i])
+            continue;
+        total += m_levels[i] - (int32_t)(m_background[i] >> 16);
+        watched++;
+    }
+
+    int32_t offset = watched ? (int32_t)(total / (int64_t)watched) : 0;
+    int32_t threshold = (int32_t)m_options.threshold * 256;
+
+    size_t changed = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+        int32_t diff = m_levels[i] - (int32_t)(m_background[i] >> 16);
+        if((!masked || m_mask[i]) && abs(diff - offset) > threshold)
+            changed++;
+
+        m_background[i] += (((int64_t)m_levels[i] << 16) - m_background[i]) /
+            (1 << m_options.background_shift);
+    }
+
+    return watched ? (unsigned)(changed * 1000 / watched) : 0;
+}
+
+bool MotionDetector::update(const unsigned char* data, size_t size,
+    int64_t time_us)
+{
+    m_frame.ok = m_decoder.parse(data, size) &&
+        m_decoder.decode_dc(1, m_frame.luma);
+    m_frame.cell_width = m_decoder.mcu_width() / 8;
+    m_frame.cell_height = m_decoder.mcu_height() / 8;
+
+    return update(m_frame, time_us);
+}
+
+bool MotionDetector::update(const MotionFrame& frame, int64_t time_us)
+{
+    m_frames++;
+
+    if(!frame.ok || frame.luma.channels != 1 || frame.cell_width <= 0 ||
+       frame.cell_height <= 0)
+    {
+        m_failures++;
+        return true;
+    }
+
+    measure(frame);
+
+    if(m_background.empty())
+    {
+        m_background.resize(m_levels.size());
+        for(size_t i = 0; i < m_levels.size(); i++)
+            m_background[i] = (int64_t)m_levels[i] << 16;
+        m_changed = 0;
+        m_above = 0;
+        m_moving = false;
+        return false;
+    }
+
+    m_changed = compare();
+
+    if(m_changed >= m_options.start_per_mille)
+        m_above++;
+    else
+        m_above = 0;
+
+    if(!m_moving && m_above >= m_options.start_frames)
+    {
+        m_moving = true;
+        m_last_motion_us = time_us;
+    }
+
+    if(m_moving)
+    {
+        if(m_changed >= m_options.stop_per_mille)
+            m_last_motion_us = time_us;
+        else if(time_us - m_last_motion_us > (int64_t)m_options.hold_ms * 1000)
+            m_moving = false;
+    }
+
+    return m_moving;
+}
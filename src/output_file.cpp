@@ -0,0 +1,870 @@
+#include "output_file.h"
+#include "io_queue.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+// slices at least this large are written straight from the caller's memory
+// on platforms without a gathered write; smaller ones are staged and merged.
+static const size_t STAGE_THRESHOLD = 256 * 1024;
+static const size_t STAGE_CAPACITY  = 4 * 1024 * 1024;
+
+// size of the aligned bounce buffer used for unaligned data in direct mode
+static const size_t DIRECT_TAIL_CAPACITY = 4 * 1024 * 1024;
+
+// direct writes going through an IoQueue are cut into pieces of this size
+// so the device sees several at once
+static const size_t QUEUE_CHUNK = 512 * 1024;
+
+static bool is_aligned(const void* p, size_t alignment)
+{
+    return ((uintptr_t)p & (alignment - 1)) == 0;
+}
+
+#ifdef _WIN32
+
+OutputFile::OutputFile() : m_handle(INVALID_HANDLE_VALUE), m_start(0),
+    m_keep_size(0),
+    m_bytes_written(0), m_write_calls(0), m_direct(false),
+    m_preallocated(false), m_dir_synced(false), m_queued(false), m_offset(0),
+    m_tail(&m_own_tail), m_tail_fixed(0), m_tail_generation(0)
+{
+}
+
+bool OutputFile::open_native(const std::string& path, bool direct,
+    bool truncate)
+{
+    DWORD access = GENERIC_WRITE;
+    DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+
+    if(direct)
+    {
+        // the last partial block of an existing file has to be read back
+        access |= GENERIC_READ;
+        flags |= FILE_FLAG_NO_BUFFERING;
+    }
+
+    m_handle = CreateFileA(path.c_str(), access, FILE_SHARE_READ, NULL,
+        truncate ? CREATE_ALWAYS : OPEN_ALWAYS, flags, NULL);
+
+    if(m_handle == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: Failed to open '%s' (error %lu)\n",
+            path.c_str(), (unsigned long)GetLastError());
+        return false;
+    }
+
+    if(!direct)
+    {
+        LARGE_INTEGER zero;
+        zero.QuadPart = 0;
+        SetFilePointerEx(m_handle, zero, NULL, FILE_END);
+        m_staging.reserve(STAGE_CAPACITY);
+    }
+
+    return true;
+}
+
+void OutputFile::close_native()
+{
+    if(m_handle != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_handle);
+        m_handle = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool OutputFile::is_open() const
+{
+    return m_handle != INVALID_HANDLE_VALUE;
+}
+
+uint64_t OutputFile::file_size()
+{
+    LARGE_INTEGER size;
+    if(!GetFileSizeEx(m_handle, &size))
+        return 0;
+    return size.QuadPart;
+}
+
+bool OutputFile::write_raw(const void* data, size_t size)
+{
+    const char* p = (const char*)data;
+
+    while(size > 0)
+    {
+        // WriteFile takes a DWORD length, so very large buffers are split
+        DWORD chunk = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+        DWORD written = 0;
+
+        m_write_calls++;
+        if(!WriteFile(m_handle, p, chunk, &written, NULL))
+        {
+            fprintf(stderr, "ERROR: Write to '%s' failed (error %lu)\n",
+                m_path.c_str(), (unsigned long)GetLastError());
+            return false;
+        }
+
+        p += written;
+        size -= written;
+        m_bytes_written += written;
+    }
+
+    return true;
+}
+
+bool OutputFile::write_at(const void* data, size_t size, uint64_t offset)
+{
+    const char* p = (const char*)data;
+
+    while(size > 0)
+    {
+        // keep chunks block aligned so this also works for direct handles
+        DWORD chunk = (size > 0x40000000) ? 0x40000000 : (DWORD)size;
+        DWORD written = 0;
+
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof ov);
+        ov.Offset = (DWORD)offset;
+        ov.OffsetHigh = (DWORD)(offset >> 32);
+
+        m_write_calls++;
+        if(!WriteFile(m_handle, p, chunk, &written, &ov))
+        {
+            fprintf(stderr, "ERROR: Write to '%s' failed (error %lu)\n",
+                m_path.c_str(), (unsigned long)GetLastError());
+            return false;
+        }
+
+        p += written;
+        size -= written;
+        offset += written;
+    }
+
+    if(!m_direct)
+    {
+        // a positioned write on a synchronous handle also moves the file
+        // pointer; put it back at the end for the next sequential write
+        LARGE_INTEGER end;
+        end.QuadPart = position();
+        SetFilePointerEx(m_handle, end, NULL, FILE_BEGIN);
+    }
+
+    return true;
+}
+
+bool OutputFile::read_at(void* data, size_t size, uint64_t offset)
+{
+    OVERLAPPED ov;
+    memset(&ov, 0, sizeof ov);
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+
+    DWORD got = 0;
+    return ReadFile(m_handle, data, (DWORD)size, &got, &ov) != 0;
+}
+
+bool OutputFile::truncate(uint64_t size)
+{
+    LARGE_INTEGER pos;
+    pos.QuadPart = size;
+
+    return SetFilePointerEx(m_handle, pos, NULL, FILE_BEGIN) &&
+        SetEndOfFile(m_handle);
+}
+
+bool OutputFile::seek_native(uint64_t offset)
+{
+    LARGE_INTEGER pos;
+    pos.QuadPart = offset;
+    return SetFilePointerEx(m_handle, pos, NULL, FILE_BEGIN) != 0;
+}
+
+bool OutputFile::extend(uint64_t size)
+{
+    if(file_size() >= size)
+        return true;
+
+    FILE_ALLOCATION_INFO alloc;
+    alloc.AllocationSize.QuadPart = size;
+    SetFileInformationByHandle(m_handle, FileAllocationInfo, &alloc,
+        sizeof alloc);
+
+    FILE_END_OF_FILE_INFO end;
+    end.EndOfFile.QuadPart = size;
+    return SetFileInformationByHandle(m_handle, FileEndOfFileInfo, &end,
+        sizeof end) != 0;
+}
+
+bool OutputFile::sync_native()
+{
+    // NTFS journals the directory entry itself, so only the file needs it
+    m_dir_synced = true;
+
+    if(!FlushFileBuffers(m_handle))
+    {
+        fprintf(stderr, "ERROR: Failed to sync '%s' (error %lu)\n",
+            m_path.c_str(), (unsigned long)GetLastError());
+        return false;
+    }
+
+    return true;
+}
+
+bool OutputFile::preallocate(uint64_t size)
+{
+    // sets the allocation size only; the end of file stays where it is
+    FILE_ALLOCATION_INFO info;
+    info.AllocationSize.QuadPart = size;
+
+    if(!SetFileInformationByHandle(m_handle, FileAllocationInfo, &info,
+        sizeof info))
+    {
+        return false;
+    }
+
+    m_preallocated = true;
+    return true;
+}
+
+bool OutputFile::write_gather(const IoSlice* slices, size_t count)
+{
+    if(m_direct)
+        return direct_gather(slices, count);
+
+    m_staging.clear();
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const IoSlice& s = slices[i];
+
+        if(s.size >= STAGE_THRESHOLD ||
+           m_staging.size() + s.size > STAGE_CAPACITY)
+        {
+            if(!m_staging.empty())
+            {
+                if(!write_raw(&m_staging[0], m_staging.size()))
+                    return false;
+                m_staging.clear();
+            }
+        }
+
+        if(s.size >= STAGE_THRESHOLD)
+        {
+            if(!write_raw(s.data, s.size))
+                return false;
+        }
+        else
+        {
+            const unsigned char* p = (const unsigned char*)s.data;
+            m_staging.insert(m_staging.end(), p, p + s.size);
+        }
+    }
+
+    if(!m_staging.empty())
+    {
+        if(!write_raw(&m_staging[0], m_staging.size()))
+            return false;
+        m_staging.clear();
+    }
+
+    return true;
+}
+
+#else // POSIX
+
+OutputFile::OutputFile() : m_fd(-1), m_start(0), m_keep_size(0),
+    m_bytes_written(0),
+    m_write_calls(0), m_direct(false), m_preallocated(false),
+    m_dir_synced(false), m_queued(false), m_offset(0), m_tail(&m_own_tail),
+    m_tail_fixed(0), m_tail_generation(0)
+{
+}
+
+bool OutputFile::open_native(const std::string& path, bool direct,
+    bool truncate)
+{
+    // not O_APPEND: Linux ignores the offset given to pwrite() on an
+    // O_APPEND descriptor, which would break patch(). We seek to the end
+    // once below instead.
+    int flags = O_WRONLY | O_CREAT;
+
+    if(direct)
+    {
+        // positions are tracked by hand with pwrite, and the last partial
+        // block of an existing file has to be read back
+        flags = O_RDWR | O_CREAT;
+      #ifdef O_DIRECT
+        flags |= O_DIRECT;
+      #endif
+    }
+
+    if(truncate)
+        flags |= O_TRUNC;
+
+    m_fd = ::open(path.c_str(), flags, 0644);
+
+    if(m_fd < 0)
+    {
+        fprintf(stderr, "ERROR: Failed to open '%s': %s\n",
+            path.c_str(), strerror(errno));
+        return false;
+    }
+
+  #ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  #endif
+
+    if(!direct)
+        lseek(m_fd, 0, SEEK_END);
+
+    return true;
+}
+
+void OutputFile::close_native()
+{
+    if(m_fd >= 0)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+}
+
+bool OutputFile::is_open() const
+{
+    return m_fd >= 0;
+}
+
+uint64_t OutputFile::file_size()
+{
+    struct stat st;
+    if(fstat(m_fd, &st) != 0)
+        return 0;
+    return st.st_size;
+}
+
+bool OutputFile::write_raw(const void* data, size_t size)
+{
+    IoSlice s = { data, size };
+    return write_gather(&s, 1);
+}
+
+bool OutputFile::write_at(const void* data, size_t size, uint64_t offset)
+{
+    const char* p = (const char*)data;
+
+    while(size > 0)
+    {
+        m_write_calls++;
+        ssize_t written = ::pwrite(m_fd, p, size, offset);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            fprintf(stderr, "ERROR: Write to '%s' failed: %s\n",
+                m_path.c_str(), strerror(errno));
+            return false;
+        }
+
+        p += written;
+        size -= written;
+        offset += written;
+    }
+
+    return true;
+}
+
+bool OutputFile::read_at(void* data, size_t size, uint64_t offset)
+{
+    return ::pread(m_fd, data, size, offset) >= 0;
+}
+
+bool OutputFile::truncate(uint64_t size)
+{
+    return ::ftruncate(m_fd, size) == 0;
+}
+
+bool OutputFile::seek_native(uint64_t offset)
+{
+    return ::lseek(m_fd, (off_t)offset, SEEK_SET) == (off_t)offset;
+}
+
+bool OutputFile::extend(uint64_t size)
+{
+    if(file_size() >= size)
+        return true;
+
+    return ::posix_fallocate(m_fd, 0, (off_t)size) == 0;
+}
+
+bool OutputFile::sync_native()
+{
+    int rc;
+    do
+    {
+      #ifdef __linux__
+        // the data and the file length, without the timestamps
+        rc = ::fdatasync(m_fd);
+      #else
+        rc = ::fsync(m_fd);
+      #endif
+    } while(rc != 0 && errno == EINTR);
+
+    if(rc != 0)
+    {
+        fprintf(stderr, "ERROR: Failed to sync '%s': %s\n",
+            m_path.c_str(), strerror(errno));
+        return false;
+    }
+
+    if(!m_dir_synced)
+    {
+        // a file created since the last crash is only reachable once its
+        // directory has been synced too
+        size_t slash = m_path.find_last_of('/');
+        string dir = (slash == string::npos) ? "." :
+            (slash == 0) ? "/" : m_path.substr(0, slash);
+
+        int fd = ::open(dir.c_str(), O_RDONLY);
+        if(fd >= 0)
+        {
+            ::fsync(fd);
+            ::close(fd);
+        }
+
+        m_dir_synced = true;
+    }
+
+    return true;
+}
+
+bool OutputFile::preallocate(uint64_t size)
+{
+  #ifdef FALLOC_FL_KEEP_SIZE
+    // KEEP_SIZE so st_size keeps tracking what has really been written;
+    // readers of a file that is still growing rely on that
+    if(::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, size) != 0)
+        return false;
+
+    m_preallocated = true;
+    return true;
+  #else
+    // posix_fallocate() would move the end of file
+    (void)size;
+    return false;
+  #endif
+}
+
+bool OutputFile::write_gather(const IoSlice* slices, size_t count)
+{
+    if(m_direct)
+        return direct_gather(slices, count);
+
+    static const size_t MAX_IOV =
+    #ifdef IOV_MAX
+        IOV_MAX;
+    #else
+        1024;
+    #endif
+
+    vector<struct iovec> iov(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        iov[i].iov_base = (void*)slices[i].data;
+        iov[i].iov_len = slices[i].size;
+    }
+
+    size_t first = 0;
+    while(first < count)
+    {
+        if(iov[first].iov_len == 0)
+        {
+            first++;
+            continue;
+        }
+
+        size_t n = count - first;
+        if(n > MAX_IOV)
+            n = MAX_IOV;
+
+        m_write_calls++;
+        ssize_t written = ::writev(m_fd, &iov[first], (int)n);
+
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+
+            fprintf(stderr, "ERROR: Write to '%s' failed: %s\n",
+                m_path.c_str(), strerror(errno));
+            return false;
+        }
+
+        m_bytes_written += written;
+
+        // advance past whatever the kernel accepted; a short write leaves
+        // us in the middle of a slice
+        size_t left = (size_t)written;
+        while(first < count && left >= iov[first].iov_len)
+        {
+            left -= iov[first].iov_len;
+            first++;
+        }
+
+        if(left > 0)
+        {
+            iov[first].iov_base = (char*)iov[first].iov_base + left;
+            iov[first].iov_len -= left;
+        }
+    }
+
+    return true;
+}
+
+#endif
+
+OutputFile::~OutputFile()
+{
+    close();
+}
+
+bool OutputFile::open(const std::string& path, unsigned flags)
+{
+    close();
+
+    bool direct = (flags & OPEN_DIRECT) != 0;
+    bool truncate = (flags & OPEN_TRUNCATE) != 0;
+    bool overwrite = (flags & OPEN_OVERWRITE) != 0 && !truncate;
+    if(!open_native(path, direct, truncate))
+        return false;
+
+    if(overwrite && !direct && !seek_native(0))
+    {
+        fprintf(stderr, "ERROR: Failed to rewind '%s'\n", path.c_str());
+        close_native();
+        return false;
+    }
+
+    m_path = path;
+    m_start = (direct || overwrite) ? 0 : file_size();
+    m_keep_size = overwrite ? file_size() : 0;
+    m_bytes_written = 0;
+    m_write_calls = 0;
+    m_direct = direct;
+    m_preallocated = false;
+    m_dir_synced = false;
+    m_offset = 0;
+    m_tail->clear();
+
+    if(direct)
+        m_tail->reserve(DIRECT_TAIL_CAPACITY);
+
+    if(direct && !overwrite)
+    {
+        // appending to an existing file: restart at the last whole block
+        // and pull the partial block after it back into the tail
+        uint64_t size = file_size();
+        m_offset = size & ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+        size_t partial = (size_t)(size - m_offset);
+
+        if(partial)
+        {
+            if(!read_at(m_tail->data(), DIRECT_ALIGNMENT, m_offset))
+            {
+                fprintf(stderr, "ERROR: Failed to read back the end of '%s'\n",
+                    path.c_str());
+                close_native();
+                return false;
+            }
+            m_tail->resize(partial);
+        }
+    }
+
+    return true;
+}
+
+void OutputFile::close()
+{
+    if(is_open() && m_direct && !m_tail->empty())
+    {
+        // the last block has to go out whole; pad it, then trim the file
+        // back to the real length
+        size_t size = m_tail->size();
+        size_t padded = (size + DIRECT_ALIGNMENT - 1) &
+            ~(DIRECT_ALIGNMENT - 1);
+
+        memset(m_tail->data() + size, 0, padded - size);
+        if(write_at(m_tail->data(), padded, m_offset))
+            truncate(max(m_offset + size, m_keep_size));
+
+        m_bytes_written += size;
+        m_tail->clear();
+    }
+    else if(is_open() && m_preallocated)
+    {
+        // cutting the file at its current length frees the reserved blocks
+        // past it
+        truncate(max(position(), m_keep_size));
+    }
+
+    close_native();
+}
+
+bool OutputFile::sync()
+{
+    if(!is_open())
+        return false;
+
+    if(m_direct && !m_tail->empty())
+    {
+        // the partial block goes out padded, as close() would write it; it
+        // stays in the tail and is written again, whole, once it fills
+        size_t size = m_tail->size();
+        size_t padded = (size + DIRECT_ALIGNMENT - 1) &
+            ~(DIRECT_ALIGNMENT - 1);
+
+        memset(m_tail->data() + size, 0, padded - size);
+        if(!write_at(m_tail->data(), padded, m_offset))
+            return false;
+    }
+
+    return sync_native();
+}
+
+bool OutputFile::write(const void* data, size_t size)
+{
+    IoSlice s = { data, size };
+    return write_gather(&s, 1);
+}
+
+uint64_t OutputFile::position() const
+{
+    if(m_direct)
+        return m_offset + m_tail->size();
+
+    return m_start + m_bytes_written;
+}
+
+uint64_t OutputFile::visible_position() const
+{
+    if(m_direct)
+        return m_offset;
+
+    return position();
+}
+
+bool OutputFile::patch(uint64_t offset, const void* data, size_t size)
+{
+    if(offset + size > position())
+        return false;
+
+    if(!m_direct)
+        return write_at(data, size, offset);
+
+    const unsigned char* p = (const unsigned char*)data;
+
+    // whatever falls in the unwritten tail is simply changed in memory
+    if(offset + size > m_offset)
+    {
+        uint64_t from = (offset > m_offset) ? offset : m_offset;
+        memcpy(m_tail->data() + (from - m_offset), p + (from - offset),
+            (size_t)(offset + size - from));
+        size = (size_t)(from - offset);
+    }
+
+    if(size == 0)
+        return true;
+
+    // the rest is on disk in whole blocks, all before m_offset; read them
+    // back, change them and write them out again
+    uint64_t first = offset & ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+    uint64_t last = (offset + size + DIRECT_ALIGNMENT - 1) &
+        ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+    size_t span = (size_t)(last - first);
+
+    m_patch.resize(span);
+    if(!read_at(m_patch.data(), span, first))
+    {
+        fprintf(stderr, "ERROR: Failed to read back '%s' for a patch\n",
+            m_path.c_str());
+        return false;
+    }
+
+    memcpy(m_patch.data() + (offset - first), p, size);
+    return write_at(m_patch.data(), span, first);
+}
+
+void OutputFile::set_tail(FrameBuffer* tail, unsigned fixed)
+{
+    m_tail = tail ? tail : &m_own_tail;
+    m_tail_fixed = tail ? fixed : 0;
+    m_tail_generation = m_tail->generation();
+}
+
+size_t OutputFile::tail_capacity()
+{
+    return DIRECT_TAIL_CAPACITY;
+}
+
+// the IoSlice::fixed value for the tail on this thread's queue: only if
+// the queue has it registered, and it has not been moved since
+unsigned OutputFile::tail_fixed() const
+{
+    IoQueue* queue = IoQueue::current();
+    if(!queue || !m_tail_fixed || m_tail_fixed > queue->registered_count() ||
+       m_tail->generation() != m_tail_generation)
+    {
+        return 0;
+    }
+
+    return m_tail_fixed;
+}
+
+// starts a block write: on the thread's IoQueue if there is one, in which
+// case the memory must be left alone until complete_writes(), otherwise
+// straight away
+bool OutputFile::submit_at(const void* data, size_t size, uint64_t offset,
+    unsigned fixed)
+{
+#ifndef _WIN32
+    IoQueue* queue = IoQueue::current();
+    if(queue && queue->ready())
+    {
+        const unsigned char* p = (const unsigned char*)data;
+        m_queued = true;
+
+        while(size > 0)
+        {
+            size_t chunk = (size > QUEUE_CHUNK) ? QUEUE_CHUNK : size;
+            if(!queue->write(m_fd, p, chunk, offset, fixed))
+                return false;
+
+            p += chunk;
+            size -= chunk;
+            offset += chunk;
+        }
+
+        return true;
+    }
+#endif
+
+    (void)fixed;
+    return write_at(data, size, offset);
+}
+
+// waits for everything submit_at() has queued
+bool OutputFile::complete_writes()
+{
+    if(!m_queued)
+        return true;
+
+    m_queued = false;
+
+    IoQueue* queue = IoQueue::current();
+    if(!queue->wait_all())
+    {
+        fprintf(stderr, "ERROR: Write to '%s' failed\n", m_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// writes out every whole block in the tail and moves the leftover partial
+// block to the front
+bool OutputFile::flush_tail_blocks()
+{
+    size_t whole = m_tail->size() & ~(DIRECT_ALIGNMENT - 1);
+    if(whole == 0)
+        return true;
+
+    // the partial block is about to be moved down over what is being
+    // written, so this has to finish first
+    if(!submit_at(m_tail->data(), whole, m_offset, tail_fixed()) ||
+       !complete_writes())
+        return false;
+
+    m_offset += whole;
+    m_bytes_written += whole;
+
+    size_t left = m_tail->size() - whole;
+    memmove(m_tail->data(), m_tail->data() + whole, left);
+    m_tail->resize(left);
+    return true;
+}
+
+bool OutputFile::direct_gather(const IoSlice* slices, size_t count)
+{
+    IoQueue* queue = IoQueue::current();
+    uint64_t enters = queue ? queue->enter_calls() : 0;
+
+    bool ok = direct_gather_blocks(slices, count);
+
+    // leave at most one partial block behind
+    ok = ok && flush_tail_blocks();
+    ok = complete_writes() && ok;
+
+    if(queue)
+        m_write_calls += queue->enter_calls() - enters;
+
+    return ok;
+}
+
+bool OutputFile::direct_gather_blocks(const IoSlice* slices, size_t count)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        const unsigned char* p = (const unsigned char*)slices[i].data;
+        size_t n = slices[i].size;
+
+        while(n > 0)
+        {
+            // fast path: the file position is block aligned and so is the
+            // caller's memory (FrameBuffer storage is), so the whole blocks
+            // can go to disk without a copy
+            if(m_tail->empty() && n >= DIRECT_ALIGNMENT &&
+               is_aligned(p, DIRECT_ALIGNMENT))
+            {
+                size_t whole = n & ~(DIRECT_ALIGNMENT - 1);
+                if(!submit_at(p, whole, m_offset, slices[i].fixed))
+                    return false;
+
+                m_offset += whole;
+                m_bytes_written += whole;
+                p += whole;
+                n -= whole;
+                continue;
+            }
+
+            size_t room = m_tail->capacity() - m_tail->size();
+            size_t take = (n < room) ? n : room;
+
+            size_t old = m_tail->size();
+            m_tail->resize(old + take);
+            memcpy(m_tail->data() + old, p, take);
+            p += take;
+            n -= take;
+
+            if(m_tail->size() == m_tail->capacity())
+            {
+                if(!flush_tail_blocks())
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
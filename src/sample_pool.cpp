@@ -0,0 +1,110 @@
+#include "sample_pool.h"
+using namespace std;
+
+SamplePool::SamplePool() : m_count(0), m_size(0), m_prefix(0),
+    m_committed(false)
+{
+}
+
+bool SamplePool::set_properties(size_t count, size_t size, size_t prefix)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if(m_committed || m_free.size() != m_slots.size())
+        return false;
+
+    if(count != m_count || size != m_size || prefix != m_prefix)
+    {
+        // storage no longer matches; drop it and let commit() rebuild
+        m_slots.clear();
+        m_free.clear();
+    }
+
+    m_count = count;
+    m_size = size;
+    m_prefix = prefix;
+    return true;
+}
+
+bool SamplePool::commit()
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    if(m_count == 0 || m_size == 0)
+        return false;
+
+    if(m_slots.empty())
+    {
+        m_slots.reserve(m_count);
+        m_free.reserve(m_count);
+
+        for(size_t i = 0; i < m_count; i++)
+        {
+            unique_ptr<Slot> slot(new Slot());
+            slot->index = i;
+            slot->memory.reserve(m_prefix + m_size);
+            slot->memory.resize(m_prefix + m_size);
+            slot->memory.prefault();
+
+            m_free.push_back(slot.get());
+            m_slots.push_back(std::move(slot));
+        }
+    }
+
+    m_committed = true;
+    return true;
+}
+
+void SamplePool::decommit()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_committed = false;
+    }
+
+    m_cv.notify_all();
+}
+
+bool SamplePool::committed()
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_committed;
+}
+
+SamplePool::Slot* SamplePool::acquire(bool wait)
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    if(wait)
+    {
+        m_cv.wait(lock, [this]{
+            return !m_committed || !m_free.empty();
+        });
+    }
+
+    if(!m_committed || m_free.empty())
+        return NULL;
+
+    Slot* slot = m_free.back();
+    m_free.pop_back();
+    return slot;
+}
+
+void SamplePool::release(Slot* slot)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        // m_free was reserved for every slot, so this never reallocates
+        m_free.push_back(slot);
+    }
+
+    m_cv.notify_one();
+}
+
+size_t SamplePool::outstanding()
+{
+    lock_guard<mutex> lock(m_mutex);
+    return m_slots.size() - m_free.size();
+}
+
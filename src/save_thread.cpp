@@ -1,30 +1,1860 @@
 #include "save_thread.h"
+#include "avi_writer.h"
+#include "jpeg_dht.h"
+#include "frame_hash.h"
+#include <cstdio>
 #include <cstring>
+#include <algorithm>
+#include <chrono>
 using namespace std;
 
-void dump_file(const char* path, void* data, size_t size)
+// === SaveBuffer ===
+
+void SaveBuffer::store(void* src, size_t byte_count)
+{
+    if(sample)
+        sample->release();
+
+    // FrameBuffer::resize() does not zero-fill, so this is the only pass
+    // over the frame
+    data.resize(byte_count);
+    memcpy(data.data(), src, byte_count);
+}
+
+void SaveBuffer::detach()
 {
-    FILE* fp = fopen(path, "wb");
-    if(!fp)
+    if(!sample || !sample->held())
         return;
-    
-    fwrite(data, 1, size, fp);
-    fclose(fp);
+
+    data.resize(sample->size());
+    memcpy(data.data(), sample->data(), sample->size());
+    sample->release();
 }
 
-void SaveBuffer::store(void* src, size_t byte_count)
+const unsigned char* SaveBuffer::bytes() const
 {
-    data.resize(byte_count);
-    memcpy(&data[0], src, byte_count);
+    if(sample && sample->held())
+        return sample->data();
+
+    return data.data();
+}
+
+size_t SaveBuffer::byte_count() const
+{
+    if(sample && sample->held())
+        return sample->size();
+
+    return data.size();
 }
 
-void SaveBuffer::save()
+bool SaveBuffer::save(const std::string& path, bool sync) const
 {
-    
+    // OutputFile reports its own errors
+    OutputFile file;
+    if(!file.open(path, OutputFile::OPEN_TRUNCATE))
+        return false;
+
+    // a file of its own has to open in any viewer, so it gets the standard
+    // Huffman tables if the camera left them out
+    IoSlice slices[3];
+    size_t count = jpeg_standalone_slices(bytes(), byte_count(), 0, slices);
+
+    bool ok = file.write_gather(slices, count);
+    if(ok && sync)
+        ok = file.sync();
+
+    file.close();
+    return ok;
 }
 
 void SaveBuffer::clear()
 {
-    
+    data.clear();
+    if(sample)
+        sample->release();
+    camera = 0;
+    capture_ns = 0;
+    stream_time = 0;
+    has_stream_time = false;
+    time_us = 0;
+    is_one_shot = false;
+    one_shot_tag = 0;
+    damaged = false;
+    hash = 0;
+    has_hash = false;
+}
+
+// === SaveThread ===
+
+SaveThread::SaveThread(const std::string& base_path,
+    const SaveOptions& options) :
+    m_writer_count(options.writer_count ? options.writer_count : 1),
+    m_should_quit(false), m_dropped(0), m_base_path(base_path),
+    m_options(options), m_budget(options.budget), m_pending_frames(0),
+    m_pending_bytes(0), m_blocked(0), free_buffers(options.budget.max_frames),
+    m_fixed_tails(0), m_fixed_warned(false), m_fixed_version(0)
+{
+    if(m_budget.max_frames == 0)
+        m_budget.max_frames = 1;
+    if(m_budget.keep_every == 0)
+        m_budget.keep_every = 1;
+
+    for(int i = 0; i < MAX_CAMERAS; i++)
+    {
+        CameraCounters& cc = m_counters[i];
+        cc.frames = 0;
+        cc.queue_full = 0;
+        cc.evicted = 0;
+        cc.decimated = 0;
+        cc.timed_out = 0;
+        cc.last_drop_frame = 0;
+        cc.decimating = false;
+        m_event_at[i] = NO_EVENT;
+        m_snap_wanted[i] = 0;
+        m_motion_version[i] = 0;
+
+        // one shard per camera; the budget caps the total across all of them
+        m_shards.push_back(unique_ptr<Shard>(new Shard(m_budget.max_frames)));
+    }
+
+    if(m_options.direct_io && m_options.io_backend == IO_BACKEND_URING)
+    {
+        m_fixed_spare.reserve(FrameBuffer::page_size());
+        IoSlice spare = { m_fixed_spare.data(), m_fixed_spare.capacity(), 0 };
+        m_fixed.assign(FIXED_TAILS, spare);
+    }
+
+    if(m_options.format == FORMAT_JPEG_FILES)
+    {
+        m_dirs.reset(new TimeDirectories(m_base_path));
+        m_dirs->start();
+    }
+
+    // motion gating decodes frames much as thumbnails do, and shares the
+    // pool, and the decode, with them
+    int thumbnail_channels = m_options.format == FORMAT_SEGMENT ?
+        m_options.thumbnail_channels : 0;
+    if(thumbnail_channels || motion_gated())
+    {
+        m_thumbnails.reset(new ThumbnailPool(thumbnail_channels,
+            m_options.thumbnail_workers));
+        m_thumbnails->start();
+    }
+
+    for(size_t i = 0; i < m_writer_count; i++)
+        m_threads.push_back(std::thread(&SaveThread::thread_main, this, i));
+
+    m_snap_thread = std::thread(&SaveThread::snapshot_main, this);
+}
+
+SaveThread::~SaveThread()
+{
+    stop();
+}
+
+void SaveThread::stop()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_should_quit = true;
+    }
+
+    m_cv.notify_all();
+
+    {
+        lock_guard<mutex> lock(m_space_mutex);
+        m_space_cv.notify_all();
+    }
+
+    {
+        lock_guard<mutex> lock(m_snap_mutex);
+        m_snap_cv.notify_all();
+        m_snap_done_cv.notify_all();
+    }
+
+    for(size_t i = 0; i < m_threads.size(); i++)
+    {
+        if(m_threads[i].joinable())
+            m_threads[i].join();
+    }
+
+    if(m_snap_thread.joinable())
+        m_snap_thread.join();
+
+    if(m_dirs)
+        m_dirs->stop();
+
+    if(m_thumbnails)
+        m_thumbnails->stop();
+}
+
+void SaveThread::reserve_free_buffers(size_t buffer_count,
+    size_t initial_data_reserve)
+{
+    for(size_t i = 0; i < buffer_count; i++)
+    {
+        unique_ptr<SaveBuffer> buf = new_buffer();
+        buf->data.reserve(initial_data_reserve);
+        buf->data.prefault();
+
+        if(m_options.io_backend != IO_BACKEND_URING)
+        {
+            // anything beyond the ring's capacity is simply freed again
+            free_buffers.push(buf);
+            continue;
+        }
+
+        // held across the push, so that a buffer the ring has no room for
+        // can be taken back out of m_fixed before it is freed; registering
+        // freed memory would make the kernel refuse the whole set
+        lock_guard<mutex> lock(m_fixed_mutex);
+
+        // the kernel takes at most MAX_FIXED registered buffers
+        bool fixed = m_fixed.size() < MAX_FIXED;
+        if(fixed)
+        {
+            buf->fixed_index = (int)m_fixed.size();
+            buf->fixed_generation = buf->data.generation();
+
+            IoSlice region = { buf->data.data(), buf->data.capacity(), 0 };
+            m_fixed.push_back(region);
+        }
+
+        if(!free_buffers.push(buf) && fixed)
+            m_fixed.pop_back();
+    }
+
+    if(m_options.io_backend == IO_BACKEND_URING)
+        m_fixed_version.fetch_add(1);
+}
+
+std::unique_ptr<SaveBuffer> SaveThread::new_buffer()
+{
+    unique_ptr<SaveBuffer> buf(new SaveBuffer());
+    buf->data.set_huge_pages(m_options.huge_pages);
+    return buf;
+}
+
+std::unique_ptr<SaveBuffer> SaveThread::get_buffer()
+{
+    unique_ptr<SaveBuffer> buf = free_buffers.pop();
+
+    if(!buf)
+        buf = new_buffer();
+
+    return buf;
+}
+
+// index into the per-camera arrays; cameras numbered MAX_CAMERAS or above
+// share the last entry
+static int camera_slot(int camera)
+{
+    if(camera < 0)
+        return 0;
+    if(camera >= SaveThread::MAX_CAMERAS)
+        return SaveThread::MAX_CAMERAS - 1;
+    return camera;
+}
+
+SaveThread::CameraCounters& SaveThread::counters_for(int camera)
+{
+    return m_counters[camera_slot(camera)];
+}
+
+SaveThread::Shard& SaveThread::shard_for(int camera)
+{
+    return *m_shards[camera_slot(camera)];
+}
+
+void SaveThread::note_drop(CameraCounters& cc, std::atomic<uint64_t>& reason)
+{
+    reason.fetch_add(1, memory_order_relaxed);
+    cc.last_drop_frame.store(cc.frames.load(memory_order_relaxed),
+        memory_order_relaxed);
+    m_dropped.fetch_add(1, memory_order_relaxed);
+}
+
+bool SaveThread::has_room(size_t bytes) const
+{
+    size_t frames = m_pending_frames.load();
+    if(frames >= m_budget.max_frames)
+        return false;
+
+    // a single frame larger than the whole byte budget is still let through
+    // when the queue is empty; otherwise that camera could never save
+    if(m_budget.max_bytes && frames > 0 &&
+       m_pending_bytes.load() + bytes > m_budget.max_bytes)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool SaveThread::wait_for_room(size_t bytes)
+{
+    if(m_budget.block_us == 0)
+        return false;
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+        chrono::microseconds(m_budget.block_us);
+
+    m_blocked.fetch_add(1);
+
+    bool room;
+    {
+        unique_lock<mutex> lock(m_space_mutex);
+        room = m_space_cv.wait_until(lock, deadline, [this, bytes]{
+            return has_room(bytes) || m_should_quit;
+        });
+    }
+
+    m_blocked.fetch_sub(1);
+    return room && !m_should_quit;
+}
+
+bool SaveThread::evict_oldest(Shard& preferred)
+{
+    // every shard's head is its oldest frame; the oldest of those is the
+    // oldest queued anywhere. The heads are only peeked at, so by the time
+    // one is popped a writer may have taken it and the next frame goes
+    // instead; near enough.
+    unique_ptr<SaveBuffer> victim;
+    Shard* shard = NULL;
+
+    for(int attempt = 0; !victim && attempt < 4; attempt++)
+    {
+        shard = NULL;
+        uint64_t oldest = 0;
+
+        for(size_t i = 0; i < m_shards.size(); i++)
+        {
+            uint64_t key;
+            if(m_shards[i]->queue.front_key(key) && (!shard || key < oldest))
+            {
+                shard = m_shards[i].get();
+                oldest = key;
+            }
+        }
+
+        if(!shard)
+            break;
+
+        victim = shard->queue.pop();
+    }
+
+    // the writers keep emptying shards under us; take whatever is left,
+    // starting with the camera's own
+    if(!victim)
+    {
+        shard = &preferred;
+        victim = shard->queue.pop();
+    }
+
+    for(size_t i = 0; !victim && i < m_shards.size(); i++)
+    {
+        shard = m_shards[i].get();
+        victim = shard->queue.pop();
+    }
+
+    if(!victim)
+        return false;
+
+    release_pending(*victim);
+    shard->queued.fetch_sub(1);
+
+    CameraCounters& cc = counters_for(victim->camera);
+    note_drop(cc, cc.evicted);
+
+    recycle(victim);
+    return true;
+}
+
+void SaveThread::release_pending(const SaveBuffer& buf)
+{
+    m_pending_frames.fetch_sub(1);
+    m_pending_bytes.fetch_sub(buf.byte_count());
+}
+
+bool SaveThread::enqueue(std::unique_ptr<SaveBuffer>& ptr)
+{
+    if(m_should_quit.load(memory_order_relaxed))
+        return false;
+
+    CameraCounters& cc = counters_for(ptr->camera);
+    Shard& shard = shard_for(ptr->camera);
+
+    // served before the budget is looked at, so a snapshot is taken even
+    // if the frame itself is then shed
+    if(m_snap_wanted[camera_slot(ptr->camera)].load(memory_order_relaxed))
+        take_snapshots(*ptr);
+
+    uint64_t seq = cc.frames.fetch_add(1, memory_order_relaxed);
+    size_t bytes = ptr->byte_count();
+    ptr->sequence = seq;
+
+    if(m_budget.policy == KEEP_EVERY_NTH && cc.decimating)
+    {
+        // stay decimated until the queue has drained to half its budget
+        if(m_pending_frames.load() > m_budget.max_frames / 2)
+        {
+            if(seq % m_budget.keep_every != 0)
+            {
+                note_drop(cc, cc.decimated);
+                return false;
+            }
+        }
+        else
+        {
+            cc.decimating = false;
+        }
+    }
+
+    while(!has_room(bytes))
+    {
+        switch(m_budget.policy)
+        {
+            case DROP_OLDEST:
+                if(evict_oldest(shard))
+                    continue;
+                break; // queue is empty; the frame is bigger than the budget
+
+            case KEEP_EVERY_NTH:
+                cc.decimating = true;
+                break;
+
+            case BLOCK:
+                if(wait_for_room(bytes))
+                    continue;
+                note_drop(cc, cc.timed_out);
+                return false;
+
+            case DROP_NEWEST:
+            default:
+                break;
+        }
+
+        note_drop(cc, cc.queue_full);
+        return false;
+    }
+
+    // Two producers can both see room for the last slot, so the budget may
+    // be overshot by a frame per capture thread. That is fine; the rings
+    // themselves are sized to the budget and stop real overruns.
+    m_pending_frames.fetch_add(1);
+    m_pending_bytes.fetch_add(bytes);
+
+    // count first, so a writer never takes a buffer it has not been told
+    // about; it may briefly see a count for a push that is still in flight
+    size_t before = shard.queued.fetch_add(1);
+
+    if(!shard.queue.push(ptr, (uint64_t)ptr->capture_ns))
+    {
+        shard.queued.fetch_sub(1);
+        release_pending(*ptr);
+        note_drop(cc, cc.queue_full);
+        return false;
+    }
+
+    if(before == 0)
+    {
+        // a writer may be asleep; taking the mutex orders this notify after
+        // its last look at the shards
+        lock_guard<mutex> lock(m_mutex);
+        m_cv.notify_one();
+    }
+
+    return true;
+}
+
+void SaveThread::recycle(std::unique_ptr<SaveBuffer>& ptr)
+{
+    ptr->clear();
+
+    // if the free list is full the pool has grown beyond what we need, so
+    // let the buffer go
+    if(!free_buffers.push(ptr))
+        ptr.reset();
+}
+
+void SaveThread::save(std::unique_ptr<SaveBuffer>& ptr)
+{
+    if(!ptr)
+        return;
+
+    if(!enqueue(ptr))
+        recycle(ptr);
+}
+
+void SaveThread::save_and_get_buffer(std::unique_ptr<SaveBuffer>& ptr)
+{
+    if(ptr && !enqueue(ptr))
+    {
+        // dropped; keep the buffer we already hold
+        ptr->clear();
+        return;
+    }
+
+    ptr = get_buffer();
+}
+
+static int64_t steady_us()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SaveThread::request_snapshot(int camera, int tag)
+{
+    if(camera < 0)
+        camera = 0;
+
+    SnapshotRequest r = { camera, tag, steady_us() };
+
+    lock_guard<mutex> lock(m_snap_mutex);
+    m_snap_requests.push_back(r);
+    m_snap_wanted[camera_slot(camera)]++;
+}
+
+// called on the capture path with a frame that at least one snapshot
+// request may be waiting for. Every request for the frame's camera gets a
+// copy of it.
+void SaveThread::take_snapshots(const SaveBuffer& frame)
+{
+    size_t size = frame.byte_count();
+    if(size == 0)
+        return;
+
+    lock_guard<mutex> lock(m_snap_mutex);
+
+    size_t i = 0;
+    while(i < m_snap_requests.size())
+    {
+        const SnapshotRequest& r = m_snap_requests[i];
+        if(r.camera != frame.camera)
+        {
+            i++;
+            continue;
+        }
+
+        Snapshot snap;
+        snap.buf = get_buffer();
+        snap.buf->data.resize(size);
+        memcpy(snap.buf->data.data(), frame.bytes(), size);
+        snap.buf->camera = frame.camera;
+        snap.buf->capture_ns = frame.capture_ns;
+        snap.buf->stream_time = frame.stream_time;
+        snap.buf->has_stream_time = frame.has_stream_time;
+        snap.buf->is_one_shot = true;
+        snap.buf->one_shot_tag = r.tag;
+        snap.asked_us = r.asked_us;
+        m_snap_ready.push_back(std::move(snap));
+
+        m_snap_requests.erase(m_snap_requests.begin() + i);
+        m_snap_wanted[camera_slot(frame.camera)]--;
+    }
+
+    m_snap_cv.notify_one();
+}
+
+// writes snapshots as they come in. Kept apart from the writers so that a
+// snapshot never waits behind a batch.
+void SaveThread::snapshot_main()
+{
+    unique_lock<mutex> lock(m_snap_mutex);
+
+    while(true)
+    {
+        m_snap_cv.wait(lock, [this]{
+            return m_should_quit || !m_snap_ready.empty();
+        });
+
+        if(m_snap_ready.empty())
+            break;
+
+        Snapshot snap = std::move(m_snap_ready.front());
+        m_snap_ready.erase(m_snap_ready.begin());
+        lock.unlock();
+
+        SnapshotResult result;
+        result.camera = snap.buf->camera;
+        result.tag = snap.buf->one_shot_tag;
+        result.path = one_shot_path(*snap.buf);
+        result.ok = snap.buf->save(result.path, true);
+        result.latency_us = steady_us() - snap.asked_us;
+        recycle(snap.buf);
+
+        lock.lock();
+        if(m_snap_done.size() >= MAX_SNAPSHOT_RESULTS)
+            m_snap_done.erase(m_snap_done.begin());
+        m_snap_done.push_back(result);
+        m_snap_done_cv.notify_all();
+    }
+}
+
+bool SaveThread::wait_snapshot(int camera, int tag, unsigned timeout_ms,
+    SnapshotResult& result)
+{
+    // as request_snapshot() stored it
+    if(camera < 0)
+        camera = 0;
+
+    chrono::steady_clock::time_point deadline = chrono::steady_clock::now() +
+        chrono::milliseconds(timeout_ms);
+
+    unique_lock<mutex> lock(m_snap_mutex);
+
+    while(true)
+    {
+        for(size_t i = 0; i < m_snap_done.size(); i++)
+        {
+            const SnapshotResult& done = m_snap_done[i];
+            if(done.camera == camera && done.tag == tag)
+            {
+                result = done;
+                m_snap_done.erase(m_snap_done.begin() + i);
+                return true;
+            }
+        }
+
+        if(m_should_quit ||
+           m_snap_done_cv.wait_until(lock, deadline) == cv_status::timeout)
+        {
+            return false;
+        }
+    }
+}
+
+SaveStats SaveThread::stats()
+{
+    lock_guard<mutex> lock(m_stats_mutex);
+    SaveStats result = m_stats;
+    result.dropped = m_dropped.load(memory_order_relaxed);
+    result.late_dirs = m_dirs ? m_dirs->late() : 0;
+
+    if(m_thumbnails)
+    {
+        result.thumbnails = m_thumbnails->built();
+        result.thumbnail_failures = m_thumbnails->failed();
+        result.thumbnail_ns = m_thumbnails->busy_ns();
+        result.thumbnail_pixels = m_thumbnails->source_pixels();
+    }
+    return result;
+}
+
+DropStats SaveThread::drop_stats(int camera)
+{
+    CameraCounters& cc = counters_for(camera);
+
+    DropStats result;
+    result.frames = cc.frames.load(memory_order_relaxed);
+    result.queue_full = cc.queue_full.load(memory_order_relaxed);
+    result.evicted = cc.evicted.load(memory_order_relaxed);
+    result.decimated = cc.decimated.load(memory_order_relaxed);
+    result.timed_out = cc.timed_out.load(memory_order_relaxed);
+    result.last_drop_frame = cc.last_drop_frame.load(memory_order_relaxed);
+    return result;
+}
+
+bool SaveThread::any_claimable() const
+{
+    for(size_t i = 0; i < m_shards.size(); i++)
+    {
+        const Shard& shard = *m_shards[i];
+        if(shard.queued.load() != 0 && !shard.in_use.load())
+            return true;
+    }
+
+    return false;
+}
+
+SaveThread::Shard* SaveThread::claim_shard(size_t writer, bool& stolen)
+{
+    size_t writers = m_writer_count;
+    size_t count = m_shards.size();
+
+    // two passes: first the shards this writer is home to, then anyone's
+    for(int pass = 0; pass < 2; pass++)
+    {
+        for(size_t n = 0; n < count; n++)
+        {
+            // start at a different shard per writer so they do not all
+            // contend on shard 0 when stealing
+            size_t i = (writer + n) % count;
+            bool home = (i % writers == writer);
+
+            if(home != (pass == 0))
+                continue;
+
+            Shard& shard = *m_shards[i];
+            if(shard.queued.load() == 0 || shard.in_use.load())
+                continue;
+
+            bool expected = false;
+            if(shard.in_use.compare_exchange_strong(expected, true))
+            {
+                stolen = !home;
+                return &shard;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+void SaveThread::register_fixed(IoQueue& queue, unsigned& version)
+{
+    unsigned current = m_fixed_version.load();
+    if(current == version)
+        return;
+
+    lock_guard<mutex> lock(m_fixed_mutex);
+    register_fixed_locked(queue);
+    version = current;
+}
+
+// registers m_fixed with queue; the caller holds m_fixed_mutex
+void SaveThread::register_fixed_locked(IoQueue& queue)
+{
+    if(m_fixed.empty() || queue.register_buffers(&m_fixed[0], m_fixed.size()))
+        return;
+
+    // a save buffer may have been freed, or the kernel may want less
+    // locked memory; the tails are still worth having on their own
+    size_t tails = min(m_fixed_tails, m_fixed.size());
+    bool registered = tails && queue.register_buffers(&m_fixed[0], tails);
+
+    // once is enough; it will keep happening
+    if(m_fixed_warned)
+        return;
+    m_fixed_warned = true;
+
+    if(registered)
+    {
+        fprintf(stderr, "WARNING: Could not register save buffers with "
+            "io_uring; registered only the direct_io bounce buffers\n");
+    }
+    else
+    {
+        fprintf(stderr, "WARNING: Could not register save buffers with "
+            "io_uring; writing without them\n");
+    }
+}
+
+// direct_io: makes the camera's bounce buffer, once, and registers it
+// with the writers' queues if there is room. It is never freed before the
+// thread is, so a queue never holds on to memory that has been let go.
+void SaveThread::prepare_tail(CameraOutput& out)
+{
+    if(out.tail)
+        return;
+
+    out.tail.reset(new FrameBuffer());
+    out.tail->set_huge_pages(m_options.huge_pages);
+    out.tail->reserve(OutputFile::tail_capacity());
+    out.tail->prefault();
+
+    if(m_options.io_backend != IO_BACKEND_URING)
+        return;
+
+    lock_guard<mutex> lock(m_fixed_mutex);
+    if(m_fixed_tails >= m_fixed.size() || m_fixed_tails >= FIXED_TAILS)
+        return;
+
+    IoSlice region = { out.tail->data(), out.tail->capacity(), 0 };
+    m_fixed[m_fixed_tails++] = region;
+    out.tail_fixed = (unsigned)m_fixed_tails;
+    m_fixed_version.fetch_add(1);
+
+    // this writer's queue still has the spare page in that place. Nothing
+    // is in flight between files, so it can register again now. Another
+    // writer only gets at the tail by claiming the shard, and registers
+    // again before it writes anything.
+    IoQueue* queue = IoQueue::current();
+    if(queue && queue->ready())
+        register_fixed_locked(*queue);
+}
+
+// the IoSlice::fixed value for a buffer's frame on this writer's queue
+unsigned SaveThread::fixed_for(const SaveBuffer& buf) const
+{
+    IoQueue* queue = IoQueue::current();
+    if(!queue || buf.fixed_index < 0)
+        return 0;
+
+    if((size_t)buf.fixed_index >= queue->registered_count() ||
+       buf.data.generation() != buf.fixed_generation ||
+       (buf.sample && buf.sample->held()))
+    {
+        return 0;
+    }
+
+    return (unsigned)buf.fixed_index + 1;
+}
+
+void SaveThread::thread_main(size_t writer)
+{
+    vector<unique_ptr<SaveBuffer> > batch;
+    batch.reserve(m_budget.max_frames);
+
+    // lives as long as the thread; OutputFile finds it through
+    // IoQueue::current()
+    IoQueue queue;
+    unsigned fixed_version = 0;
+
+    // SYNC_INTERVAL: how long to wait for frames before looking for idle
+    // cameras' files to sync
+    int64_t idle_wait_ms = m_options.durability.interval_ms;
+
+    if(m_options.io_backend == IO_BACKEND_URING)
+    {
+        if(queue.init(m_options.queue_depth))
+            IoQueue::set_current(&queue);
+        else if(writer == 0)
+            fprintf(stderr, "WARNING: io_uring is not available; "
+                "using plain writes\n");
+    }
+
+    while(true)
+    {
+        bool stolen = false;
+        Shard* shard = claim_shard(writer, stolen);
+
+        if(shard)
+        {
+            // if more shards are waiting, get another writer going on them
+            // before we disappear into a long write
+            if(any_claimable())
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_cv.notify_one();
+            }
+
+            // take everything that is waiting for this shard
+            while(true)
+            {
+                unique_ptr<SaveBuffer> buf = shard->queue.pop();
+                if(!buf)
+                    break;
+                release_pending(*buf);
+                batch.push_back(std::move(buf));
+            }
+
+            // the queue just shrank; let any blocked producers through
+            if(!batch.empty() && m_blocked.load() > 0)
+            {
+                lock_guard<mutex> lock(m_space_mutex);
+                m_space_cv.notify_all();
+            }
+
+            if(!batch.empty())
+            {
+                if(queue.ready())
+                    register_fixed(queue, fixed_version);
+
+                // write_batch() may add a camera's pre-roll to the batch
+                size_t taken = batch.size();
+                write_batch(*shard, batch);
+
+                if(stolen)
+                {
+                    lock_guard<mutex> lock(m_stats_mutex);
+                    m_stats.steals++;
+                }
+
+                // and take out buffers that it keeps for one
+                for(size_t i = 0; i < batch.size(); i++)
+                {
+                    if(batch[i])
+                        recycle(batch[i]);
+                }
+
+                shard->queued.fetch_sub(taken);
+                batch.clear();
+            }
+            else
+            {
+                // a producer has counted a buffer but not yet published it
+                std::this_thread::yield();
+            }
+
+            // anything pushed while we held the shard saw a non-zero count
+            // and did not signal; the next pass of the loop picks it up
+            shard->in_use = false;
+            continue;
+        }
+
+        unique_lock<mutex> lock(m_mutex);
+        auto woken = [this]{
+            return m_should_quit || any_claimable();
+        };
+
+        // with SYNC_INTERVAL an idle writer still wakes when the next sync
+        // falls due, so that a camera which stops sending has its last
+        // frames synced within the interval, not at shutdown
+        if(m_options.durability.policy == SYNC_INTERVAL)
+        {
+            if(!m_cv.wait_for(lock, chrono::milliseconds(idle_wait_ms),
+               woken))
+            {
+                lock.unlock();
+                idle_wait_ms = sync_idle();
+                continue;
+            }
+        }
+        else
+        {
+            m_cv.wait(lock, woken);
+        }
+
+        if(m_should_quit && !any_claimable())
+            break;
+    }
+
+    // close the files of any shard this writer can claim; the others are
+    // closed by whoever holds them, or by the destructor
+    for(size_t i = 0; i < m_shards.size(); i++)
+    {
+        Shard& shard = *m_shards[i];
+        bool expected = false;
+        if(shard.in_use.compare_exchange_strong(expected, true))
+        {
+            SaveStats delta;
+            if(m_options.durability.policy != SYNC_NONE)
+            {
+                for(size_t c = 0; c < shard.outputs.size(); c++)
+                    sync_output(shard.outputs[c], (int)c, delta);
+            }
+
+            // the last frames, held to compare the next with, give back
+            // their capture samples, and the pre-roll frames no event
+            // came for go back to the pool unwritten
+            for(size_t c = 0; c < shard.outputs.size(); c++)
+            {
+                CameraOutput& out = shard.outputs[c];
+                if(out.last_frame)
+                    recycle(out.last_frame);
+
+                for(size_t n = 0; n < out.preroll.size(); n++)
+                    recycle(out.preroll[n]);
+                delta.expired += out.preroll.size();
+                out.preroll.clear();
+                out.preroll_bytes = 0;
+            }
+
+            shard.outputs.clear();
+            shard.in_use = false;
+
+            lock_guard<mutex> lock(m_stats_mutex);
+            m_stats.syncs += delta.syncs;
+            m_stats.expired += delta.expired;
+        }
+    }
+
+    IoQueue::set_current(NULL);
+}
+
+static bool camera_less(const unique_ptr<SaveBuffer>& a,
+    const unique_ptr<SaveBuffer>& b)
+{
+    return a->camera < b->camera;
+}
+
+// YYYYMMDD_HHMMSS_mmm, in UTC, for a time in microseconds since 1970
+static void format_time(int64_t time_us, char* out, size_t size)
+{
+    int64_t ms = time_us / 1000;
+    int64_t seconds = ms / 1000;
+    int64_t days = seconds / 86400;
+    int64_t in_day = seconds % 86400;
+
+    int y;
+    unsigned m, d;
+    civil_from_days(days, y, m, d);
+
+    snprintf(out, size, "%04d%02u%02u_%02d%02d%02d_%03d", y, m, d,
+        (int)(in_day / 3600), (int)(in_day / 60 % 60), (int)(in_day % 60),
+        (int)(ms % 1000));
+}
+
+void SaveThread::write_batch(Shard& shard,
+    std::vector<std::unique_ptr<SaveBuffer> >& batch)
+{
+    SaveStats delta;
+    delta.batches = 1;
+    delta.frames = batch.size();
+    delta.largest_batch = batch.size();
+
+    // a shard may hold more than one camera when camera numbers exceed
+    // MAX_CAMERAS; group them. The sort is stable so each camera's frames
+    // stay in capture order.
+    stable_sort(batch.begin(), batch.end(), camera_less);
+
+    vector<FrameInfo> frames;
+    frames.reserve(batch.size());
+
+    size_t i = 0;
+    while(i < batch.size())
+    {
+        int camera = batch[i]->camera;
+        CameraOutput* out = output_for(shard, camera);
+        frames.clear();
+
+        bool events = out && m_options.events.enabled;
+        bool gated = out && motion_gated();
+
+        // motion gating: the pool decodes the camera's frames first, all at
+        // once, for the motion checks below and for their thumbnails
+        size_t decoded = 0;
+        if(gated)
+            decode_for_motion(*out, batch, i);
+
+        for(; i < batch.size() && batch[i]->camera == camera; i++)
+        {
+            frame_time(out, *batch[i]);
+            
+            // if this frame starts an event, the pre-roll is put in ahead
+            // of it and written first
+            if(events)
+                start_event(*out, batch, i);
+
+            SaveBuffer& buf = *batch[i];
+
+            size_t size = buf.byte_count();
+            if(size == 0)
+                continue;
+
+            int64_t time_us = buf.time_us;
+
+            // between events there is no file for one-shots to go in
+            if(events && !out->in_event && buf.is_one_shot)
+            {
+                save_one_shot(buf);
+                continue;
+            }
+
+            if(events && !buf.is_one_shot)
+            {
+                // past the post-roll: the clip is finished
+                if(out->in_event && time_us > out->event_until_us)
+                {
+                    close_output(*out, camera, frames, delta);
+                    out->in_event = false;
+                }
+
+                if(!out->in_event)
+                {
+                    hold_preroll(*out, batch[i], time_us, delta);
+                    continue;
+                }
+            }
+
+            // decode_for_motion() took every frame with something in it
+            size_t dc = decoded;
+            if(gated)
+                decoded++;
+
+            if(gated && !buf.is_one_shot &&
+               !motion_keeps(*out, out->motion_frames[dc], buf, time_us,
+               delta))
+            {
+                continue;
+            }
+
+            FrameInfo f;
+            f.data = buf.bytes();
+            f.size = size;
+            f.camera = buf.camera;
+            f.time_us = time_us;
+            f.is_one_shot = buf.is_one_shot;
+            f.one_shot_tag = buf.one_shot_tag;
+            f.is_damaged = buf.damaged;
+            f.fixed = fixed_for(buf);
+            f.thumbnail = NULL;
+            f.thumbnail_size = 0;
+            f.hash = 0;
+            f.has_hash = false;
+            f.is_repeat = false;
+
+            if(out)
+            {
+                // finish the current file before starting the next one, or
+                // before this frame would take it past its size. A file
+                // with nothing in it takes any frame, however big.
+                if(out->sink && (out->sink->full() ||
+                   output_expired(*out, time_us) || (out->sink_frames &&
+                   !out->sink->fits(out->pending_bytes +
+                   out->sink->frame_bytes(f)))))
+                {
+                    close_output(*out, camera, frames, delta);
+                }
+
+                // if the file cannot be opened the frame is lost; the next
+                // batch tries again
+                if(!out->sink)
+                    open_output(*out, buf, time_us);
+            }
+
+            bool have_sink = out && out->sink;
+
+            if(buf.is_one_shot &&
+               !(have_sink && out->sink->keeps_one_shots()))
+            {
+                save_one_shot(buf);
+                continue;
+            }
+
+            if(!have_sink)
+                continue;
+
+            // the segment format keeps every frame's hash, and can store a
+            // frame the same as the one before it as a repeat of that one
+            if(out->sink->keeps_repeats())
+            {
+                f.hash = buf.has_hash ? buf.hash : frame_hash(f.data, size);
+                f.has_hash = true;
+                f.is_repeat = m_options.repeat_records && !buf.is_one_shot &&
+                    size == out->last_size && f.hash == out->last_hash &&
+                    out->last_frame &&
+                    memcmp(f.data, out->last_frame->bytes(), size) == 0;
+
+                out->last_hash = f.hash;
+                out->last_size = size;
+
+                // keep this frame's buffer to compare the next with, and
+                // leave the one it replaces in the batch to be recycled once
+                // the batch is written. A repeat leaves the one it repeats.
+                if(m_options.repeat_records && !f.is_repeat)
+                    swap(out->last_frame, batch[i]);
+
+                if(f.is_repeat)
+                {
+                    delta.repeats++;
+                    delta.repeat_bytes += size;
+                }
+            }
+
+            // a repeat shares the thumbnail of the frame it repeats
+            if(gated && !f.is_repeat && !out->thumbnails[dc].empty())
+            {
+                f.thumbnail = &out->thumbnails[dc][0];
+                f.thumbnail_size = out->thumbnails[dc].size();
+            }
+
+            frames.push_back(f);
+            out->sink_frames++;
+            out->pending_bytes += out->sink->frame_bytes(f);
+            delta.bytes += size;
+        }
+
+        if(out)
+            write_frames(*out, frames, delta);
+    }
+
+    lock_guard<mutex> lock(m_stats_mutex);
+    m_stats.batches += delta.batches;
+    m_stats.frames += delta.frames;
+    m_stats.bytes += delta.bytes;
+    m_stats.write_calls += delta.write_calls;
+    m_stats.largest_batch = max(m_stats.largest_batch, delta.largest_batch);
+    m_stats.syncs += delta.syncs;
+    m_stats.expired += delta.expired;
+    m_stats.motion_checks += delta.motion_checks;
+    m_stats.still_frames += delta.still_frames;
+    m_stats.motion_ns += delta.motion_ns;
+    m_stats.repeats += delta.repeats;
+    m_stats.repeat_bytes += delta.repeat_bytes;
+    m_stats.lost_frames += delta.lost_frames;
+    m_stats.queued_bytes += delta.queued_bytes;
+    m_stats.fixed_bytes += delta.fixed_bytes;
+}
+
+bool SaveThread::wants_frame_hashes() const
+{
+    return m_options.format == FORMAT_SEGMENT;
+}
+
+std::string SaveThread::one_shot_path(const SaveBuffer& buf) const
+{
+    char name[64];
+    snprintf(name, sizeof name, "/oneshot_cam%d_%d.jpg", buf.camera,
+        buf.one_shot_tag);
+    return m_base_path + name;
+}
+
+// saves a one-shot frame as a JPEG of its own, for when the camera's file
+// cannot hold it
+void SaveThread::save_one_shot(const SaveBuffer& buf)
+{
+    buf.save(one_shot_path(buf), m_options.durability.policy != SYNC_NONE);
+}
+
+// writes the frames gathered for the camera's current file, then closes it
+void SaveThread::close_output(CameraOutput& out, int camera,
+    std::vector<FrameInfo>& frames, SaveStats& delta)
+{
+    // a failed write has closed it already
+    if(!write_frames(out, frames, delta))
+        return;
+
+    if(m_options.durability.policy != SYNC_NONE)
+        sync_output(out, camera, delta);
+
+    out.segment = NULL;
+    out.sink.reset();
+}
+
+void SaveThread::trigger_event(int camera)
+{
+    int first = camera;
+    int last = camera;
+
+    if(camera < 0)
+    {
+        first = 0;
+        last = MAX_CAMERAS - 1;
+    }
+    else if(camera >= MAX_CAMERAS)
+    {
+        first = last = MAX_CAMERAS - 1;
+    }
+
+    for(int i = first; i <= last; i++)
+    {
+        uint64_t none = NO_EVENT;
+        m_event_at[i].compare_exchange_strong(none,
+            m_counters[i].frames.load(memory_order_relaxed));
+    }
+}
+
+void SaveThread::set_motion_mask(int camera, int columns, int rows,
+    const std::vector<unsigned char>& mask)
+{
+    int slot = camera_slot(camera);
+
+    lock_guard<mutex> lock(m_motion_mutex);
+    MotionMask& m = m_motion_masks[slot];
+    m.columns = columns;
+    m.rows = rows;
+    m.cells = mask;
+    m_motion_version[slot]++;
+}
+
+bool SaveThread::motion_gated() const
+{
+    return m_options.motion.enabled && !m_options.events.enabled;
+}
+
+// motion gating: has the pool decode the camera's frames from batch[first]
+// on that have anything in them, into out.motion_frames and, if segments
+// keep them, out.thumbnails, in order
+void SaveThread::decode_for_motion(CameraOutput& out,
+    const std::vector<std::unique_ptr<SaveBuffer> >& batch, size_t first)
+{
+    vector<FrameInfo> frames;
+    for(size_t i = first; i < batch.size() &&
+        batch[i]->camera == batch[first]->camera; i++)
+    {
+        const SaveBuffer& buf = *batch[i];
+        if(buf.byte_count() == 0)
+            continue;
+
+        FrameInfo f = FrameInfo();
+        f.data = buf.bytes();
+        f.size = buf.byte_count();
+        f.camera = buf.camera;
+        f.time_us = buf.time_us;
+        frames.push_back(f);
+    }
+
+    m_thumbnails->build(frames.empty() ? NULL : &frames[0], frames.size(),
+        out.thumbnails, &out.motion_frames);
+}
+
+// motion gating: checks the frame for motion, from what decode_for_motion()
+// made of it, and says whether to keep it. While nothing moves, a frame is
+// kept once every idle interval.
+bool SaveThread::motion_keeps(CameraOutput& out, const MotionFrame& frame,
+    const SaveBuffer& buf, int64_t time_us, SaveStats& delta)
+{
+    const MotionOptions& options = m_options.motion;
+    int slot = camera_slot(buf.camera);
+
+    if(!out.motion)
+        out.motion.reset(new MotionDetector(options));
+
+    unsigned version = m_motion_version[slot].load();
+    if(version != out.motion_mask_version)
+    {
+        lock_guard<mutex> lock(m_motion_mutex);
+        const MotionMask& m = m_motion_masks[slot];
+        out.motion->set_mask(m.columns, m.rows, m.cells);
+        out.motion_mask_version = m_motion_version[slot].load();
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool moving = out.motion->update(frame, time_us);
+    delta.motion_ns += chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start).count();
+    delta.motion_checks++;
+
+    if(moving || (options.idle_interval_ms &&
+       time_us - out.kept_us >= (int64_t)options.idle_interval_ms * 1000))
+    {
+        out.kept_us = time_us;
+        return true;
+    }
+
+    delta.still_frames++;
+    return false;
+}
+
+// starts an event if batch[at] is the first frame after a trigger. The
+// post-roll runs from that frame's capture time, and the held pre-roll is
+// moved into the batch just ahead of it so that it is written first.
+bool SaveThread::start_event(CameraOutput& out,
+    std::vector<std::unique_ptr<SaveBuffer> >& batch, size_t at)
+{
+    const SaveBuffer& buf = *batch[at];
+    int camera = camera_slot(buf.camera);
+
+    uint64_t trigger = m_event_at[camera].load();
+    if(buf.sequence < trigger ||
+       !m_event_at[camera].compare_exchange_strong(trigger, NO_EVENT))
+    {
+        return false;
+    }
+
+    int64_t until = buf.time_us +
+        (int64_t)m_options.events.post_roll_ms * 1000;
+
+    if(!out.in_event || until > out.event_until_us)
+        out.event_until_us = until;
+    out.in_event = true;
+
+    batch.insert(batch.begin() + at,
+        make_move_iterator(out.preroll.begin()),
+        make_move_iterator(out.preroll.end()));
+    out.preroll.clear();
+    out.preroll_bytes = 0;
+    return true;
+}
+
+// keeps a frame in the camera's pre-roll, letting go of whatever is now too
+// old or over the byte limit. The newest frame is always kept.
+void SaveThread::hold_preroll(CameraOutput& out,
+    std::unique_ptr<SaveBuffer>& ptr, int64_t time_us, SaveStats& delta)
+{
+    ptr->detach();
+    out.preroll_bytes += ptr->byte_count();
+    out.preroll.push_back(std::move(ptr));
+
+    int64_t oldest_us = time_us - (int64_t)m_options.events.pre_roll_ms * 1000;
+
+    size_t n = 0;
+    while(n + 1 < out.preroll.size())
+    {
+        SaveBuffer& old = *out.preroll[n];
+        if(out.preroll_bytes <= m_options.events.max_bytes &&
+           old.time_us >= oldest_us)
+        {
+            break;
+        }
+
+        out.preroll_bytes -= old.byte_count();
+        recycle(out.preroll[n]);
+        n++;
+    }
+
+    out.preroll.erase(out.preroll.begin(), out.preroll.begin() + n);
+    delta.expired += n;
+}
+
+// writes the frames gathered for the camera's current file. If the write
+// fails the file is closed, so the next frame starts another, and false
+// is returned.
+bool SaveThread::write_frames(CameraOutput& out,
+    std::vector<FrameInfo>& frames, SaveStats& delta)
+{
+    out.pending_bytes = 0;
+
+    if(frames.empty() || !out.sink)
+        return true;
+
+    // with motion gating the thumbnails were made along with the checks
+    if(m_options.format == FORMAT_SEGMENT && m_options.thumbnail_channels &&
+       !motion_gated())
+    {
+        m_thumbnails->build(&frames[0], frames.size(), out.thumbnails);
+        for(size_t i = 0; i < frames.size(); i++)
+        {
+            const std::vector<unsigned char>& t = out.thumbnails[i];
+            frames[i].thumbnail = t.empty() ? NULL : &t[0];
+            frames[i].thumbnail_size = t.size();
+        }
+    }
+
+    IoQueue* queue = IoQueue::current();
+    uint64_t queued_before = queue ? queue->queued_bytes() : 0;
+    uint64_t fixed_before = queue ? queue->fixed_bytes() : 0;
+
+    uint64_t calls_before = out.sink->write_calls();
+    bool ok = out.sink->write_frames(&frames[0], frames.size());
+    delta.write_calls += out.sink->write_calls() - calls_before;
+
+    if(queue)
+    {
+        delta.queued_bytes += queue->queued_bytes() - queued_before;
+        delta.fixed_bytes += queue->fixed_bytes() - fixed_before;
+    }
+
+    // the sink has already said why; whatever it managed to put in the
+    // file is left out of its index
+    if(!ok)
+    {
+        fprintf(stderr, "ERROR: Lost %zu frames of camera %d; starting a "
+            "new file\n", frames.size(), frames[0].camera);
+
+        delta.lost_frames += frames.size();
+        for(size_t i = 0; i < frames.size(); i++)
+            delta.bytes -= frames[i].size;
+
+        out.segment = NULL;
+        out.sink.reset();
+        frames.clear();
+        return false;
+    }
+
+    for(size_t i = 0; i < frames.size(); i++)
+    {
+        out.unsynced_bytes += frames[i].size;
+        if(frames[i].is_one_shot)
+            out.unsynced_one_shot = true;
+    }
+
+    out.written_us = frames.back().time_us;
+
+    if(sync_due(out))
+        sync_output(out, frames[0].camera, delta);
+    else
+        publish_durability(frames[0].camera, out.written_us, false);
+
+    if(out.segment)
+    {
+        int camera = frames[0].camera;
+        if(camera >= MAX_CAMERAS)
+            camera = MAX_CAMERAS - 1;
+
+        lock_guard<mutex> lock(m_ring_mutex);
+        RingPosition& pos = m_ring[camera];
+        pos.active = true;
+        pos.segment = out.ring_slot;
+        pos.sequence = out.ring_sequence;
+        pos.offset = out.segment->visible_bytes();
+        pos.last_time_us = frames.back().time_us;
+    }
+
+    frames.clear();
+    return true;
+}
+
+static int64_t steady_ms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// whether the durability policy wants the camera's file synced now
+bool SaveThread::sync_due(const CameraOutput& out) const
+{
+    const DurabilityPolicy& d = m_options.durability;
+
+    switch(d.policy)
+    {
+        case SYNC_INTERVAL:
+            return out.unsynced_bytes &&
+                steady_ms() - out.synced_ms >= (int64_t)d.interval_ms;
+
+        case SYNC_BYTES:
+            return out.unsynced_bytes && out.unsynced_bytes >= d.bytes;
+
+        case SYNC_ONE_SHOTS:
+            return out.unsynced_one_shot;
+
+        case SYNC_NONE:
+        default:
+            return false;
+    }
+}
+
+// SYNC_INTERVAL, from a writer with nothing to write: syncs the files of
+// cameras whose interval has run out since they last sent a frame, in
+// shards no other writer holds. Returns how many milliseconds until the
+// next one is due, or the whole interval if nothing is waiting.
+int64_t SaveThread::sync_idle()
+{
+    int64_t interval = m_options.durability.interval_ms;
+    int64_t next = interval;
+
+    for(size_t i = 0; i < m_shards.size(); i++)
+    {
+        Shard& shard = *m_shards[i];
+        bool expected = false;
+        if(!shard.in_use.compare_exchange_strong(expected, true))
+            continue;
+
+        SaveStats delta;
+        for(size_t c = 0; c < shard.outputs.size(); c++)
+        {
+            CameraOutput& out = shard.outputs[c];
+            if(!out.sink || !out.unsynced_bytes)
+                continue;
+
+            if(sync_due(out))
+                sync_output(out, (int)c, delta);
+            else
+                next = min(next, out.synced_ms + interval - steady_ms());
+        }
+
+        shard.in_use = false;
+
+        if(delta.syncs)
+        {
+            lock_guard<mutex> lock(m_stats_mutex);
+            m_stats.syncs += delta.syncs;
+        }
+    }
+
+    return max<int64_t>(next, 1);
+}
+
+// syncs everything written to the camera's file so far and moves its
+// durable watermark up to the last frame
+void SaveThread::sync_output(CameraOutput& out, int camera, SaveStats& delta)
+{
+    if(!out.sink || !out.unsynced_bytes)
+        return;
+
+    // a failed sync leaves the data counted as unsynced, so the next
+    // batch tries again; the watermark stays where it was
+    out.synced_ms = steady_ms();
+    bool synced = out.sink->sync();
+
+    if(synced)
+    {
+        out.unsynced_bytes = 0;
+        out.unsynced_one_shot = false;
+        delta.syncs++;
+    }
+
+    publish_durability(camera, out.written_us, synced);
+}
+
+void SaveThread::publish_durability(int camera, int64_t written_us,
+    bool synced)
+{
+    if(camera < 0)
+        camera = 0;
+    if(camera >= MAX_CAMERAS)
+        camera = MAX_CAMERAS - 1;
+
+    lock_guard<mutex> lock(m_durable_mutex);
+    DurableMark& mark = m_durable[camera];
+    mark.written_us = written_us;
+
+    if(synced)
+    {
+        mark.durable_us = written_us;
+        mark.syncs++;
+    }
+}
+
+DurableMark SaveThread::durability(int camera)
+{
+    if(camera < 0)
+        camera = 0;
+    if(camera >= MAX_CAMERAS)
+        camera = MAX_CAMERAS - 1;
+
+    lock_guard<mutex> lock(m_durable_mutex);
+    return m_durable[camera];
+}
+
+// works out a frame's capture time, once. Frames with a stream time feed
+// the camera's clock estimator and, once it has a fit, are timed by where
+// their stream time falls on the host clock, which leaves out the jitter of
+// delivery. Pre-roll frames come through here a second time and keep the
+// time they were given.
+int64_t SaveThread::frame_time(CameraOutput* out, SaveBuffer& buf)
+{
+    if(buf.time_us)
+        return buf.time_us;
+
+    int64_t host_ns = buf.capture_ns;
+
+    if(out && buf.has_stream_time)
+    {
+        // REFERENCE_TIME counts 100ns units
+        int64_t device_ns = buf.stream_time * 100;
+
+        if(out->clock.add(device_ns, buf.capture_ns))
+            publish_clock(buf.camera, out->clock);
+
+        if(out->clock.ready())
+            host_ns = out->clock.to_host_ns(device_ns);
+    }
+
+    buf.time_us = monotonic_to_wall_us(host_ns);
+    return buf.time_us;
+}
+
+void SaveThread::publish_clock(int camera, const ClockEstimator& clock)
+{
+    ClockDrift drift;
+    drift.valid = clock.ready();
+    drift.drift_ppm = clock.drift_ppm();
+    drift.jitter_us = clock.jitter_us();
+    drift.frames = clock.frames();
+
+    lock_guard<mutex> lock(m_clock_mutex);
+    m_clock[camera_slot(camera)] = drift;
+}
+
+ClockDrift SaveThread::clock_drift(int camera)
+{
+    lock_guard<mutex> lock(m_clock_mutex);
+    return m_clock[camera_slot(camera)];
+}
+
+bool SaveThread::ring_mode() const
+{
+    return m_options.ring_segments && m_options.segment_bytes &&
+        m_options.format == FORMAT_SEGMENT;
+}
+
+std::string SaveThread::ring_path(int camera, unsigned segment) const
+{
+    char name[64];
+    snprintf(name, sizeof name, "/cam%d_ring_%02u.seg", camera, segment);
+    return m_base_path + name;
+}
+
+RingPosition SaveThread::ring_position(int camera)
+{
+    if(camera < 0)
+        camera = 0;
+    if(camera >= MAX_CAMERAS)
+        camera = MAX_CAMERAS - 1;
+
+    lock_guard<mutex> lock(m_ring_mutex);
+    return m_ring[camera];
+}
+
+// creates any of the camera's ring files that are missing, at full size,
+// and works out which one to overwrite first. A ring left by an earlier
+// run is picked up where it left off.
+bool SaveThread::prepare_ring(CameraOutput& out, int camera)
+{
+    uint64_t newest = 0;
+    uint64_t oldest = UINT64_MAX;
+    unsigned oldest_slot = 0;
+
+    for(unsigned i = 0; i < m_options.ring_segments; i++)
+    {
+        string path = ring_path(camera, i);
+
+        // files that are missing or not segments count as oldest of all
+        uint64_t sequence = 0;
+        FILE* fp = fopen(path.c_str(), "rb");
+        if(fp)
+        {
+            SegmentHeader header;
+            if(fread(&header, sizeof header, 1, fp) == 1 &&
+               memcmp(header.magic, SEGMENT_MAGIC, sizeof header.magic) == 0)
+            {
+                sequence = header.sequence;
+            }
+            fclose(fp);
+        }
+
+        OutputFile file;
+        if(!file.open(path, OutputFile::OPEN_OVERWRITE) ||
+           !file.extend(m_options.segment_bytes))
+        {
+            fprintf(stderr, "ERROR: Could not create ring file '%s'\n",
+                path.c_str());
+            return false;
+        }
+        file.close();
+
+        if(sequence > newest)
+            newest = sequence;
+        if(sequence < oldest)
+        {
+            oldest = sequence;
+            oldest_slot = i;
+        }
+    }
+
+    // open_output() moves on a slot before each segment
+    out.ring_ready = true;
+    out.ring_slot = (oldest_slot + m_options.ring_segments - 1) %
+        m_options.ring_segments;
+    out.ring_sequence = newest;
+    return true;
+}
+
+SaveThread::CameraOutput* SaveThread::output_for(Shard& shard, int camera)
+{
+    if(camera < 0)
+        return NULL;
+
+    if((size_t)camera >= shard.outputs.size())
+        shard.outputs.resize(camera + 1);
+
+    return &shard.outputs[camera];
+}
+
+bool SaveThread::output_expired(const CameraOutput& out, int64_t time_us) const
+{
+    if(m_options.format == FORMAT_JPEG_FILES)
+    {
+        return time_us / TimeDirectories::MINUTE_US !=
+            out.opened_us / TimeDirectories::MINUTE_US;
+    }
+
+    if(m_options.file_seconds == 0)
+        return false;
+
+    return time_us - out.opened_us >= (int64_t)m_options.file_seconds * 1000000;
+}
+
+bool SaveThread::open_output(CameraOutput& out, const SaveBuffer& first,
+    int64_t time_us)
+{
+    unsigned flags = m_options.direct_io ? OutputFile::OPEN_DIRECT : 0;
+    out.segment = NULL;
+
+    // whatever the last file did not get synced is out of reach now
+    out.unsynced_bytes = 0;
+    out.unsynced_one_shot = false;
+
+    // and a repeat can only refer to a frame in the same file
+    out.last_size = 0;
+
+    out.sink_frames = 0;
+    out.pending_bytes = 0;
+
+    if(ring_mode())
+    {
+        if(!out.ring_ready && !prepare_ring(out, first.camera))
+            return false;
+
+        // the next slot holds the oldest segment
+        unsigned slot = (out.ring_slot + 1) % m_options.ring_segments;
+
+        unique_ptr<SegmentWriter> segment(
+            new SegmentWriter(m_options.segment_bytes, true));
+        segment->set_sequence(out.ring_sequence + 1);
+        segment->set_share_headers(m_options.share_headers);
+        if(m_options.thumbnail_channels)
+            segment->set_thumbnail_channels(m_options.thumbnail_channels);
+
+        if(m_options.direct_io)
+        {
+            prepare_tail(out);
+            segment->set_tail(out.tail.get(), out.tail_fixed);
+        }
+
+        if(!segment->open(ring_path(first.camera, slot), flags))
+            return false;
+
+        out.ring_slot = slot;
+        out.ring_sequence++;
+        out.segment = segment.get();
+        out.sink = std::move(segment);
+        out.opened_us = time_us;
+        out.synced_ms = steady_ms();
+        return true;
+    }
+
+    if(m_options.format == FORMAT_JPEG_FILES)
+    {
+        // made ahead of time, normally; see TimeDirectories
+        std::string dir = m_dirs->minute_path(first.camera, time_us);
+        if(dir.empty())
+            return false;
+
+        unique_ptr<FrameSink> sink(
+            new JpegDirSink(m_options.durability.policy != SYNC_NONE));
+        if(!sink->open(dir, flags))
+            return false;
+
+        out.sink = std::move(sink);
+        out.opened_us = time_us;
+        out.synced_ms = steady_ms();
+        return true;
+    }
+
+    unique_ptr<FrameSink> sink;
+    if(m_options.format == FORMAT_SEGMENT)
+    {
+        SegmentWriter* segment = new SegmentWriter(m_options.segment_bytes);
+        segment->set_share_headers(m_options.share_headers);
+        if(m_options.thumbnail_channels)
+            segment->set_thumbnail_channels(m_options.thumbnail_channels);
+
+        if(m_options.direct_io)
+        {
+            prepare_tail(out);
+            segment->set_tail(out.tail.get(), out.tail_fixed);
+        }
+        sink.reset(segment);
+    }
+    else if(m_options.format == FORMAT_AVI)
+        sink.reset(new AviWriter());
+    else
+        sink.reset(new StreamSink());
+
+    char name[64];
+    if(m_options.format == FORMAT_MJPEG_STREAM && m_options.file_seconds == 0)
+    {
+        snprintf(name, sizeof name, "/cam%d%s", first.camera,
+            sink->extension());
+    }
+    else
+    {
+        char when[32];
+        format_time(time_us, when, sizeof when);
+        snprintf(name, sizeof name, "/cam%d_%s", first.camera, when);
+
+        // small segments can fill within a millisecond; the new file must
+        // not truncate the one just closed
+        if(out.last_name == name)
+            out.repeat++;
+        else
+            out.repeat = 0;
+        out.last_name = name;
+
+        size_t length = strlen(name);
+        if(out.repeat)
+        {
+            snprintf(name + length, sizeof name - length, "_%u%s",
+                out.repeat, sink->extension());
+        }
+        else
+        {
+            snprintf(name + length, sizeof name - length, "%s",
+                sink->extension());
+        }
+    }
+
+    if(!sink->open(m_base_path + name, flags))
+        return false;
+
+    out.sink = std::move(sink);
+    out.opened_us = time_us;
+    out.synced_ms = steady_ms();
+    return true;
 }
 
@@ -0,0 +1,392 @@
+#include "segment_reader.h"
+#include "crc32c.h"
+#include "jpeg_dht.h"
+#include "frame_hash.h"
+#include <cstring>
+using namespace std;
+
+static int seek64(FILE* f, uint64_t offset, int whence)
+{
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, whence);
+#else
+    return fseeko(f, (off_t)offset, whence);
+#endif
+}
+
+static uint64_t tell64(FILE* f)
+{
+#ifdef _WIN32
+    return (uint64_t)_ftelli64(f);
+#else
+    return (uint64_t)ftello(f);
+#endif
+}
+
+const size_t SegmentReader::NO_THUMBNAIL;
+const size_t SegmentReader::NO_SOURCE;
+
+SegmentReader::SegmentReader() :
+    m_file(NULL), m_size(0), m_clean(false), m_headers_loaded(false),
+    m_hashed(false)
+{
+    memset(&m_header, 0, sizeof m_header);
+    memset(&m_hash, 0, sizeof m_hash);
+}
+
+SegmentReader::~SegmentReader()
+{
+    close();
+}
+
+bool SegmentReader::open(const std::string& path)
+{
+    close();
+
+    m_file = fopen(path.c_str(), "rb");
+    if(!m_file)
+    {
+        fprintf(stderr, "ERROR: Could not open segment %s\n", path.c_str());
+        return false;
+    }
+
+    m_path = path;
+    seek64(m_file, 0, SEEK_END);
+    m_size = tell64(m_file);
+
+    if(!read_at(0, &m_header, sizeof m_header) ||
+       memcmp(m_header.magic, SEGMENT_MAGIC, sizeof m_header.magic) != 0 ||
+       m_header.header_size < sizeof m_header ||
+       m_header.record_header_size != sizeof(RecordHeader) ||
+       m_header.index_entry_size != sizeof(SegmentIndexEntry))
+    {
+        fprintf(stderr, "ERROR: %s is not a segment\n", path.c_str());
+        close();
+        return false;
+    }
+
+    m_clean = load_index();
+    if(!m_clean)
+        walk_records();
+
+    for(size_t i = 0; i < m_index.size(); i++)
+    {
+        const SegmentIndexEntry& e = m_index[i];
+        if(e.flags & RECORD_HEADER_BLOCK)
+            continue;
+
+        // a thumbnail belongs to the frame just before it
+        if(e.flags & RECORD_THUMBNAIL)
+        {
+            if(!m_frames.empty() && m_thumbnails.back() == NO_THUMBNAIL &&
+               m_index[m_frames.back()].time_us == e.time_us)
+            {
+                m_thumbnails.back() = i;
+            }
+            continue;
+        }
+
+        // a repeat is of the last frame before it that is not one
+        size_t source = m_frames.size();
+        if(e.flags & RECORD_REPEAT)
+            source = m_sources.empty() ? NO_SOURCE : m_sources.back();
+
+        m_frames.push_back(i);
+        m_sources.push_back(source);
+        m_thumbnails.push_back(source == NO_SOURCE ||
+            source == m_frames.size() - 1 ? NO_THUMBNAIL :
+            m_thumbnails[source]);
+    }
+
+    return true;
+}
+
+void SegmentReader::close()
+{
+    if(m_file)
+        fclose(m_file);
+
+    m_file = NULL;
+    m_size = 0;
+    m_clean = false;
+    m_index.clear();
+    m_frames.clear();
+    m_sources.clear();
+    m_thumbnails.clear();
+    m_headers.clear();
+    m_headers_loaded = false;
+}
+
+bool SegmentReader::read_at(uint64_t offset, void* data, size_t size)
+{
+    if(offset > m_size || size > m_size - offset)
+        return false;
+
+    if(seek64(m_file, offset, SEEK_SET) != 0)
+        return false;
+
+    return fread(data, 1, size, m_file) == size;
+}
+
+// reads the record at offset and checks its magic and checksum
+bool SegmentReader::read_record(uint64_t offset, RecordHeader& r,
+    std::vector<unsigned char>& payload)
+{
+    if(!read_at(offset, &r, sizeof r) || r.magic != RECORD_MAGIC)
+        return false;
+
+    payload.resize(r.size);
+    if(r.size && !read_at(offset + sizeof r, &payload[0], r.size))
+        return false;
+
+    uint32_t crc = r.size ? crc32c(0, &payload[0], r.size) : 0;
+    return crc32c(crc, &r, RECORD_CHECKSUMMED_BYTES) == r.checksum;
+}
+
+// the index written by a clean close, found from the header
+bool SegmentReader::load_index()
+{
+    uint64_t count = m_header.record_count;
+    uint64_t offset = m_header.index_offset;
+    if(offset == 0 || count > m_size / sizeof(SegmentIndexEntry))
+        return false;
+
+    uint64_t bytes = count * sizeof(SegmentIndexEntry);
+
+    SegmentFooter footer;
+    if(!read_at(offset + bytes, &footer, sizeof footer) ||
+       memcmp(footer.magic, SEGMENT_FOOTER_MAGIC, sizeof footer.magic) != 0 ||
+       footer.index_offset != offset || footer.record_count != count)
+    {
+        return false;
+    }
+
+    m_index.resize((size_t)count);
+    if(count && (!read_at(offset, &m_index[0], (size_t)bytes) ||
+       crc32c(0, &m_index[0], (size_t)bytes) != footer.index_checksum))
+    {
+        m_index.clear();
+        return false;
+    }
+
+    return true;
+}
+
+// rebuilds the index of a segment that was not closed, keeping every record
+// up to the first bad one or, in a reused ring file, the first one older
+// than the record before it
+void SegmentReader::walk_records()
+{
+    m_index.clear();
+
+    uint64_t pos = m_header.header_size;
+    int64_t last_us = INT64_MIN;
+
+    RecordHeader r;
+    while(read_record(pos, r, m_payload) && r.time_us >= last_us)
+    {
+        SegmentIndexEntry e;
+        e.offset = pos;
+        e.time_us = r.time_us;
+        e.size = r.size;
+        e.flags = r.flags;
+        m_index.push_back(e);
+
+        last_us = r.time_us;
+        pos += sizeof r + r.size +
+            (RECORD_ALIGNMENT - r.size % RECORD_ALIGNMENT) % RECORD_ALIGNMENT;
+    }
+}
+
+void SegmentReader::load_headers()
+{
+    m_headers_loaded = true;
+
+    RecordHeader r;
+    for(size_t i = 0; i < m_index.size(); i++)
+    {
+        if(!(m_index[i].flags & RECORD_HEADER_BLOCK))
+            continue;
+
+        HeaderRef ref;
+        if(!read_record(m_index[i].offset, r, m_payload) ||
+           m_payload.size() < sizeof ref)
+        {
+            fprintf(stderr, "ERROR: Bad header block in %s\n",
+                m_path.c_str());
+            continue;
+        }
+
+        memcpy(&ref, &m_payload[0], sizeof ref);
+        if(ref.header_size != m_payload.size() - sizeof ref)
+            continue;
+
+        m_headers[ref.hash].assign(m_payload.begin() + sizeof ref,
+            m_payload.end());
+    }
+}
+
+// reads frame i into m_payload and lists the pieces that make it up. With
+// standalone set, the standard DHT is added if the frame lacks one.
+bool SegmentReader::read_parts(size_t i, bool standalone,
+    std::vector<IoSlice>& slices)
+{
+    slices.clear();
+    m_hashed = false;
+    if(i >= m_frames.size() || m_sources[i] == NO_SOURCE)
+        return false;
+
+    RecordHeader r;
+
+    // a repeat holds only the hash of the frame it repeats, which has to
+    // be that frame's own
+    if(frame(i).flags & RECORD_REPEAT)
+    {
+        if(!read_record(frame(i).offset, r, m_payload) ||
+           m_payload.size() != sizeof m_hash)
+        {
+            return false;
+        }
+
+        memcpy(&m_hash, &m_payload[0], sizeof m_hash);
+        m_hashed = true;
+        i = m_sources[i];
+    }
+
+    // before the frame, since loading them goes through m_payload too
+    if((frame(i).flags & RECORD_SHARED_HEADER) && !m_headers_loaded)
+        load_headers();
+
+    if(!read_record(frame(i).offset, r, m_payload))
+        return false;
+
+    const unsigned char* body = m_payload.empty() ? NULL : &m_payload[0];
+    size_t body_size = m_payload.size();
+
+    if(r.flags & RECORD_HASHED)
+    {
+        FrameHash h;
+        if(body_size < sizeof h)
+            return false;
+        memcpy(&h, body, sizeof h);
+        body += sizeof h;
+        body_size -= sizeof h;
+
+        if(m_hashed && (h.hash != m_hash.hash ||
+           h.frame_size != m_hash.frame_size))
+        {
+            return false;
+        }
+
+        m_hash = h;
+        m_hashed = true;
+    }
+    else if(m_hashed)
+        return false;
+
+    IoSlice parts[3];
+    size_t count = 0;
+
+    if(r.flags & RECORD_SHARED_HEADER)
+    {
+        HeaderRef ref;
+        if(body_size < sizeof ref)
+            return false;
+        memcpy(&ref, body, sizeof ref);
+        body += sizeof ref;
+        body_size -= sizeof ref;
+
+        map<uint64_t, vector<unsigned char> >::const_iterator it =
+            m_headers.find(ref.hash);
+        if(it == m_headers.end() || it->second.size() != ref.header_size)
+            return false;
+
+        const vector<unsigned char>& header = it->second;
+        if(standalone)
+        {
+            count = jpeg_standalone_slices(&header[0], header.size(), 0,
+                parts);
+        }
+        else
+        {
+            IoSlice h = { &header[0], header.size(), 0 };
+            parts[count++] = h;
+        }
+
+        slices.insert(slices.end(), parts, parts + count);
+
+        IoSlice rest = { body, body_size, 0 };
+        slices.push_back(rest);
+        return true;
+    }
+
+    if(standalone)
+    {
+        count = jpeg_standalone_slices(body, body_size, 0, parts);
+    }
+    else
+    {
+        IoSlice whole = { body, body_size, 0 };
+        parts[count++] = whole;
+    }
+
+    slices.insert(slices.end(), parts, parts + count);
+    return true;
+}
+
+bool SegmentReader::read_frame(size_t i, std::vector<unsigned char>& jpeg)
+{
+    if(!read_parts(i, false, m_slices))
+        return false;
+
+    jpeg.clear();
+    for(size_t k = 0; k < m_slices.size(); k++)
+    {
+        const unsigned char* p = (const unsigned char*)m_slices[k].data;
+        jpeg.insert(jpeg.end(), p, p + m_slices[k].size);
+    }
+
+    if(m_hashed && (jpeg.size() != m_hash.frame_size ||
+       frame_hash(jpeg.empty() ? NULL : &jpeg[0], jpeg.size()) !=
+       m_hash.hash))
+    {
+        fprintf(stderr, "ERROR: Frame %llu of %s does not match its hash\n",
+            (unsigned long long)i, m_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool SegmentReader::frame_slices(size_t i, std::vector<IoSlice>& slices)
+{
+    return read_parts(i, true, slices);
+}
+
+bool SegmentReader::read_thumbnail(size_t i, JpegImage& image)
+{
+    if(!has_thumbnail(i))
+        return false;
+
+    RecordHeader r;
+    ThumbnailHeader h;
+    if(!read_record(m_index[m_thumbnails[i]].offset, r, m_payload) ||
+       m_payload.size() < sizeof h)
+    {
+        return false;
+    }
+
+    memcpy(&h, &m_payload[0], sizeof h);
+    size_t bytes = (size_t)h.width * h.height * h.channels;
+    if((h.channels != 1 && h.channels != 3) ||
+       bytes != m_payload.size() - sizeof h)
+    {
+        return false;
+    }
+
+    image.width = h.width;
+    image.height = h.height;
+    image.channels = h.channels;
+    image.pixels.assign(m_payload.begin() + sizeof h, m_payload.end());
+    return true;
+}
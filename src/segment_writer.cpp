@@ -0,0 +1,380 @@
+#include "segment_writer.h"
+#include "crc32c.h"
+#include "jpeg_scan.h"
+#include <cstdio>
+#include <cstring>
+using namespace std;
+
+static const unsigned char zero_padding[RECORD_ALIGNMENT] = { 0 };
+
+SegmentWriter::SegmentWriter(uint64_t segment_bytes, bool reuse_file) :
+    m_segment_bytes(segment_bytes), m_reuse(reuse_file), m_sequence(0),
+    m_share_headers(true), m_thumbnail_channels(0), m_pos(0), m_next(0), m_failed(false),
+    m_last_hash(0), m_last_size(0)
+{
+    memset(&m_header, 0, sizeof m_header);
+}
+
+SegmentWriter::~SegmentWriter()
+{
+    close();
+}
+
+bool SegmentWriter::open(const std::string& path, unsigned flags)
+{
+    close();
+
+    if(m_reuse)
+        flags |= OutputFile::OPEN_OVERWRITE;
+    else
+        flags |= OutputFile::OPEN_TRUNCATE;
+
+    if(!m_file.open(path, flags))
+        return false;
+
+    // not fatal; appends just allocate as they go. A reused file has all
+    // of its space already.
+    if(m_segment_bytes && !m_reuse)
+        m_file.preallocate(m_segment_bytes);
+
+    memset(&m_header, 0, sizeof m_header);
+    memcpy(m_header.magic, SEGMENT_MAGIC, sizeof m_header.magic);
+    m_header.version = SEGMENT_VERSION;
+    m_header.header_size = sizeof(SegmentHeader);
+    m_header.record_header_size = sizeof(RecordHeader);
+    m_header.index_entry_size = sizeof(SegmentIndexEntry);
+    m_header.camera = -1;
+    m_header.sequence = m_sequence;
+
+    m_index.clear();
+    m_headers.clear();
+    m_failed = false;
+    m_last_hash = 0;
+    m_last_size = 0;
+
+    // the camera and first timestamp are filled in by close(); until then
+    // readers go by the records themselves
+    if(!m_file.write(&m_header, sizeof m_header))
+    {
+        m_file.close();
+        return false;
+    }
+
+    m_pos = sizeof m_header;
+    return true;
+}
+
+bool SegmentWriter::full() const
+{
+    return !fits(0);
+}
+
+// a record's header and payload, padded, and its index entry
+static uint64_t record_bytes(uint64_t payload)
+{
+    return sizeof(RecordHeader) + payload + RECORD_ALIGNMENT - 1 +
+        sizeof(SegmentIndexEntry);
+}
+
+uint64_t SegmentWriter::frame_bytes(const FrameInfo& f) const
+{
+    // stored whole, or as a header block and the rest: never more than the
+    // frame, two records, and a HeaderRef with each
+    uint64_t bytes = record_bytes(sizeof(FrameHash) + f.size);
+    if(m_share_headers)
+        bytes += record_bytes(2 * sizeof(HeaderRef));
+
+    if(f.thumbnail)
+    {
+        bytes += record_bytes(f.thumbnail_size);
+    }
+    else if(m_thumbnail_channels)
+    {
+        // one pixel per 8x8 block, as JpegDecoder::decode_dc() makes it
+        int width, height;
+        if(jpeg_frame_size(f.data, f.size, width, height))
+        {
+            bytes += record_bytes(sizeof(ThumbnailHeader) +
+                (uint64_t)((width + 7) / 8) * ((height + 7) / 8) *
+                m_thumbnail_channels);
+        }
+    }
+
+    return bytes;
+}
+
+bool SegmentWriter::fits(uint64_t bytes) const
+{
+    if(!m_segment_bytes)
+        return true;
+
+    uint64_t used = m_pos + m_index.size() * sizeof(SegmentIndexEntry) +
+        sizeof(SegmentFooter);
+    return used + bytes <= m_segment_bytes;
+}
+
+static uint64_t fnv1a64(const unsigned char* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// queues one record at m_next, and its index entry in m_pending. hash and
+// ref, if given, go ahead of data in the payload, in that order. fixed is
+// passed through to IoSlice::fixed for data.
+void SegmentWriter::add_record(const FrameInfo& f, uint32_t flags,
+    const FrameHash* hash, const HeaderRef* ref, const unsigned char* data,
+    size_t size, unsigned fixed)
+{
+    m_records.push_back(RecordHeader());
+    RecordHeader& r = m_records.back();
+
+    size_t payload = size + (hash ? sizeof *hash : 0) +
+        (ref ? sizeof *ref : 0);
+
+    r.magic = RECORD_MAGIC;
+    r.size = (uint32_t)payload;
+    r.time_us = f.time_us;
+    r.camera = f.camera;
+    r.flags = flags;
+    r.one_shot_tag = f.one_shot_tag;
+
+    uint32_t crc = hash ? crc32c(0, hash, sizeof *hash) : 0;
+    if(ref)
+        crc = crc32c(crc, ref, sizeof *ref);
+    crc = crc32c(crc, data, size);
+    r.checksum = crc32c(crc, &r, RECORD_CHECKSUMMED_BYTES);
+
+    IoSlice h = { &r, sizeof r };
+    m_slices.push_back(h);
+
+    if(hash)
+    {
+        IoSlice s = { hash, sizeof *hash };
+        m_slices.push_back(s);
+    }
+
+    if(ref)
+    {
+        IoSlice s = { ref, sizeof *ref };
+        m_slices.push_back(s);
+    }
+
+    if(size)
+    {
+        IoSlice d = { data, size, fixed };
+        m_slices.push_back(d);
+    }
+
+    size_t pad = (RECORD_ALIGNMENT - payload % RECORD_ALIGNMENT) %
+        RECORD_ALIGNMENT;
+    if(pad)
+    {
+        IoSlice p = { zero_padding, pad };
+        m_slices.push_back(p);
+    }
+
+    SegmentIndexEntry e;
+    e.offset = m_next;
+    e.time_us = f.time_us;
+    e.size = r.size;
+    e.flags = r.flags;
+    m_pending.push_back(e);
+
+    m_next += sizeof r + payload + pad;
+}
+
+// finds, or stores, the header the frame can share. Returns NULL if the
+// frame is to be stored whole.
+const HeaderRef* SegmentWriter::share_header(const FrameInfo& f,
+    size_t& header_size)
+{
+    header_size = jpeg_header_length(f.data, f.size);
+    if(header_size < MIN_SHARED_HEADER || header_size >= f.size)
+        return NULL;
+
+    uint64_t hash = fnv1a64(f.data, header_size);
+
+    for(size_t i = 0; i < m_headers.size(); i++)
+    {
+        const SharedHeader& h = m_headers[i];
+        if(h.ref.hash == hash && h.bytes.size() == header_size &&
+           memcmp(&h.bytes[0], f.data, header_size) == 0)
+        {
+            return &h.ref;
+        }
+    }
+
+    if(m_headers.size() >= MAX_SHARED_HEADERS)
+        return NULL;
+
+    // a header with the same hash but other bytes would make frames
+    // ambiguous; leave it unshared
+    for(size_t i = 0; i < m_headers.size(); i++)
+    {
+        if(m_headers[i].ref.hash == hash)
+            return NULL;
+    }
+
+    m_headers.push_back(SharedHeader());
+    SharedHeader& h = m_headers.back();
+    h.ref.hash = hash;
+    h.ref.header_size = (uint32_t)header_size;
+    h.ref.reserved = 0;
+    h.bytes.assign(f.data, f.data + header_size);
+
+    // the header block goes in just ahead of the frame
+    m_refs.push_back(h.ref);
+    add_record(f, RECORD_HEADER_BLOCK, NULL, &m_refs.back(), f.data,
+        header_size, f.fixed);
+    return &h.ref;
+}
+
+bool SegmentWriter::write_frames(const FrameInfo* frames, size_t count)
+{
+    if(count == 0)
+        return true;
+
+    // reserved up front, since m_slices points into them
+    m_records.clear();
+    m_records.reserve(3 * count);
+    m_hashes.clear();
+    m_hashes.reserve(count);
+    m_refs.clear();
+    m_refs.reserve(2 * count);
+    m_slices.clear();
+    m_pending.clear();
+    m_next = m_pos;
+
+    // nothing below counts until the write has gone through; if it fails,
+    // this is put back
+    size_t headers_before = m_headers.size();
+    uint64_t last_hash_before = m_last_hash;
+    size_t last_size_before = m_last_size;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const FrameInfo& f = frames[i];
+
+        uint32_t flags = f.is_one_shot ? RECORD_ONE_SHOT : 0;
+        if(f.is_damaged)
+            flags |= RECORD_DAMAGED;
+
+        const FrameHash* hash = NULL;
+        if(f.has_hash)
+        {
+            FrameHash h;
+            h.hash = f.hash;
+            h.frame_size = (uint32_t)f.size;
+            h.reserved = 0;
+            m_hashes.push_back(h);
+            hash = &m_hashes.back();
+            flags |= RECORD_HASHED;
+        }
+
+        // a repeat of a frame in an earlier segment has nothing to refer
+        // to here
+        if(f.is_repeat && hash && m_last_size &&
+           f.size == m_last_size && f.hash == m_last_hash)
+        {
+            add_record(f, flags | RECORD_REPEAT, hash, NULL, NULL, 0, 0);
+            continue;
+        }
+
+        m_last_hash = f.hash;
+        m_last_size = hash ? f.size : 0;
+
+        size_t header_size = 0;
+        const HeaderRef* shared = m_share_headers ?
+            share_header(f, header_size) : NULL;
+
+        if(shared)
+        {
+            m_refs.push_back(*shared);
+            add_record(f, flags | RECORD_SHARED_HEADER, hash, &m_refs.back(),
+                f.data + header_size, f.size - header_size, f.fixed);
+        }
+        else
+        {
+            add_record(f, flags, hash, NULL, f.data, f.size, f.fixed);
+        }
+
+        if(f.thumbnail)
+        {
+            add_record(f, RECORD_THUMBNAIL, NULL, NULL, f.thumbnail,
+                f.thumbnail_size, 0);
+        }
+    }
+
+    if(!m_file.write_gather(&m_slices[0], m_slices.size()))
+    {
+        m_headers.resize(headers_before);
+        m_last_hash = last_hash_before;
+        m_last_size = last_size_before;
+        m_failed = true;
+        return false;
+    }
+
+    if(m_index.empty())
+    {
+        m_header.camera = frames[0].camera;
+        m_header.first_time_us = frames[0].time_us;
+    }
+
+    m_index.insert(m_index.end(), m_pending.begin(), m_pending.end());
+    m_pos = m_next;
+    return true;
+}
+
+bool SegmentWriter::write_footer()
+{
+    SegmentFooter footer;
+    memset(&footer, 0, sizeof footer);
+
+    // after a failed write the file may hold part of a batch that the
+    // index leaves out; the index goes after it
+    footer.index_offset = m_failed ? m_file.position() : m_pos;
+    footer.record_count = m_index.size();
+    memcpy(footer.magic, SEGMENT_FOOTER_MAGIC, sizeof footer.magic);
+
+    IoSlice slices[2];
+    size_t count = 0;
+
+    if(!m_index.empty())
+    {
+        size_t bytes = m_index.size() * sizeof(SegmentIndexEntry);
+        footer.index_checksum = crc32c(0, &m_index[0], bytes);
+
+        IoSlice s = { &m_index[0], bytes };
+        slices[count++] = s;
+    }
+
+    IoSlice f = { &footer, sizeof footer };
+    slices[count++] = f;
+
+    if(!m_file.write_gather(slices, count))
+        return false;
+
+    m_header.index_offset = footer.index_offset;
+    m_header.record_count = footer.record_count;
+    return m_file.patch(0, &m_header, sizeof m_header);
+}
+
+void SegmentWriter::close()
+{
+    if(!m_file.is_open())
+        return;
+
+    if(!write_footer())
+        fprintf(stderr, "ERROR: Could not finish the segment index\n");
+
+    m_file.close();
+    m_index.clear();
+    m_pos = 0;
+    m_failed = false;
+}
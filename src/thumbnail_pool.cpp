@@ -0,0 +1,224 @@
+#include "thumbnail_pool.h"
+#include "jpeg_decoder.h"
+#include "segment_format.h"
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+using namespace std;
+
+// a decoder and its output, kept by each thread that makes thumbnails so
+// their buffers are reused from one frame to the next
+class ThumbnailPool::Worker
+{
+  public:
+    Worker(ThumbnailPool& pool) : m_pool(pool) {}
+
+    void make(const FrameInfo& f, std::vector<unsigned char>& out,
+        MotionFrame* motion);
+
+  private:
+    ThumbnailPool& m_pool;
+    JpegDecoder m_decoder;
+    JpegImage m_image;
+};
+
+void ThumbnailPool::Worker::make(const FrameInfo& f,
+    std::vector<unsigned char>& out, MotionFrame* motion)
+{
+    out.clear();
+    if(motion)
+        motion->ok = false;
+
+    // a repeat shares the thumbnail of the frame it repeats
+    if(f.is_repeat)
+        return;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    // a gray thumbnail is the gray image motion detection wants; an RGB one
+    // has it made alongside
+    int channels = m_pool.m_channels ? m_pool.m_channels : 1;
+    JpegImage* gray = motion && channels == 3 ? &motion->luma : NULL;
+
+    bool ok = m_decoder.parse(f.data, f.size) &&
+        m_decoder.decode_dc(channels, m_image, gray) &&
+        m_image.width <= 0xFFFF && m_image.height <= 0xFFFF;
+
+    if(ok && motion)
+    {
+        if(!gray)
+            motion->luma = m_image;
+        motion->cell_width = m_decoder.mcu_width() / 8;
+        motion->cell_height = m_decoder.mcu_height() / 8;
+        motion->ok = true;
+    }
+
+    if(ok && m_pool.m_channels)
+    {
+        ThumbnailHeader h;
+        memset(&h, 0, sizeof h);
+        h.width = (uint16_t)m_image.width;
+        h.height = (uint16_t)m_image.height;
+        h.channels = (uint8_t)m_image.channels;
+
+        out.resize(sizeof h + m_image.pixels.size());
+        memcpy(&out[0], &h, sizeof h);
+        if(!m_image.pixels.empty())
+        {
+            memcpy(&out[sizeof h], &m_image.pixels[0],
+                m_image.pixels.size());
+        }
+    }
+
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - start).count();
+
+    m_pool.m_busy_ns += ns;
+    if(ok)
+    {
+        m_pool.m_built++;
+        m_pool.m_pixels += (uint64_t)m_decoder.width() * m_decoder.height();
+    }
+    else
+    {
+        m_pool.m_failed++;
+    }
+}
+
+ThumbnailPool::ThumbnailPool(int channels, size_t worker_count) :
+    m_channels(channels == 3 || channels == 0 ? channels : 1),
+    m_worker_count(worker_count),
+    m_should_quit(false), m_built(0), m_failed(0), m_busy_ns(0), m_pixels(0)
+{
+}
+
+ThumbnailPool::~ThumbnailPool()
+{
+    stop();
+}
+
+void ThumbnailPool::start()
+{
+    if(!m_threads.empty())
+        return;
+
+    m_should_quit = false;
+    for(size_t i = 0; i < m_worker_count; i++)
+        m_threads.push_back(std::thread(&ThumbnailPool::thread_main, this));
+}
+
+void ThumbnailPool::stop()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_should_quit = true;
+    }
+
+    m_cv.notify_all();
+
+    for(size_t i = 0; i < m_threads.size(); i++)
+    {
+        if(m_threads[i].joinable())
+            m_threads[i].join();
+    }
+
+    m_threads.clear();
+}
+
+// hands out the next frame of the oldest job. Call with m_mutex held.
+bool ThumbnailPool::take(Job*& job, size_t& index)
+{
+    if(m_jobs.empty())
+        return false;
+
+    job = m_jobs.front();
+    index = job->next++;
+    if(job->next == job->count)
+        m_jobs.pop_front();
+    return true;
+}
+
+void ThumbnailPool::finish(Job* job)
+{
+    bool last;
+    {
+        lock_guard<mutex> lock(m_mutex);
+        last = (++job->done == job->count);
+    }
+
+    if(last)
+        m_done_cv.notify_all();
+}
+
+void ThumbnailPool::make(Worker& worker, Job& job, size_t index)
+{
+    worker.make(job.frames[index], (*job.thumbnails)[index],
+        job.motion ? &(*job.motion)[index] : NULL);
+}
+
+void ThumbnailPool::build(const FrameInfo* frames, size_t count,
+    std::vector<std::vector<unsigned char> >& thumbnails,
+    std::vector<MotionFrame>* motion)
+{
+    thumbnails.resize(count);
+    if(motion)
+        motion->resize(count);
+    if(count == 0)
+        return;
+
+    Job job;
+    job.frames = frames;
+    job.count = count;
+    job.thumbnails = &thumbnails;
+    job.motion = motion;
+    job.next = 0;
+    job.done = 0;
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_jobs.push_back(&job);
+    }
+
+    m_cv.notify_all();
+
+    // the caller works on its own job rather than sitting idle. Once all
+    // of it has been handed out, it only waits.
+    Worker worker(*this);
+    unique_lock<mutex> lock(m_mutex);
+    while(job.next < job.count)
+    {
+        size_t index = job.next++;
+        if(job.next == job.count)
+            m_jobs.erase(find(m_jobs.begin(), m_jobs.end(), &job));
+
+        lock.unlock();
+        make(worker, job, index);
+        lock.lock();
+        job.done++;
+    }
+
+    while(job.done < job.count)
+        m_done_cv.wait(lock);
+}
+
+void ThumbnailPool::thread_main()
+{
+    Worker worker(*this);
+
+    for(;;)
+    {
+        Job* job = NULL;
+        size_t index = 0;
+        {
+            unique_lock<mutex> lock(m_mutex);
+            while(!m_should_quit && !take(job, index))
+                m_cv.wait(lock);
+
+            if(!job)
+                return;
+        }
+
+        make(worker, *job, index);
+        finish(job);
+    }
+}
@@ -0,0 +1,180 @@
+#include "time_directories.h"
+#include "capture_clock.h"
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+// how many minutes past the newest one asked for are made in advance
+static const int64_t MINUTES_AHEAD = 2;
+
+// creates one directory; one that already exists is fine
+static bool make_directory(const std::string& path)
+{
+#ifdef _WIN32
+    if(CreateDirectoryA(path.c_str(), NULL))
+        return true;
+    return GetLastError() == ERROR_ALREADY_EXISTS;
+#else
+    if(mkdir(path.c_str(), 0777) == 0)
+        return true;
+    return errno == EEXIST;
+#endif
+}
+
+TimeDirectories::TimeDirectories(const std::string& base_path) :
+    m_base_path(base_path), m_should_quit(false), m_late(0)
+{
+}
+
+TimeDirectories::~TimeDirectories()
+{
+    stop();
+}
+
+void TimeDirectories::start()
+{
+    if(m_thread.joinable())
+        return;
+
+    m_should_quit = false;
+    m_thread = std::thread(&TimeDirectories::thread_main, this);
+}
+
+void TimeDirectories::stop()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_should_quit = true;
+    }
+
+    m_cv.notify_all();
+
+    if(m_thread.joinable())
+        m_thread.join();
+}
+
+std::string TimeDirectories::path_for(int camera, int64_t minute) const
+{
+    int64_t days = minute / (24 * 60);
+    int in_day = (int)(minute % (24 * 60));
+
+    int y;
+    unsigned m, d;
+    civil_from_days(days, y, m, d);
+
+    char name[64];
+    snprintf(name, sizeof name, "/cam%d/%04d%02u%02u/%02d/%02d", camera,
+        y, m, d, in_day / 60, in_day % 60);
+    return m_base_path + name;
+}
+
+// makes every level of the camera/minute directory. The upper levels
+// nearly always exist already, which costs one failed mkdir each.
+bool TimeDirectories::make(int camera, int64_t minute)
+{
+    std::string path = path_for(camera, minute);
+
+    // each '/' after the base path ends one level
+    for(size_t i = m_base_path.size() + 1; i <= path.size(); i++)
+    {
+        if(i < path.size() && path[i] != '/')
+            continue;
+
+        if(!make_directory(path.substr(0, i)))
+        {
+            fprintf(stderr, "ERROR: Could not create directory %s\n",
+                path.substr(0, i).c_str());
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string TimeDirectories::minute_path(int camera, int64_t time_us)
+{
+    int64_t minute = time_us / MINUTE_US;
+    Key key(camera, minute);
+
+    {
+        lock_guard<mutex> lock(m_mutex);
+
+        map<int, int64_t>::iterator it = m_cameras.find(camera);
+        if(it == m_cameras.end())
+            m_cameras[camera] = minute;
+        else if(minute > it->second)
+            it->second = minute;
+
+        if(m_made.count(key))
+            return path_for(camera, minute);
+    }
+
+    // the background thread has not got here; start it on the minutes
+    // after this one while this one is made here
+    m_cv.notify_all();
+
+    if(!make(camera, minute))
+        return std::string();
+
+    m_late++;
+
+    lock_guard<mutex> lock(m_mutex);
+    m_made.insert(key);
+    return path_for(camera, minute);
+}
+
+void TimeDirectories::thread_main()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while(!m_should_quit)
+    {
+        int64_t now = monotonic_to_wall_us(monotonic_ns()) / MINUTE_US;
+
+        // work out what is missing, then make it without holding the lock
+        vector<Key> missing;
+        for(map<int, int64_t>::iterator it = m_cameras.begin();
+            it != m_cameras.end(); ++it)
+        {
+            int64_t from = max(it->second, now);
+            for(int64_t m = from; m <= from + MINUTES_AHEAD; m++)
+            {
+                Key key(it->first, m);
+                if(!m_made.count(key))
+                    missing.push_back(key);
+            }
+        }
+
+        // forget minutes that are over; nothing will ask for them again
+        // short of a jump in the clock, and making them again is harmless
+        for(set<Key>::iterator it = m_made.begin(); it != m_made.end(); )
+        {
+            if(it->second < now - 1)
+                m_made.erase(it++);
+            else
+                ++it;
+        }
+
+        for(size_t i = 0; i < missing.size() && !m_should_quit; i++)
+        {
+            lock.unlock();
+            bool ok = make(missing[i].first, missing[i].second);
+            lock.lock();
+
+            if(ok)
+                m_made.insert(missing[i]);
+        }
+
+        m_cv.wait_for(lock, chrono::seconds(1));
+    }
+}
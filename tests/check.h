@@ -0,0 +1,61 @@
+#pragma once
+
+// The little the unit tests in tests/ need: CHECK() reports a failed
+// condition and carries on, and test_result() turns the count of failures
+// into the exit status "make test" looks at.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+inline int& check_failures()
+{
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, \
+                #cond); \
+            check_failures()++; \
+        } \
+    } while(0)
+
+// prints the test's outcome and returns the exit status for main()
+inline int test_result(const char* name)
+{
+    if(check_failures())
+    {
+        printf("FAIL %s: %d checks failed\n", name, check_failures());
+        return 1;
+    }
+
+    printf("ok   %s\n", name);
+    return 0;
+}
+
+// makes a new empty directory under /tmp for the test's files; left behind
+// for a look if the test fails, removed by remove_test_dir() otherwise
+inline std::string make_test_dir(const char* name)
+{
+    std::string path = std::string("/tmp/") + name + "_XXXXXX";
+    if(!mkdtemp(&path[0]))
+    {
+        perror("mkdtemp");
+        exit(1);
+    }
+    return path;
+}
+
+inline void remove_test_dir(const std::string& path)
+{
+    if(check_failures())
+        return;
+
+    std::string cmd = "rm -rf '" + path + "'";
+    if(system(cmd.c_str()) != 0)
+        fprintf(stderr, "could not remove %s\n", path.c_str());
+}
@@ -0,0 +1,428 @@
+#include "jpeg_encoder.h"
+#include "jpeg_dht.h"
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+static const int ZIGZAG[64] =
+{
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Annex K.1, in natural order
+static const int LUMA_QUANT[64] =
+{
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+
+static const int CHROMA_QUANT[64] =
+{
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+struct HuffmanCode
+{
+    unsigned code[256];
+    int length[256];
+};
+
+// the four tables of JPEG_DEFAULT_DHT, indexed by class * 2 + id
+static void standard_codes(HuffmanCode codes[4])
+{
+    memset(codes, 0, 4 * sizeof(HuffmanCode));
+
+    const unsigned char* p = JPEG_DEFAULT_DHT + 4;
+    const unsigned char* end = JPEG_DEFAULT_DHT + JPEG_DEFAULT_DHT_SIZE;
+
+    while(p < end)
+    {
+        int table = (p[0] >> 4) * 2 + (p[0] & 15);
+        const unsigned char* counts = p + 1;
+        const unsigned char* values = p + 17;
+
+        // Annex C: codes of each length count up from the last length's
+        // codes, shifted
+        unsigned code = 0;
+        int k = 0;
+        for(int length = 1; length <= 16; length++)
+        {
+            for(int i = 0; i < counts[length - 1]; i++, k++)
+            {
+                codes[table].code[values[k]] = code++;
+                codes[table].length[values[k]] = length;
+            }
+            code <<= 1;
+        }
+
+        p = values + k;
+    }
+}
+
+class BitWriter
+{
+  public:
+    explicit BitWriter(vector<unsigned char>& out) : m_out(out), m_bits(0),
+        m_count(0) {}
+
+    void put(unsigned value, int length)
+    {
+        for(int i = length - 1; i >= 0; i--)
+        {
+            m_bits = (m_bits << 1) | ((value >> i) & 1);
+            if(++m_count == 8)
+                emit();
+        }
+    }
+
+    // pads the last byte with ones
+    void flush()
+    {
+        while(m_count)
+            put(1, 1);
+    }
+
+  private:
+    void emit()
+    {
+        m_out.push_back((unsigned char)m_bits);
+        if(m_bits == 0xFF)
+            m_out.push_back(0);
+        m_bits = 0;
+        m_count = 0;
+    }
+
+    vector<unsigned char>& m_out;
+    unsigned m_bits;
+    int m_count;
+};
+
+static int magnitude_bits(int v)
+{
+    if(v < 0)
+        v = -v;
+    int n = 0;
+    while(v)
+    {
+        n++;
+        v >>= 1;
+    }
+    return n;
+}
+
+static void put_value(BitWriter& bits, int v, int n)
+{
+    if(v < 0)
+        v += (1 << n) - 1;
+    bits.put((unsigned)v, n);
+}
+
+static void forward_dct(const float in[64], float out[64])
+{
+    static float cosines[8][8];
+    static bool ready = false;
+    if(!ready)
+    {
+        for(int u = 0; u < 8; u++)
+        {
+            for(int x = 0; x < 8; x++)
+            {
+                float c = u ? 0.5f : 0.5f / sqrtf(2.0f);
+                cosines[u][x] = c * cosf((2 * x + 1) * u * 3.14159265f / 16);
+            }
+        }
+        ready = true;
+    }
+
+    float rows[64];
+    for(int y = 0; y < 8; y++)
+    {
+        for(int u = 0; u < 8; u++)
+        {
+            float sum = 0;
+            for(int x = 0; x < 8; x++)
+                sum += cosines[u][x] * in[y * 8 + x];
+            rows[y * 8 + u] = sum;
+        }
+    }
+
+    for(int u = 0; u < 8; u++)
+    {
+        for(int v = 0; v < 8; v++)
+        {
+            float sum = 0;
+            for(int y = 0; y < 8; y++)
+                sum += cosines[v][y] * rows[y * 8 + u];
+            out[v * 8 + u] = sum;
+        }
+    }
+}
+
+static void encode_block(BitWriter& bits, const float samples[64],
+    const int quant[64], const HuffmanCode& dc, const HuffmanCode& ac,
+    int& prediction)
+{
+    float coefficients[64];
+    forward_dct(samples, coefficients);
+
+    int q[64];
+    for(int i = 0; i < 64; i++)
+    {
+        float c = coefficients[ZIGZAG[i]] / quant[ZIGZAG[i]];
+        q[i] = (int)(c < 0 ? c - 0.5f : c + 0.5f);
+    }
+
+    int diff = q[0] - prediction;
+    prediction = q[0];
+    int n = magnitude_bits(diff);
+    bits.put(dc.code[n], dc.length[n]);
+    put_value(bits, diff, n);
+
+    int run = 0;
+    for(int i = 1; i < 64; i++)
+    {
+        if(q[i] == 0)
+        {
+            run++;
+            continue;
+        }
+
+        while(run > 15)
+        {
+            bits.put(ac.code[0xF0], ac.length[0xF0]);
+            run -= 16;
+        }
+
+        n = magnitude_bits(q[i]);
+        int symbol = run << 4 | n;
+        bits.put(ac.code[symbol], ac.length[symbol]);
+        put_value(bits, q[i], n);
+        run = 0;
+    }
+
+    if(run)
+        bits.put(ac.code[0], ac.length[0]);
+}
+
+static void put16(vector<unsigned char>& out, int v)
+{
+    out.push_back((unsigned char)(v >> 8));
+    out.push_back((unsigned char)v);
+}
+
+static void scale_quant(const int base[64], int quality, int out[64])
+{
+    if(quality < 1)
+        quality = 1;
+    if(quality > 100)
+        quality = 100;
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+
+    for(int i = 0; i < 64; i++)
+    {
+        int q = (base[i] * scale + 50) / 100;
+        out[i] = q < 1 ? 1 : (q > 255 ? 255 : q);
+    }
+}
+
+std::vector<unsigned char> jpeg_encode(const unsigned char* pixels,
+    int width, int height, int channels, const JpegEncodeOptions& options)
+{
+    bool colour = channels == 3;
+    int components = colour ? 3 : 1;
+
+    // the planes, Y then Cb and Cr at full size; chroma is averaged down
+    // as each MCU is encoded
+    vector<float> planes[3];
+    for(int c = 0; c < components; c++)
+        planes[c].resize((size_t)width * height);
+
+    for(size_t i = 0; i < (size_t)width * height; i++)
+    {
+        if(!colour)
+        {
+            planes[0][i] = pixels[i];
+            continue;
+        }
+
+        float r = pixels[3 * i], g = pixels[3 * i + 1], b = pixels[3 * i + 2];
+        planes[0][i] = 0.299f * r + 0.587f * g + 0.114f * b;
+        planes[1][i] = -0.168736f * r - 0.331264f * g + 0.5f * b + 128;
+        planes[2][i] = 0.5f * r - 0.418688f * g - 0.081312f * b + 128;
+    }
+
+    int quant[2][64];
+    scale_quant(LUMA_QUANT, options.quality, quant[0]);
+    scale_quant(CHROMA_QUANT, options.quality, quant[1]);
+
+    vector<unsigned char> out;
+    out.push_back(0xFF);
+    out.push_back(0xD8);
+
+    for(int t = 0; t < (colour ? 2 : 1); t++)
+    {
+        out.push_back(0xFF);
+        out.push_back(0xDB);
+        put16(out, 67);
+        out.push_back((unsigned char)t);
+        for(int i = 0; i < 64; i++)
+            out.push_back((unsigned char)quant[t][ZIGZAG[i]]);
+    }
+
+    out.push_back(0xFF);
+    out.push_back(0xC0);
+    put16(out, 8 + 3 * components);
+    out.push_back(8);
+    put16(out, height);
+    put16(out, width);
+    out.push_back((unsigned char)components);
+    for(int c = 0; c < components; c++)
+    {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(c == 0 && colour ? 0x22 : 0x11);
+        out.push_back(c == 0 ? 0 : 1);
+    }
+
+    if(!options.omit_dht)
+        out.insert(out.end(), JPEG_DEFAULT_DHT,
+            JPEG_DEFAULT_DHT + JPEG_DEFAULT_DHT_SIZE);
+
+    if(options.restart_interval)
+    {
+        out.push_back(0xFF);
+        out.push_back(0xDD);
+        put16(out, 4);
+        put16(out, options.restart_interval);
+    }
+
+    out.push_back(0xFF);
+    out.push_back(0xDA);
+    put16(out, 6 + 2 * components);
+    out.push_back((unsigned char)components);
+    for(int c = 0; c < components; c++)
+    {
+        out.push_back((unsigned char)(c + 1));
+        out.push_back(c == 0 ? 0x00 : 0x11);
+    }
+    out.push_back(0);
+    out.push_back(63);
+    out.push_back(0);
+
+    HuffmanCode codes[4];
+    standard_codes(codes);
+
+    int mcu = colour ? 16 : 8;
+    int columns = (width + mcu - 1) / mcu;
+    int rows = (height + mcu - 1) / mcu;
+    int prediction[3] = { 0, 0, 0 };
+    int restart = 0;
+
+    BitWriter bits(out);
+
+    for(int my = 0; my < rows; my++)
+    {
+        for(int mx = 0; mx < columns; mx++)
+        {
+            int index = my * columns + mx;
+            if(options.restart_interval && index &&
+               index % options.restart_interval == 0)
+            {
+                bits.flush();
+                out.push_back(0xFF);
+                out.push_back((unsigned char)(0xD0 + (restart++ & 7)));
+                prediction[0] = prediction[1] = prediction[2] = 0;
+            }
+
+            // the luma blocks of the MCU, then each chroma block
+            int luma_blocks = colour ? 4 : 1;
+            for(int b = 0; b < luma_blocks + (colour ? 2 : 0); b++)
+            {
+                int c = b < luma_blocks ? 0 : 1 + (b - luma_blocks);
+                int step = c ? 2 : 1;
+                int x0 = mx * mcu + (c ? 0 : (b & 1) * 8);
+                int y0 = my * mcu + (c ? 0 : (b >> 1) * 8);
+
+                float samples[64];
+                for(int y = 0; y < 8; y++)
+                {
+                    for(int x = 0; x < 8; x++)
+                    {
+                        float sum = 0;
+                        for(int dy = 0; dy < step; dy++)
+                        {
+                            for(int dx = 0; dx < step; dx++)
+                            {
+                                int px = x0 + x * step + dx;
+                                int py = y0 + y * step + dy;
+                                if(px >= width)
+                                    px = width - 1;
+                                if(py >= height)
+                                    py = height - 1;
+                                sum += planes[c][(size_t)py * width + px];
+                            }
+                        }
+                        samples[y * 8 + x] = sum / (step * step) - 128;
+                    }
+                }
+
+                int t = c ? 1 : 0;
+                encode_block(bits, samples, quant[t], codes[t],
+                    codes[2 + t], prediction[c]);
+            }
+        }
+    }
+
+    bits.flush();
+    out.push_back(0xFF);
+    out.push_back(0xD9);
+    return out;
+}
+
+std::vector<unsigned char> test_image(int width, int height, int channels,
+    int frame)
+{
+    vector<unsigned char> pixels((size_t)width * height * channels);
+
+    // a bright square moves across a gradient
+    int size = height / 4 + 1;
+    int left = (frame * 8) % (width > size ? width - size : 1);
+    int top = height / 3;
+
+    for(int y = 0; y < height; y++)
+    {
+        for(int x = 0; x < width; x++)
+        {
+            bool square = x >= left && x < left + size && y >= top &&
+                y < top + size;
+            for(int c = 0; c < channels; c++)
+            {
+                int v = square ? 230 - 40 * c :
+                    (x * 255 / width + y * (c + 1) * 64 / height) & 255;
+                pixels[((size_t)y * width + x) * channels + c] =
+                    (unsigned char)v;
+            }
+        }
+    }
+
+    return pixels;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+// A baseline JPEG encoder for the tests and benchmarks, so they can make
+// frames like a camera's without shipping image files: 8-bit, gray or
+// YCbCr 4:2:0, the standard Huffman tables (jpeg_dht.h), and optionally
+// restart markers. Written for clarity, not speed.
+
+#include <vector>
+#include <cstddef>
+
+struct JpegEncodeOptions
+{
+    int quality;          // 1 to 100, as libjpeg scales its tables
+    int restart_interval; // MCUs between restart markers, 0 for none
+
+    // leave the DHT out, as many UVC cameras do
+    bool omit_dht;
+
+    JpegEncodeOptions() : quality(85), restart_interval(0), omit_dht(false) {}
+};
+
+// encodes width by height pixels, rows top to bottom with no padding, of
+// 1 (gray) or 3 (RGB) channels
+std::vector<unsigned char> jpeg_encode(const unsigned char* pixels,
+    int width, int height, int channels,
+    const JpegEncodeOptions& options = JpegEncodeOptions());
+
+// a test image: smooth gradients with some edges, which changes with
+// frame so a sequence of them has motion in it
+std::vector<unsigned char> test_image(int width, int height, int channels,
+    int frame = 0);
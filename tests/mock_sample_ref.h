@@ -0,0 +1,96 @@
+#pragma once
+
+// A SampleRef over bytes the test owns, standing in for MJ_SampleRef so
+// the hold/write/release protocol can be exercised without DirectShow.
+//
+// What happens to the sample is counted in a SampleLog the test keeps,
+// since the mock itself belongs to the SaveBuffer and is deleted with it.
+// A gated mock makes data() wait until open() is called, which holds up
+// whichever thread is reading the frame.
+
+#include "sample_ref.h"
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+struct SampleLog
+{
+    std::atomic<int> reads;          // data() calls while held
+    std::atomic<int> stale_reads;    // data() calls after release()
+    std::atomic<int> releases;       // release() calls that let go
+    std::atomic<int> extra_releases; // release() calls with nothing held
+
+    SampleLog() : reads(0), stale_reads(0), releases(0), extra_releases(0) {}
+};
+
+class MockSampleRef : public SampleRef
+{
+  public:
+    MockSampleRef(const std::vector<unsigned char>& bytes, SampleLog& log,
+        bool gated = false) : m_bytes(bytes), m_log(log), m_held(true),
+        m_gated(gated), m_entered(false) {}
+
+    const unsigned char* data() const
+    {
+        if(!m_held)
+            m_log.stale_reads++;
+        else
+            m_log.reads++;
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_entered = true;
+        m_cv.notify_all();
+        m_cv.wait(lock, [this]{ return !m_gated; });
+
+        return m_bytes.data();
+    }
+
+    size_t size() const { return m_bytes.size(); }
+    bool held() const { return m_held; }
+
+    void release()
+    {
+        if(!m_held)
+        {
+            m_log.extra_releases++;
+            return;
+        }
+
+        // called while the sample is still held, as MJ_SampleRef would
+        // hand it back to the allocator
+        if(on_release)
+            on_release();
+
+        m_held = false;
+        m_log.releases++;
+    }
+
+    // gated mocks: waits for a thread to get stuck in data()
+    void wait_entered()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this]{ return m_entered; });
+    }
+
+    // gated mocks: lets data() return
+    void open()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_gated = false;
+        m_cv.notify_all();
+    }
+
+    std::function<void()> on_release;
+
+  private:
+    std::vector<unsigned char> m_bytes;
+    SampleLog& m_log;
+    std::atomic<bool> m_held;
+
+    mutable std::mutex m_mutex;
+    mutable std::condition_variable m_cv;
+    bool m_gated;
+    mutable bool m_entered;
+};
@@ -0,0 +1,473 @@
+// AviWriter read back: the RIFF tree of every file it writes is parsed and
+// walked, and the hdrl/strl headers, the 'indx' super index, the 'ix00'
+// standard indexes and the first RIFF's 'idx1' must all find the frames
+// that went in, in order. Files are checked after close(), after a sync()
+// with the writer still going, and across the move to 'AVIX' RIFFs, for
+// which the writer is given a small RIFF limit.
+
+#include "check.h"
+#include "avi_writer.h"
+#include <cstring>
+#include <map>
+using namespace std;
+
+static const uint32_t WIDTH = 640;
+static const uint32_t HEIGHT = 480;
+static const int64_t FRAME_US = 40000;
+
+// a frame with an SOF0 marker giving WIDTH x HEIGHT, and noise after it
+static vector<unsigned char> make_frame(unsigned seed, size_t size)
+{
+    vector<unsigned char> bytes(size);
+    uint32_t x = seed * 2654435761u + 1;
+    for(size_t i = 0; i < size; i++)
+    {
+        x = x * 1664525u + 1013904223u;
+        bytes[i] = (unsigned char)((x >> 24) % 0xFF);
+    }
+
+    static const unsigned char sof[] = {
+        0xFF, 0xD8, 0xFF, 0xC0, 0x00, 0x0B, 0x08,
+        HEIGHT >> 8, HEIGHT & 0xFF, WIDTH >> 8, WIDTH & 0xFF,
+    };
+    memcpy(&bytes[0], sof, sizeof(sof));
+    bytes[size - 2] = 0xFF;
+    bytes[size - 1] = 0xD9;
+    return bytes;
+}
+
+static vector<vector<unsigned char> > make_frames(size_t count,
+    size_t size)
+{
+    vector<vector<unsigned char> > frames;
+    for(size_t i = 0; i < count; i++)
+        frames.push_back(make_frame((unsigned)i, size + i % 7));
+    return frames;
+}
+
+// writes frames[first, first + count) in batches of batch
+static bool write(AviWriter& w, const vector<vector<unsigned char> >& frames,
+    size_t first, size_t count, size_t batch)
+{
+    vector<FrameInfo> infos;
+    for(size_t i = first; i < first + count; i += batch)
+    {
+        infos.clear();
+        for(size_t j = i; j < first + count && j < i + batch; j++)
+        {
+            FrameInfo f = FrameInfo();
+            f.data = &frames[j][0];
+            f.size = frames[j].size();
+            f.time_us = 1000000 + (int64_t)j * FRAME_US;
+            infos.push_back(f);
+        }
+        if(!w.write_frames(&infos[0], infos.size()))
+            return false;
+    }
+    return true;
+}
+
+static vector<unsigned char> read_file(const string& path)
+{
+    vector<unsigned char> bytes;
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f)
+        return bytes;
+
+    unsigned char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(f);
+    return bytes;
+}
+
+static uint32_t get16(const vector<unsigned char>& f, uint64_t at)
+{
+    return f[at] | (f[at + 1] << 8);
+}
+
+static uint32_t get32(const vector<unsigned char>& f, uint64_t at)
+{
+    return get16(f, at) | (get16(f, at + 2) << 16);
+}
+
+static uint64_t get64(const vector<unsigned char>& f, uint64_t at)
+{
+    return get32(f, at) | ((uint64_t)get32(f, at + 4) << 32);
+}
+
+static string fourcc(const vector<unsigned char>& f, uint64_t at)
+{
+    if(at + 4 > f.size())
+        return string();
+    return string((const char*)&f[at], 4);
+}
+
+struct Chunk
+{
+    string id;      // for RIFF and LIST, the list type
+    bool list;
+    uint64_t at;    // of the chunk header
+    uint32_t size;  // of the data, from the header
+    vector<Chunk> children;
+};
+
+// parses the chunks that fill [begin, end). False if one runs past the
+// end or leaves bytes over.
+static bool parse(const vector<unsigned char>& f, uint64_t begin,
+    uint64_t end, vector<Chunk>& out)
+{
+    uint64_t pos = begin;
+    while(pos < end)
+    {
+        if(end - pos < 8)
+            return false;
+
+        Chunk c;
+        c.id = fourcc(f, pos);
+        c.list = c.id == "RIFF" || c.id == "LIST";
+        c.at = pos;
+        c.size = get32(f, pos + 4);
+
+        uint64_t data_end = pos + 8 + c.size;
+        if(data_end > end)
+            return false;
+
+        if(c.list)
+        {
+            if(c.size < 4)
+                return false;
+            c.id = fourcc(f, pos + 8);
+            if(!parse(f, pos + 12, data_end, c.children))
+                return false;
+        }
+
+        out.push_back(c);
+        pos = data_end + (c.size & 1);
+    }
+    return pos == end;
+}
+
+static const Chunk* find(const vector<Chunk>& chunks, const char* id)
+{
+    for(size_t i = 0; i < chunks.size(); i++)
+    {
+        if(chunks[i].id == id)
+            return &chunks[i];
+    }
+    return NULL;
+}
+
+static bool same_frame(const vector<unsigned char>& f, uint64_t at,
+    uint32_t size, const vector<unsigned char>& frame)
+{
+    return size == frame.size() && at + size <= f.size() &&
+        memcmp(&f[at], &frame[0], size) == 0;
+}
+
+// checks that path is a well-formed OpenDML file holding frames, in
+// order, with every RIFF within riff_limit. idx1 is looked for once the
+// first RIFF is finished, by close() or by moving on to an AVIX.
+//
+// A file that has been synced but not closed may, in direct mode, run on
+// past its last RIFF into the zeros that pad out the last block.
+static void check_avi(const string& path,
+    const vector<vector<unsigned char> >& frames, uint64_t riff_limit,
+    bool closed)
+{
+    vector<unsigned char> f = read_file(path);
+    if(!closed)
+    {
+        uint64_t end = 0;
+        while(end + 8 <= f.size() && fourcc(f, end) == "RIFF")
+            end += 8 + get32(f, end + 4);
+
+        CHECK(end <= f.size() && f.size() - end < 4096);
+        for(uint64_t i = end; i < f.size(); i++)
+            CHECK(f[i] == 0);
+        if(end < f.size())
+            f.resize(end);
+    }
+
+    vector<Chunk> riffs;
+    bool parsed = parse(f, 0, f.size(), riffs);
+    CHECK(parsed);
+    CHECK(!riffs.empty());
+    if(!parsed || riffs.empty())
+        return;
+
+    for(size_t i = 0; i < riffs.size(); i++)
+    {
+        CHECK(riffs[i].list);
+        CHECK(riffs[i].id == (i == 0 ? "AVI " : "AVIX"));
+        CHECK(8 + riffs[i].size <= riff_limit);
+        CHECK(find(riffs[i].children, "movi"));
+    }
+
+    const Chunk& avi = riffs[0];
+    const Chunk* hdrl = find(avi.children, "hdrl");
+    CHECK(hdrl && hdrl == &avi.children[0]);
+    if(!hdrl)
+        return;
+
+    const Chunk* avih = find(hdrl->children, "avih");
+    const Chunk* strl = find(hdrl->children, "strl");
+    const Chunk* odml = find(hdrl->children, "odml");
+    CHECK(avih && avih->size == 56);
+    CHECK(strl && odml);
+    if(!avih || !strl || !odml)
+        return;
+
+    const Chunk* strh = find(strl->children, "strh");
+    const Chunk* strf = find(strl->children, "strf");
+    const Chunk* indx = find(strl->children, "indx");
+    const Chunk* dmlh = find(odml->children, "dmlh");
+    CHECK(strh && strf && indx && dmlh);
+    if(!strh || !strf || !indx || !dmlh)
+        return;
+
+    // the frames as the 'movi' lists have them, and which list each ix00
+    // chunk is in
+    size_t k = 0;
+    size_t first_riff_frames = 0;
+    map<uint64_t, const Chunk*> ix00s;
+    map<uint64_t, uint64_t> ix00_movi;
+    for(size_t i = 0; i < riffs.size(); i++)
+    {
+        const Chunk* movi = find(riffs[i].children, "movi");
+        if(!movi)
+            continue;
+
+        for(size_t j = 0; j < movi->children.size(); j++)
+        {
+            const Chunk& c = movi->children[j];
+            if(c.id == "00dc")
+            {
+                CHECK(k < frames.size() &&
+                    same_frame(f, c.at + 8, c.size, frames[k]));
+                k++;
+                if(i == 0)
+                    first_riff_frames++;
+            }
+            else
+            {
+                CHECK(c.id == "ix00");
+                ix00s[c.at] = &c;
+                ix00_movi[c.at] = movi->at;
+            }
+        }
+    }
+    CHECK(k == frames.size());
+
+    const Chunk* idx1 = find(avi.children, "idx1");
+    bool first_done = closed || riffs.size() > 1;
+    CHECK((idx1 != NULL) == first_done);
+
+    uint64_t a = avih->at + 8;
+    CHECK(get32(f, a + 12) == (first_done ? 0x10u : 0u)); // AVIF_HASINDEX
+    CHECK(get32(f, a + 16) == first_riff_frames);
+    CHECK(get32(f, a + 24) == 1);
+    CHECK(get32(f, a + 32) == WIDTH);
+    CHECK(get32(f, a + 36) == HEIGHT);
+    if(frames.size() > 1)
+        CHECK(get32(f, a) == FRAME_US);
+
+    uint64_t s = strh->at + 8;
+    CHECK(fourcc(f, s) == "vids");
+    CHECK(fourcc(f, s + 4) == "MJPG");
+    CHECK(get32(f, s + 32) == frames.size());
+    CHECK(fourcc(f, strf->at + 8 + 16) == "MJPG");
+    CHECK(get32(f, dmlh->at + 8) == frames.size());
+
+    // the super index, and through it every ix00 chunk, in order
+    uint64_t x = indx->at + 8;
+    CHECK(get16(f, x) == 4);
+    CHECK(f[x + 3] == 0); // AVI_INDEX_OF_INDEXES
+    CHECK(fourcc(f, x + 8) == "00dc");
+
+    uint32_t entries = get32(f, x + 4);
+    CHECK(entries == ix00s.size());
+    CHECK(24 + 16 * (uint64_t)entries <= indx->size);
+
+    k = 0;
+    for(uint32_t i = 0; i < entries && 24 + 16 * i + 16 <= indx->size; i++)
+    {
+        uint64_t e = x + 24 + 16 * i;
+        uint64_t offset = get64(f, e);
+        uint32_t size = get32(f, e + 8);
+        uint32_t count = get32(f, e + 12);
+
+        const Chunk* ix = ix00s.count(offset) ? ix00s[offset] : NULL;
+        CHECK(ix);
+        if(!ix)
+            continue;
+        CHECK(size == 8 + ix->size);
+
+        uint64_t q = offset + 8;
+        CHECK(get16(f, q) == 2);
+        CHECK(f[q + 3] == 1); // AVI_INDEX_OF_CHUNKS
+        CHECK(get32(f, q + 4) == count);
+        CHECK(fourcc(f, q + 8) == "00dc");
+        CHECK(24 + 8 * (uint64_t)count == ix->size);
+
+        uint64_t base = get64(f, q + 12);
+        CHECK(base == ix00_movi[offset]);
+
+        for(uint32_t j = 0; j < count && 24 + 8 * j + 8 <= ix->size; j++)
+        {
+            uint32_t at = get32(f, q + 24 + 8 * j);
+            uint32_t bytes = get32(f, q + 28 + 8 * j);
+            CHECK(!(bytes & 0x80000000)); // key frame
+            CHECK(fourcc(f, base + at - 8) == "00dc");
+            CHECK(k < frames.size() &&
+                same_frame(f, base + at, bytes, frames[k]));
+            k++;
+        }
+    }
+    CHECK(k == frames.size());
+
+    // idx1 follows the first 'movi' list and covers the frames in it,
+    // with offsets of the chunk headers from the 'movi' fourcc
+    if(!idx1)
+        return;
+
+    const Chunk* movi = find(avi.children, "movi");
+    CHECK(movi && idx1 > movi);
+    CHECK(idx1->size == 16 * first_riff_frames);
+    if(!movi)
+        return;
+
+    for(size_t i = 0; i < idx1->size / 16 && i < frames.size(); i++)
+    {
+        uint64_t e = idx1->at + 8 + 16 * i;
+        CHECK(fourcc(f, e) == "00dc");
+        CHECK(get32(f, e + 4) == 0x10); // AVIIF_KEYFRAME
+
+        uint64_t chunk = movi->at + 8 + get32(f, e + 8);
+        uint32_t size = get32(f, e + 12);
+        CHECK(fourcc(f, chunk) == "00dc");
+        CHECK(get32(f, chunk + 4) == size);
+        CHECK(same_frame(f, chunk + 8, size, frames[i]));
+    }
+}
+
+// a file closed after a few frames, long before the first ix00 would
+// have been written, is complete
+static void test_closed_early(unsigned flags)
+{
+    string dir = make_test_dir("test_avi_writer");
+    string path = dir + "/early.avi";
+
+    for(size_t count = 1; count <= 5; count += 2)
+    {
+        vector<vector<unsigned char> > frames = make_frames(count, 3001);
+
+        AviWriter w;
+        CHECK(w.open(path, flags));
+        CHECK(write(w, frames, 0, count, 2));
+        CHECK(w.frame_count() == count);
+        w.close();
+
+        check_avi(path, frames, AviWriter::RIFF_LIMIT, true);
+    }
+
+    remove_test_dir(dir);
+}
+
+// an ix00 chunk every INDEX_FRAMES frames, each in the super index
+static void test_index_chunks(unsigned flags)
+{
+    string dir = make_test_dir("test_avi_writer");
+    string path = dir + "/indexed.avi";
+
+    size_t count = 2 * AviWriter::INDEX_FRAMES + 5;
+    vector<vector<unsigned char> > frames = make_frames(count, 200);
+
+    AviWriter w;
+    CHECK(w.open(path, flags));
+    CHECK(write(w, frames, 0, count, 50));
+    w.close();
+
+    check_avi(path, frames, AviWriter::RIFF_LIMIT, true);
+
+    // three ix00 chunks: two full ones and the one close() wrote
+    vector<unsigned char> f = read_file(path);
+    size_t ix00s = 0;
+    for(size_t i = 0; i + 4 <= f.size(); i++)
+        ix00s += memcmp(&f[i], "ix00", 4) == 0;
+    CHECK(ix00s == 3);
+
+    remove_test_dir(dir);
+}
+
+// past the limit the writer ends the first RIFF with idx1 and goes on in
+// AVIX RIFFs, a batch at a time or a frame at a time
+static void test_rollover(unsigned flags)
+{
+    string dir = make_test_dir("test_avi_writer");
+    string path = dir + "/rollover.avi";
+
+    const uint64_t limit = 256 * 1024;
+    size_t count = 150;
+    vector<vector<unsigned char> > frames = make_frames(count, 9000);
+
+    size_t batches[] = { 1, 11, count };
+    for(size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++)
+    {
+        AviWriter w(limit);
+        CHECK(w.open(path, flags));
+        CHECK(write(w, frames, 0, count, batches[b]));
+        w.close();
+
+        // 150 frames of 9KB make 1.3MB, so at least six RIFFs
+        check_avi(path, frames, limit, true);
+        vector<unsigned char> f = read_file(path);
+        CHECK(f.size() > 5 * limit);
+    }
+
+    remove_test_dir(dir);
+}
+
+// what sync() leaves, before close(), is already a complete file: first
+// within the first RIFF, then after the move to AVIX
+static void test_synced(unsigned flags)
+{
+    string dir = make_test_dir("test_avi_writer");
+    string path = dir + "/synced.avi";
+
+    const uint64_t limit = 128 * 1024;
+    vector<vector<unsigned char> > frames = make_frames(40, 9000);
+
+    AviWriter w(limit);
+    CHECK(w.open(path, flags));
+
+    CHECK(write(w, frames, 0, 5, 3));
+    CHECK(w.sync());
+    check_avi(path, vector<vector<unsigned char> >(frames.begin(),
+        frames.begin() + 5), limit, false);
+
+    CHECK(write(w, frames, 5, 25, 4));
+    CHECK(w.sync());
+    check_avi(path, vector<vector<unsigned char> >(frames.begin(),
+        frames.begin() + 30), limit, false);
+
+    CHECK(write(w, frames, 30, 10, 10));
+    w.close();
+    check_avi(path, frames, limit, true);
+
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    unsigned modes[] = { 0, OutputFile::OPEN_DIRECT };
+    for(size_t i = 0; i < 2; i++)
+    {
+        test_closed_early(modes[i]);
+        test_index_chunks(modes[i]);
+        test_rollover(modes[i]);
+        test_synced(modes[i]);
+    }
+    return test_result("avi_writer");
+}
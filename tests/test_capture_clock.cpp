@@ -0,0 +1,158 @@
+// capture_clock.h: civil_from_days() against known dates and against a
+// day by day walk of the calendar across the leap year rules (2000 is a
+// leap year, 1900 and 2100 are not), and monotonic_to_wall_us() kept
+// monotonic, from several threads at once, and within a resample of the
+// wall clock for the whole time it is called.
+
+#include "check.h"
+#include "capture_clock.h"
+#include <chrono>
+#include <thread>
+#include <vector>
+using namespace std;
+
+static bool is_date(int64_t days, int y, unsigned m, unsigned d)
+{
+    int cy;
+    unsigned cm, cd;
+    civil_from_days(days, cy, cm, cd);
+    return cy == y && cm == m && cd == d;
+}
+
+static void test_known_dates()
+{
+    CHECK(is_date(0, 1970, 1, 1));
+    CHECK(is_date(-1, 1969, 12, 31));
+    CHECK(is_date(365, 1971, 1, 1));
+    CHECK(is_date(10957, 2000, 1, 1));
+    CHECK(is_date(11016, 2000, 2, 29));
+    CHECK(is_date(11017, 2000, 3, 1));
+    CHECK(is_date(19782, 2024, 2, 29));
+    CHECK(is_date(24855, 2038, 1, 19));
+    CHECK(is_date(47540, 2100, 2, 28));
+    CHECK(is_date(47541, 2100, 3, 1));
+    CHECK(is_date(-25509, 1900, 2, 28));
+    CHECK(is_date(-25508, 1900, 3, 1));
+    CHECK(is_date(-719468, 0, 3, 1));
+    CHECK(is_date(-719469, 0, 2, 29));
+}
+
+static unsigned days_in_month(int y, unsigned m)
+{
+    static const unsigned days[] = {
+        31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31
+    };
+    bool leap = (y % 4 == 0 && y % 100 != 0) || y % 400 == 0;
+    return (m == 2 && leap) ? 29 : days[m - 1];
+}
+
+// every day from 1600-01-01 to 2500-12-31 is the day after the one
+// before it
+static void test_every_day()
+{
+    int y = 1600;
+    unsigned m = 1;
+    unsigned d = 1;
+
+    int64_t first = -135140; // 1600-01-01
+    CHECK(is_date(first, y, m, d));
+
+    size_t wrong = 0;
+    for(int64_t days = first + 1; y < 2501; days++)
+    {
+        if(++d > days_in_month(y, m))
+        {
+            d = 1;
+            if(++m > 12)
+            {
+                m = 1;
+                y++;
+            }
+        }
+
+        // checked without CHECK so a bug does not print 300000 lines
+        if(y < 2501 && !is_date(days, y, m, d) && wrong++ < 10)
+            fprintf(stderr, "day %lld is not %04d-%02u-%02u\n",
+                (long long)days, y, m, d);
+    }
+    CHECK(wrong == 0);
+}
+
+static int64_t wall_now_us()
+{
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// converts the time now, over and over for a little more than a
+// resample: what it gets never goes back, and is never further from the
+// wall clock, read either side of it, than the clocks can drift apart in
+// the second since the offset was measured
+static void convert_now(int64_t run_ns, size_t& back, int64_t& worst_us)
+{
+    int64_t start = monotonic_ns();
+    int64_t last = 0;
+    back = 0;
+    worst_us = 0;
+
+    for(int64_t now = start; now - start < run_ns; )
+    {
+        int64_t before = wall_now_us();
+        now = monotonic_ns();
+        int64_t us = monotonic_to_wall_us(now);
+        int64_t after = wall_now_us();
+
+        if(us < last)
+            back++;
+        last = us;
+
+        int64_t off = 0;
+        if(us < before)
+            off = before - us;
+        else if(us > after)
+            off = us - after;
+        if(off > worst_us)
+            worst_us = off;
+    }
+}
+
+static void test_monotonic(size_t threads)
+{
+    vector<size_t> back(threads);
+    vector<int64_t> worst(threads);
+    vector<thread> running;
+    for(size_t i = 0; i < threads; i++)
+    {
+        running.push_back(thread(convert_now, 1200000000LL,
+            ref(back[i]), ref(worst[i])));
+    }
+
+    for(size_t i = 0; i < threads; i++)
+    {
+        running[i].join();
+        CHECK(back[i] == 0);
+
+        // CLOCK_MONOTONIC and CLOCK_REALTIME are slewed together; 1ms
+        // allows for a slow reading
+        CHECK(worst[i] < 1000);
+    }
+}
+
+// a time in the past maps to that far before now
+static void test_past()
+{
+    int64_t now = monotonic_ns();
+    int64_t wall = wall_now_us();
+    int64_t us = monotonic_to_wall_us(now - 3600LL * 1000000000);
+    CHECK(llabs(wall - 3600LL * 1000000 - us) < 1000);
+}
+
+int main()
+{
+    test_known_dates();
+    test_every_day();
+    test_monotonic(1);
+    test_monotonic(3);
+    test_past();
+    return test_result("capture_clock");
+}
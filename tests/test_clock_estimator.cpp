@@ -0,0 +1,274 @@
+// ClockEstimator on synthetic arrivals: a device clock running a fixed
+// number of ppm off the host's is followed, frames held up on their way in
+// do not pull the fit late, and a break in the device clock starts it
+// over. Then SaveThread::frame_time() behind it: frames are timed by
+// their arrival until there is a fit, and by their stream time after.
+
+#include "check.h"
+#include "clock_estimator.h"
+#include "save_thread.h"
+#include "segment_reader.h"
+#include <dirent.h>
+#include <cmath>
+using namespace std;
+
+// 30 frames a second of device time
+static const int64_t FRAME_NS = 33333300;
+
+// the least any frame takes to arrive
+static const int64_t MIN_DELAY_NS = 1000000;
+
+// repeatable delivery delays
+struct Delays
+{
+    uint32_t x;
+
+    explicit Delays(uint32_t seed) : x(seed * 2654435761u + 1) {}
+
+    // 0 to n - 1
+    int64_t below(int64_t n)
+    {
+        x = x * 1664525u + 1013904223u;
+        return (int64_t)((x >> 8) % (uint32_t)n);
+    }
+};
+
+// a device whose clock runs ppm slower than the host's, starting at
+// host time host_start
+struct Device
+{
+    double ppm;
+    int64_t host_start;
+
+    // when a frame stamped device_ns was really captured, on the host clock
+    int64_t host_ns(int64_t device_ns) const
+    {
+        return host_start + device_ns +
+            (int64_t)llround(device_ns * ppm * 1e-6);
+    }
+};
+
+// feeds frames n_first to n_last - 1, each arriving after MIN_DELAY_NS
+// plus whatever extra() says
+template <class Extra>
+static void feed(ClockEstimator& c, const Device& d, int64_t n_first,
+    int64_t n_last, Extra extra)
+{
+    for(int64_t n = n_first; n < n_last; n++)
+    {
+        int64_t device_ns = n * FRAME_NS;
+        c.add(device_ns, d.host_ns(device_ns) + MIN_DELAY_NS + extra());
+    }
+}
+
+// how far to_host_ns() is from the fastest possible arrival of a frame
+static double error_us(const ClockEstimator& c, const Device& d,
+    int64_t device_ns)
+{
+    return (c.to_host_ns(device_ns) -
+        (d.host_ns(device_ns) + MIN_DELAY_NS)) / 1000.0;
+}
+
+// a fixed drift is recovered to within a ppm, over ten minutes of frames
+// with up to 4ms of delay on top of the least
+static void test_drift()
+{
+    double drifts[] = { 0, 50, -120, 400 };
+    for(size_t i = 0; i < sizeof(drifts) / sizeof(drifts[0]); i++)
+    {
+        Device d = { drifts[i], 5000000000LL };
+        Delays delays((uint32_t)i);
+        ClockEstimator c;
+
+        int64_t frames = 600 * 30;
+        feed(c, d, 0, frames, [&]() { return delays.below(4000000); });
+
+        CHECK(c.ready());
+        CHECK(c.frames() == (uint64_t)frames);
+        CHECK(fabs(c.drift_ppm() - drifts[i]) < 1.0);
+
+        // the fit tracks the fastest arrivals: the fastest of each
+        // second's 30 frames comes in about 4ms / 31 after the least
+        double e = error_us(c, d, frames * FRAME_NS);
+        CHECK(e > -100 && e < 400);
+    }
+}
+
+// most frames held up by 5 to 50ms, one in a thousand by 300ms: the fit
+// still follows the few that come straight through, not the average
+static void test_one_sided_jitter()
+{
+    Device d = { 75, 0 };
+    Delays delays(7);
+    ClockEstimator c;
+
+    int64_t frames = 600 * 30;
+    feed(c, d, 0, frames, [&]() -> int64_t {
+        if(delays.below(1000) == 0)
+            return 300000000;
+        if(delays.below(10) < 7)
+            return 5000000 + delays.below(45000000);
+        return delays.below(500000);
+    });
+
+    CHECK(c.ready());
+    CHECK(c.frames() == (uint64_t)frames);
+    CHECK(fabs(c.drift_ppm() - 75) < 2.0);
+
+    double e = error_us(c, d, frames * FRAME_NS);
+    CHECK(e > -100 && e < 500);
+
+    // the spread is still reported
+    CHECK(c.jitter_us() > 5000);
+}
+
+// no fit until two buckets are finished; to_host_ns() is not to be used
+// before then
+static void test_not_ready()
+{
+    Device d = { 0, 0 };
+    ClockEstimator c;
+
+    // the first frame of the third bucket finishes the second
+    int64_t third = 2000000000 / FRAME_NS + 1;
+    feed(c, d, 0, third, []() { return 0; });
+    CHECK(!c.ready());
+    feed(c, d, third, third + 1, []() { return 0; });
+    CHECK(c.ready());
+}
+
+// the stream time going back, or jumping by more than half a second
+// against the fit, throws the history away; the fit that follows is of
+// the clocks as they are now
+static void test_discontinuity()
+{
+    Device d = { 30, 1000000000 };
+    ClockEstimator c;
+    feed(c, d, 0, 20 * 30, []() { return 0; });
+    CHECK(c.ready());
+    CHECK(c.frames() == 20 * 30);
+
+    // the graph is restarted: stream time starts from 0 again, 20s later
+    // on the host
+    Device restarted = { 30, d.host_ns(20 * 30 * FRAME_NS) };
+    feed(c, restarted, 0, 1, []() { return 0; });
+    CHECK(!c.ready());
+    CHECK(c.frames() == 1);
+
+    feed(c, restarted, 1, 5 * 30, []() { return 0; });
+    CHECK(c.ready());
+    CHECK(fabs(error_us(c, restarted, 5 * 30 * FRAME_NS)) < 10);
+
+    // a jump forward of 2s in the device clock, with the host going on
+    // as before
+    int64_t n = 5 * 30;
+    Device jumped = { 30, 0 };
+    jumped.host_start = restarted.host_ns(n * FRAME_NS) -
+        jumped.host_ns((n + 60) * FRAME_NS);
+    feed(c, jumped, n + 60, n + 61, []() { return 0; });
+    CHECK(!c.ready());
+    CHECK(c.frames() == 1);
+
+    feed(c, jumped, n + 61, n + 60 + 5 * 30, []() { return 0; });
+    CHECK(c.ready());
+    CHECK(fabs(error_us(c, jumped, (n + 60 + 5 * 30) * FRAME_NS)) < 10);
+
+    // a single frame 200ms late is only jitter
+    uint64_t before = c.frames();
+    int64_t late = (n + 60 + 5 * 30) * FRAME_NS;
+    c.add(late, jumped.host_ns(late) + MIN_DELAY_NS + 200000000);
+    CHECK(c.ready());
+    CHECK(c.frames() == before + 1);
+}
+
+static vector<string> segment_files(const string& dir)
+{
+    vector<string> files;
+    DIR* d = opendir(dir.c_str());
+    while(dirent* e = d ? readdir(d) : NULL)
+    {
+        string name = e->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    if(d)
+        closedir(d);
+    return files;
+}
+
+// frames that alternate between arriving 1ms and 6ms after capture: the
+// gaps between their times show the arrival jitter for as long as the
+// writer has no fit, which is the first two seconds of stream time, and
+// the even 33.3ms of the stream times after that
+static void test_frame_time()
+{
+    string dir = make_test_dir("test_clock_estimator");
+    SaveOptions options;
+    options.format = FORMAT_SEGMENT;
+    options.file_seconds = 0;
+
+    int64_t frames = 5 * 30;
+    int64_t host_start = monotonic_ns();
+    {
+        SaveThread st(dir, options);
+        vector<unsigned char> bytes(4096, 0x20);
+        bytes[0] = 0xFF;
+        bytes[1] = 0xD8;
+        bytes[bytes.size() - 2] = 0xFF;
+        bytes[bytes.size() - 1] = 0xD9;
+
+        for(int64_t n = 0; n < frames; n++)
+        {
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store(&bytes[0], bytes.size());
+            buf->camera = 0;
+            buf->stream_time = n * FRAME_NS / 100;
+            buf->has_stream_time = true;
+            buf->capture_ns = host_start + n * FRAME_NS + MIN_DELAY_NS +
+                (n % 2) * 5000000;
+            st.save(buf);
+        }
+        st.stop();
+
+        ClockDrift drift = st.clock_drift(0);
+        CHECK(drift.valid);
+        CHECK(fabs(drift.drift_ppm) < 1);
+        // published as each bucket is finished
+        CHECK(drift.frames > (uint64_t)(frames - 30));
+        CHECK(drift.frames <= (uint64_t)frames);
+    }
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() == 1);
+
+    SegmentReader r;
+    CHECK(!files.empty() && r.open(files[0]));
+    CHECK(r.frame_count() == (size_t)frames);
+
+    // the first frame of the third bucket is the first with a fit
+    int64_t first_fitted = 2000000000 / FRAME_NS + 1;
+    for(size_t i = 1; i < r.frame_count(); i++)
+    {
+        int64_t gap = r.frame(i).time_us - r.frame(i - 1).time_us;
+        int64_t expected = FRAME_NS / 1000;
+        if((int64_t)i < first_fitted)
+            expected += (i % 2) ? 5000 : -5000;
+        else if((int64_t)i == first_fitted)
+            expected -= (i % 2) ? 0 : 5000;
+
+        // the wall clock offset may be measured again in between
+        CHECK(llabs(gap - expected) < 100);
+    }
+
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_drift();
+    test_one_sided_jitter();
+    test_not_ready();
+    test_discontinuity();
+    test_frame_time();
+    return test_result("clock_estimator");
+}
@@ -0,0 +1,210 @@
+// DecodePool gives exactly what JpegDecoder::decode() gives for the same
+// frame: split into bands at its restart intervals, decoded whole when a
+// restart marker is missing, and a frame per thread when there are none.
+
+#include "check.h"
+#include "decode_pool.h"
+#include "jpeg_encoder.h"
+#include <cstring>
+using namespace std;
+
+static const int WIDTH = 333;
+static const int HEIGHT = 201;
+
+static vector<unsigned char> encoded(int restart_interval, int frame = 0)
+{
+    JpegEncodeOptions options;
+    options.restart_interval = restart_interval;
+    vector<unsigned char> pixels = test_image(WIDTH, HEIGHT, 3, frame);
+    return jpeg_encode(&pixels[0], WIDTH, HEIGHT, 3, options);
+}
+
+static int channels_of(JpegPixelFormat format)
+{
+    return format == JPEG_GRAY ? 1 : 3;
+}
+
+// a frame's decode at scale into rows with a few bytes of padding, which
+// must be left as they were
+struct Output
+{
+    size_t stride;
+    vector<unsigned char> pixels;
+};
+
+static Output make_output(const vector<unsigned char>& jpeg, int scale,
+    JpegPixelFormat format)
+{
+    JpegDecoder decoder;
+    decoder.parse(&jpeg[0], jpeg.size());
+
+    Output o;
+    o.stride = (size_t)decoder.output_width(scale) * channels_of(format) + 5;
+    o.pixels.assign(o.stride * decoder.output_height(scale), 0xA5);
+    return o;
+}
+
+// JpegDecoder::decode() on its own, into an output shaped the same
+static bool decode_direct(const vector<unsigned char>& jpeg, int scale,
+    JpegPixelFormat format, Output& o)
+{
+    JpegDecoder decoder;
+    return decoder.parse(&jpeg[0], jpeg.size()) &&
+        decoder.decode(scale, format, &o.pixels[0], o.stride);
+}
+
+static DecodeRequest request(const vector<unsigned char>& jpeg, int scale,
+    JpegPixelFormat format, Output& o)
+{
+    DecodeRequest r;
+    r.data = &jpeg[0];
+    r.size = jpeg.size();
+    r.scale = scale;
+    r.format = format;
+    r.out = &o.pixels[0];
+    r.stride = o.stride;
+    r.ok = false;
+    return r;
+}
+
+// frames with restart markers every few MCUs, or a row of them or more,
+// are split and come out the same at every scale and format
+static void test_restart_intervals(DecodePool& pool)
+{
+    int intervals[] = { 1, 3, 7, 21, 50 };
+    int scales[] = { 1, 2, 4, 8 };
+    JpegPixelFormat formats[] = { JPEG_RGB, JPEG_BGR, JPEG_GRAY };
+
+    for(size_t i = 0; i < sizeof intervals / sizeof intervals[0]; i++)
+    {
+        vector<unsigned char> jpeg = encoded(intervals[i]);
+
+        for(size_t s = 0; s < sizeof scales / sizeof scales[0]; s++)
+        {
+            for(size_t f = 0; f < sizeof formats / sizeof formats[0]; f++)
+            {
+                Output expected = make_output(jpeg, scales[s], formats[f]);
+                CHECK(decode_direct(jpeg, scales[s], formats[f], expected));
+
+                Output got = make_output(jpeg, scales[s], formats[f]);
+                DecodeRequest r = request(jpeg, scales[s], formats[f], got);
+
+                uint64_t split = pool.split();
+                CHECK(pool.decode(&r, 1));
+                CHECK(r.ok);
+                CHECK(pool.split() == split + 1);
+                CHECK(got.pixels == expected.pixels);
+            }
+        }
+    }
+}
+
+// with one restart marker taken out the frame cannot be cut up; it is
+// decoded whole, and does whatever decode() does with it
+static void test_missing_marker(DecodePool& pool)
+{
+    vector<unsigned char> jpeg = encoded(4);
+
+    // the third RST in the scan data
+    size_t found = 0;
+    for(size_t i = 0; i + 1 < jpeg.size(); i++)
+    {
+        if(jpeg[i] == 0xFF && jpeg[i + 1] >= 0xD0 && jpeg[i + 1] <= 0xD7 &&
+           ++found == 3)
+        {
+            jpeg.erase(jpeg.begin() + i, jpeg.begin() + i + 2);
+            break;
+        }
+    }
+    CHECK(found == 3);
+
+    Output expected = make_output(jpeg, 1, JPEG_RGB);
+    bool direct_ok = decode_direct(jpeg, 1, JPEG_RGB, expected);
+
+    Output got = make_output(jpeg, 1, JPEG_RGB);
+    DecodeRequest r = request(jpeg, 1, JPEG_RGB, got);
+
+    uint64_t split = pool.split();
+    CHECK(pool.decode(&r, 1) == direct_ok);
+    CHECK(r.ok == direct_ok);
+    CHECK(pool.split() == split);
+    if(direct_ok)
+        CHECK(got.pixels == expected.pixels);
+}
+
+// frames without restart markers go a frame per thread, each one whole
+static void test_no_restarts(DecodePool& pool)
+{
+    const size_t FRAMES = 6;
+
+    vector<vector<unsigned char> > jpegs;
+    vector<Output> expected, got;
+    for(size_t i = 0; i < FRAMES; i++)
+    {
+        jpegs.push_back(encoded(0, (int)i));
+        expected.push_back(make_output(jpegs[i], 2, JPEG_RGB));
+        got.push_back(make_output(jpegs[i], 2, JPEG_RGB));
+        CHECK(decode_direct(jpegs[i], 2, JPEG_RGB, expected[i]));
+    }
+
+    vector<DecodeRequest> requests;
+    for(size_t i = 0; i < FRAMES; i++)
+        requests.push_back(request(jpegs[i], 2, JPEG_RGB, got[i]));
+
+    uint64_t split = pool.split();
+    uint64_t decoded = pool.decoded();
+    CHECK(pool.decode(&requests[0], requests.size()));
+    CHECK(pool.split() == split);
+    CHECK(pool.decoded() == decoded + FRAMES);
+
+    for(size_t i = 0; i < FRAMES; i++)
+    {
+        CHECK(requests[i].ok);
+        CHECK(got[i].pixels == expected[i].pixels);
+    }
+}
+
+// a frame that cannot be parsed fails alone; the rest of its batch is done
+static void test_bad_frame(DecodePool& pool)
+{
+    vector<unsigned char> good = encoded(5);
+    vector<unsigned char> bad(good.begin(), good.begin() + 40);
+
+    Output expected = make_output(good, 1, JPEG_RGB);
+    CHECK(decode_direct(good, 1, JPEG_RGB, expected));
+
+    Output got = make_output(good, 1, JPEG_RGB);
+    Output scratch = make_output(good, 1, JPEG_RGB);
+    DecodeRequest requests[2] = {
+        request(bad, 1, JPEG_RGB, scratch),
+        request(good, 1, JPEG_RGB, got)
+    };
+
+    uint64_t failed = pool.failed();
+    CHECK(!pool.decode(requests, 2));
+    CHECK(!requests[0].ok);
+    CHECK(requests[1].ok);
+    CHECK(pool.failed() == failed + 1);
+    CHECK(got.pixels == expected.pixels);
+}
+
+int main()
+{
+    size_t workers[] = { 0, 1, 3 };
+    for(size_t w = 0; w < sizeof workers / sizeof workers[0]; w++)
+    {
+        DecodePool pool(workers[w]);
+        pool.start();
+
+        // with no threads but the caller's there is nothing to split for
+        if(workers[w] > 0)
+            test_restart_intervals(pool);
+        test_missing_marker(pool);
+        test_no_restarts(pool);
+        test_bad_frame(pool);
+
+        pool.stop();
+    }
+
+    return test_result("decode_pool");
+}
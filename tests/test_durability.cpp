@@ -0,0 +1,184 @@
+// The durability policies and the watermark they move (DurableMark): each
+// policy syncs when it says it does, durable_us only ever reaches frames
+// that were synced, and with SYNC_INTERVAL a camera that goes quiet has
+// its last frames synced about interval_ms later, not at shutdown.
+
+#include "check.h"
+#include "save_thread.h"
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static const size_t FRAME_BYTES = 8192;
+
+static vector<unsigned char> make_frame(unsigned seed)
+{
+    vector<unsigned char> bytes(FRAME_BYTES, (unsigned char)seed);
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[FRAME_BYTES - 2] = 0xFF;
+    bytes[FRAME_BYTES - 1] = 0xD9;
+    return bytes;
+}
+
+static void save_frame(SaveThread& st, int64_t n, bool one_shot = false)
+{
+    vector<unsigned char> bytes = make_frame((unsigned)n);
+    unique_ptr<SaveBuffer> buf = st.get_buffer();
+    buf->store(&bytes[0], bytes.size());
+    buf->camera = 0;
+    buf->capture_ns = n * 40000000LL;
+    buf->is_one_shot = one_shot;
+    buf->one_shot_tag = (int)n;
+    st.save(buf);
+}
+
+// waits up to timeout_ms for the writer to hand over frames newer than
+// after, and returns the mark as it is then
+static DurableMark wait_written(SaveThread& st, int64_t after,
+    int timeout_ms)
+{
+    DurableMark mark = st.durability(0);
+    for(int waited = 0; mark.written_us <= after && waited < timeout_ms;
+        waited += 5)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+        mark = st.durability(0);
+    }
+    return mark;
+}
+
+static SaveOptions options_for(SyncPolicy policy)
+{
+    SaveOptions options;
+    options.durability.policy = policy;
+    options.segment_bytes = 0;
+    return options;
+}
+
+// one batch, then nothing: the watermark catches up with it about
+// interval_ms after the batch's sync is due, with the writer idle
+static void test_interval_idle()
+{
+    string dir = make_test_dir("test_durability");
+    SaveOptions options = options_for(SYNC_INTERVAL);
+    options.durability.interval_ms = 300;
+
+    {
+        SaveThread st(dir, options);
+
+        // the file is opened with the interval starting afresh, so
+        // neither batch is synced as it is written
+        save_frame(st, 1);
+        DurableMark first = wait_written(st, 0, 2000);
+        CHECK(first.written_us > 0);
+
+        chrono::steady_clock::time_point start =
+            chrono::steady_clock::now();
+        save_frame(st, 2);
+        save_frame(st, 3);
+        DurableMark mark = wait_written(st, first.written_us, 2000);
+        CHECK(mark.written_us > first.written_us);
+        CHECK(mark.durable_us < mark.written_us);
+
+        // polled until it is durable, with room for a slow machine
+        while(mark.durable_us < mark.written_us &&
+              chrono::steady_clock::now() - start < chrono::seconds(3))
+        {
+            this_thread::sleep_for(chrono::milliseconds(5));
+            mark = st.durability(0);
+        }
+
+        int64_t ms = chrono::duration_cast<chrono::milliseconds>(
+            chrono::steady_clock::now() - start).count();
+        CHECK(mark.durable_us == mark.written_us);
+        CHECK(ms <= 300 + 200);
+
+        st.stop();
+    }
+
+    remove_test_dir(dir);
+}
+
+// SYNC_NONE never syncs, even at shutdown; written_us still moves
+static void test_none()
+{
+    string dir = make_test_dir("test_durability");
+    {
+        SaveThread st(dir, options_for(SYNC_NONE));
+        for(int64_t n = 1; n <= 3; n++)
+            save_frame(st, n);
+        st.stop();
+
+        DurableMark mark = st.durability(0);
+        CHECK(mark.written_us > 0);
+        CHECK(mark.durable_us == 0);
+        CHECK(mark.syncs == 0);
+        CHECK(st.stats().syncs == 0);
+    }
+    remove_test_dir(dir);
+}
+
+// SYNC_BYTES syncs after the batch that takes it over the count, and not
+// before
+static void test_bytes()
+{
+    string dir = make_test_dir("test_durability");
+    SaveOptions options = options_for(SYNC_BYTES);
+    options.durability.bytes = 3 * FRAME_BYTES;
+
+    {
+        SaveThread st(dir, options);
+
+        int64_t last = 0;
+        for(int64_t n = 1; n <= 2; n++)
+        {
+            save_frame(st, n);
+            DurableMark mark = wait_written(st, last, 2000);
+            CHECK(mark.written_us > last);
+            CHECK(mark.durable_us == 0);
+            last = mark.written_us;
+        }
+
+        save_frame(st, 3);
+        DurableMark mark = wait_written(st, last, 2000);
+        CHECK(mark.durable_us == mark.written_us);
+        CHECK(mark.syncs == 1);
+
+        st.stop();
+    }
+    remove_test_dir(dir);
+}
+
+// SYNC_ONE_SHOTS leaves ordinary frames alone and syncs the batch with a
+// one-shot in it
+static void test_one_shots()
+{
+    string dir = make_test_dir("test_durability");
+    {
+        SaveThread st(dir, options_for(SYNC_ONE_SHOTS));
+
+        save_frame(st, 1);
+        DurableMark mark = wait_written(st, 0, 2000);
+        CHECK(mark.written_us > 0);
+        this_thread::sleep_for(chrono::milliseconds(50));
+        CHECK(st.durability(0).durable_us == 0);
+
+        save_frame(st, 2, true);
+        mark = wait_written(st, mark.written_us, 2000);
+        CHECK(mark.durable_us == mark.written_us);
+        CHECK(mark.syncs == 1);
+
+        st.stop();
+    }
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_interval_idle();
+    test_none();
+    test_bytes();
+    test_one_shots();
+    return test_result("durability");
+}
@@ -0,0 +1,179 @@
+// Event recording: each clip holds exactly the pre-roll that was held when
+// its event was triggered and the post-roll after it, a trigger during the
+// post-roll carries on in the same file, frames outside every event are
+// never written, and every buffer held for the pre-roll goes back to the
+// free list, including those still held at stop().
+
+#include "check.h"
+#include "save_thread.h"
+#include "segment_reader.h"
+#include <dirent.h>
+#include <algorithm>
+#include <set>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+// frames are 100ms apart; the limits fall between frames so that rounding
+// in the wall clock cannot move one across
+static const int64_t FRAME_NS = 100000000;
+static const unsigned PRE_ROLL_MS = 950;
+static const unsigned POST_ROLL_MS = 1050;
+
+static vector<unsigned char> make_frame(unsigned seed)
+{
+    vector<unsigned char> bytes(4096, (unsigned char)seed);
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[bytes.size() - 2] = 0xFF;
+    bytes[bytes.size() - 1] = 0xD9;
+    return bytes;
+}
+
+static vector<string> segment_files(const string& dir)
+{
+    vector<string> files;
+    DIR* d = opendir(dir.c_str());
+    while(dirent* e = d ? readdir(d) : NULL)
+    {
+        string name = e->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    if(d)
+        closedir(d);
+    sort(files.begin(), files.end());
+    return files;
+}
+
+// the frame numbers in a segment, in the order they are stored
+static vector<int> frames_in(const string& path)
+{
+    vector<int> frames;
+    SegmentReader r;
+    CHECK(r.open(path));
+
+    vector<unsigned char> jpeg;
+    for(size_t i = 0; i < r.frame_count(); i++)
+    {
+        CHECK(r.read_frame(i, jpeg) && jpeg.size() > 2);
+        if(jpeg.size() > 2)
+            frames.push_back(jpeg[2]);
+    }
+    return frames;
+}
+
+static vector<int> range(int first, int last)
+{
+    vector<int> frames;
+    for(int n = first; n <= last; n++)
+        frames.push_back(n);
+    return frames;
+}
+
+struct Recorder
+{
+    SaveThread& st;
+    int64_t start_ns;
+    int next;
+
+    // every buffer handed to save()
+    set<SaveBuffer*> buffers;
+
+    void save_to(int last)
+    {
+        for(; next <= last; next++)
+        {
+            vector<unsigned char> bytes = make_frame((unsigned)next);
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buffers.insert(buf.get());
+            buf->store(&bytes[0], bytes.size());
+            buf->camera = 0;
+            buf->capture_ns = start_ns + next * FRAME_NS;
+            st.save(buf);
+        }
+    }
+
+    // waits for the writer to have written frame n, so that it has taken
+    // the last trigger and a new one is not merged into it
+    void wait_written(int n)
+    {
+        // half a frame early, for rounding in the wall clock
+        int64_t time_us = monotonic_to_wall_us(start_ns + n * FRAME_NS) -
+            FRAME_NS / 2000;
+
+        for(int waited = 0; st.durability(0).written_us < time_us &&
+            waited < 5000; waited += 5)
+        {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        }
+        CHECK(st.durability(0).written_us >= time_us);
+    }
+};
+
+static void test_clips()
+{
+    string dir = make_test_dir("test_events");
+
+    SaveOptions options;
+    options.format = FORMAT_SEGMENT;
+    options.file_seconds = 0;
+    options.events.enabled = true;
+    options.events.pre_roll_ms = PRE_ROLL_MS;
+    options.events.post_roll_ms = POST_ROLL_MS;
+
+    SaveThread st(dir, options);
+    Recorder r = { st, monotonic_ns(), 0, set<SaveBuffer*>() };
+
+    // frames 0-29 go by with nothing happening. The trigger starts the
+    // event at the next frame, 30, with the ten frames within 950ms of 29
+    // ahead of it; the post-roll takes in frames up to 1050ms after 30.
+    r.save_to(29);
+    st.trigger_event(0);
+    r.save_to(35);
+    r.wait_written(35);
+
+    // a second trigger, at 36, pushes the end of the same clip out to 46
+    st.trigger_event(0);
+    r.save_to(79);
+    r.wait_written(46);
+
+    // a third, at 80, is a clip of its own: 70-79 and the post-roll
+    st.trigger_event(0);
+    r.save_to(99);
+    st.stop();
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() == 2);
+    if(files.size() == 2)
+    {
+        vector<int> first = range(20, 46);
+        vector<int> second = range(70, 90);
+        CHECK(frames_in(files[0]) == first);
+        CHECK(frames_in(files[1]) == second);
+    }
+
+    // the other 52 frames, 9 of them still held at stop(), were never
+    // written
+    SaveStats stats = st.stats();
+    CHECK(stats.frames == 100);
+    CHECK(stats.expired == 100 - 27 - 21);
+
+    // every buffer is back on the free list
+    size_t returned = 0;
+    vector<unique_ptr<SaveBuffer> > taken;
+    for(size_t i = 0; i < r.buffers.size(); i++)
+    {
+        taken.push_back(st.get_buffer());
+        returned += r.buffers.count(taken.back().get());
+    }
+    CHECK(returned == r.buffers.size());
+
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_clips();
+    return test_result("events");
+}
@@ -0,0 +1,72 @@
+// DROP_OLDEST must throw out the oldest frame queued for any camera, not
+// just the oldest of the camera that needs the room.
+//
+// The writer is held up on its first frame, a sample whose data() waits
+// for the test to let it go, so everything saved after it stays queued.
+
+#include "check.h"
+#include "mock_sample_ref.h"
+#include "save_thread.h"
+using namespace std;
+
+static void save_frame(SaveThread& st, int camera, int64_t capture_ns)
+{
+    unique_ptr<SaveBuffer> buf = st.get_buffer();
+    unsigned char bytes[64] = { 0xFF, 0xD8 };
+    buf->store(bytes, sizeof bytes);
+    buf->camera = camera;
+    buf->capture_ns = capture_ns;
+    st.save(buf);
+}
+
+static uint64_t evicted(SaveThread& st, int camera)
+{
+    return st.drop_stats(camera).evicted;
+}
+
+int main()
+{
+    string dir = make_test_dir("test_evict_oldest");
+
+    SaveOptions options;
+    options.budget.max_frames = 4;
+    options.budget.policy = DROP_OLDEST;
+
+    SampleLog log;
+    vector<unsigned char> stall_bytes(64);
+    MockSampleRef* stall = new MockSampleRef(stall_bytes, log, true);
+    {
+        SaveThread st(dir, options);
+
+        unique_ptr<SaveBuffer> first = st.get_buffer();
+        first->sample.reset(stall);
+        first->camera = 2;
+        first->capture_ns = 1;
+        st.save(first);
+        stall->wait_entered();
+
+        // camera 1's frame is the oldest still queued; camera 0 keeps
+        // saving until something has to go
+        save_frame(st, 1, 1000);
+        int64_t t = 2000;
+        for(int i = 0; i < 16 && evicted(st, 0) + evicted(st, 1) == 0; i++)
+            save_frame(st, 0, t += 1000);
+
+        CHECK(evicted(st, 1) == 1);
+        CHECK(evicted(st, 0) == 0);
+
+        // the next eviction is camera 0's own oldest
+        save_frame(st, 0, t += 1000);
+        CHECK(evicted(st, 1) == 1);
+        CHECK(evicted(st, 0) == 1);
+
+        // cameras past the last slot share its counters
+        CHECK(st.drop_stats(SaveThread::MAX_CAMERAS + 3).evicted ==
+            evicted(st, SaveThread::MAX_CAMERAS - 1));
+
+        stall->open();
+    }
+
+    remove_test_dir(dir);
+    return test_result("evict_oldest");
+}
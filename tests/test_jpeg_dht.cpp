@@ -0,0 +1,138 @@
+// jpeg_standalone_slices(): a frame sent without a DHT, gathered from its
+// slices, is the same frame with the Annex K tables in it, byte for byte
+// where the encoder puts its DHT in the same place and pixel for pixel
+// where it does not. A frame that has a DHT already, or whose headers
+// cannot be walked, goes out untouched.
+
+#include "check.h"
+#include "jpeg_dht.h"
+#include "jpeg_decoder.h"
+#include "jpeg_encoder.h"
+#include <cstring>
+using namespace std;
+
+static const unsigned FIXED = 7;
+
+static vector<unsigned char> encoded(int width, int height, int channels,
+    int restart_interval, bool omit_dht)
+{
+    JpegEncodeOptions options;
+    options.restart_interval = restart_interval;
+    options.omit_dht = omit_dht;
+    vector<unsigned char> pixels = test_image(width, height, channels);
+    return jpeg_encode(&pixels[0], width, height, channels, options);
+}
+
+// the bytes a gathered write of the slices would put in the file
+static vector<unsigned char> gather(const IoSlice* slices, size_t count)
+{
+    vector<unsigned char> bytes;
+    for(size_t i = 0; i < count; i++)
+    {
+        const unsigned char* p = (const unsigned char*)slices[i].data;
+        bytes.insert(bytes.end(), p, p + slices[i].size);
+    }
+    return bytes;
+}
+
+static bool decode(const vector<unsigned char>& jpeg, JpegImage& image)
+{
+    JpegDecoder decoder;
+    return decoder.parse(&jpeg[0], jpeg.size()) &&
+        decoder.decode(1, JPEG_RGB, image);
+}
+
+// the encoder writes its DHT just ahead of the SOS when there is no DRI,
+// which is where the insert point is, so the two frames are the same
+// bytes; with a DRI between them they are the same pixels
+static void test_inserted()
+{
+    int channels[] = { 1, 3 };
+    int restarts[] = { 0, 4 };
+    for(size_t c = 0; c < 2; c++)
+    {
+        for(size_t r = 0; r < 2; r++)
+        {
+            vector<unsigned char> bare =
+                encoded(96, 64, channels[c], restarts[r], true);
+            vector<unsigned char> full =
+                encoded(96, 64, channels[c], restarts[r], false);
+            CHECK(full.size() == bare.size() + JPEG_DEFAULT_DHT_SIZE);
+
+            IoSlice slices[3];
+            size_t count = jpeg_standalone_slices(&bare[0], bare.size(),
+                FIXED, slices);
+            CHECK(count == 3);
+            if(count != 3)
+                continue;
+
+            // the frame's own bytes keep their fixed buffer; the table
+            // is not in one
+            CHECK(slices[0].data == &bare[0]);
+            CHECK(slices[0].fixed == FIXED);
+            CHECK(slices[1].data == JPEG_DEFAULT_DHT);
+            CHECK(slices[1].size == JPEG_DEFAULT_DHT_SIZE);
+            CHECK(slices[1].fixed == 0);
+            CHECK((const unsigned char*)slices[2].data ==
+                &bare[0] + slices[0].size);
+            CHECK(slices[2].fixed == FIXED);
+            CHECK(slices[0].size + slices[2].size == bare.size());
+
+            // the DHT goes right before the SOS
+            const unsigned char* rest =
+                (const unsigned char*)slices[2].data;
+            CHECK(rest[0] == 0xFF && rest[1] == 0xDA);
+
+            vector<unsigned char> standalone = gather(slices, count);
+            if(restarts[r] == 0)
+                CHECK(standalone == full);
+
+            JpegImage a, b;
+            CHECK(decode(standalone, a));
+            CHECK(decode(full, b));
+            CHECK(a.width == 96 && a.height == 64);
+            CHECK(a.pixels == b.pixels);
+
+            // and it now has a DHT of its own
+            CHECK(jpeg_dht_insert_point(&standalone[0],
+                standalone.size()) == 0);
+        }
+    }
+}
+
+static void check_untouched(const vector<unsigned char>& frame)
+{
+    IoSlice slices[3];
+    size_t count = jpeg_standalone_slices(&frame[0], frame.size(), FIXED,
+        slices);
+    CHECK(count == 1);
+    CHECK(slices[0].data == &frame[0]);
+    CHECK(slices[0].size == frame.size());
+    CHECK(slices[0].fixed == FIXED);
+}
+
+static void test_untouched()
+{
+    for(int channels = 1; channels <= 3; channels += 2)
+    {
+        check_untouched(encoded(96, 64, channels, 0, false));
+        check_untouched(encoded(96, 64, channels, 4, false));
+    }
+
+    // not a JPEG, or one whose headers run off the end before the SOS
+    vector<unsigned char> junk(512, 0x20);
+    check_untouched(junk);
+
+    vector<unsigned char> bare = encoded(96, 64, 3, 0, true);
+    size_t sos = jpeg_dht_insert_point(&bare[0], bare.size());
+    CHECK(sos > 0);
+    bare.resize(sos - 1);
+    check_untouched(bare);
+}
+
+int main()
+{
+    test_inserted();
+    test_untouched();
+    return test_result("jpeg_dht");
+}
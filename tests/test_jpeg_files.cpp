@@ -0,0 +1,262 @@
+// FORMAT_JPEG_FILES: the camN/YYYYMMDD/HH/MM layout TimeDirectories
+// makes, including across a leap day and the end of a century; the
+// background thread having the next minutes' directories made before they
+// are asked for; the file names JpegDirSink gives frames either side of a
+// minute and a day boundary; and, in direct mode, every file trimmed to
+// the frame's length when it is closed, whether straight away or at a
+// sync.
+
+#include "check.h"
+#include "save_thread.h"
+#include "time_directories.h"
+#include <sys/stat.h>
+#include <dirent.h>
+#include <map>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static const int64_t DAY_US = 86400LL * 1000000;
+static const int64_t HOUR_US = 3600LL * 1000000;
+static const int64_t MINUTE_US = 60LL * 1000000;
+
+static int64_t at(int64_t days, int hour, int minute, int64_t ms)
+{
+    return days * DAY_US + hour * HOUR_US + minute * MINUTE_US + ms * 1000;
+}
+
+static vector<unsigned char> make_frame(unsigned seed, size_t size)
+{
+    vector<unsigned char> bytes(size, (unsigned char)seed);
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[size - 2] = 0xFF;
+    bytes[size - 1] = 0xD9;
+    return bytes;
+}
+
+static bool is_directory(const string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static vector<unsigned char> read_file(const string& path)
+{
+    vector<unsigned char> bytes;
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f)
+        return bytes;
+
+    unsigned char buffer[65536];
+    size_t n;
+    while((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+        bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(f);
+    return bytes;
+}
+
+static size_t files_in(const string& dir)
+{
+    size_t count = 0;
+    DIR* d = opendir(dir.c_str());
+    while(dirent* e = d ? readdir(d) : NULL)
+        count += e->d_name[0] != '.';
+    if(d)
+        closedir(d);
+    return count;
+}
+
+// the directory for a camera and a minute, worked out independently of
+// TimeDirectories
+static string minute_dir(const string& base, int camera, int64_t time_us)
+{
+    int64_t minute = time_us / MINUTE_US;
+    int y;
+    unsigned m, d;
+    civil_from_days(minute / (24 * 60), y, m, d);
+
+    char name[64];
+    snprintf(name, sizeof name, "/cam%d/%04d%02u%02u/%02d/%02d", camera, y,
+        m, d, (int)(minute % (24 * 60) / 60), (int)(minute % 60));
+    return base + name;
+}
+
+static void test_layout()
+{
+    string dir = make_test_dir("test_jpeg_files");
+    TimeDirectories dirs(dir);
+
+    // 2024-02-29 23:59:30.5
+    string path = dirs.minute_path(3, at(19782, 23, 59, 30500));
+    CHECK(path == dir + "/cam3/20240229/23/59");
+    CHECK(is_directory(path));
+    CHECK(dirs.late() == 1);
+
+    // known now, so not made again
+    CHECK(dirs.minute_path(3, at(19782, 23, 59, 59999)) == path);
+    CHECK(dirs.late() == 1);
+
+    // 2100 is not a leap year
+    path = dirs.minute_path(0, at(47540, 23, 59, 59999));
+    CHECK(path == dir + "/cam0/21000228/23/59");
+    CHECK(is_directory(path));
+    path = dirs.minute_path(0, at(47540, 24, 0, 0));
+    CHECK(path == dir + "/cam0/21000301/00/00");
+    CHECK(is_directory(path));
+    CHECK(dirs.late() == 3);
+
+    remove_test_dir(dir);
+}
+
+// once a camera has asked for a minute, the next two are made in the
+// background and asking for them costs no mkdir
+static void test_made_ahead()
+{
+    string dir = make_test_dir("test_jpeg_files");
+    TimeDirectories dirs(dir);
+    dirs.start();
+
+    int64_t now = monotonic_to_wall_us(monotonic_ns());
+    CHECK(dirs.minute_path(1, now) == minute_dir(dir, 1, now));
+    CHECK(dirs.late() == 1);
+
+    string next = minute_dir(dir, 1, now + MINUTE_US);
+    string after = minute_dir(dir, 1, now + 2 * MINUTE_US);
+    for(int waited = 0; waited < 3000 &&
+        !(is_directory(next) && is_directory(after)); waited += 5)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    CHECK(is_directory(next));
+    CHECK(is_directory(after));
+
+    CHECK(dirs.minute_path(1, now + MINUTE_US) == next);
+    CHECK(dirs.minute_path(1, now + 2 * MINUTE_US) == after);
+    CHECK(dirs.late() == 1);
+
+    // a camera asking for a minute ahead of the clock gets the two after
+    // that one made
+    string later = minute_dir(dir, 2, now + 11 * MINUTE_US);
+    dirs.minute_path(2, now + 10 * MINUTE_US);
+    CHECK(dirs.late() == 2);
+    for(int waited = 0; waited < 3000 && !is_directory(later); waited += 5)
+        this_thread::sleep_for(chrono::milliseconds(5));
+    CHECK(dirs.minute_path(2, now + 11 * MINUTE_US) == later);
+    CHECK(dirs.late() == 2);
+
+    dirs.stop();
+    remove_test_dir(dir);
+}
+
+struct Frame
+{
+    int64_t time_us;
+    size_t size;
+    string name; // expected, from the base path
+};
+
+// saves frames for camera 0 with the given capture times and checks that
+// each ends up, whole and no longer, in the file it should, and that no
+// other files were written
+static void check_files(const SaveOptions& options, const Frame* frames,
+    size_t count)
+{
+    string dir = make_test_dir("test_jpeg_files");
+    {
+        SaveThread st(dir, options);
+        for(size_t i = 0; i < count; i++)
+        {
+            vector<unsigned char> bytes =
+                make_frame((unsigned)i + 1, frames[i].size);
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store(&bytes[0], bytes.size());
+            buf->camera = 0;
+            buf->time_us = frames[i].time_us;
+            st.save(buf);
+        }
+        st.stop();
+    }
+
+    map<string, size_t> per_dir;
+    for(size_t i = 0; i < count; i++)
+    {
+        string path = dir + "/" + frames[i].name;
+        vector<unsigned char> bytes = read_file(path);
+        CHECK(bytes == make_frame((unsigned)i + 1, frames[i].size));
+        if(bytes.size() != frames[i].size)
+        {
+            fprintf(stderr, "%s: %zu bytes, not %zu\n", path.c_str(),
+                bytes.size(), frames[i].size);
+        }
+        per_dir[path.substr(0, path.rfind('/'))]++;
+    }
+
+    for(map<string, size_t>::iterator it = per_dir.begin();
+        it != per_dir.end(); ++it)
+    {
+        CHECK(files_in(it->first) == it->second);
+    }
+
+    remove_test_dir(dir);
+}
+
+// a file's number counts up from the first frame's millisecond within the
+// minute times 1000; a new minute starts a new directory, and the count
+// again
+static void test_file_names()
+{
+    SaveOptions options;
+    options.format = FORMAT_JPEG_FILES;
+
+    Frame frames[] = {
+        // 2024-12-31 23:59:59.800 into 2025
+        { at(20088, 23, 59, 59800), 5000,
+            "cam0/20241231/23/59/59800000.jpg" },
+        { at(20088, 23, 59, 59900), 5001,
+            "cam0/20241231/23/59/59800001.jpg" },
+        { at(20089, 0, 0, 0), 5002, "cam0/20250101/00/00/00000000.jpg" },
+        { at(20089, 0, 0, 100), 5003, "cam0/20250101/00/00/00000001.jpg" },
+        // 2025-06-01 12:00:59.950 into 12:01
+        { at(20240, 12, 0, 59950), 5004,
+            "cam0/20250601/12/00/59950000.jpg" },
+        { at(20240, 12, 1, 50), 5005, "cam0/20250601/12/01/00050000.jpg" },
+        { at(20240, 12, 1, 51), 5006, "cam0/20250601/12/01/00050001.jpg" },
+    };
+    check_files(options, frames, sizeof(frames) / sizeof(frames[0]));
+}
+
+// direct mode writes whole blocks; closing each file has to cut it back
+// to the frame, both when files are closed as they are written and when
+// they are held open for the next sync
+static void test_direct_trimmed()
+{
+    vector<Frame> frames;
+    for(size_t i = 0; i < 40; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof name, "cam0/20250601/10/20/%08zu.jpg",
+            30000000 + i);
+        Frame f = { at(20240, 10, 20, 30000 + 10 * (int64_t)i),
+            3000 + 517 * i, name };
+        frames.push_back(f);
+    }
+
+    SaveOptions options;
+    options.format = FORMAT_JPEG_FILES;
+    options.direct_io = true;
+    check_files(options, &frames[0], frames.size());
+
+    options.durability.policy = SYNC_INTERVAL;
+    options.durability.interval_ms = 1;
+    check_files(options, &frames[0], frames.size());
+}
+
+int main()
+{
+    test_layout();
+    test_made_ahead();
+    test_file_names();
+    test_direct_trimmed();
+    return test_result("jpeg_files");
+}
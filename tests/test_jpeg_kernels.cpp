@@ -0,0 +1,207 @@
+// Every SIMD level of the decoder's kernels gives exactly what the scalar
+// reference gives: kernel by kernel on random input, and for whole frames
+// from tests/jpeg_encoder at every scale and pixel format. The frames also
+// have to come out close to the pixels they were made from.
+
+#include "check.h"
+#include "jpeg_kernels.h"
+#include "jpeg_decoder.h"
+#include "jpeg_encoder.h"
+#include <cmath>
+#include <cstring>
+using namespace std;
+
+static uint32_t g_random = 12345;
+
+static uint32_t next_random()
+{
+    g_random = g_random * 1664525u + 1013904223u;
+    return g_random >> 8;
+}
+
+// coefficients as dequantising leaves them: mostly small, a few large,
+// many zero
+static void random_block(int16_t* coefs)
+{
+    for(int i = 0; i < 64; i++)
+    {
+        uint32_t r = next_random();
+        if(i > 0 && r % 3 == 0)
+            coefs[i] = 0;
+        else if(r % 7 == 0)
+            coefs[i] = (int16_t)((int)(next_random() % 4096) - 2048);
+        else
+            coefs[i] = (int16_t)((int)(next_random() % 256) - 128);
+    }
+}
+
+static void test_idct(const JpegKernels& simd, const JpegKernels& scalar)
+{
+    for(int n = 0; n < 20000; n++)
+    {
+        int16_t a[64], b[64];
+        random_block(a);
+        random_block(b);
+
+        // every eighth block flat, which decoders often special-case
+        if(n % 8 == 0)
+            memset(a + 1, 0, 63 * sizeof a[0]);
+
+        unsigned char expected[8 * 16], got[8 * 16];
+        scalar.idct(a, expected, 16);
+        scalar.idct(b, expected + 8, 16);
+
+        memset(got, 0, sizeof got);
+        simd.idct(a, got, 16);
+        simd.idct(b, got + 8, 16);
+        CHECK(memcmp(got, expected, sizeof got) == 0);
+
+        if(simd.idct_pair)
+        {
+            memset(got, 0, sizeof got);
+            simd.idct_pair(a, b, got, 16);
+            CHECK(memcmp(got, expected, sizeof got) == 0);
+        }
+    }
+}
+
+static void test_upsample(const JpegKernels& simd, const JpegKernels& scalar)
+{
+    vector<unsigned char> in(200);
+    for(size_t i = 0; i < in.size(); i++)
+        in[i] = (unsigned char)next_random();
+
+    for(size_t width = 1; width <= 2 * in.size(); width++)
+    {
+        // one byte past the end, which must be left alone
+        vector<unsigned char> expected(width + 1, 0xA5);
+        vector<unsigned char> got(width + 1, 0xA5);
+        scalar.upsample_h2(&in[0], &expected[0], width);
+        simd.upsample_h2(&in[0], &got[0], width);
+        CHECK(got == expected);
+    }
+}
+
+static void test_colour(const JpegKernels& simd, const JpegKernels& scalar)
+{
+    vector<unsigned char> y(200), cb(200), cr(200);
+    for(size_t i = 0; i < y.size(); i++)
+    {
+        y[i] = (unsigned char)next_random();
+        cb[i] = (unsigned char)next_random();
+        cr[i] = (unsigned char)next_random();
+    }
+
+    // the extremes, where clamping matters
+    y[0] = 0;
+    cb[0] = 0;
+    cr[0] = 0;
+    y[1] = 255;
+    cb[1] = 255;
+    cr[1] = 255;
+
+    for(size_t width = 1; width <= y.size(); width++)
+    {
+        for(int bgr = 0; bgr < 2; bgr++)
+        {
+            vector<unsigned char> expected(3 * width + 1, 0xA5);
+            vector<unsigned char> got(3 * width + 1, 0xA5);
+            scalar.ycc_to_rgb(&y[0], &cb[0], &cr[0], &expected[0], width,
+                bgr != 0);
+            simd.ycc_to_rgb(&y[0], &cb[0], &cr[0], &got[0], width,
+                bgr != 0);
+            CHECK(got == expected);
+        }
+    }
+}
+
+// peak signal to noise ratio of a decoded image against its source
+static double psnr(const vector<unsigned char>& a,
+    const vector<unsigned char>& b)
+{
+    double sum = 0;
+    for(size_t i = 0; i < a.size(); i++)
+    {
+        double d = (double)a[i] - b[i];
+        sum += d * d;
+    }
+    double mse = sum / a.size();
+    return mse == 0 ? 99.0 : 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static void test_decode(const vector<JpegKernels>& kernels)
+{
+    struct Case
+    {
+        int width;
+        int height;
+        int channels;
+        int restart_interval;
+    };
+    Case cases[] = {
+        { 320, 240, 3, 0 },
+        { 333, 201, 3, 5 },
+        { 161, 97, 1, 0 },
+        { 8, 8, 3, 0 }
+    };
+    JpegPixelFormat formats[] = { JPEG_RGB, JPEG_BGR, JPEG_GRAY };
+    int scales[] = { 1, 2, 4, 8 };
+
+    for(size_t c = 0; c < sizeof cases / sizeof cases[0]; c++)
+    {
+        const Case& k = cases[c];
+        JpegEncodeOptions options;
+        options.restart_interval = k.restart_interval;
+        vector<unsigned char> pixels = test_image(k.width, k.height,
+            k.channels);
+        vector<unsigned char> jpeg = jpeg_encode(&pixels[0], k.width,
+            k.height, k.channels, options);
+
+        for(size_t f = 0; f < sizeof formats / sizeof formats[0]; f++)
+        {
+            for(size_t s = 0; s < sizeof scales / sizeof scales[0]; s++)
+            {
+                JpegImage reference;
+                for(size_t i = 0; i < kernels.size(); i++)
+                {
+                    JpegDecoder decoder;
+                    decoder.set_kernels(kernels[i]);
+                    CHECK(decoder.parse(&jpeg[0], jpeg.size()));
+
+                    JpegImage image;
+                    CHECK(decoder.decode(scales[s], formats[f], image));
+                    if(i == 0)
+                        reference = image;
+                    else
+                        CHECK(image.pixels == reference.pixels);
+                }
+
+                // the same picture as went in; a single block of 4:2:0 has
+                // too little chroma for that to say much
+                if(scales[s] == 1 && formats[f] != JPEG_BGR &&
+                   (formats[f] == JPEG_GRAY) == (k.channels == 1) &&
+                   k.width >= 64)
+                {
+                    CHECK(psnr(reference.pixels, pixels) > 25.0);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    vector<JpegKernels> kernels;
+    jpeg_available_kernels(kernels);
+    CHECK(strcmp(kernels.back().name, jpeg_kernels().name) == 0);
+
+    for(size_t i = 1; i < kernels.size(); i++)
+    {
+        test_idct(kernels[i], kernels[0]);
+        test_upsample(kernels[i], kernels[0]);
+        test_colour(kernels[i], kernels[0]);
+    }
+
+    test_decode(kernels);
+    return test_result("jpeg_kernels");
+}
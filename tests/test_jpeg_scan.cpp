@@ -0,0 +1,167 @@
+// jpeg_scan() on frames from tests/jpeg_encoder: valid ones pass whole,
+// every way of cutting one short is caught, and damage is reported where
+// it is. The SIMD 0xFF search must agree with the scalar one everywhere,
+// including a 0xFF on either side of a vector boundary.
+
+#include "check.h"
+#include "jpeg_scan.h"
+#include "jpeg_encoder.h"
+using namespace std;
+
+static vector<unsigned char> encoded(int width, int height, int channels,
+    int restart_interval = 0)
+{
+    JpegEncodeOptions options;
+    options.restart_interval = restart_interval;
+    vector<unsigned char> pixels = test_image(width, height, channels);
+    return jpeg_encode(&pixels[0], width, height, channels, options);
+}
+
+// scans with both searches, checks they agree, and returns the result
+static JpegCheck scan_both(const vector<unsigned char>& jpeg, JpegScan& scan)
+{
+    const unsigned char* data = jpeg.empty() ? NULL : &jpeg[0];
+
+    JpegScan scalar;
+    jpeg_scan_scalar(data, jpeg.size(), scalar);
+    jpeg_scan(data, jpeg.size(), scan);
+
+    CHECK(scan.result == scalar.result);
+    CHECK(scan.length == scalar.length);
+    CHECK(scan.error_offset == scalar.error_offset);
+    CHECK(scan.scans == scalar.scans);
+    return scan.result;
+}
+
+static void test_valid()
+{
+    vector<unsigned char> frames[] = {
+        encoded(320, 240, 3),
+        encoded(320, 240, 1),
+        encoded(333, 201, 3, 4)
+    };
+
+    for(size_t i = 0; i < sizeof frames / sizeof frames[0]; i++)
+    {
+        JpegScan scan;
+        CHECK(scan_both(frames[i], scan) == JPEG_VALID);
+        CHECK(scan.length == frames[i].size());
+        CHECK(scan.scans == 1);
+
+        // padding after the EOI is not part of the frame
+        vector<unsigned char> padded = frames[i];
+        padded.resize(padded.size() + 1000, 0);
+        CHECK(scan_both(padded, scan) == JPEG_VALID);
+        CHECK(scan.length == frames[i].size());
+    }
+}
+
+static void test_truncated()
+{
+    vector<unsigned char> frame = encoded(160, 120, 3, 2);
+
+    for(size_t cut = 0; cut < frame.size(); cut++)
+    {
+        vector<unsigned char> part(frame.begin(), frame.begin() + cut);
+        JpegScan scan;
+        JpegCheck expected = cut < 2 ? JPEG_NO_SOI : JPEG_TRUNCATED;
+        CHECK(scan_both(part, scan) == expected);
+    }
+}
+
+static void test_damaged()
+{
+    vector<unsigned char> frame = encoded(320, 240, 3);
+    size_t header = jpeg_header_length(&frame[0], frame.size());
+    CHECK(header > 0 && header < frame.size());
+
+    JpegScan scan;
+
+    vector<unsigned char> no_soi = frame;
+    no_soi[1] = 0x00;
+    CHECK(scan_both(no_soi, scan) == JPEG_NO_SOI);
+
+    // garbage where the first segment after the SOI should start
+    vector<unsigned char> garbage = frame;
+    garbage[2] = 0x12;
+    CHECK(scan_both(garbage, scan) == JPEG_BAD_MARKER);
+    CHECK(scan.error_offset == 2);
+
+    // a 0xFF in the scan data followed by neither 0x00 nor a marker
+    for(size_t e = header + 1; e + 3 < frame.size(); e += 997)
+    {
+        if(frame[e - 1] == 0xFF || frame[e] == 0xFF || frame[e + 1] == 0xFF)
+            continue;
+
+        vector<unsigned char> bad = frame;
+        bad[e] = 0xFF;
+        bad[e + 1] = 0x12;
+        CHECK(scan_both(bad, scan) == JPEG_BAD_STUFFING);
+        CHECK(scan.error_offset == e);
+    }
+
+    // the SOF taken out, so the SOS comes first
+    vector<unsigned char> no_sof;
+    size_t pos = 2;
+    while(pos + 4 <= header)
+    {
+        size_t length = (size_t)frame[pos + 2] << 8 | frame[pos + 3];
+        if(frame[pos + 1] == 0xC0)
+        {
+            no_sof = frame;
+            no_sof.erase(no_sof.begin() + pos,
+                no_sof.begin() + pos + 2 + length);
+            break;
+        }
+        pos += 2 + length;
+    }
+    CHECK(!no_sof.empty());
+    CHECK(scan_both(no_sof, scan) == JPEG_NO_FRAME_HEADER);
+}
+
+// scan data of every length up to a few vectors, with a stuffed 0xFF, a
+// restart marker or a bad 0xFF at every position in it
+static void test_vector_boundaries()
+{
+    vector<unsigned char> frame = encoded(16, 16, 1);
+    size_t header = jpeg_header_length(&frame[0], frame.size());
+
+    for(size_t length = 0; length < 160; length++)
+    {
+        for(size_t k = 0; k + 1 < length; k++)
+        {
+            for(int kind = 0; kind < 3; kind++)
+            {
+                vector<unsigned char> jpeg(frame.begin(),
+                    frame.begin() + header);
+                jpeg.resize(header + length, 0x11);
+                jpeg[header + k] = 0xFF;
+                jpeg[header + k + 1] = kind == 0 ? 0x00 :
+                    kind == 1 ? 0xD3 : 0x12;
+                jpeg.push_back(0xFF);
+                jpeg.push_back(0xD9);
+
+                JpegScan scan;
+                if(kind < 2)
+                {
+                    CHECK(scan_both(jpeg, scan) == JPEG_VALID);
+                    CHECK(scan.length == jpeg.size());
+                }
+                else
+                {
+                    CHECK(scan_both(jpeg, scan) == JPEG_BAD_STUFFING);
+                    CHECK(scan.error_offset == header + k);
+                }
+            }
+        }
+    }
+}
+
+int main()
+{
+    test_valid();
+    test_truncated();
+    test_damaged();
+    test_vector_boundaries();
+    return test_result("jpeg_scan");
+}
@@ -0,0 +1,228 @@
+// MotionDetector gives the same answers for frames the ThumbnailPool has
+// decoded as for frames it decodes itself, its background keeps following
+// the scene at the slowest rate allowed, and behind SaveThread every
+// frame is decoded once, for its thumbnail and the motion check together.
+
+#include "check.h"
+#include "motion_detector.h"
+#include "thumbnail_pool.h"
+#include "segment_reader.h"
+#include "save_thread.h"
+#include "jpeg_encoder.h"
+#include <dirent.h>
+using namespace std;
+
+static const int WIDTH = 320;
+static const int HEIGHT = 240;
+
+// frames 0 to still - 1 the same, then the square moves
+static vector<vector<unsigned char> > make_frames(int count, int still)
+{
+    vector<vector<unsigned char> > frames;
+    for(int i = 0; i < count; i++)
+    {
+        vector<unsigned char> pixels = test_image(WIDTH, HEIGHT, 3,
+            i < still ? 0 : i);
+        frames.push_back(jpeg_encode(&pixels[0], WIDTH, HEIGHT, 3));
+    }
+    return frames;
+}
+
+static void test_decode_dc_gray()
+{
+    vector<vector<unsigned char> > frames = make_frames(1, 1);
+    const vector<unsigned char>& jpeg = frames[0];
+
+    JpegDecoder decoder;
+    JpegImage gray, rgb, both;
+    CHECK(decoder.parse(&jpeg[0], jpeg.size()));
+    CHECK(decoder.decode_dc(1, gray));
+    CHECK(decoder.parse(&jpeg[0], jpeg.size()));
+    CHECK(decoder.decode_dc(3, rgb, &both));
+    CHECK(rgb.channels == 3);
+    CHECK(both.channels == 1);
+    CHECK(both.width == gray.width && both.height == gray.height);
+    CHECK(both.pixels == gray.pixels);
+}
+
+// the pool's MotionFrames, gray or alongside RGB thumbnails, or none
+// alongside gray ones, lead to exactly what update() on the bytes does
+static void test_pool_frames()
+{
+    vector<vector<unsigned char> > jpegs = make_frames(24, 8);
+
+    vector<FrameInfo> frames;
+    for(size_t i = 0; i < jpegs.size(); i++)
+    {
+        FrameInfo f = FrameInfo();
+        f.data = &jpegs[i][0];
+        f.size = jpegs[i].size();
+        frames.push_back(f);
+    }
+
+    MotionOptions options;
+    options.start_frames = 1;
+
+    int channels[] = { 0, 1, 3 };
+    for(size_t c = 0; c < sizeof channels / sizeof channels[0]; c++)
+    {
+        ThumbnailPool pool(channels[c], 2);
+        pool.start();
+
+        vector<vector<unsigned char> > thumbnails;
+        vector<MotionFrame> motion;
+        pool.build(&frames[0], frames.size(), thumbnails, &motion);
+        pool.stop();
+
+        CHECK(pool.built() == frames.size());
+        CHECK(motion.size() == frames.size());
+
+        MotionDetector direct(options);
+        MotionDetector pooled(options);
+        bool moved = false;
+        for(size_t i = 0; i < frames.size(); i++)
+        {
+            CHECK(motion[i].ok);
+            CHECK(thumbnails[i].empty() == (channels[c] == 0));
+
+            int64_t time_us = (int64_t)i * 40000;
+            bool a = direct.update(frames[i].data, frames[i].size, time_us);
+            bool b = pooled.update(motion[i], time_us);
+            CHECK(a == b);
+            CHECK(direct.changed_per_mille() == pooled.changed_per_mille());
+            if(i < 8)
+                CHECK(!b);
+            moved = moved || b;
+        }
+        CHECK(moved);
+        CHECK(pooled.failures() == 0);
+    }
+}
+
+// one MCU per pixel of a 4 by 4 DC image, all at level, bar the first
+static MotionFrame flat_frame(unsigned char level, unsigned char first)
+{
+    MotionFrame f;
+    f.luma.width = 4;
+    f.luma.height = 4;
+    f.luma.channels = 1;
+    f.luma.pixels.assign(16, level);
+    f.luma.pixels[0] = first;
+    f.ok = true;
+    return f;
+}
+
+// frames after the first that still show the change to one MCU
+static int frames_to_settle(unsigned shift, int limit)
+{
+    MotionOptions options;
+    options.background_shift = shift;
+    MotionDetector detector(options);
+
+    detector.update(flat_frame(100, 100), 0);
+
+    MotionFrame changed = flat_frame(100, 160);
+    for(int n = 0; n < limit; n++)
+    {
+        detector.update(changed, (int64_t)(n + 1) * 40000);
+        if(detector.changed_per_mille() == 0)
+            return n;
+    }
+    return limit;
+}
+
+static void test_background_shift()
+{
+    // the background moves 1/2^shift of the way each frame, so a 60 level
+    // change falls below the threshold of 12 after about ln(5) * 2^shift
+    // frames: 25 at 4, and about 105000 at 16
+    int fast = frames_to_settle(4, 1000);
+    CHECK(fast > 15 && fast < 40);
+
+    int slow = frames_to_settle(16, 200000);
+    CHECK(slow > 90000 && slow < 120000);
+}
+
+static vector<string> segment_files(const string& dir)
+{
+    vector<string> files;
+    DIR* d = opendir(dir.c_str());
+    while(dirent* e = d ? readdir(d) : NULL)
+    {
+        string name = e->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    if(d)
+        closedir(d);
+    return files;
+}
+
+// still frames are left out and moving ones kept, each frame is decoded
+// once, and the kept ones have thumbnails
+static void test_gated_save()
+{
+    const int STILL = 10;
+    const int COUNT = 20;
+    vector<vector<unsigned char> > jpegs = make_frames(COUNT, STILL);
+
+    string dir = make_test_dir("test_motion_detector");
+
+    SaveOptions options;
+    options.motion.enabled = true;
+    options.motion.start_frames = 1;
+    options.motion.idle_interval_ms = 0;
+    options.thumbnail_channels = 3;
+    options.repeat_records = false;
+
+    SaveStats stats;
+    {
+        SaveThread st(dir, options);
+        for(int i = 0; i < COUNT; i++)
+        {
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store((void*)&jpegs[i][0], jpegs[i].size());
+            buf->camera = 0;
+            buf->capture_ns = (int64_t)(i + 1) * 40000000;
+            st.save(buf);
+        }
+        st.stop();
+        stats = st.stats();
+    }
+
+    CHECK(stats.motion_checks == (uint64_t)COUNT);
+    CHECK(stats.still_frames == (uint64_t)STILL);
+    CHECK(stats.thumbnails == (uint64_t)COUNT);
+    CHECK(stats.thumbnail_failures == 0);
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() == 1);
+    if(files.size() == 1)
+    {
+        SegmentReader r;
+        CHECK(r.open(files[0]));
+        CHECK(r.frame_count() == (size_t)(COUNT - STILL));
+
+        for(size_t i = 0; i < r.frame_count(); i++)
+        {
+            vector<unsigned char> jpeg;
+            JpegImage thumbnail;
+            CHECK(r.read_frame(i, jpeg));
+            CHECK(jpeg == jpegs[STILL + i]);
+            CHECK(r.read_thumbnail(i, thumbnail));
+            CHECK(thumbnail.width == (WIDTH + 7) / 8);
+            CHECK(thumbnail.channels == 3);
+        }
+    }
+
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_decode_dc_gray();
+    test_pool_frames();
+    test_background_shift();
+    test_gated_save();
+    return test_result("motion_detector");
+}
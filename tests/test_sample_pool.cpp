@@ -0,0 +1,209 @@
+// SamplePool, the platform-neutral core of MJ_Allocator: slots go round
+// without touching the heap, a blocked acquire() is woken by a release or
+// by decommit(), properties cannot change under outstanding samples, and
+// each camera's pool has the count and size it was given.
+
+#include "check.h"
+#include "sample_pool.h"
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <set>
+#include <new>
+#include <cstdlib>
+using namespace std;
+
+// every operator new in the program, so a stretch of code can be shown to
+// allocate nothing
+static atomic<size_t> g_allocations(0);
+
+void* operator new(size_t size)
+{
+    g_allocations++;
+    void* p = malloc(size ? size : 1);
+    if(!p)
+        throw bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+// acquire and release move the same slots round, with the same memory,
+// and no allocation
+static void test_recycling()
+{
+    SamplePool pool;
+    CHECK(pool.set_properties(4, 64 * 1024, 32));
+    CHECK(pool.commit());
+
+    set<SamplePool::Slot*> slots;
+    set<unsigned char*> memory;
+    for(size_t i = 0; i < pool.count(); i++)
+    {
+        slots.insert(pool.slot(i));
+        memory.insert(pool.slot(i)->memory.data());
+    }
+
+    size_t before = g_allocations.load();
+    bool same = true;
+    for(int round = 0; round < 1000; round++)
+    {
+        SamplePool::Slot* taken[4];
+        for(int i = 0; i < 4; i++)
+        {
+            taken[i] = pool.acquire(false);
+            same = same && taken[i] && slots.count(taken[i]) &&
+                memory.count(taken[i]->memory.data());
+        }
+
+        same = same && pool.acquire(false) == NULL &&
+            pool.outstanding() == 4;
+
+        for(int i = 0; i < 4; i++)
+            pool.release(taken[i]);
+    }
+    size_t after = g_allocations.load();
+
+    CHECK(same);
+    CHECK(after == before);
+    CHECK(pool.outstanding() == 0);
+
+    // a Stop/Run cycle keeps the storage
+    pool.decommit();
+    CHECK(pool.acquire(false) == NULL);
+    CHECK(pool.commit());
+    for(size_t i = 0; i < pool.count(); i++)
+        CHECK(memory.count(pool.slot(i)->memory.data()) == 1);
+}
+
+// a waiting acquire() on an empty pool gets the slot that is released
+static void test_woken_by_release()
+{
+    SamplePool pool;
+    CHECK(pool.set_properties(1, 4096, 0));
+    CHECK(pool.commit());
+
+    SamplePool::Slot* only = pool.acquire(false);
+    CHECK(only != NULL);
+
+    atomic<bool> returned(false);
+    SamplePool::Slot* got = NULL;
+    thread waiter([&]() {
+        got = pool.acquire(true);
+        returned = true;
+    });
+
+    this_thread::sleep_for(chrono::milliseconds(50));
+    CHECK(!returned);
+
+    pool.release(only);
+    waiter.join();
+    CHECK(got == only);
+    pool.release(got);
+}
+
+// and decommit() sends it away empty-handed
+static void test_woken_by_decommit()
+{
+    SamplePool pool;
+    CHECK(pool.set_properties(1, 4096, 0));
+    CHECK(pool.commit());
+
+    SamplePool::Slot* only = pool.acquire(false);
+
+    atomic<bool> returned(false);
+    SamplePool::Slot* got = only;
+    thread waiter([&]() {
+        got = pool.acquire(true);
+        returned = true;
+    });
+
+    this_thread::sleep_for(chrono::milliseconds(50));
+    CHECK(!returned);
+
+    pool.decommit();
+    waiter.join();
+    CHECK(got == NULL);
+
+    // slots that were out can still come back
+    pool.release(only);
+    CHECK(pool.outstanding() == 0);
+}
+
+static void test_properties_locked()
+{
+    SamplePool pool;
+    CHECK(pool.set_properties(2, 4096, 0));
+    CHECK(pool.commit());
+
+    // not while committed
+    CHECK(!pool.set_properties(3, 4096, 0));
+
+    // nor while a sample is out, even decommitted
+    SamplePool::Slot* slot = pool.acquire(false);
+    pool.decommit();
+    CHECK(!pool.set_properties(3, 4096, 0));
+    CHECK(pool.count() == 2);
+
+    pool.release(slot);
+    CHECK(pool.set_properties(3, 8192, 16));
+    CHECK(pool.commit());
+    CHECK(pool.count() == 3);
+    CHECK(pool.slot(2)->memory.size() == 16 + 8192);
+}
+
+// two cameras' pools, sized differently, each hand out just their own
+static void test_per_camera()
+{
+    struct Camera
+    {
+        size_t count;
+        size_t size;
+        size_t prefix;
+    };
+    Camera cameras[] = {
+        { 3, 2 * 1024 * 1024, 0 },
+        { 8, 256 * 1024, 64 }
+    };
+
+    SamplePool pools[2];
+    for(int c = 0; c < 2; c++)
+    {
+        CHECK(pools[c].set_properties(cameras[c].count, cameras[c].size,
+            cameras[c].prefix));
+        CHECK(pools[c].commit());
+    }
+
+    for(int c = 0; c < 2; c++)
+    {
+        SamplePool& pool = pools[c];
+        CHECK(pool.count() == cameras[c].count);
+        CHECK(pool.size() == cameras[c].size);
+        CHECK(pool.prefix() == cameras[c].prefix);
+
+        vector<SamplePool::Slot*> taken;
+        while(SamplePool::Slot* slot = pool.acquire(false))
+        {
+            CHECK(slot->memory.size() == cameras[c].prefix + cameras[c].size);
+            taken.push_back(slot);
+        }
+        CHECK(taken.size() == cameras[c].count);
+        CHECK(pools[1 - c].outstanding() == 0);
+
+        for(size_t i = 0; i < taken.size(); i++)
+            pool.release(taken[i]);
+    }
+}
+
+int main()
+{
+    test_recycling();
+    test_woken_by_release();
+    test_woken_by_decommit();
+    test_properties_locked();
+    test_per_camera();
+    return test_result("sample_pool");
+}
@@ -0,0 +1,197 @@
+// The zero-copy protocol: a frame saved with its capture sample held must
+// be read from the sample, reach its file, and only then be released,
+// exactly once. Frames that never get written must still let go of their
+// samples.
+
+#include "check.h"
+#include "mock_sample_ref.h"
+#include "save_thread.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+static vector<unsigned char> make_frame(unsigned seed, size_t size)
+{
+    vector<unsigned char> bytes(size);
+    uint32_t x = seed * 2654435761u + 1;
+    for(size_t i = 0; i < size; i++)
+    {
+        x = x * 1664525u + 1013904223u;
+        bytes[i] = (unsigned char)((x >> 24) % 0xFF); // no 0xFF: no markers
+    }
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[size - 2] = 0xFF;
+    bytes[size - 1] = 0xD9;
+    return bytes;
+}
+
+// true if any file under dir holds bytes
+static bool on_disk(const string& dir, const vector<unsigned char>& bytes)
+{
+    DIR* d = opendir(dir.c_str());
+    if(!d)
+        return false;
+
+    bool found = false;
+    while(dirent* e = readdir(d))
+    {
+        string name = e->d_name;
+        if(name == "." || name == ".." || found)
+            continue;
+
+        string path = dir + "/" + name;
+        struct stat st;
+        if(stat(path.c_str(), &st) != 0)
+            continue;
+
+        if(S_ISDIR(st.st_mode))
+        {
+            found = on_disk(path, bytes);
+            continue;
+        }
+
+        ifstream in(path.c_str(), ios::binary);
+        vector<unsigned char> file((istreambuf_iterator<char>(in)),
+            istreambuf_iterator<char>());
+        found = search(file.begin(), file.end(), bytes.begin(),
+            bytes.end()) != file.end();
+    }
+
+    closedir(d);
+    return found;
+}
+
+static void save_sample(SaveThread& st, MockSampleRef* sample, int camera,
+    int64_t capture_ns)
+{
+    unique_ptr<SaveBuffer> buf = st.get_buffer();
+    buf->data.clear();
+    buf->sample.reset(sample);
+    buf->camera = camera;
+    buf->capture_ns = capture_ns;
+    st.save(buf);
+}
+
+// held, written, then released: the frame is in the file by the time the
+// sample goes back
+static void test_written_before_release()
+{
+    string dir = make_test_dir("test_sample_ref");
+    SampleLog log;
+    const int FRAMES = 8;
+    vector<vector<unsigned char> > frames;
+    frames.reserve(FRAMES); // the release hooks keep references
+    atomic<int> written_first(0);
+
+    {
+        SaveThread st(dir);
+        for(int i = 0; i < FRAMES; i++)
+        {
+            frames.push_back(make_frame(i, 4096 + 512 * i));
+            MockSampleRef* sample = new MockSampleRef(frames.back(), log);
+            const vector<unsigned char>& bytes = frames.back();
+            sample->on_release = [&dir, &bytes, &written_first]() {
+                if(on_disk(dir, bytes))
+                    written_first++;
+            };
+            save_sample(st, sample, 0, (i + 1) * 1000000LL);
+        }
+        st.stop();
+
+        CHECK(log.releases == FRAMES);
+        CHECK(written_first == FRAMES);
+    }
+
+    CHECK(log.reads >= FRAMES);
+    CHECK(log.stale_reads == 0);
+    CHECK(log.extra_releases == 0);
+    CHECK(log.releases == FRAMES);
+    remove_test_dir(dir);
+}
+
+// a frame the budget sheds gives its sample back at once
+static void test_shed_releases()
+{
+    string dir = make_test_dir("test_sample_ref");
+    SampleLog log;
+    vector<unsigned char> stall_bytes = make_frame(100, 1024);
+    vector<unsigned char> bytes = make_frame(101, 1024);
+
+    SaveOptions options;
+    options.budget.max_frames = 1;
+    options.budget.policy = DROP_NEWEST;
+
+    {
+        SaveThread st(dir, options);
+
+        // the writer stays inside the first frame, so the next one waits
+        // on the queue and the one after does not fit
+        MockSampleRef* stall = new MockSampleRef(stall_bytes, log, true);
+        save_sample(st, stall, 0, 1000);
+        stall->wait_entered();
+
+        save_sample(st, new MockSampleRef(bytes, log), 0, 2000);
+        CHECK(st.drop_stats(0).queue_full == 0);
+        save_sample(st, new MockSampleRef(bytes, log), 0, 3000);
+        CHECK(st.drop_stats(0).queue_full == 1);
+        CHECK(log.releases == 1);
+
+        stall->open();
+        st.stop();
+        CHECK(log.releases == 3);
+    }
+
+    CHECK(log.stale_reads == 0);
+    CHECK(log.extra_releases == 0);
+    remove_test_dir(dir);
+}
+
+// detach() copies the frame out, then lets go; store() lets go first
+static void test_detach_and_store()
+{
+    string dir = make_test_dir("test_sample_ref");
+    SampleLog log;
+    vector<unsigned char> bytes = make_frame(200, 2048);
+
+    SaveThread st(dir);
+    unique_ptr<SaveBuffer> ptr = st.get_buffer();
+    SaveBuffer& buf = *ptr;
+    buf.data.clear();
+    buf.sample.reset(new MockSampleRef(bytes, log));
+    CHECK(buf.byte_count() == bytes.size());
+    CHECK(buf.bytes() != buf.data.data());
+
+    buf.detach();
+    CHECK(log.releases == 1);
+    CHECK(!buf.sample->held());
+    CHECK(buf.byte_count() == bytes.size());
+    CHECK(memcmp(buf.bytes(), &bytes[0], bytes.size()) == 0);
+
+    // nothing held: neither lets go again
+    buf.detach();
+    unsigned char small[4] = { 1, 2, 3, 4 };
+    buf.store(small, sizeof small);
+    CHECK(log.releases == 1);
+    CHECK(buf.byte_count() == sizeof small);
+
+    buf.sample.reset(new MockSampleRef(bytes, log));
+    buf.store(small, sizeof small);
+    CHECK(log.releases == 2);
+    CHECK(memcmp(buf.bytes(), small, sizeof small) == 0);
+
+    CHECK(log.stale_reads == 0);
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_written_before_release();
+    test_shed_releases();
+    test_detach_and_store();
+    return test_result("sample_ref");
+}
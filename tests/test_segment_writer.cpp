@@ -0,0 +1,429 @@
+// SegmentWriter on its own, and behind SaveThread: what the index says is
+// in a segment must be what is in it, even when writes fail.
+//
+// Writes are made to fail by lowering RLIMIT_FSIZE, with SIGXFSZ ignored
+// so the write returns EFBIG instead of killing the test.
+
+#include "check.h"
+#include "segment_writer.h"
+#include "segment_reader.h"
+#include "save_thread.h"
+#include "jpeg_encoder.h"
+#include "frame_hash.h"
+#include <dirent.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <cstring>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+static vector<unsigned char> make_frame(unsigned seed, size_t size)
+{
+    vector<unsigned char> bytes(size);
+    uint32_t x = seed * 2654435761u + 1;
+    for(size_t i = 0; i < size; i++)
+    {
+        x = x * 1664525u + 1013904223u;
+        bytes[i] = (unsigned char)((x >> 24) % 0xFF);
+    }
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[size - 2] = 0xFF;
+    bytes[size - 1] = 0xD9;
+    return bytes;
+}
+
+static FrameInfo frame_info(const vector<unsigned char>& bytes,
+    int64_t time_us)
+{
+    FrameInfo f = FrameInfo();
+    f.data = &bytes[0];
+    f.size = bytes.size();
+    f.time_us = time_us;
+    return f;
+}
+
+static void limit_file_size(rlim_t bytes)
+{
+    struct rlimit r;
+    getrlimit(RLIMIT_FSIZE, &r);
+    r.rlim_cur = bytes;
+    setrlimit(RLIMIT_FSIZE, &r);
+}
+
+static vector<string> segment_files(const string& dir)
+{
+    vector<string> files;
+    DIR* d = opendir(dir.c_str());
+    while(dirent* e = d ? readdir(d) : NULL)
+    {
+        string name = e->d_name;
+        if(name.size() > 4 && name.compare(name.size() - 4, 4, ".seg") == 0)
+            files.push_back(dir + "/" + name);
+    }
+    if(d)
+        closedir(d);
+    return files;
+}
+
+// a batch that fails part way leaves the index as it was, and the index
+// close() writes goes after whatever did reach the file
+static void test_failed_write_not_indexed()
+{
+    string dir = make_test_dir("test_segment_writer");
+    string path = dir + "/failed.seg";
+
+    vector<vector<unsigned char> > frames;
+    for(unsigned i = 0; i < 8; i++)
+        frames.push_back(make_frame(i, 8192 + 64 * i));
+
+    SegmentWriter w(0);
+    CHECK(w.open(path, 0));
+
+    vector<FrameInfo> batch;
+    for(size_t i = 0; i < 4; i++)
+        batch.push_back(frame_info(frames[i], 1000 * (i + 1)));
+    CHECK(w.write_frames(&batch[0], batch.size()));
+    CHECK(w.record_count() == 4);
+
+    // room for a frame and a bit of the second
+    limit_file_size(w.bytes_written() + 12000);
+
+    batch.clear();
+    for(size_t i = 4; i < 8; i++)
+        batch.push_back(frame_info(frames[i], 1000 * (i + 1)));
+    CHECK(!w.write_frames(&batch[0], batch.size()));
+    CHECK(w.record_count() == 4);
+
+    limit_file_size(RLIM_INFINITY);
+    w.close();
+
+    SegmentReader r;
+    CHECK(r.open(path));
+    CHECK(r.closed_cleanly());
+    CHECK(r.frame_count() == 4);
+
+    for(size_t i = 0; i < r.frame_count() && i < 4; i++)
+    {
+        vector<unsigned char> jpeg;
+        CHECK(r.read_frame(i, jpeg));
+        CHECK(jpeg == frames[i]);
+    }
+
+    r.close();
+    remove_test_dir(dir);
+}
+
+// SaveThread gives up on a file whose write fails and starts another; every
+// frame it did not count as lost can be read back
+static void test_save_thread_moves_on()
+{
+    string dir = make_test_dir("test_segment_writer");
+    const unsigned FRAMES = 24;
+
+    vector<vector<unsigned char> > frames;
+    for(unsigned i = 0; i < FRAMES; i++)
+        frames.push_back(make_frame(100 + i, 16384));
+
+    // each file takes five or six frames before it fails
+    limit_file_size(100 * 1024);
+
+    SaveStats stats;
+    {
+        SaveThread st(dir);
+        for(unsigned i = 0; i < FRAMES; i++)
+        {
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store(&frames[i][0], frames[i].size());
+            buf->capture_ns = (i + 1) * 40000000LL;
+            st.save(buf);
+
+            // a few frames per batch
+            if(i % 3 == 2)
+                this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        st.stop();
+        stats = st.stats();
+    }
+
+    limit_file_size(RLIM_INFINITY);
+
+    CHECK(stats.lost_frames > 0);
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() > 1);
+
+    size_t read_back = 0;
+    for(size_t n = 0; n < files.size(); n++)
+    {
+        SegmentReader r;
+        CHECK(r.open(files[n]));
+
+        for(size_t i = 0; i < r.frame_count(); i++)
+        {
+            vector<unsigned char> jpeg;
+            CHECK(r.read_frame(i, jpeg));
+
+            bool known = false;
+            for(size_t j = 0; j < frames.size() && !known; j++)
+                known = jpeg == frames[j];
+            CHECK(known);
+            read_back++;
+        }
+    }
+
+    CHECK(read_back + stats.lost_frames == FRAMES);
+    remove_test_dir(dir);
+}
+
+// every segment, index and footer included, stays within segment_bytes,
+// however the frames fall into batches; with thumbnails too, which are
+// only made once a batch is being written
+static void check_segment_sizes(const SaveOptions& options)
+{
+    string dir = make_test_dir("test_segment_writer");
+    const int FRAMES = 90;
+
+    vector<vector<unsigned char> > frames;
+    for(int i = 0; i < 6; i++)
+    {
+        vector<unsigned char> pixels = test_image(320, 240, 3, i);
+        frames.push_back(jpeg_encode(&pixels[0], 320, 240, 3));
+    }
+
+    {
+        SaveThread st(dir, options);
+        for(int i = 0; i < FRAMES; i++)
+        {
+            const vector<unsigned char>& f = frames[i % frames.size()];
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store((void*)&f[0], f.size());
+            buf->capture_ns = (i + 1) * 40000000LL;
+            st.save(buf);
+
+            // batches of 1 to 12 frames
+            if(i % 13 == 0)
+                this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        st.stop();
+    }
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() >= 3);
+
+    for(size_t n = 0; n < files.size(); n++)
+    {
+        struct stat info;
+        CHECK(stat(files[n].c_str(), &info) == 0);
+        CHECK((uint64_t)info.st_size <= options.segment_bytes);
+
+        SegmentReader r;
+        CHECK(r.open(files[n]));
+        CHECK(r.closed_cleanly());
+
+        const SegmentHeader& h = r.header();
+        uint64_t end = h.index_offset +
+            h.record_count * sizeof(SegmentIndexEntry) + sizeof(SegmentFooter);
+        CHECK(end <= options.segment_bytes);
+
+        for(size_t i = 0; i < r.frame_count(); i++)
+        {
+            vector<unsigned char> jpeg;
+            CHECK(r.read_frame(i, jpeg));
+            if(options.thumbnail_channels)
+                CHECK(r.has_thumbnail(i));
+        }
+    }
+
+    remove_test_dir(dir);
+}
+
+static void test_segments_within_size()
+{
+    SaveOptions options;
+    options.segment_bytes = 128 * 1024;
+    options.thumbnail_channels = 3;
+    check_segment_sizes(options);
+
+    options.repeat_records = false;
+    options.share_headers = false;
+    options.thumbnail_channels = 0;
+    check_segment_sizes(options);
+
+    // a ring of three files, each written over again
+    options.ring_segments = 3;
+    options.thumbnail_channels = 1;
+    check_segment_sizes(options);
+}
+
+// direct_io, where everything unaligned goes through the camera's bounce
+// buffer: with io_uring that buffer is registered, and every byte of it
+// must still land where the index says
+static void check_direct_read_back(const SaveOptions& options)
+{
+    string dir = make_test_dir("test_segment_writer");
+    const unsigned FRAMES = 60;
+
+    // odd sizes, so frames start anywhere in a block
+    vector<vector<unsigned char> > frames;
+    for(unsigned i = 0; i < FRAMES; i++)
+        frames.push_back(make_frame(200 + i, 20000 + i * 613));
+
+    SaveStats stats;
+    {
+        SaveThread st(dir, options);
+        st.reserve_free_buffers(8, 64 * 1024);
+        for(unsigned i = 0; i < FRAMES; i++)
+        {
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store(&frames[i][0], frames[i].size());
+            buf->camera = i % 2;
+            buf->capture_ns = (i + 1) * 40000000LL;
+            st.save(buf);
+
+            if(i % 7 == 6)
+                this_thread::sleep_for(chrono::milliseconds(20));
+        }
+        st.stop();
+        stats = st.stats();
+    }
+
+    // all of it from registered memory, if io_uring is there at all
+    CHECK(stats.fixed_bytes == stats.queued_bytes);
+
+    vector<string> files = segment_files(dir);
+    size_t read_back = 0;
+    for(size_t n = 0; n < files.size(); n++)
+    {
+        SegmentReader r;
+        CHECK(r.open(files[n]));
+        CHECK(r.closed_cleanly());
+
+        for(size_t i = 0; i < r.frame_count(); i++)
+        {
+            vector<unsigned char> jpeg;
+            CHECK(r.read_frame(i, jpeg));
+
+            bool known = false;
+            for(size_t j = 0; j < frames.size() && !known; j++)
+                known = jpeg == frames[j];
+            CHECK(known);
+            read_back++;
+        }
+    }
+
+    // a ring keeps only its last few files' worth
+    if(options.ring_segments)
+        CHECK(read_back > 0 && read_back < FRAMES);
+    else
+        CHECK(read_back == FRAMES);
+    remove_test_dir(dir);
+}
+
+static void test_direct_read_back()
+{
+    SaveOptions options;
+    options.direct_io = true;
+    options.io_backend = IO_BACKEND_URING;
+    options.segment_bytes = 256 * 1024;
+    check_direct_read_back(options);
+
+    options.ring_segments = 2;
+    check_direct_read_back(options);
+
+    options.io_backend = IO_BACKEND_PWRITE;
+    options.ring_segments = 0;
+    check_direct_read_back(options);
+}
+
+// the frame pieced back together from frame_slices(), which does not
+// check it against its hash
+static vector<unsigned char> frame_bytes(SegmentReader& r, size_t i)
+{
+    vector<unsigned char> bytes;
+    vector<IoSlice> slices;
+    CHECK(r.frame_slices(i, slices));
+    for(size_t n = 0; n < slices.size(); n++)
+    {
+        const unsigned char* p = (const unsigned char*)slices[n].data;
+        bytes.insert(bytes.end(), p, p + slices[n].size);
+    }
+    return bytes;
+}
+
+// a frame with the same size and hash as the one before it, but other
+// bytes, is written whole rather than as a repeat, in the same batch as
+// that frame or in the next
+static void check_hash_collision(bool separate_batches)
+{
+    string dir = make_test_dir("test_segment_writer");
+
+    vector<unsigned char> a = make_frame(300, 30000);
+    vector<unsigned char> b = make_frame(301, 30000);
+    uint64_t hash = frame_hash(&a[0], a.size());
+
+    // a, a, then b passed off as a by its hash, twice
+    const vector<unsigned char>* order[] = { &a, &a, &b, &b };
+    const size_t COUNT = sizeof order / sizeof order[0];
+
+    SaveStats stats;
+    {
+        SaveOptions options;
+        options.segment_bytes = 0;
+        SaveThread st(dir, options);
+        for(size_t i = 0; i < COUNT; i++)
+        {
+            unique_ptr<SaveBuffer> buf = st.get_buffer();
+            buf->store((void*)&(*order[i])[0], order[i]->size());
+            buf->camera = 0;
+            buf->capture_ns = (int64_t)(i + 1) * 40000000;
+            buf->hash = hash;
+            buf->has_hash = true;
+            st.save(buf);
+
+            if(separate_batches)
+                this_thread::sleep_for(chrono::milliseconds(30));
+        }
+        st.stop();
+        stats = st.stats();
+    }
+
+    CHECK(stats.repeats == 2);
+
+    vector<string> files = segment_files(dir);
+    CHECK(files.size() == 1);
+    if(files.size() == 1)
+    {
+        SegmentReader r;
+        CHECK(r.open(files[0]));
+        CHECK(r.frame_count() == COUNT);
+        for(size_t i = 0; i < r.frame_count() && i < COUNT; i++)
+        {
+            bool repeat = (r.frame(i).flags & RECORD_REPEAT) != 0;
+            CHECK(repeat == (i % 2 == 1));
+            CHECK(frame_bytes(r, i) == *order[i]);
+        }
+    }
+
+    remove_test_dir(dir);
+}
+
+static void test_hash_collision()
+{
+    check_hash_collision(false);
+    check_hash_collision(true);
+}
+
+int main()
+{
+    signal(SIGXFSZ, SIG_IGN);
+
+    test_failed_write_not_indexed();
+    test_save_thread_moves_on();
+    test_segments_within_size();
+    test_direct_read_back();
+    test_hash_collision();
+    return test_result("segment_writer");
+}
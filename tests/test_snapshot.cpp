@@ -0,0 +1,82 @@
+// Snapshots are matched to their waiters by camera and tag together: two
+// cameras may use the same tag, and the one whose frame comes first must
+// not wake, or be collected by, the other's waiter.
+
+#include "check.h"
+#include "save_thread.h"
+#include <fstream>
+#include <iterator>
+using namespace std;
+
+static vector<unsigned char> make_frame(unsigned char fill, size_t size)
+{
+    vector<unsigned char> bytes(size, fill);
+    bytes[0] = 0xFF;
+    bytes[1] = 0xD8;
+    bytes[size - 2] = 0xFF;
+    bytes[size - 1] = 0xD9;
+    return bytes;
+}
+
+static vector<unsigned char> read_file(const string& path)
+{
+    ifstream in(path.c_str(), ios::binary);
+    return vector<unsigned char>(istreambuf_iterator<char>(in),
+        istreambuf_iterator<char>());
+}
+
+static void save_frame(SaveThread& st, int camera,
+    const vector<unsigned char>& bytes)
+{
+    unique_ptr<SaveBuffer> buf = st.get_buffer();
+    buf->store((void*)&bytes[0], bytes.size());
+    buf->camera = camera;
+    buf->capture_ns = 40000000LL;
+    st.save(buf);
+}
+
+static void test_same_tag_two_cameras()
+{
+    string dir = make_test_dir("test_snapshot");
+    const int TAG = 7;
+
+    vector<unsigned char> frame0 = make_frame(0x10, 4096);
+    vector<unsigned char> frame1 = make_frame(0x20, 4096);
+
+    {
+        SaveThread st(dir);
+        st.request_snapshot(0, TAG);
+        st.request_snapshot(1, TAG);
+
+        save_frame(st, 0, frame0);
+
+        // camera 0's snapshot is done, but camera 1 has no frame yet
+        SnapshotResult result;
+        CHECK(!st.wait_snapshot(1, TAG, 300, result));
+
+        CHECK(st.wait_snapshot(0, TAG, 2000, result));
+        CHECK(result.ok);
+        CHECK(result.camera == 0 && result.tag == TAG);
+        CHECK(read_file(result.path) == frame0);
+
+        save_frame(st, 1, frame1);
+
+        CHECK(st.wait_snapshot(1, TAG, 2000, result));
+        CHECK(result.ok);
+        CHECK(result.camera == 1 && result.tag == TAG);
+        CHECK(read_file(result.path) == frame1);
+
+        // each result is collected once
+        CHECK(!st.wait_snapshot(0, TAG, 50, result));
+
+        st.stop();
+    }
+
+    remove_test_dir(dir);
+}
+
+int main()
+{
+    test_same_tag_two_cameras();
+    return test_result("snapshot");
+}